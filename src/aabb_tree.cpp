@@ -0,0 +1,583 @@
+/* Bricks Game - Dynamic AABB Tree
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Bounding volume tree over axis-aligned boxes. Leaves hold a "fat"
+// box, enlarged by AABB_TREE_MARGIN and by the predicted displacement,
+// so an object moving a little every tick only gets reinserted when it
+// leaves its fat box. Inner nodes are kept balanced with AVL-style
+// rotations while refitting the path back to the root.
+
+#define AABB_TREE_NULL -1
+#define AABB_TREE_MARGIN 0.02
+#define AABB_TREE_DISPLACEMENT_FACTOR 2
+
+struct AABB {
+  V2 min;
+  V2 max;
+};
+
+struct AABBTreeNode {
+  AABB aabb;
+  int item;
+  int parent; // Next free node while the node is in the free list.
+  int child0;
+  int child1;
+  int height; // 0 for leaves, -1 for free nodes.
+};
+
+struct AABBTree {
+  int root;
+  int free_list;
+  int nodes_max;
+  int nodes_count;
+  AABBTreeNode *nodes;
+  int stack_max;
+  int *stack;
+};
+
+struct IntArray {
+  int max;
+  int count;
+  int *items;
+};
+
+
+static void
+int_array_push (IntArray *array, int value)
+{
+  if (array->count == array->max)
+    {
+      array->max = array->max ? array->max * 2 : 64;
+      int *new_items = new int[array->max];
+      for (int index = 0; index < array->count; ++index)
+        {
+          new_items[index] = array->items[index];
+        }
+      delete[] array->items;
+      array->items = new_items;
+    }
+
+  array->items[array->count++] = value;
+}
+
+
+static void
+int_array_free (IntArray *array)
+{
+  delete[] array->items;
+  array->items = 0;
+  array->max = 0;
+  array->count = 0;
+}
+
+
+static AABB
+aabb_from_rect (V2 pos, V2 dim)
+{
+  AABB aabb;
+  aabb.min = pos - dim / 2;
+  aabb.max = pos + dim / 2;
+  return aabb;
+}
+
+
+static AABB
+aabb_union (AABB a, AABB b)
+{
+  AABB aabb;
+  aabb.min.x = a.min.x < b.min.x ? a.min.x : b.min.x;
+  aabb.min.y = a.min.y < b.min.y ? a.min.y : b.min.y;
+  aabb.max.x = a.max.x > b.max.x ? a.max.x : b.max.x;
+  aabb.max.y = a.max.y > b.max.y ? a.max.y : b.max.y;
+  return aabb;
+}
+
+
+static float
+aabb_perimeter (AABB aabb)
+{
+  return 2 * ((aabb.max.x - aabb.min.x) + (aabb.max.y - aabb.min.y));
+}
+
+
+static int
+aabb_contains (AABB outer, AABB inner)
+{
+  return (outer.min.x <= inner.min.x && outer.min.y <= inner.min.y &&
+          outer.max.x >= inner.max.x && outer.max.y >= inner.max.y);
+}
+
+
+static int
+aabb_overlap (AABB a, AABB b)
+{
+  return (a.min.x <= b.max.x && a.max.x >= b.min.x &&
+          a.min.y <= b.max.y && a.max.y >= b.min.y);
+}
+
+
+static void
+aabb_tree_init (AABBTree *tree)
+{
+  *tree = {};
+  tree->root = AABB_TREE_NULL;
+  tree->free_list = AABB_TREE_NULL;
+}
+
+
+static void
+aabb_tree_free (AABBTree *tree)
+{
+  delete[] tree->nodes;
+  delete[] tree->stack;
+  aabb_tree_init (tree);
+}
+
+
+static void
+aabb_tree_clear (AABBTree *tree)
+{
+  // Keeps the node storage, so rebuilding the tree for a new level
+  // doesn't allocate.
+  tree->root = AABB_TREE_NULL;
+  tree->nodes_count = 0;
+  tree->free_list = tree->nodes_max ? 0 : AABB_TREE_NULL;
+
+  for (int node_index = 0;
+       node_index < tree->nodes_max;
+       ++node_index)
+    {
+      tree->nodes[node_index].parent = node_index + 1;
+      tree->nodes[node_index].height = -1;
+    }
+
+  if (tree->nodes_max)
+    {
+      tree->nodes[tree->nodes_max - 1].parent = AABB_TREE_NULL;
+    }
+}
+
+
+// Makes tree the same as source, reusing tree's node storage when it is
+// big enough. The query stack isn't part of the tree and stays as is.
+static void
+aabb_tree_copy (AABBTree *tree, AABBTree *source)
+{
+  if (tree->nodes_max < source->nodes_max)
+    {
+      delete[] tree->nodes;
+      tree->nodes = new AABBTreeNode[source->nodes_max];
+    }
+
+  tree->root = source->root;
+  tree->free_list = source->free_list;
+  tree->nodes_max = source->nodes_max;
+  tree->nodes_count = source->nodes_count;
+  if (source->nodes_max)
+    {
+      memcpy (tree->nodes, source->nodes,
+              source->nodes_max * sizeof (AABBTreeNode));
+    }
+}
+
+
+static int
+aabb_tree_alloc_node (AABBTree *tree)
+{
+  if (tree->free_list == AABB_TREE_NULL)
+    {
+      int old_max = tree->nodes_max;
+      tree->nodes_max = old_max ? old_max * 2 : 64;
+
+      AABBTreeNode *new_nodes = new AABBTreeNode[tree->nodes_max];
+      for (int node_index = 0; node_index < old_max; ++node_index)
+        {
+          new_nodes[node_index] = tree->nodes[node_index];
+        }
+      for (int node_index = old_max;
+           node_index < tree->nodes_max;
+           ++node_index)
+        {
+          new_nodes[node_index].parent = node_index + 1;
+          new_nodes[node_index].height = -1;
+        }
+      new_nodes[tree->nodes_max - 1].parent = AABB_TREE_NULL;
+
+      delete[] tree->nodes;
+      tree->nodes = new_nodes;
+      tree->free_list = old_max;
+    }
+
+  int node_index = tree->free_list;
+  AABBTreeNode *node = tree->nodes + node_index;
+  tree->free_list = node->parent;
+  node->item = -1;
+  node->parent = AABB_TREE_NULL;
+  node->child0 = AABB_TREE_NULL;
+  node->child1 = AABB_TREE_NULL;
+  node->height = 0;
+  ++tree->nodes_count;
+
+  return node_index;
+}
+
+
+static void
+aabb_tree_free_node (AABBTree *tree, int node_index)
+{
+  tree->nodes[node_index].parent = tree->free_list;
+  tree->nodes[node_index].height = -1;
+  tree->free_list = node_index;
+  --tree->nodes_count;
+}
+
+
+static void
+aabb_tree_replace_child (AABBTree *tree, int parent_index,
+                         int old_child, int new_child)
+{
+  if (parent_index == AABB_TREE_NULL)
+    {
+      tree->root = new_child;
+    }
+  else if (tree->nodes[parent_index].child0 == old_child)
+    {
+      tree->nodes[parent_index].child0 = new_child;
+    }
+  else
+    {
+      tree->nodes[parent_index].child1 = new_child;
+    }
+}
+
+
+// Rotates the taller child of node a up if its children heights
+// differ by more than one. Returns the root of the rotated subtree.
+static int
+aabb_tree_balance (AABBTree *tree, int a_index)
+{
+  AABBTreeNode *nodes = tree->nodes;
+  AABBTreeNode *a = nodes + a_index;
+
+  if (a->height < 2)
+    {
+      return a_index;
+    }
+
+  int b_index = a->child0;
+  int c_index = a->child1;
+  AABBTreeNode *b = nodes + b_index;
+  AABBTreeNode *c = nodes + c_index;
+  int balance = c->height - b->height;
+
+  if (balance > 1)
+    {
+      // Rotate c up.
+      int f_index = c->child0;
+      int g_index = c->child1;
+      AABBTreeNode *f = nodes + f_index;
+      AABBTreeNode *g = nodes + g_index;
+
+      c->child0 = a_index;
+      c->parent = a->parent;
+      a->parent = c_index;
+      aabb_tree_replace_child (tree, c->parent, a_index, c_index);
+
+      if (f->height > g->height)
+        {
+          c->child1 = f_index;
+          a->child1 = g_index;
+          g->parent = a_index;
+          a->aabb = aabb_union (b->aabb, g->aabb);
+          c->aabb = aabb_union (a->aabb, f->aabb);
+          a->height = 1 + max (b->height, g->height);
+          c->height = 1 + max (a->height, f->height);
+        }
+      else
+        {
+          c->child1 = g_index;
+          a->child1 = f_index;
+          f->parent = a_index;
+          a->aabb = aabb_union (b->aabb, f->aabb);
+          c->aabb = aabb_union (a->aabb, g->aabb);
+          a->height = 1 + max (b->height, f->height);
+          c->height = 1 + max (a->height, g->height);
+        }
+
+      return c_index;
+    }
+  else if (balance < -1)
+    {
+      // Rotate b up.
+      int d_index = b->child0;
+      int e_index = b->child1;
+      AABBTreeNode *d = nodes + d_index;
+      AABBTreeNode *e = nodes + e_index;
+
+      b->child0 = a_index;
+      b->parent = a->parent;
+      a->parent = b_index;
+      aabb_tree_replace_child (tree, b->parent, a_index, b_index);
+
+      if (d->height > e->height)
+        {
+          b->child1 = d_index;
+          a->child0 = e_index;
+          e->parent = a_index;
+          a->aabb = aabb_union (c->aabb, e->aabb);
+          b->aabb = aabb_union (a->aabb, d->aabb);
+          a->height = 1 + max (c->height, e->height);
+          b->height = 1 + max (a->height, d->height);
+        }
+      else
+        {
+          b->child1 = e_index;
+          a->child0 = d_index;
+          d->parent = a_index;
+          a->aabb = aabb_union (c->aabb, d->aabb);
+          b->aabb = aabb_union (a->aabb, e->aabb);
+          a->height = 1 + max (c->height, d->height);
+          b->height = 1 + max (a->height, e->height);
+        }
+
+      return b_index;
+    }
+
+  return a_index;
+}
+
+
+// Walks from node_index up to the root, rebalancing and refitting the
+// boxes and heights on the way.
+static void
+aabb_tree_refit (AABBTree *tree, int node_index)
+{
+  while (node_index != AABB_TREE_NULL)
+    {
+      node_index = aabb_tree_balance (tree, node_index);
+
+      AABBTreeNode *node = tree->nodes + node_index;
+      AABBTreeNode *child0 = tree->nodes + node->child0;
+      AABBTreeNode *child1 = tree->nodes + node->child1;
+
+      node->height = 1 + max (child0->height, child1->height);
+      node->aabb = aabb_union (child0->aabb, child1->aabb);
+
+      node_index = node->parent;
+    }
+}
+
+
+static void
+aabb_tree_insert_leaf (AABBTree *tree, int leaf_index)
+{
+  if (tree->root == AABB_TREE_NULL)
+    {
+      tree->root = leaf_index;
+      tree->nodes[leaf_index].parent = AABB_TREE_NULL;
+      return;
+    }
+
+  // Find the best sibling by the surface area heuristic: the cost of
+  // a subtree is the perimeter it adds to all of its ancestors.
+  AABB leaf_aabb = tree->nodes[leaf_index].aabb;
+  int index = tree->root;
+
+  while (tree->nodes[index].height > 0)
+    {
+      AABBTreeNode *node = tree->nodes + index;
+      float area = aabb_perimeter (node->aabb);
+      float combined_area = aabb_perimeter (aabb_union (node->aabb, leaf_aabb));
+
+      float cost = 2 * combined_area;
+      float inheritance_cost = 2 * (combined_area - area);
+
+      float child_costs[2];
+      int children[2] = {node->child0, node->child1};
+
+      for (int child = 0; child < 2; ++child)
+        {
+          AABBTreeNode *child_node = tree->nodes + children[child];
+          float new_area =
+            aabb_perimeter (aabb_union (child_node->aabb, leaf_aabb));
+
+          if (child_node->height == 0)
+            {
+              child_costs[child] = new_area + inheritance_cost;
+            }
+          else
+            {
+              child_costs[child] = (new_area -
+                                    aabb_perimeter (child_node->aabb) +
+                                    inheritance_cost);
+            }
+        }
+
+      if (cost < child_costs[0] && cost < child_costs[1])
+        {
+          break;
+        }
+
+      index = child_costs[0] < child_costs[1] ? children[0] : children[1];
+    }
+
+  int sibling_index = index;
+  int old_parent = tree->nodes[sibling_index].parent;
+  int new_parent = aabb_tree_alloc_node (tree);
+
+  AABBTreeNode *parent = tree->nodes + new_parent;
+  parent->parent = old_parent;
+  parent->aabb = aabb_union (leaf_aabb, tree->nodes[sibling_index].aabb);
+  parent->height = tree->nodes[sibling_index].height + 1;
+  parent->child0 = sibling_index;
+  parent->child1 = leaf_index;
+
+  aabb_tree_replace_child (tree, old_parent, sibling_index, new_parent);
+  tree->nodes[sibling_index].parent = new_parent;
+  tree->nodes[leaf_index].parent = new_parent;
+
+  aabb_tree_refit (tree, old_parent);
+}
+
+
+static void
+aabb_tree_remove_leaf (AABBTree *tree, int leaf_index)
+{
+  if (leaf_index == tree->root)
+    {
+      tree->root = AABB_TREE_NULL;
+      return;
+    }
+
+  int parent_index = tree->nodes[leaf_index].parent;
+  int grand_parent = tree->nodes[parent_index].parent;
+  int sibling_index = (tree->nodes[parent_index].child0 == leaf_index ?
+                       tree->nodes[parent_index].child1 :
+                       tree->nodes[parent_index].child0);
+
+  aabb_tree_replace_child (tree, grand_parent, parent_index, sibling_index);
+  tree->nodes[sibling_index].parent = grand_parent;
+  aabb_tree_free_node (tree, parent_index);
+
+  aabb_tree_refit (tree, grand_parent);
+}
+
+
+static AABB
+aabb_tree_fatten (AABB aabb, V2 displacement)
+{
+  aabb.min.x -= AABB_TREE_MARGIN;
+  aabb.min.y -= AABB_TREE_MARGIN;
+  aabb.max.x += AABB_TREE_MARGIN;
+  aabb.max.y += AABB_TREE_MARGIN;
+
+  V2 d = displacement * AABB_TREE_DISPLACEMENT_FACTOR;
+
+  if (d.x < 0) aabb.min.x += d.x; else aabb.max.x += d.x;
+  if (d.y < 0) aabb.min.y += d.y; else aabb.max.y += d.y;
+
+  return aabb;
+}
+
+
+// Returns the proxy id that identifies the item in the tree.
+static int
+aabb_tree_insert (AABBTree *tree, AABB aabb, int item)
+{
+  int proxy = aabb_tree_alloc_node (tree);
+  tree->nodes[proxy].aabb = aabb_tree_fatten (aabb, (V2) {0, 0});
+  tree->nodes[proxy].item = item;
+  aabb_tree_insert_leaf (tree, proxy);
+
+  return proxy;
+}
+
+
+static void
+aabb_tree_remove (AABBTree *tree, int proxy)
+{
+  aabb_tree_remove_leaf (tree, proxy);
+  aabb_tree_free_node (tree, proxy);
+}
+
+
+// Returns 1 if the proxy had to be reinserted, 0 if the new box still
+// fits inside its fat box.
+static int
+aabb_tree_move (AABBTree *tree, int proxy, AABB aabb, V2 displacement)
+{
+  if (aabb_contains (tree->nodes[proxy].aabb, aabb))
+    {
+      return 0;
+    }
+
+  aabb_tree_remove_leaf (tree, proxy);
+  tree->nodes[proxy].aabb = aabb_tree_fatten (aabb, displacement);
+  aabb_tree_insert_leaf (tree, proxy);
+
+  return 1;
+}
+
+
+static void
+aabb_tree_set_item (AABBTree *tree, int proxy, int item)
+{
+  tree->nodes[proxy].item = item;
+}
+
+
+// Appends the items of all leaves whose fat box overlaps aabb.
+static void
+aabb_tree_query (AABBTree *tree, AABB aabb, IntArray *results)
+{
+  if (tree->root == AABB_TREE_NULL)
+    {
+      return;
+    }
+
+  // A depth-first walk never holds more than height + 1 nodes.
+  int stack_needed = tree->nodes[tree->root].height + 2;
+  if (tree->stack_max < stack_needed)
+    {
+      delete[] tree->stack;
+      tree->stack_max = stack_needed * 2;
+      tree->stack = new int[tree->stack_max];
+    }
+
+  int *stack = tree->stack;
+  int stack_count = 0;
+  stack[stack_count++] = tree->root;
+
+  while (stack_count > 0)
+    {
+      AABBTreeNode *node = tree->nodes + stack[--stack_count];
+
+      if (aabb_overlap (node->aabb, aabb))
+        {
+          if (node->height == 0)
+            {
+              int_array_push (results, node->item);
+            }
+          else
+            {
+              stack[stack_count++] = node->child0;
+              stack[stack_count++] = node->child1;
+            }
+        }
+    }
+}
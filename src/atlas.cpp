@@ -0,0 +1,617 @@
+/* Bricks Game - Sprite Atlas
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Every sprite sheet packed into one texture, so everything textured in
+// a pass is drawn with one bind and, through a SpriteBatch, one draw
+// call.
+//
+// The sheets are PNGs. Packing them is done once, by "bricks
+// --build-atlas" or "make", into ATLAS_FILEPATH: a header giving each
+// sheet's place, then the texture's pixels as GL takes them, so loading
+// it is one read and one upload. The header has a hash of the PNGs, and
+// when they change the game packs them again itself and rewrites the
+// file.
+//
+// Sheets keep their own layout, so a sprite is a sheet and a rect of it
+// in the sheet's pixels, as before there was an atlas.
+
+#define ATLAS_FILEPATH "res/sprites.atlas"
+#define ATLAS_VERSION 1
+// Each sheet's edge pixels are repeated around it this many times, so
+// sampling next to an edge never picks up a neighbouring sheet.
+#define ATLAS_PADDING 1
+
+enum SpriteSheet {
+  SPRITE_SHEET_POWERUPS,
+  SPRITE_SHEET_DIGITS,
+  SPRITE_SHEET_ENUM_LENGTH,
+};
+
+static const char *sprite_sheet_filepaths[SPRITE_SHEET_ENUM_LENGTH] = {
+  "res/powerups.png",
+  "res/digits.png",
+};
+
+struct AtlasRect {
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+};
+
+// What ATLAS_FILEPATH starts with. The pixels follow, top row first.
+struct AtlasHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t sources_hash;
+  int32_t width;
+  int32_t height;
+  AtlasRect sheets[SPRITE_SHEET_ENUM_LENGTH];
+};
+
+struct Atlas {
+  AtlasHeader header;
+  // Until upload_atlas has them.
+  unsigned char *pixels;
+  GLuint texture;
+};
+
+struct SpriteInstance {
+  V2 center;
+  V2 half_dim;
+  // The texture coordinates of the top left and bottom right corners.
+  V2 uv0;
+  V2 uv1;
+  GLubyte color[4];
+};
+
+// Like a ShapeBatch, but of rects of the atlas. Nothing touches GL
+// until flush_sprites.
+struct SpriteBatch {
+  int max;
+  int count;
+  SpriteInstance *instances;
+  Atlas *atlas;
+  GLuint program;
+  GLuint corners_buffer;
+  GLuint instances_buffer;
+};
+
+enum SpriteAttribute {
+  SPRITE_ATTRIBUTE_CORNER,
+  SPRITE_ATTRIBUTE_CENTER,
+  SPRITE_ATTRIBUTE_UV,
+  SPRITE_ATTRIBUTE_COLOR,
+  SPRITE_ATTRIBUTE_ENUM_LENGTH,
+};
+
+static const char *sprite_attribute_names[SPRITE_ATTRIBUTE_ENUM_LENGTH] = {
+  "corner",
+  "center",
+  "uv",
+  "color",
+};
+
+static const char *sprite_vertex_shader = R"GLSL(
+#version 120
+
+attribute vec2 corner;
+attribute vec4 center;
+attribute vec4 uv;
+attribute vec4 color;
+
+varying vec2 v_uv;
+varying vec4 v_color;
+
+void
+main ()
+{
+  // The texture's rows go down, so the bottom corners take uv.w.
+  v_uv = mix (uv.xw, uv.zy, corner * 0.5 + 0.5);
+  v_color = color;
+  gl_Position = (gl_ModelViewProjectionMatrix *
+                 vec4 (center.xy + corner * center.zw, 0, 1));
+}
+)GLSL";
+
+static const char *sprite_fragment_shader = R"GLSL(
+#version 120
+
+uniform sampler2D atlas;
+
+varying vec2 v_uv;
+varying vec4 v_color;
+
+void
+main ()
+{
+  gl_FragColor = texture2D (atlas, v_uv) * v_color;
+}
+)GLSL";
+
+
+static uint64_t
+hash_bytes (uint64_t hash, const void *data, size_t size)
+{
+  // FNV-1a.
+  const unsigned char *bytes = (const unsigned char *) data;
+  for (size_t index = 0; index < size; ++index)
+    {
+      hash = (hash ^ bytes[index]) * 0x100000001b3;
+    }
+  return hash;
+}
+
+
+// Reads the whole file into bytes. Returns 0 if it can't be read.
+static int
+read_atlas_source (const char *filepath, string *bytes)
+{
+  FILE *file = fopen (filepath, "rb");
+  if (!file)
+    {
+      return 0;
+    }
+
+  char buffer[4096];
+  size_t size;
+  bytes->clear ();
+  while ((size = fread (buffer, 1, sizeof (buffer), file)) > 0)
+    {
+      bytes->append (buffer, size);
+    }
+
+  int failed = ferror (file);
+  fclose (file);
+  return !failed;
+}
+
+
+// What the sheets are packed from. Exits if one can't be read.
+static uint64_t
+hash_atlas_sources (string *sources)
+{
+  uint64_t hash = 0xcbf29ce484222325;
+  uint32_t version = ATLAS_VERSION;
+  hash = hash_bytes (hash, &version, sizeof (version));
+
+  for (int sheet = 0; sheet < SPRITE_SHEET_ENUM_LENGTH; ++sheet)
+    {
+      const char *filepath = sprite_sheet_filepaths[sheet];
+
+      if (!read_atlas_source (filepath, sources + sheet))
+        {
+          cerr << "Error: Can't read " << filepath << "." << endl;
+          exit (1);
+        }
+
+      hash = hash_bytes (hash, filepath, strlen (filepath) + 1);
+      hash = hash_bytes (hash, sources[sheet].data (), sources[sheet].size ());
+    }
+
+  return hash;
+}
+
+
+static int
+get_atlas_side (int size)
+{
+  int side = 64;
+  while (side < size)
+    {
+      side *= 2;
+    }
+  return side;
+}
+
+
+// Packs the sheets, tallest first, in rows. sources are the PNGs'
+// contents, as hash_atlas_sources read them.
+static void
+build_atlas (Atlas *atlas, string *sources, uint64_t sources_hash)
+{
+  unsigned char *images[SPRITE_SHEET_ENUM_LENGTH];
+  int order[SPRITE_SHEET_ENUM_LENGTH];
+  AtlasHeader *header = &atlas->header;
+
+  *header = {};
+  memcpy (header->magic, "BATL", 4);
+  header->version = ATLAS_VERSION;
+  header->sources_hash = sources_hash;
+
+  int widest = 0;
+  int area = 0;
+
+  for (int sheet = 0; sheet < SPRITE_SHEET_ENUM_LENGTH; ++sheet)
+    {
+      AtlasRect *rect = header->sheets + sheet;
+      images[sheet] = decode_png ((const unsigned char *) sources[sheet].data (),
+                                  sources[sheet].size (),
+                                  &rect->width, &rect->height);
+      if (!images[sheet])
+        {
+          cerr << "Error: " << sprite_sheet_filepaths[sheet]
+               << " is not an 8 bit, non interlaced PNG." << endl;
+          exit (1);
+        }
+
+      widest = max (widest, rect->width + 2 * ATLAS_PADDING);
+      area += ((rect->width + 2 * ATLAS_PADDING) *
+               (rect->height + 2 * ATLAS_PADDING));
+      order[sheet] = sheet;
+    }
+
+  sort (order, order + SPRITE_SHEET_ENUM_LENGTH,
+        [header] (int a, int b)
+        {
+          return header->sheets[a].height > header->sheets[b].height;
+        });
+
+  header->width = get_atlas_side (max (widest, (int) ceil (sqrt (area))));
+
+  int x = 0;
+  int y = 0;
+  int row_height = 0;
+
+  for (int index = 0; index < SPRITE_SHEET_ENUM_LENGTH; ++index)
+    {
+      AtlasRect *rect = header->sheets + order[index];
+      int width = rect->width + 2 * ATLAS_PADDING;
+      int height = rect->height + 2 * ATLAS_PADDING;
+
+      if (x + width > header->width)
+        {
+          x = 0;
+          y += row_height;
+          row_height = 0;
+        }
+
+      rect->x = x + ATLAS_PADDING;
+      rect->y = y + ATLAS_PADDING;
+      x += width;
+      row_height = max (row_height, height);
+    }
+
+  header->height = get_atlas_side (y + row_height);
+
+  size_t size = (size_t) header->width * header->height * 4;
+  atlas->pixels = new unsigned char[size];
+  memset (atlas->pixels, 0, size);
+
+  for (int sheet = 0; sheet < SPRITE_SHEET_ENUM_LENGTH; ++sheet)
+    {
+      AtlasRect *rect = header->sheets + sheet;
+
+      for (int y = -ATLAS_PADDING; y < rect->height + ATLAS_PADDING; ++y)
+        {
+          int source_y = max (0, min (y, rect->height - 1));
+
+          for (int x = -ATLAS_PADDING; x < rect->width + ATLAS_PADDING; ++x)
+            {
+              int source_x = max (0, min (x, rect->width - 1));
+              memcpy (atlas->pixels + (((size_t) (rect->y + y) * header->width +
+                                        rect->x + x) * 4),
+                      images[sheet] + ((size_t) source_y * rect->width +
+                                       source_x) * 4,
+                      4);
+            }
+        }
+
+      delete[] images[sheet];
+    }
+}
+
+
+// Returns 0 if it can't be written.
+static int
+write_atlas (Atlas *atlas, const char *filepath)
+{
+  FILE *file = fopen (filepath, "wb");
+  if (!file)
+    {
+      return 0;
+    }
+
+  size_t size = (size_t) atlas->header.width * atlas->header.height * 4;
+  int written = (fwrite (&atlas->header, sizeof (atlas->header), 1, file) == 1 &&
+                 fwrite (atlas->pixels, size, 1, file) == 1);
+
+  return fclose (file) == 0 && written;
+}
+
+
+// Returns 0 unless filepath is a whole atlas of the same version and
+// sources.
+static int
+read_atlas (Atlas *atlas, const char *filepath, uint64_t sources_hash)
+{
+  FILE *file = fopen (filepath, "rb");
+  if (!file)
+    {
+      return 0;
+    }
+
+  AtlasHeader *header = &atlas->header;
+  int valid = (fread (header, sizeof (*header), 1, file) == 1 &&
+               memcmp (header->magic, "BATL", 4) == 0 &&
+               header->version == ATLAS_VERSION &&
+               header->sources_hash == sources_hash &&
+               header->width > 0 && header->width <= PNG_MAX_SIDE &&
+               header->height > 0 && header->height <= PNG_MAX_SIDE);
+
+  if (valid)
+    {
+      size_t size = (size_t) header->width * header->height * 4;
+      atlas->pixels = new unsigned char[size];
+      valid = fread (atlas->pixels, size, 1, file) == 1;
+
+      if (!valid)
+        {
+          delete[] atlas->pixels;
+          atlas->pixels = 0;
+        }
+    }
+
+  fclose (file);
+  return valid;
+}
+
+
+// Makes the texture, in one upload, and lets go of the pixels.
+static void
+upload_atlas (Atlas *atlas)
+{
+  glGenTextures (1, &atlas->texture);
+  glBindTexture (GL_TEXTURE_2D, atlas->texture);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA8,
+                atlas->header.width, atlas->header.height,
+                0,
+                GL_RGBA, GL_UNSIGNED_BYTE, atlas->pixels);
+
+  delete[] atlas->pixels;
+  atlas->pixels = 0;
+}
+
+
+// Loads ATLAS_FILEPATH, packing it again first if the PNGs changed
+// since. Needs a current GL context.
+static void
+load_atlas (Atlas *atlas)
+{
+  string sources[SPRITE_SHEET_ENUM_LENGTH];
+  uint64_t sources_hash = hash_atlas_sources (sources);
+
+  *atlas = {};
+
+  if (!read_atlas (atlas, ATLAS_FILEPATH, sources_hash))
+    {
+      build_atlas (atlas, sources, sources_hash);
+
+      if (!write_atlas (atlas, ATLAS_FILEPATH))
+        {
+          cerr << "Warning: Can't write " << ATLAS_FILEPATH
+               << ", the sprites will be packed again next time." << endl;
+        }
+    }
+
+  upload_atlas (atlas);
+}
+
+
+static void
+free_atlas (Atlas *atlas)
+{
+  if (atlas->texture)
+    {
+      glDeleteTextures (1, &atlas->texture);
+    }
+
+  delete[] atlas->pixels;
+  *atlas = {};
+}
+
+
+// "bricks --build-atlas": packs the sheets whether or not they changed.
+// Returns the exit code.
+static int
+build_atlas_command (void)
+{
+  string sources[SPRITE_SHEET_ENUM_LENGTH];
+  Atlas atlas = {};
+  build_atlas (&atlas, sources, hash_atlas_sources (sources));
+
+  if (!write_atlas (&atlas, ATLAS_FILEPATH))
+    {
+      cerr << "Error: Can't write " << ATLAS_FILEPATH << "." << endl;
+      return 1;
+    }
+
+  printf ("%s: %d sheets in %dx%d\n", ATLAS_FILEPATH,
+          SPRITE_SHEET_ENUM_LENGTH, atlas.header.width, atlas.header.height);
+
+  free_atlas (&atlas);
+  return 0;
+}
+
+
+// Needs a current GL context and load_gl_functions, and atlas uploaded.
+static void
+init_sprite_batch (SpriteBatch *batch, Atlas *atlas)
+{
+  GLuint vertex_shader = compile_shader (GL_VERTEX_SHADER,
+                                         sprite_vertex_shader);
+  GLuint fragment_shader = compile_shader (GL_FRAGMENT_SHADER,
+                                           sprite_fragment_shader);
+
+  batch->atlas = atlas;
+  batch->program = gl.CreateProgram ();
+  gl.AttachShader (batch->program, vertex_shader);
+  gl.AttachShader (batch->program, fragment_shader);
+
+  for (int attribute = 0;
+       attribute < SPRITE_ATTRIBUTE_ENUM_LENGTH;
+       ++attribute)
+    {
+      gl.BindAttribLocation (batch->program, attribute,
+                             sprite_attribute_names[attribute]);
+    }
+
+  gl.LinkProgram (batch->program);
+  gl.DeleteShader (vertex_shader);
+  gl.DeleteShader (fragment_shader);
+
+  GLint linked = 0;
+  gl.GetProgramiv (batch->program, GL_LINK_STATUS, &linked);
+
+  if (!linked)
+    {
+      char log[1024];
+      gl.GetProgramInfoLog (batch->program, sizeof (log), 0, log);
+      cerr << "Error: Can't link shader program: " << log << endl;
+      exit (1);
+    }
+
+  float corners[] = {-1, -1, 1, -1, -1, 1, 1, 1};
+  gl.GenBuffers (1, &batch->corners_buffer);
+  gl.BindBuffer (GL_ARRAY_BUFFER, batch->corners_buffer);
+  gl.BufferData (GL_ARRAY_BUFFER, sizeof (corners), corners, GL_STATIC_DRAW);
+
+  gl.GenBuffers (1, &batch->instances_buffer);
+  gl.BindBuffer (GL_ARRAY_BUFFER, 0);
+}
+
+
+static void
+free_sprite_batch (SpriteBatch *batch)
+{
+  if (batch->program)
+    {
+      gl.DeleteProgram (batch->program);
+      gl.DeleteBuffers (1, &batch->corners_buffer);
+      gl.DeleteBuffers (1, &batch->instances_buffer);
+    }
+
+  delete[] batch->instances;
+  *batch = {};
+}
+
+
+// Draws the part of sheet offset pixels from its top left corner, of
+// portion_dim pixels, centered on pos and dim in size, tinted by color.
+static void
+draw_sprite (SpriteBatch *batch, SpriteSheet sheet, V2 pos, V2 dim,
+             V2 offset, V2 portion_dim, Color color)
+{
+  if (batch->count == batch->max)
+    {
+      int new_max = batch->max ? batch->max * 2 : 64;
+      SpriteInstance *new_instances = new SpriteInstance[new_max];
+      if (batch->count)
+        {
+          memcpy (new_instances, batch->instances,
+                  batch->count * sizeof (SpriteInstance));
+        }
+      delete[] batch->instances;
+      batch->instances = new_instances;
+      batch->max = new_max;
+    }
+
+  AtlasHeader *header = &batch->atlas->header;
+  AtlasRect *rect = header->sheets + sheet;
+  V2 atlas_dim = {(float) header->width, (float) header->height};
+  V2 origin = {(float) rect->x, (float) rect->y};
+
+  SpriteInstance *instance = batch->instances + batch->count++;
+  instance->center = pos;
+  instance->half_dim = dim / 2;
+  instance->uv0 = (origin + offset) / atlas_dim;
+  instance->uv1 = (origin + offset + portion_dim) / atlas_dim;
+  instance->color[0] = get_color_byte (color.r);
+  instance->color[1] = get_color_byte (color.g);
+  instance->color[2] = get_color_byte (color.b);
+  instance->color[3] = get_color_byte (color.a);
+}
+
+
+// Draws and clears everything queued, with the current transform.
+static void
+flush_sprites (SpriteBatch *batch)
+{
+  if (!batch->count)
+    {
+      return;
+    }
+
+  gl.UseProgram (batch->program);
+  glBindTexture (GL_TEXTURE_2D, batch->atlas->texture);
+  count_texture_bind ();
+
+  gl.BindBuffer (GL_ARRAY_BUFFER, batch->corners_buffer);
+  gl.EnableVertexAttribArray (SPRITE_ATTRIBUTE_CORNER);
+  gl.VertexAttribPointer (SPRITE_ATTRIBUTE_CORNER, 2, GL_FLOAT, GL_FALSE,
+                          0, 0);
+
+  int size = batch->count * sizeof (SpriteInstance);
+  gl.BindBuffer (GL_ARRAY_BUFFER, batch->instances_buffer);
+  gl.BufferData (GL_ARRAY_BUFFER, size, 0, GL_STREAM_DRAW);
+  gl.BufferSubData (GL_ARRAY_BUFFER, 0, size, batch->instances);
+
+  struct {
+    int size;
+    GLenum type;
+    size_t offset;
+  } attributes[] = {
+    {0, 0, 0},
+    {4, GL_FLOAT, offsetof (SpriteInstance, center)},
+    {4, GL_FLOAT, offsetof (SpriteInstance, uv0)},
+    {4, GL_UNSIGNED_BYTE, offsetof (SpriteInstance, color)},
+  };
+
+  for (int attribute = SPRITE_ATTRIBUTE_CENTER;
+       attribute < SPRITE_ATTRIBUTE_ENUM_LENGTH;
+       ++attribute)
+    {
+      gl.EnableVertexAttribArray (attribute);
+      gl.VertexAttribPointer (attribute,
+                              attributes[attribute].size,
+                              attributes[attribute].type,
+                              attributes[attribute].type == GL_UNSIGNED_BYTE,
+                              sizeof (SpriteInstance),
+                              (void *) attributes[attribute].offset);
+      gl.VertexAttribDivisor (attribute, 1);
+    }
+
+  gl.DrawArraysInstanced (GL_TRIANGLE_STRIP, 0, 4, batch->count);
+  count_draw_call (4 * batch->count);
+  count_state_changes (2);
+
+  for (int attribute = 0;
+       attribute < SPRITE_ATTRIBUTE_ENUM_LENGTH;
+       ++attribute)
+    {
+      gl.VertexAttribDivisor (attribute, 0);
+      gl.DisableVertexAttribArray (attribute);
+    }
+
+  gl.BindBuffer (GL_ARRAY_BUFFER, 0);
+  gl.UseProgram (0);
+
+  batch->count = 0;
+}
@@ -0,0 +1,255 @@
+/* Bricks Game - Autoplay
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// A bot that plays by looking ahead, for attract mode and for playing
+// levels through to test them. Every AUTOPLAY_PREDICT_INTERVAL it forks
+// the game state and steps the fork on, silently and with the paddle
+// held still, until a ball comes down to the paddle; then it moves the
+// paddle there, off center by as much as sends the ball toward the
+// lowest brick. Fork and steps touch nothing outside the fork, so this
+// runs on the simulation thread, before each step.
+//
+// Looking ahead stops after AUTOPLAY_LOOKAHEAD seconds of game time, or
+// once it has taken AUTOPLAY_BUDGET seconds of real time, which keeps
+// it well inside a frame.
+
+#define AUTOPLAY_LOOKAHEAD 4.0
+#define AUTOPLAY_BUDGET 0.004
+#define AUTOPLAY_PREDICT_INTERVAL 0.05
+// How many steps go between looks at the clock, which costs about as
+// much as a step.
+#define AUTOPLAY_CLOCK_STEPS 32
+// How long a ball held on the paddle waits to be served.
+#define AUTOPLAY_SERVE_DELAY 0.4
+// How far off center the paddle hits the ball, at least and at most, as
+// part of its half width. A ball hit in the center may keep going
+// straight up and down for good.
+#define AUTOPLAY_AIM_MIN 0.15
+#define AUTOPLAY_AIM_MAX 0.8
+// The paddle doesn't move for less than this part of its width.
+#define AUTOPLAY_DEADZONE 0.05
+
+struct Autoplay {
+  GameState fork;
+  double next_prediction;
+  double serve_time;
+  // Where the paddle should go, if has_target.
+  int has_target;
+  float target_x;
+
+  // Over every prediction so far.
+  int predictions_count;
+  int predictions_landed;
+  long predicted_steps;
+  double predict_time;
+  double predict_time_max;
+};
+
+
+static void
+init_autoplay (Autoplay *autoplay)
+{
+  *autoplay = {};
+  init_game_state (&autoplay->fork, 0);
+}
+
+
+static void
+free_autoplay (Autoplay *autoplay)
+{
+  free_game_state (&autoplay->fork);
+}
+
+
+// Forks game_state into fork and steps the fork by dt from time, with
+// no input, until a ball is a step from falling on the paddle's top.
+// Returns that ball as it is then, in landing, and the number of steps
+// it took, or -1 with no ball coming down within max_steps, or before
+// deadline on the clock of get_seconds. steps_taken is set either way.
+static int
+predict_landing (GameState *fork, GameState *game_state, double time,
+                 double dt, int max_steps, double deadline,
+                 Ball *landing, int *steps_taken)
+{
+  fork_game_state (fork, game_state);
+  fork->input_left = 0;
+  fork->input_right = 0;
+  fork->input_shoot = 0;
+  Paddle *paddle = &fork->paddle;
+  *steps_taken = 0;
+
+  for (int step = 1; step <= max_steps; ++step)
+    {
+      if (step % AUTOPLAY_CLOCK_STEPS == 0 && get_seconds () > deadline)
+        {
+          return -1;
+        }
+
+      time += dt;
+      step_game (fork, 0, 0, time, dt);
+      *steps_taken = step;
+
+      if (fork->game_mode != GAME_STARTED)
+        {
+          return -1;
+        }
+
+      float paddle_top = paddle->pos.y + paddle->dim.y / 2;
+      float paddle_bottom = paddle->pos.y - paddle->dim.y / 2;
+
+      for (int ball_index = 0;
+           ball_index < fork->balls_count;
+           ++ball_index)
+        {
+          Ball *ball = fork->balls + ball_index;
+
+          if (ball_index != paddle->caught_ball && ball->dir.y < 0 &&
+              ball->pos.y - ball->size + ball->dir.y * dt < paddle_top &&
+              ball->pos.y + ball->size > paddle_bottom)
+            {
+              *landing = *ball;
+              return step;
+            }
+        }
+    }
+
+  return -1;
+}
+
+
+// Where the paddle should be for the landing ball to bounce off it
+// straight at the lowest brick loaded, which nothing can be in front of.
+// Walls aren't taken into account, other than that the paddle can't go
+// through them.
+static float
+get_autoplay_aim (GameState *game_state, Ball *landing)
+{
+  BricksArray *bricks_array = &game_state->bricks_array;
+  Paddle *paddle = &game_state->paddle;
+  Brick *lowest = 0;
+
+  for (int brick_index = 0;
+       brick_index < bricks_array->count;
+       ++brick_index)
+    {
+      Brick *brick = bricks_array->items + brick_index;
+      if (!lowest || brick->pos.y < lowest->pos.y)
+        {
+          lowest = brick;
+        }
+    }
+
+  if (!lowest)
+    {
+      return landing->pos.x;
+    }
+
+  // The paddle flips dir.y and adds PADDLE_CURVE_FACTOR times how far
+  // off center the ball hits to dir.x.
+  float distance_y = max (lowest->pos.y - landing->pos.y, landing->size);
+  float dir_x = ((lowest->pos.x - landing->pos.x) / distance_y *
+                 -landing->dir.y);
+  float aim = (dir_x - landing->dir.x) / PADDLE_CURVE_FACTOR;
+  float aim_max = paddle->dim.x / 2 * AUTOPLAY_AIM_MAX;
+  aim = max (-aim_max, min (aim, aim_max));
+
+  float paddle_x = landing->pos.x - aim;
+  paddle_x = max (-1 + paddle->dim.x / 2,
+                  min (paddle_x, 1 - paddle->dim.x / 2));
+
+  // Off to the side of the ball away from the nearer wall, where the
+  // paddle always fits.
+  float aim_min = paddle->dim.x / 2 * AUTOPLAY_AIM_MIN;
+  if (fabsf (landing->pos.x - paddle_x) < aim_min)
+    {
+      paddle_x = landing->pos.x + (landing->pos.x > 0 ? -aim_min : aim_min);
+    }
+
+  return paddle_x;
+}
+
+
+// Sets game_state's input for the step by dt to time. dt is also the
+// step the prediction takes.
+static void
+update_autoplay (Autoplay *autoplay, GameState *game_state, double time,
+                 double dt)
+{
+  Paddle *paddle = &game_state->paddle;
+
+  game_state->input_left = 0;
+  game_state->input_right = 0;
+  game_state->input_shoot = 0;
+
+  if (game_state->game_mode != GAME_STARTED)
+    {
+      autoplay->has_target = 0;
+      autoplay->next_prediction = time;
+      return;
+    }
+
+  if (time >= autoplay->next_prediction)
+    {
+      autoplay->next_prediction = time + AUTOPLAY_PREDICT_INTERVAL;
+
+      double begin = get_seconds ();
+      Ball landing;
+      int steps_taken;
+      int landed = predict_landing (&autoplay->fork, game_state, time, dt,
+                                    (int) (AUTOPLAY_LOOKAHEAD / dt),
+                                    begin + AUTOPLAY_BUDGET,
+                                    &landing, &steps_taken) >= 0;
+      double predict_time = get_seconds () - begin;
+
+      ++autoplay->predictions_count;
+      autoplay->predictions_landed += landed;
+      autoplay->predicted_steps += steps_taken;
+      autoplay->predict_time += predict_time;
+      autoplay->predict_time_max = max (autoplay->predict_time_max,
+                                        predict_time);
+
+      // Without a landing in sight, the paddle stays on the last one.
+      if (landed)
+        {
+          autoplay->has_target = 1;
+          autoplay->target_x = get_autoplay_aim (game_state, &landing);
+        }
+    }
+
+  if (paddle->caught_ball >= 0)
+    {
+      if (time >= autoplay->serve_time)
+        {
+          game_state->input_shoot = 1;
+          autoplay->has_target = 0;
+        }
+    }
+  else
+    {
+      autoplay->serve_time = time + AUTOPLAY_SERVE_DELAY;
+      game_state->input_shoot =
+        game_state->powerup_timers[POWERUP_SHOOTER] != 0;
+    }
+
+  if (autoplay->has_target)
+    {
+      float deadzone = paddle->dim.x * AUTOPLAY_DEADZONE;
+      game_state->input_left = autoplay->target_x < paddle->pos.x - deadzone;
+      game_state->input_right = autoplay->target_x > paddle->pos.x + deadzone;
+    }
+}
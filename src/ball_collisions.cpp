@@ -0,0 +1,239 @@
+/* Bricks Game - Ball Collisions
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Sort-and-sweep broadphase for balls. The balls' extents along the
+// sweep axis are kept sorted between ticks and only fixed up with an
+// insertion sort, which is close to linear since balls move a little
+// per tick. The sweep axis is x unless the balls are spread much wider
+// along y, as in a tall scrolling level.
+
+#define SWEEP_AXIS_HYSTERESIS 2
+
+// The keys are copied out of the balls at the start of every update, so
+// sorting and sweeping only touch this contiguous array.
+struct SweepEntry {
+  float begin;
+  float end;
+  float other;
+  float size;
+  int ball_index;
+};
+
+struct SweepAndPrune {
+  int axis;
+  int max;
+  int count;
+  SweepEntry *entries;
+};
+
+
+static float
+get_axis (V2 v, int axis)
+{
+  return axis ? v.y : v.x;
+}
+
+
+static void
+sweep_and_prune_free (SweepAndPrune *sap)
+{
+  delete[] sap->entries;
+  *sap = {};
+}
+
+
+// The order of the entries carries from step to step, so a copy of the
+// balls needs a copy of it to find the same pairs in the same order.
+static void
+sweep_and_prune_copy (SweepAndPrune *sap, SweepAndPrune *source)
+{
+  if (sap->max < source->count)
+    {
+      delete[] sap->entries;
+      sap->entries = new SweepEntry[source->max];
+      sap->max = source->max;
+    }
+
+  sap->axis = source->axis;
+  sap->count = source->count;
+  for (int i = 0; i < source->count; ++i)
+    {
+      sap->entries[i] = source->entries[i];
+    }
+}
+
+
+static void
+sweep_and_prune_insertion_sort (SweepAndPrune *sap)
+{
+  SweepEntry *entries = sap->entries;
+
+  for (int i = 1; i < sap->count; ++i)
+    {
+      SweepEntry entry = entries[i];
+
+      int j = i;
+      for (; j > 0 && entries[j - 1].begin > entry.begin; --j)
+        {
+          entries[j] = entries[j - 1];
+        }
+      entries[j] = entry;
+    }
+}
+
+
+static void
+sweep_and_prune_update (SweepAndPrune *sap, Ball *balls, int balls_count)
+{
+  if (sap->max < balls_count)
+    {
+      SweepEntry *new_entries = new SweepEntry[balls_count * 2];
+      for (int i = 0; i < sap->count; ++i)
+        {
+          new_entries[i] = sap->entries[i];
+        }
+      delete[] sap->entries;
+      sap->entries = new_entries;
+      sap->max = balls_count * 2;
+    }
+
+  // Balls are removed by moving the last one into the freed slot, so
+  // dropping the indices past the end and appending the new ones
+  // leaves every ball in the list once, mostly still in order.
+  int count = 0;
+  for (int i = 0; i < sap->count; ++i)
+    {
+      if (sap->entries[i].ball_index < balls_count)
+        {
+          sap->entries[count++] = sap->entries[i];
+        }
+    }
+  for (int ball_index = sap->count; ball_index < balls_count; ++ball_index)
+    {
+      sap->entries[count++].ball_index = ball_index;
+    }
+  sap->count = count;
+
+  V2 mean = {0, 0};
+  V2 variance = {0, 0};
+  for (int ball_index = 0; ball_index < balls_count; ++ball_index)
+    {
+      mean += balls[ball_index].pos;
+    }
+  if (balls_count)
+    {
+      mean /= balls_count;
+    }
+  for (int ball_index = 0; ball_index < balls_count; ++ball_index)
+    {
+      V2 delta = balls[ball_index].pos - mean;
+      variance.x += delta.x * delta.x;
+      variance.y += delta.y * delta.y;
+    }
+
+  int old_axis = sap->axis;
+  if (sap->axis == 0 && variance.y > variance.x * SWEEP_AXIS_HYSTERESIS)
+    {
+      sap->axis = 1;
+    }
+  else if (sap->axis == 1 && variance.x > variance.y * SWEEP_AXIS_HYSTERESIS)
+    {
+      sap->axis = 0;
+    }
+
+  for (int i = 0; i < sap->count; ++i)
+    {
+      SweepEntry *entry = sap->entries + i;
+      Ball *ball = balls + entry->ball_index;
+      float center = get_axis (ball->pos, sap->axis);
+      entry->begin = center - ball->size;
+      entry->end = center + ball->size;
+      entry->other = get_axis (ball->pos, !sap->axis);
+      entry->size = ball->size;
+    }
+
+  if (sap->axis == old_axis)
+    {
+      sweep_and_prune_insertion_sort (sap);
+    }
+  else
+    {
+      // The old order says nothing about the new axis.
+      sort (sap->entries, sap->entries + sap->count,
+            [] (const SweepEntry &a, const SweepEntry &b)
+            {
+              return a.begin < b.begin;
+            });
+    }
+}
+
+
+// Appends the pairs of balls whose bounding boxes overlap to pairs, as
+// two ball indices per pair.
+static void
+sweep_and_prune_pairs (SweepAndPrune *sap, IntArray *pairs)
+{
+  SweepEntry *entries = sap->entries;
+
+  for (int i = 0; i < sap->count; ++i)
+    {
+      SweepEntry a = entries[i];
+
+      for (int j = i + 1; j < sap->count && entries[j].begin <= a.end; ++j)
+        {
+          if (fabsf (entries[j].other - a.other) < a.size + entries[j].size)
+            {
+              int_array_push (pairs, a.ball_index);
+              int_array_push (pairs, entries[j].ball_index);
+            }
+        }
+    }
+}
+
+
+// Elastic collision of two balls of equal mass: they are pushed apart
+// and swap their velocity components along the contact normal. Returns
+// 1 if the balls were touching.
+static int
+collide_balls (Ball *a, Ball *b)
+{
+  V2 delta = b->pos - a->pos;
+  float distance_squared = dot (delta, delta);
+  float radii = a->size + b->size;
+
+  if (distance_squared >= radii * radii || distance_squared == 0)
+    {
+      return 0;
+    }
+
+  float distance = sqrt (distance_squared);
+  V2 normal = delta / distance;
+  V2 separation = normal * ((radii - distance) / 2);
+  a->pos -= separation;
+  b->pos += separation;
+
+  float approach = dot (a->dir - b->dir, normal);
+
+  if (approach > 0)
+    {
+      a->dir -= normal * approach;
+      b->dir += normal * approach;
+    }
+
+  return 1;
+}
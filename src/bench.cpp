@@ -0,0 +1,1097 @@
+/* Bricks Game - Benchmarks
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Run with "bricks --bench". Nothing here needs a window or audio.
+
+#define BENCH_TICKS 200
+#define BENCH_DT (1.0 / 60)
+
+// Which build the results are of. The Makefile's release, lto and pgo
+// targets say how they were built.
+#ifndef BRICKS_BUILD
+#ifdef __OPTIMIZE__
+#define BRICKS_BUILD "optimized"
+#else
+#define BRICKS_BUILD "unoptimized"
+#endif
+#endif
+
+
+static double
+bench_seconds (void)
+{
+  return (double) SDL_GetPerformanceCounter () / SDL_GetPerformanceFrequency ();
+}
+
+
+// Balls bouncing in a box whose area grows with the ball count, so the
+// density, and the number of real contacts per ball, stays the same.
+static Ball *
+bench_new_balls (int balls_count, V2 arena)
+{
+  Ball *balls = new Ball[balls_count];
+
+  for (int ball_index = 0; ball_index < balls_count; ++ball_index)
+    {
+      V2 pos = {(float) (rand32 () * arena.x), (float) (rand32 () * arena.y)};
+      V2 dir = {(float) (rand32 () - 0.5), (float) (rand32 () - 0.5)};
+      balls[ball_index] = new_ball (pos, normalize (dir) * BALLS_SPEED_INIT);
+    }
+
+  return balls;
+}
+
+
+static void
+bench_move_balls (Ball *balls, int balls_count, V2 arena)
+{
+  for (int ball_index = 0; ball_index < balls_count; ++ball_index)
+    {
+      Ball *ball = balls + ball_index;
+      ball->pos += ball->dir * BENCH_DT;
+
+      if (ball->pos.x < 0 || ball->pos.x > arena.x)
+        {
+          ball->dir.x = -ball->dir.x;
+        }
+      if (ball->pos.y < 0 || ball->pos.y > arena.y)
+        {
+          ball->dir.y = -ball->dir.y;
+        }
+    }
+}
+
+
+static void
+bench_balls_collisions (void)
+{
+  cout << endl << "Ball collisions, " << BENCH_TICKS << " ticks:" << endl;
+  cout << "  balls   arena   sap us/tick  sap ns/ball  brute us/tick" << endl;
+
+  int counts[] = {250, 500, 1000, 2000, 4000, 8000, 16000};
+  float area_per_ball = 0.25 * 0.25;
+
+  for (int tall = 0; tall < 2; ++tall)
+    {
+      for (uint count_index = 0;
+           count_index < array_len (counts);
+           ++count_index)
+        {
+          int balls_count = counts[count_index];
+          float area = balls_count * area_per_ball;
+
+          // The tall arena is as wide as the playfield, like a
+          // scrolling level.
+          V2 arena;
+          arena.x = tall ? 2 : sqrt (area);
+          arena.y = area / arena.x;
+
+          srand (balls_count);
+          Ball *balls = bench_new_balls (balls_count, arena);
+          SweepAndPrune sap = {};
+          IntArray pairs = {};
+
+          double begin = bench_seconds ();
+          for (int tick = 0; tick < BENCH_TICKS; ++tick)
+            {
+              bench_move_balls (balls, balls_count, arena);
+              sweep_and_prune_update (&sap, balls, balls_count);
+              pairs.count = 0;
+              sweep_and_prune_pairs (&sap, &pairs);
+
+              for (int pair_index = 0;
+                   pair_index < pairs.count;
+                   pair_index += 2)
+                {
+                  collide_balls (balls + pairs.items[pair_index],
+                                 balls + pairs.items[pair_index + 1]);
+                }
+            }
+          double sap_time = (bench_seconds () - begin) / BENCH_TICKS;
+
+          delete[] balls;
+          sweep_and_prune_free (&sap);
+          int_array_free (&pairs);
+
+          // All pairs, for reference. Too slow to be worth running on
+          // the bigger counts.
+          double brute_time = 0;
+          if (balls_count <= 4000)
+            {
+              srand (balls_count);
+              balls = bench_new_balls (balls_count, arena);
+
+              begin = bench_seconds ();
+              for (int tick = 0; tick < BENCH_TICKS / 10; ++tick)
+                {
+                  bench_move_balls (balls, balls_count, arena);
+                  for (int a = 0; a < balls_count; ++a)
+                    {
+                      for (int b = a + 1; b < balls_count; ++b)
+                        {
+                          collide_balls (balls + a, balls + b);
+                        }
+                    }
+                }
+              brute_time = (bench_seconds () - begin) / (BENCH_TICKS / 10);
+
+              delete[] balls;
+            }
+
+          printf ("  %6d  %s  %11.1f  %11.1f  ",
+                  balls_count, tall ? " tall " : "square",
+                  sap_time * 1e6, sap_time * 1e9 / balls_count);
+          if (brute_time > 0)
+            {
+              printf ("%13.1f\n", brute_time * 1e6);
+            }
+          else
+            {
+              printf ("%13s\n", "-");
+            }
+        }
+    }
+}
+
+
+static void
+bench_vectors (void)
+{
+  cout << endl << "V2 batch operations (" V2_SIMD_NAME "), ns per vector:" << endl;
+  cout << "  operation      scalar     batch   max error" << endl;
+
+  // Odd, so the scalar tails run too.
+  int count = 4095;
+  int rounds = 2000;
+  V2 *source = new V2[count];
+  V2 *scalar = new V2[count];
+  V2 *batch = new V2[count];
+
+  srand (count);
+  for (int i = 0; i < count; ++i)
+    {
+      source[i].x = rand32 () * 4 - 2;
+      source[i].y = rand32 () * 4 - 2;
+    }
+  source[count / 2] = (V2) {0, 0};
+
+  const char *names[] = {"add_scaled", "normalize", "clamp"};
+
+  for (uint op = 0; op < array_len (names); ++op)
+    {
+      double times[2];
+
+      for (int use_batch = 0; use_batch < 2; ++use_batch)
+        {
+          V2 *vectors = use_batch ? batch : scalar;
+          double begin = bench_seconds ();
+
+          for (int round = 0; round < rounds; ++round)
+            {
+              memcpy (vectors, source, count * sizeof (V2));
+
+              switch (op)
+                {
+                case 0:
+                  {
+                    if (use_batch) add_scaled_many (vectors, source, 0.5, count);
+                    else add_scaled_many_scalar (vectors, source, 0.5, count);
+                  } break;
+                case 1:
+                  {
+                    if (use_batch) normalize_many (vectors, count);
+                    else normalize_many_scalar (vectors, count);
+                  } break;
+                case 2:
+                  {
+                    V2 min = {-1, -0.5};
+                    V2 max = {1, 0.5};
+                    if (use_batch) clamp_many (vectors, count, min, max);
+                    else clamp_many_scalar (vectors, count, min, max);
+                  } break;
+                }
+            }
+
+          times[use_batch] = (bench_seconds () - begin) / rounds / count;
+        }
+
+      float max_error = 0;
+      for (int i = 0; i < count; ++i)
+        {
+          V2 error = batch[i] - scalar[i];
+          max_error = max (max_error, max (fabsf (error.x), fabsf (error.y)));
+        }
+
+      printf ("  %-10s  %8.2f  %8.2f  %10.2g\n",
+              names[op], times[0] * 1e9, times[1] * 1e9, max_error);
+    }
+
+  delete[] source;
+  delete[] scalar;
+  delete[] batch;
+}
+
+
+// Moving a full pool of particles on a step, a particle at a time and
+// down the arrays in vectors.
+static void
+bench_particles (void)
+{
+  cout << endl << "Particle update (" V2_SIMD_NAME "), " << PARTICLES_MAX
+       << " particles:" << endl;
+  cout << "  scalar ns  batch ns  max error" << endl;
+
+  int rounds = 200;
+  float dt = BENCH_DT;
+  float drag = expf (-PARTICLE_DRAG * dt);
+  Particles particles[2];
+
+  for (int use_batch = 0; use_batch < 2; ++use_batch)
+    {
+      init_particles (particles + use_batch, 1);
+      ParticleEmission emission = {PARTICLE_DEBRIS, {0, 0}, {2, 2},
+                                   {1, 1, 1}};
+      while (particles[use_batch].count < PARTICLES_MAX)
+        {
+          spawn_particles (particles + use_batch, &emission);
+        }
+    }
+
+  double times[2];
+  for (int use_batch = 0; use_batch < 2; ++use_batch)
+    {
+      Particles *pool = particles + use_batch;
+      double begin = bench_seconds ();
+
+      for (int round = 0; round < rounds; ++round)
+        {
+          if (use_batch) move_particles (pool, dt, drag);
+          else move_particles_scalar (pool, 0, pool->count, dt, drag);
+        }
+
+      times[use_batch] = (bench_seconds () - begin) / rounds / pool->count;
+    }
+
+  float max_error = 0;
+  for (int i = 0; i < PARTICLES_MAX; ++i)
+    {
+      max_error = max (max_error, fabsf (particles[0].x[i] - particles[1].x[i]));
+      max_error = max (max_error, fabsf (particles[0].y[i] - particles[1].y[i]));
+    }
+
+  printf ("  %9.2f  %8.2f  %9.2g\n", times[0] * 1e9, times[1] * 1e9,
+          max_error);
+
+  free_particles (particles);
+  free_particles (particles + 1);
+}
+
+
+// The CPU side of drawing circles: the triangle fans draw_circle used to
+// send with glVertex, against queueing one instance for the shader.
+static void
+bench_shapes (void)
+{
+  cout << endl << "Circles, CPU ns per circle:" << endl;
+  cout << "  triangle fan  instance  fan bytes  instance bytes" << endl;
+
+  int count = 10000;
+  int rounds = 100;
+  int sides = 12;
+  V2 *fan = new V2[count * (sides + 3)];
+  ShapeBatch batch = {};
+
+  double begin = bench_seconds ();
+  for (int round = 0; round < rounds; ++round)
+    {
+      V2 *vertex = fan;
+      for (int i = 0; i < count; ++i)
+        {
+          V2 pos = {i * 1e-4f, 0};
+          float r = 0.05;
+          float angle_step = M_PI * 2 / sides;
+          float angle = angle_step;
+
+          *vertex++ = pos;
+          *vertex++ = (V2) {pos.x + r, pos.y};
+          for (int side = 0; side < sides; ++side)
+            {
+              *vertex++ = (V2) {cosf (angle) * r + pos.x,
+                                sinf (angle) * r + pos.y};
+              angle += angle_step;
+            }
+          *vertex++ = (V2) {pos.x + r, pos.y};
+        }
+    }
+  double fan_time = (bench_seconds () - begin) / rounds / count;
+
+  begin = bench_seconds ();
+  for (int round = 0; round < rounds; ++round)
+    {
+      batch.count = 0;
+      for (int i = 0; i < count; ++i)
+        {
+          draw_circle (&batch, (V2) {i * 1e-4f, 0}, 0.05,
+                       (Color) {0.9, 0.2, 0.5});
+        }
+    }
+  double instance_time = (bench_seconds () - begin) / rounds / count;
+
+  // Immediate mode sends a color and 15 vertices of 2 floats.
+  printf ("  %12.1f  %8.1f  %9d  %14d\n",
+          fan_time * 1e9, instance_time * 1e9,
+          (int) (sizeof (float) * (3 + (sides + 3) * 2)),
+          (int) sizeof (ShapeInstance));
+
+  delete[] fan;
+  free_shape_batch (&batch);
+}
+
+
+// Packing the sprite atlas from the PNGs, against reading the packed
+// file, which is what the game does unless a PNG changed.
+static void
+bench_atlas (void)
+{
+  int rounds = 20;
+  string sources[SPRITE_SHEET_ENUM_LENGTH];
+  uint64_t sources_hash = hash_atlas_sources (sources);
+  Atlas atlas = {};
+
+  double begin = bench_seconds ();
+  for (int round = 0; round < rounds; ++round)
+    {
+      build_atlas (&atlas, sources, sources_hash);
+      free_atlas (&atlas);
+    }
+  double build_time = (bench_seconds () - begin) / rounds;
+
+  const char *filepath = "bench.atlas";
+  build_atlas (&atlas, sources, sources_hash);
+  int written = write_atlas (&atlas, filepath);
+  free_atlas (&atlas);
+
+  begin = bench_seconds ();
+  int read = written;
+  for (int round = 0; round < rounds && read; ++round)
+    {
+      read = read_atlas (&atlas, filepath, sources_hash);
+      free_atlas (&atlas);
+    }
+  double read_time = (bench_seconds () - begin) / rounds;
+  remove (filepath);
+
+  cout << endl << "Sprite atlas, " << SPRITE_SHEET_ENUM_LENGTH
+       << " sheets:" << endl;
+  printf ("  %.3f ms to pack from the PNGs\n", build_time * 1e3);
+  if (read)
+    {
+      printf ("  %.3f ms to read packed\n", read_time * 1e3);
+    }
+  else
+    {
+      printf ("  Can't write %s to read it back.\n", filepath);
+    }
+}
+
+
+// Generating, parsing and indexing big generated maps, and querying
+// them the way a ball does every tick.
+static void
+bench_maps (void)
+{
+  cout << endl << "Generated maps:" << endl;
+  cout << "  kind        size      bricks  generate ms  parse ms  tree ms  query us" << endl;
+
+  int sizes[] = {100, 300, 1000, 2000};
+  int queries_count = 10000;
+
+  for (int kind = 0; kind < MAPGEN_ENUM_LENGTH; ++kind)
+    {
+      for (uint size_index = 0; size_index < array_len (sizes); ++size_index)
+        {
+          int size = sizes[size_index];
+
+          double begin = bench_seconds ();
+          ostringstream map_stream;
+          generate_map (map_stream, (MapGenKind) kind, size, size, 1,
+                        (V2) {0, 0});
+          string map_text = map_stream.str ();
+          double generate_time = bench_seconds () - begin;
+
+          begin = bench_seconds ();
+          MapLayout layout = {};
+          int bricks_count = parse_map (map_text.data (), map_text.size (),
+                                        0, 0, 0);
+          Brick *bricks = new Brick[bricks_count];
+          parse_map (map_text.data (), map_text.size (), bricks, &layout, 0);
+          double parse_time = bench_seconds () - begin;
+
+          begin = bench_seconds ();
+          AABBTree tree;
+          aabb_tree_init (&tree);
+          for (int brick_index = 0; brick_index < bricks_count; ++brick_index)
+            {
+              aabb_tree_insert (&tree, aabb_from_rect (bricks[brick_index].pos,
+                                                       bricks[brick_index].dim),
+                                brick_index);
+            }
+          double tree_time = bench_seconds () - begin;
+
+          // Ball sized boxes anywhere on the map.
+          float map_bottom = get_tile_pos (&layout, 0, layout.rows).y;
+          IntArray results = {};
+          srand (size);
+          begin = bench_seconds ();
+          for (int query = 0; query < queries_count; ++query)
+            {
+              V2 pos = {(float) (rand32 () * 2 - 1),
+                        (float) (map_bottom + rand32 () * (1 - map_bottom))};
+              results.count = 0;
+              aabb_tree_query (&tree,
+                               aabb_from_rect (pos, (V2) {DEFAULT_BALL_SIZE * 2,
+                                                          DEFAULT_BALL_SIZE * 2}),
+                               &results);
+            }
+          double query_time = (bench_seconds () - begin) / queries_count;
+
+          printf ("  %-8s  %4dx%-4d  %8d  %11.1f  %8.1f  %7.1f  %8.3f\n",
+                  mapgen_kind_names[kind], size, size, bricks_count,
+                  generate_time * 1e3, parse_time * 1e3, tree_time * 1e3,
+                  query_time * 1e6);
+
+          delete[] bricks;
+          aabb_tree_free (&tree);
+          int_array_free (&results);
+        }
+    }
+}
+
+
+// Scrolling a camera from the bottom of ever taller maps to the top.
+// What is loaded, and the cost per frame, should only depend on the
+// view.
+static void
+bench_level_streaming (void)
+{
+  cout << endl << "Level streaming, 100 columns, scrolling bottom to top:" << endl;
+  cout << "  rows    bricks  index ms  loaded max  visible  stream us/frame  max us" << endl;
+
+  int rows_counts[] = {300, 3000, 30000};
+  float scroll_step = 0.05;
+
+  for (uint rows_index = 0; rows_index < array_len (rows_counts); ++rows_index)
+    {
+      int rows_count = rows_counts[rows_index];
+
+      ostringstream map_stream;
+      generate_map (map_stream, MAPGEN_NOISE, 100, rows_count, 1, (V2) {0, 0});
+      string map_text = map_stream.str ();
+
+      FILE *file = tmpfile ();
+      fwrite (map_text.data (), 1, map_text.size (), file);
+      rewind (file);
+
+      Level level = {};
+      BricksArray bricks_array = {};
+      AABBTree bricks_tree;
+      aabb_tree_init (&bricks_tree);
+      IntArray query = {};
+      IntArray visible = {};
+
+      double begin = bench_seconds ();
+      load_level_file (&level, file, "bench", &bricks_array, &bricks_tree);
+      double index_time = bench_seconds () - begin;
+      int bricks_count = level.bricks_left;
+
+      Camera camera = {};
+      camera.dim = (V2) {2, 2};
+      LevelChunk *last_chunk = level.chunks + level.chunks_count - 1;
+      camera.pos.y = get_chunk_bottom (&level, last_chunk) + camera.dim.y / 2;
+
+      int frames_count = 0;
+      int loaded_max = 0;
+      double visible_total = 0;
+      double stream_time = 0;
+      double stream_time_max = 0;
+
+      for (; camera.pos.y <= 1 - camera.dim.y / 2; camera.pos.y += scroll_step)
+        {
+          begin = bench_seconds ();
+          stream_level (&level,
+                        camera.pos.y - camera.dim.y / 2,
+                        camera.pos.y + camera.dim.y / 2,
+                        &bricks_array, &bricks_tree, &query);
+          visible.count = 0;
+          aabb_tree_query (&bricks_tree, aabb_from_rect (camera.pos, camera.dim),
+                           &visible);
+          double frame_time = bench_seconds () - begin;
+
+          stream_time += frame_time;
+          stream_time_max = max (stream_time_max, frame_time);
+          loaded_max = max (loaded_max, bricks_array.count);
+          visible_total += visible.count;
+          ++frames_count;
+        }
+
+      printf ("  %5d  %8d  %8.1f  %10d  %7.0f  %15.1f  %6.1f\n",
+              rows_count, bricks_count, index_time * 1e3, loaded_max,
+              visible_total / frames_count,
+              stream_time / frames_count * 1e6, stream_time_max * 1e6);
+
+      free_level (&level, &bricks_array, &bricks_tree);
+      aabb_tree_free (&bricks_tree);
+      int_array_free (&query);
+      int_array_free (&visible);
+    }
+}
+
+
+// A headless game played by the autoplay, as fast as it goes.
+struct AutoplayRun {
+  int steps_count;
+  int levels_won;
+  int games_lost;
+  int lives_lost;
+  // In seconds, of wall time, autoplay included.
+  double step_time;
+  double step_time_max;
+};
+
+
+// Plays seconds of game time at 120 Hz from a new game on map_filepath.
+// game_state and autoplay are initialized by the caller.
+static AutoplayRun
+run_autoplay (GameState *game_state, Autoplay *autoplay,
+              const char *map_filepath, double seconds)
+{
+  double dt = 1.0 / 120;
+  AutoplayRun run = {};
+  run.steps_count = seconds / dt;
+
+  new_game (game_state);
+  new_level (game_state, map_filepath);
+
+  for (int step = 0; step < run.steps_count; ++step)
+    {
+      double time = step * dt;
+      GameMode game_mode = game_state->game_mode;
+      int lives_count = game_state->lives_count;
+
+      double begin = bench_seconds ();
+      update_autoplay (autoplay, game_state, time, dt);
+      step_game (game_state, 0, map_filepath, time, dt);
+      double step_time = bench_seconds () - begin;
+
+      run.step_time += step_time;
+      run.step_time_max = max (run.step_time_max, step_time);
+
+      if (game_mode == GAME_STARTED && game_state->game_mode == GAME_WIN)
+        {
+          ++run.levels_won;
+        }
+      if (game_mode == GAME_STARTED && game_state->game_mode == GAME_OVER)
+        {
+          ++run.games_lost;
+        }
+      run.lives_lost += game_state->lives_count < lives_count;
+    }
+
+  return run;
+}
+
+
+// What forking the game state costs with more and more bricks loaded,
+// and how the autoplay does on the first map: how far it sees, how long
+// that takes next to its budget, and how it plays.
+static void
+bench_autoplay (void)
+{
+  cout << endl << "Forking the game state, 1000 forks:" << endl;
+  cout << "  bricks  fork us" << endl;
+
+  int sizes[] = {10, 100, 300};
+  int forks_count = 1000;
+
+  for (uint size_index = 0; size_index < array_len (sizes); ++size_index)
+    {
+      int size = sizes[size_index];
+
+      ostringstream map_stream;
+      generate_map (map_stream, MAPGEN_PATTERN, size, size, 1, (V2) {0, 0});
+      string map_text = map_stream.str ();
+      int bricks_count = parse_map (map_text.data (), map_text.size (),
+                                    0, 0, 0);
+
+      GameState game_state;
+      init_game_state (&game_state, 1);
+      game_state.config = embedded_config;
+      new_game (&game_state);
+      new_level (&game_state, "res/map1.txt");
+
+      BricksArray *bricks_array = &game_state.bricks_array;
+      int first = bricks_array->count;
+      reserve_bricks (bricks_array, first + bricks_count);
+      MapLayout layout = {};
+      parse_map (map_text.data (), map_text.size (),
+                 bricks_array->items + first, &layout, 0);
+      insert_bricks (bricks_array, &game_state.bricks_tree,
+                     first + bricks_count);
+
+      GameState fork;
+      init_game_state (&fork, 0);
+      fork_game_state (&fork, &game_state);
+
+      double begin = bench_seconds ();
+      for (int fork_index = 0; fork_index < forks_count; ++fork_index)
+        {
+          fork_game_state (&fork, &game_state);
+        }
+      double fork_time = (bench_seconds () - begin) / forks_count;
+
+      printf ("  %6d  %7.1f\n", bricks_array->count, fork_time * 1e6);
+
+      free_game_state (&fork);
+      free_game_state (&game_state);
+    }
+
+  GameState game_state;
+  init_game_state (&game_state, 1);
+  game_state.config = embedded_config;
+  Autoplay autoplay;
+  init_autoplay (&autoplay);
+
+  AutoplayRun run = run_autoplay (&game_state, &autoplay, "res/map1.txt", 300);
+
+  int predictions_count = max (autoplay.predictions_count, 1);
+
+  cout << endl << "Autoplay, 300 seconds of res/map1.txt at 120 Hz:" << endl;
+  printf ("  %d predictions, %.0f%% of them seeing a ball land\n",
+          autoplay.predictions_count,
+          100.0 * autoplay.predictions_landed / predictions_count);
+  printf ("  %.0f steps ahead on average, %.0f steps per ms\n",
+          (double) autoplay.predicted_steps / predictions_count,
+          autoplay.predicted_steps / (autoplay.predict_time * 1e3));
+  printf ("  %.3f ms per prediction, %.3f ms at most, of a %.3f ms budget\n",
+          autoplay.predict_time / predictions_count * 1e3,
+          autoplay.predict_time_max * 1e3, AUTOPLAY_BUDGET * 1e3);
+  printf ("  %d levels won, %d lives and %d games lost\n",
+          run.levels_won, run.lives_lost, run.games_lost);
+  printf ("  %.1f us per step, %.1f us at most\n",
+          run.step_time / run.steps_count * 1e6, run.step_time_max * 1e6);
+
+  free_autoplay (&autoplay);
+  free_game_state (&game_state);
+}
+
+
+// A server on localhost playing a generated map of about 100000 bricks
+// with the autoplay, and a spectator mirroring it, in simulated time:
+// what a tick costs the server, stepping the game and on the network,
+// what the spectator gets sent, and whether its bricks end up the same
+// as the server's.
+static void
+bench_net (void)
+{
+  const char *map_filepath = "bench_net_map.txt";
+  ofstream map_file (map_filepath, ofstream::binary);
+  generate_map (map_file, MAPGEN_PATTERN, 100, 2500, 1, (V2) {0, 0});
+  map_file.close ();
+
+  double dt = 1.0 / 120;
+  int seconds = 60;
+  Config config = embedded_config;
+  NetServer *server = new NetServer;
+  NetMirror *mirror = new NetMirror;
+  GameState replica;
+  init_game_state (&replica, 0);
+  replica.config = config;
+  NetAddress address;
+
+  cout << endl << "Network, " << seconds << " seconds of a 100x2500 map at "
+       << 1 / dt << " Hz, one spectator on localhost:" << endl;
+
+  if (!init_net () ||
+      !init_net_server (server, &config, map_filepath, 0, 1, 1, 0) ||
+      !resolve_net_address ("127.0.0.1", get_net_socket_port (&server->socket),
+                            &address) ||
+      !init_net_mirror (mirror, &replica, 0, &address, 0, 1))
+    {
+      cout << "  No UDP sockets to be had, skipped." << endl;
+      delete server;
+      delete mirror;
+      remove (map_filepath);
+      return;
+    }
+
+  GameState *game_state = &server->seats[0].game_state;
+  int bricks_count = game_state->level.bricks_count;
+  int steps_count = seconds / dt;
+  double time = 0;
+  int events_count = 0;
+
+  for (int step = 0; step < steps_count; ++step)
+    {
+      time = step * dt;
+      update_net_server (server, time, dt);
+      update_net_mirror (mirror, 0, time);
+      events_count += game_state->brick_hits.count;
+    }
+
+  int ticks_count = max (server->ticks_count, 1);
+  int packets_count = max (server->packets_sent, 1);
+  printf ("  %d bricks, %d hit in %d levels\n", bricks_count, events_count,
+          game_state->levels_count);
+  printf ("  tick: step %.3f ms (max %.3f), net %.3f ms (max %.3f)\n",
+          server->step_time / ticks_count * 1e3, server->step_time_max * 1e3,
+          server->net_time / ticks_count * 1e3, server->net_time_max * 1e3);
+  printf ("  %.0f B/s to the spectator, %d packets of %.1f B on average\n",
+          server->bytes_sent / (double) seconds, server->packets_sent,
+          (double) server->bytes_sent / packets_count);
+
+  // Held still, until the spectator has all there is and is looking at
+  // the newest frame.
+  for (int send = 0; send < 10; ++send)
+    {
+      time += 1.0 / NET_SEND_RATE;
+      receive_net_packets (server, time);
+      send_net_snapshots (server, time);
+      update_net_mirror (mirror, 0, time + NET_INTERPOLATION_DELAY);
+    }
+
+  // Every brick loaded on both sides should be there on both, with the
+  // same health.
+  float *healths = new float[bricks_count];
+  for (int id = 0; id < bricks_count; ++id)
+    {
+      healths[id] = -1;
+    }
+
+  BricksArray *server_bricks = &game_state->bricks_array;
+  BricksArray *mirror_bricks = &replica.bricks_array;
+  for (int brick_index = 0; brick_index < server_bricks->count; ++brick_index)
+    {
+      Brick *brick = server_bricks->items + brick_index;
+      healths[brick->id] = brick->health;
+    }
+
+  int compared = 0;
+  int different = 0;
+  for (int brick_index = 0; brick_index < mirror_bricks->count; ++brick_index)
+    {
+      Brick *brick = mirror_bricks->items + brick_index;
+      if (brick->chunk < 0 ||
+          game_state->level.chunks[brick->chunk].state == CHUNK_LOADED)
+        {
+          ++compared;
+          different += healths[brick->id] != brick->health;
+          healths[brick->id] = -1;
+        }
+    }
+
+  for (int brick_index = 0; brick_index < server_bricks->count; ++brick_index)
+    {
+      Brick *brick = server_bricks->items + brick_index;
+      if (healths[brick->id] >= 0 && brick->chunk >= 0 &&
+          replica.level.chunks[brick->chunk].state == CHUNK_LOADED)
+        {
+          ++compared;
+          ++different;
+        }
+    }
+
+  printf ("  %d of the %d bricks loaded on both sides differ\n",
+          different, compared);
+
+  // An ack with the events below zero, as only a broken or hostile
+  // client sends, should be dropped, and the snapshot after it still go
+  // out from where the spectator is.
+  NetPeer *peer = server->peers;
+  int acked_events = peer->acked_events;
+  int bad_seq = mirror->latest_seq;
+  int bad_level = replica.levels_count;
+  int bad_events = -1000000;
+  int bad_input = 0;
+  unsigned char data[NET_PACKET_MAX];
+  NetBits bits;
+  begin_net_packet (&bits, data, NET_ACK);
+  serialize_bits (&bits, &bad_seq, 32);
+  serialize_varint (&bits, &bad_level);
+  serialize_varint (&bits, &bad_events);
+  serialize_bits (&bits, &bad_input, 3);
+  send_packet (&mirror->socket, &mirror->server, data,
+               get_net_bits_size (&bits));
+
+  time += 1.0 / NET_SEND_RATE;
+  receive_net_packets (server, time);
+  send_net_snapshots (server, time);
+  printf ("  an ack with %d events %s\n", bad_events,
+          peer->acked_events == acked_events ? "was dropped" : "got through");
+
+  delete[] healths;
+  free_net_mirror (mirror);
+  free_game_state (&replica);
+  free_net_server (server);
+  delete mirror;
+  delete server;
+  remove (map_filepath);
+}
+
+
+// Timers on the wheel against a countdown each, as the game kept them
+// before, with every timer scheduled again as it fires. The wheel's
+// tick costs about what fires in it, the countdowns' what there is.
+static void
+bench_timers (void)
+{
+  float delay_max = 30;
+  cout << endl << "Timers, due in up to " << delay_max << " s, "
+       << BENCH_TICKS << " ticks:" << endl;
+  cout << "  timers  schedule ns  cancel ns  fired/tick  wheel us/tick"
+       << "  countdowns us/tick" << endl;
+
+  int counts[] = {1000, 10000, 100000};
+
+  for (uint count_index = 0; count_index < array_len (counts); ++count_index)
+    {
+      int count = counts[count_index];
+      Random random = {1};
+      TimerWheel wheel = {};
+      int *ids = new int[count];
+      float *countdowns = new float[count];
+
+      double begin = bench_seconds ();
+      for (int index = 0; index < count; ++index)
+        {
+          ids[index] = schedule_timer (&wheel,
+                                       random_float (&random) * delay_max,
+                                       0, index);
+        }
+      double schedule_time = (bench_seconds () - begin) / count;
+
+      begin = bench_seconds ();
+      for (int index = 0; index < count; ++index)
+        {
+          cancel_timer (&wheel, ids[index]);
+        }
+      double cancel_time = (bench_seconds () - begin) / count;
+
+      for (int index = 0; index < count; ++index)
+        {
+          countdowns[index] = random_float (&random) * delay_max;
+          ids[index] = schedule_timer (&wheel, countdowns[index], 0, index);
+        }
+
+      long fired = 0;
+      begin = bench_seconds ();
+      for (int tick = 0; tick < BENCH_TICKS; ++tick)
+        {
+          advance_timer_wheel (&wheel, BENCH_DT);
+
+          int type;
+          int index;
+          while (pop_timer (&wheel, &type, &index))
+            {
+              ids[index] = schedule_timer (&wheel,
+                                           random_float (&random) * delay_max,
+                                           0, index);
+              ++fired;
+            }
+        }
+      double wheel_time = (bench_seconds () - begin) / BENCH_TICKS;
+
+      begin = bench_seconds ();
+      for (int tick = 0; tick < BENCH_TICKS; ++tick)
+        {
+          for (int index = 0; index < count; ++index)
+            {
+              countdowns[index] -= BENCH_DT;
+              if (countdowns[index] <= 0)
+                {
+                  countdowns[index] += random_float (&random) * delay_max;
+                }
+            }
+        }
+      double countdowns_time = (bench_seconds () - begin) / BENCH_TICKS;
+
+      printf ("  %6d  %11.1f  %9.1f  %10.1f  %13.2f  %18.2f\n", count,
+              schedule_time * 1e9, cancel_time * 1e9,
+              (double) fired / BENCH_TICKS, wheel_time * 1e6,
+              countdowns_time * 1e6);
+
+      free_timer_wheel (&wheel);
+      delete[] ids;
+      delete[] countdowns;
+    }
+}
+
+
+// What the game's threads pay for the metrics, and what a scrape costs
+// the metrics thread.
+static void
+bench_metrics (void)
+{
+  int count = 1000000;
+  cout << endl << "Metrics, " << count << " samples:" << endl;
+
+  Random random = {1};
+  float *values = new float[count];
+  for (int index = 0; index < count; ++index)
+    {
+      values[index] = random_float (&random) * 0.02f;
+    }
+
+  double begin = bench_seconds ();
+  for (int index = 0; index < count; ++index)
+    {
+      observe_metric (METRICS_TICK_TIME, values[index]);
+    }
+  double observe_time = (bench_seconds () - begin) / count;
+
+  begin = bench_seconds ();
+  for (int index = 0; index < count; ++index)
+    {
+      set_metric (METRICS_BALLS, values[index]);
+    }
+  double set_time = (bench_seconds () - begin) / count;
+
+  MetricsServer server = {};
+  int scrapes_count = 1000;
+  size_t text_size = 0;
+  begin = bench_seconds ();
+  for (int scrape = 0; scrape < scrapes_count; ++scrape)
+    {
+      text_size = format_metrics (&server).size ();
+    }
+  double scrape_time = (bench_seconds () - begin) / scrapes_count;
+
+  printf ("  observe %.1f ns  set %.1f ns  scrape %.1f us for %d bytes\n",
+          observe_time * 1e9, set_time * 1e9, scrape_time * 1e6,
+          (int) text_size);
+
+  delete[] values;
+}
+
+
+// How close frames start to their schedule, and how much of the time
+// the process spends on the CPU while it waits.
+static void
+bench_frame_pacing (void)
+{
+  cout << endl << "Frame pacing, 1 second per rate:" << endl;
+  cout << "  fps  wake on event  mean error us  max error us  cpu %" << endl;
+
+  float fps_values[] = {30, 60, 144};
+
+  for (uint fps_index = 0; fps_index < array_len (fps_values) * 2; ++fps_index)
+    {
+      float fps = fps_values[fps_index / 2];
+      int wake_on_event = fps_index % 2;
+      int frames_count = fps;
+
+      FramePacer pacer;
+      init_frame_pacer (&pacer);
+
+      double error_total = 0;
+      double error_max = 0;
+      clock_t cpu_begin = clock ();
+      double begin = bench_seconds ();
+      double last_frame = begin;
+
+      for (int frame = 0; frame < frames_count; ++frame)
+        {
+          wait_next_frame (&pacer, fps, wake_on_event);
+          double now = bench_seconds ();
+          double error = fabs (now - last_frame - 1 / fps);
+          error_total += error;
+          error_max = max (error_max, error);
+          last_frame = now;
+        }
+
+      double wall_time = bench_seconds () - begin;
+      double cpu_time = (double) (clock () - cpu_begin) / CLOCKS_PER_SEC;
+
+      printf ("  %3.0f  %13s  %13.1f  %12.1f  %5.1f\n",
+              fps, wake_on_event ? "yes" : "no",
+              error_total / frames_count * 1e6, error_max * 1e6,
+              cpu_time / wall_time * 100);
+    }
+}
+
+
+static int
+run_benchmarks (void)
+{
+  cout << "Build: " << BRICKS_BUILD << ", " V2_SIMD_NAME " vectors, compiler "
+       << __VERSION__ << endl;
+
+  bench_vectors ();
+  bench_particles ();
+  bench_balls_collisions ();
+  bench_shapes ();
+  bench_atlas ();
+  bench_maps ();
+  bench_level_streaming ();
+  bench_timers ();
+  bench_metrics ();
+  bench_autoplay ();
+  bench_net ();
+  bench_frame_pacing ();
+
+  return 0;
+}
+
+
+// "bricks --headless [SECONDS [MAP]]": the autoplay playing the stock
+// config without a window or audio, one game after another, which is
+// what the Makefile's pgo target trains on. Returns the exit code.
+static int
+run_headless_command (int argc, char *argv[])
+{
+  double seconds = argc >= 1 ? atof (argv[0]) : 300;
+  const char *map_filepath = argc >= 2 ? argv[1] : "res/map1.txt";
+
+  if (seconds <= 0)
+    {
+      cerr << "Error: Play for more than 0 seconds." << endl;
+      return 1;
+    }
+
+  GameState game_state;
+  init_game_state (&game_state, 1);
+  game_state.config = embedded_config;
+  Autoplay autoplay;
+  init_autoplay (&autoplay);
+
+  double begin = bench_seconds ();
+  AutoplayRun run = run_autoplay (&game_state, &autoplay, map_filepath,
+                                  seconds);
+  double total_time = bench_seconds () - begin;
+
+  cout << "Build: " << BRICKS_BUILD << endl;
+  printf ("  %.0f seconds of %s in %.2f s, %.0f times real time\n",
+          seconds, map_filepath, total_time, seconds / total_time);
+  printf ("  %.1f us per step, %.1f us at most\n",
+          run.step_time / run.steps_count * 1e6, run.step_time_max * 1e6);
+  printf ("  %d levels won, %d lives and %d games lost\n",
+          run.levels_won, run.lives_lost, run.games_lost);
+
+  free_autoplay (&autoplay);
+  free_game_state (&game_state);
+  return 0;
+}
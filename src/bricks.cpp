@@ -21,18 +21,40 @@
 #include <SDL_mixer.h>
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <time.h>
 #include <math.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
 using namespace std;
 
 #include "vectors.cpp"
+#include "random.cpp"
+#include "aabb_tree.cpp"
+#include "timer_wheel.cpp"
+#include "gl.cpp"
+#include "pacing.cpp"
+#include "thread_pool.cpp"
+#include "latency.cpp"
+#include "render_stats.cpp"
+#include "shapes.cpp"
+#include "png.cpp"
+#include "atlas.cpp"
+#include "render_scale.cpp"
+#include "particles.cpp"
+#include "capture.cpp"
+#include "music.cpp"
+#include "net.cpp"
+#include "metrics.cpp"
 
 #define array_len(arr) (sizeof (arr) / sizeof (*(arr)))
 
+// The window's size at the start, before any resizing.
 #define WINDOW_WIDTH 400
 #define WINDOW_HEIGHT 400
 #define DEFAULT_SFX_VOLUME 0.05
@@ -44,6 +66,7 @@ using namespace std;
 #define SHOOT_RATE 0.2
 #define POWERUPS_MAX 3
 #define BRICK_MAX_HEALTH 5
+#define BRICK_TILE_MAX_HEALTH 35
 #define PADDLE_CURVE_FACTOR 7.5
 #define PADDLE_PUSH_FORCE 4
 #define DEFAULT_PADDLE_WIDTH 0.3
@@ -57,15 +80,13 @@ using namespace std;
 #define DEFAULT_POWERUP_SIZE 0.1
 #define DEFAULT_POWERUP_SPEED 0.75
 #define DEFAULT_GAME_WAIT_TIME 2
+#define PADDLE_SCREEN_Y -0.85
+#define CAMERA_SPEED 0.5
+#define CAMERA_LOWEST_BRICK_Y -0.4
 
 typedef unsigned char uchar;
 typedef unsigned int uint;
 
-struct Image {
-  GLuint id;
-  V2 dim;
-};
-
 struct Ball {
   V2 pos;
   V2 dir;
@@ -87,8 +108,14 @@ struct Paddle {
   V2 pos;
   V2 dim;
   float speed;
-  float blink_duration;
-  Ball *caught_ball;
+  // The eyes are shut.
+  int blinking;
+  // The index of the ball held on the paddle, or -1.
+  int caught_ball;
+  // When move_paddle last moved the paddle, and how far it went since
+  // the last step of the balls.
+  double move_time;
+  float move_distance;
 };
 
 enum PowerupType {
@@ -109,7 +136,18 @@ struct Powerup {
 struct Brick {
   V2 pos;
   V2 dim;
+  V2 vel;
   float health;
+  // What the map gave it, which it heals back to.
+  float max_health;
+  // The timer that heals it, or 0.
+  int timer;
+  int proxy;
+  // Index of the level chunk the brick was streamed in with, or -1.
+  int chunk;
+  // The brick's place among all the bricks of its map, in the order of
+  // the file, so it's the same wherever the map is loaded.
+  int id;
 };
 
 struct BricksArray {
@@ -118,11 +156,35 @@ struct BricksArray {
   Brick *items;
 };
 
+// A brick's health after a hit, 0 or less if that destroyed it, or
+// after it healed.
+struct BrickHit {
+  int id;
+  float health;
+};
+
+struct BrickHits {
+  int max;
+  int count;
+  BrickHit *items;
+};
+
 struct SoundsArray {
   int count;
   Mix_Chunk *items[9];
 };
 
+struct GameSounds {
+  SoundsArray ball_hit;
+  SoundsArray shoot_hit;
+  SoundsArray shoot;
+  Mix_Chunk *powerup;
+  // Moves on to the next track with each level.
+  Music *music;
+};
+
+#include "ball_collisions.cpp"
+
 enum GameMode {
   GAME_STARTING,
   GAME_STARTED,
@@ -131,37 +193,206 @@ enum GameMode {
 };
 
 
+struct Config {
+  float split_time;
+  float glue_time;
+  float shooter_time;
+  // How long a damaged brick goes without a hit before it heals, or 0
+  // for never.
+  float brick_regen_time;
+  float powerup_chances[POWERUP_ENUM_LENGTH];
+  int lives_count;
+  int vsync;
+  float max_fps;
+  float idle_fps;
+  float sim_fps;
+  int max_queued_frames;
+  int measure_latency;
+  int capture_fps;
+  int render_stats;
+  int fullscreen;
+  float render_scale;
+  int upscale_filter;
+  int dynamic_resolution;
+  float min_render_scale;
+  int autoplay;
+};
+
+
+// The view is dim wide and tall around pos, in the same coordinates as
+// everything in the level. The level is 2 wide, its top at y = 1, and
+// may go down as far as the map does.
+struct Camera {
+  V2 pos;
+  V2 dim;
+};
+
+#include "parse.cpp"
+#include "embedded.cpp"
+#include "level.cpp"
+
+
+// What a timer of GameState.timers does when it fires.
+enum TimerType {
+  // data is the PowerupType that runs out.
+  TIMER_POWERUP,
+  // The shooter can shoot again.
+  TIMER_SHOOT,
+  // A won or lost game goes on to the next level.
+  TIMER_GAME_WAIT,
+  TIMER_BLINK,
+  // data is the index of the brick that heals.
+  TIMER_BRICK_REGEN,
+};
+
 struct GameState {
-  float sfx_volume;
-  float music_volume;
   GameMode game_mode;
-  PowerupType active_powerup;
-  float powerup_chances[POWERUP_ENUM_LENGTH];
-  float powerup_time;
-  float split_time_init;
-  float glue_time_init;
-  float shooter_time_init;
-  float game_wait_time;
-  float shoot_timeout;
+  Config config;
+  Camera camera;
+  Level level;
+  // Game time, which stops with the game. The ids of the timers below
+  // are 0 while they aren't running.
+  TimerWheel timers;
+  int powerup_timers[POWERUP_ENUM_LENGTH];
+  int shoot_timer;
+  int game_wait_timer;
+  int blink_timer;
   float balls_speed;
-  int lives_count_init;
   int lives_count;
   int score;
   int input_shoot;
   int input_left;
   int input_right;
+  // The step draws all its chances from here rather than rand (), so a
+  // fork of the game state plays out the same as the game.
+  Random random;
 
   Paddle paddle;
   int balls_count;
   Ball balls[BALLS_MAX];
+  SweepAndPrune balls_sap;
+  IntArray balls_pairs;
   int bullets_count;
   Bullet bullets[BULLETS_MAX];
   int powerups_count;
   Powerup powerups[POWERUPS_MAX];
+  ParticleEmissions particle_emissions;
   BricksArray bricks_array;
+  int moving_bricks_count;
+  AABBTree bricks_tree;
+  IntArray bricks_query;
+  IntArray bricks_visible;
+  // The bricks the last step hit, for the server to pass on.
+  BrickHits brick_hits;
+  // The last step's collision tests of bricks and of pairs of balls
+  // that the broad phase let through, and how many of them hit.
+  int collisions_tested;
+  int collisions_hit;
+  // Goes up with every new_level, so a new level can be told from a
+  // restart of the same one.
+  int levels_count;
 };
 
 
+static void
+push_brick_hit (BrickHits *hits, int id, float health)
+{
+  if (hits->count == hits->max)
+    {
+      hits->max = hits->max ? hits->max * 2 : 64;
+      BrickHit *new_items = new BrickHit[hits->max];
+      for (int index = 0; index < hits->count; ++index)
+        {
+          new_items[index] = hits->items[index];
+        }
+      delete[] hits->items;
+      hits->items = new_items;
+    }
+
+  BrickHit *hit = hits->items + hits->count++;
+  hit->id = id;
+  hit->health = health;
+}
+
+
+static void
+init_game_state (GameState *game_state, uint64_t seed)
+{
+  *game_state = {};
+  game_state->random.state = seed;
+  aabb_tree_init (&game_state->bricks_tree);
+}
+
+
+static void
+free_game_state (GameState *game_state)
+{
+  free_level (&game_state->level, &game_state->bricks_array,
+              &game_state->bricks_tree);
+  aabb_tree_free (&game_state->bricks_tree);
+  int_array_free (&game_state->bricks_query);
+  int_array_free (&game_state->bricks_visible);
+  sweep_and_prune_free (&game_state->balls_sap);
+  int_array_free (&game_state->balls_pairs);
+  delete[] game_state->brick_hits.items;
+  game_state->brick_hits = {};
+  free_timer_wheel (&game_state->timers);
+}
+
+
+// Makes fork a copy of game_state that can be stepped ahead without
+// changing the game: for seeing what will happen, as the autoplay does.
+// The fork keeps its storage from one fork_game_state to the next, so
+// once it has grown to the game's size forking doesn't allocate, and
+// it costs about a copy of the bricks. Its level doesn't stream, and
+// it should be stepped without sounds and only while GAME_STARTED, as
+// anything else may load a new level. Free it with free_game_state.
+static void
+fork_game_state (GameState *fork, GameState *game_state)
+{
+  Level level = fork->level;
+  BricksArray bricks_array = fork->bricks_array;
+  AABBTree bricks_tree = fork->bricks_tree;
+  IntArray bricks_query = fork->bricks_query;
+  IntArray bricks_visible = fork->bricks_visible;
+  SweepAndPrune balls_sap = fork->balls_sap;
+  IntArray balls_pairs = fork->balls_pairs;
+  BrickHits brick_hits = fork->brick_hits;
+  TimerWheel timers = fork->timers;
+
+  *fork = *game_state;
+
+  fork->level = level;
+  fork->bricks_array = bricks_array;
+  fork->bricks_tree = bricks_tree;
+  fork->bricks_query = bricks_query;
+  fork->bricks_visible = bricks_visible;
+  fork->balls_sap = balls_sap;
+  fork->balls_pairs = balls_pairs;
+  fork->brick_hits = brick_hits;
+  fork->brick_hits.count = 0;
+  fork->timers = timers;
+
+  fork_level (&fork->level, &fork->bricks_array,
+              &game_state->level, &game_state->bricks_array);
+  aabb_tree_copy (&fork->bricks_tree, &game_state->bricks_tree);
+  sweep_and_prune_copy (&fork->balls_sap, &game_state->balls_sap);
+  copy_timer_wheel (&fork->timers, &game_state->timers);
+}
+
+
+// The seconds left of the powerup, 0 if it isn't active.
+static float
+get_powerup_time (GameState *game_state, PowerupType type)
+{
+  return get_timer_left (&game_state->timers,
+                         game_state->powerup_timers[type]);
+}
+
+
+#include "mapgen.cpp"
+
+
 static double
 rand32 (void)
 {
@@ -197,124 +428,54 @@ rand32 (void)
 // }
 
 
+// Everything in the level is drawn through this, the HUD with the
+// identity transform.
 static void
-draw_rect (V2 pos, V2 dim)
-{
-  dim /= 2;
-
-  glBegin (GL_TRIANGLE_STRIP);
-  glVertex2f (pos.x - dim.x, pos.y - dim.y);
-  glVertex2f (pos.x - dim.x, pos.y + dim.y);
-  glVertex2f (pos.x + dim.x, pos.y - dim.y);
-  glVertex2f (pos.x + dim.x, pos.y + dim.y);
-  glEnd ();
-}
-
-
-static void
-draw_circle (V2 pos, float r)
+set_camera_transform (Camera *camera)
 {
-  int sides = 12;
-  float angle_step = M_PI * 2 / sides;
-  float angle = angle_step;
-
-  glBegin (GL_TRIANGLE_FAN);
-  glVertex2f (pos.x, pos.y);
-  glVertex2f (pos.x + r, pos.y);
-  for (int i = 0; i < sides; ++i)
-    {
-      glVertex2f (cosf (angle) * r + pos.x,
-                  sinf (angle) * r + pos.y);
-      angle += angle_step;
-    }
-  glVertex2f (pos.x + r, pos.y);
-  glEnd ();
+  glMatrixMode (GL_MODELVIEW);
+  glLoadIdentity ();
+  glScalef (2 / camera->dim.x, 2 / camera->dim.y, 1);
+  glTranslatef (-camera->pos.x, -camera->pos.y, 0);
 }
 
 
+// The paddle blinks about every eight seconds, for a fifth of one.
 static void
-draw_semi_circle (V2 pos, float r, float begin_angle, float end_angle)
+update_paddle_blink (GameState *game_state, double dt)
 {
-  if (end_angle < begin_angle)
-    {
-      end_angle += M_PI * 2;
-    }
-
-  int sides = 12;
-  float angle_step = (end_angle - begin_angle) / sides;
-  float angle = begin_angle;
-
-  glBegin (GL_TRIANGLE_FAN);
-  glVertex2f (pos.x, pos.y);
-
-  for (int i = 0; i <= sides; ++i)
+  if (random_float (&game_state->random) < 0.12 * dt)
     {
-      glVertex2f (cosf (angle) * r + pos.x,
-                  sinf (angle) * r + pos.y);
-      angle += angle_step;
+      game_state->paddle.blinking = 1;
+      set_timer (&game_state->timers, &game_state->blink_timer, 0.2,
+                 TIMER_BLINK, 0);
     }
-
-  glVertex2f (pos.x + r, pos.y);
-  glEnd ();
-}
-
-
-static void
-draw_image (Image *image, V2 pos, V2 dim, V2 image_offset, V2 image_portion_dim)
-{
-  dim /= 2;
-
-  V2 t0 = image_offset / image->dim;
-  V2 t1 = t0 + image_portion_dim / image->dim;
-
-  glBindTexture (GL_TEXTURE_2D, image->id);
-
-  glEnable (GL_TEXTURE_2D);
-  glBegin (GL_TRIANGLE_STRIP);
-  glTexCoord2f (t0.x, t1.y);
-  glVertex2f (pos.x - dim.x, pos.y - dim.y);
-
-  glTexCoord2f (t0.x, t0.y);
-  glVertex2f (pos.x - dim.x, pos.y + dim.y);
-
-  glTexCoord2f (t1.x, t1.y);
-  glVertex2f (pos.x + dim.x, pos.y - dim.y);
-
-  glTexCoord2f (t1.x, t0.y);
-  glVertex2f (pos.x + dim.x, pos.y + dim.y);
-  glEnd ();
-  glDisable (GL_TEXTURE_2D);
 }
 
 
 static void
-draw_paddle (Paddle *paddle, V2 eyes_target, EmotionType emotion, double dt)
+draw_paddle (ShapeBatch *shapes, Paddle *paddle, V2 eyes_target,
+             EmotionType emotion)
 {
-  glColor3f (0.8, 0.6, 1);
-  draw_rect (paddle->pos, paddle->dim);
+  draw_rounded_rect (shapes, paddle->pos, paddle->dim, paddle->dim.y / 3,
+                     (Color) {0.8, 0.6, 1});
 
   switch (emotion)
     {
     case EMOTION_HAPPY:
       {
-        glColor3f (0, 0, 0);
-        draw_semi_circle (paddle->pos, 0.03, M_PI, M_PI * 2);
+        draw_semi_circle (shapes, paddle->pos, 0.03, M_PI, M_PI * 2,
+                          (Color) {0, 0, 0});
       } break;
     case EMOTION_SAD:
       {
-        glColor3f (0, 0, 0);
         V2 mouth_pos = paddle->pos;
         mouth_pos.y -= paddle->dim.y * 0.4;
-        draw_semi_circle (mouth_pos, 0.03, 0, M_PI);
+        draw_semi_circle (shapes, mouth_pos, 0.03, 0, M_PI, (Color) {0, 0, 0});
       } break;
     }
 
-  if (rand32 () < 0.12 * dt)
-    {
-      paddle->blink_duration = 1;
-    }
-
-  if (paddle->blink_duration <= 0)
+  if (!paddle->blinking)
     {
       V2 eye_pos = paddle->pos;
       eye_pos.x -= 0.1;
@@ -322,11 +483,8 @@ draw_paddle (Paddle *paddle, V2 eyes_target, EmotionType emotion, double dt)
            eye_index < 2;
            ++eye_index)
         {
-          glColor3f (0,0,0);
-          draw_circle (eye_pos, 0.05);
-
-          glColor3f (1,1,1);
-          draw_circle (eye_pos, 0.04);
+          draw_circle (shapes, eye_pos, 0.05, (Color) {0, 0, 0});
+          draw_circle (shapes, eye_pos, 0.04, (Color) {1, 1, 1});
 
           float angle = atan2 (eyes_target.y - eye_pos.y,
                                eyes_target.x - eye_pos.x);
@@ -335,64 +493,52 @@ draw_paddle (Paddle *paddle, V2 eyes_target, EmotionType emotion, double dt)
           pupil.x += cosf (angle) * 0.01;
           pupil.y += sinf (angle) * 0.01;
 
-          glColor3f (0,0,0);
-          draw_circle (pupil, 0.025);
+          draw_circle (shapes, pupil, 0.025, (Color) {0, 0, 0});
 
           eye_pos.x += 0.2;
         }
     }
-  else
-    {
-      paddle->blink_duration -= 5 * dt;
-    }
-}
-
-
-static void
-draw_lives (int lives_count)
-{
-  V2 live_dim = {0.05, 0.03};
-  V2 live_pos;
-  live_pos.x = -1 + live_dim.x * 1.5;
-  live_pos.y = -0.95;
-
-  glColor3f (0.8, 0.6, 1.0);
-
-  for (int live_index = 0;
-       live_index < lives_count;
-       ++live_index)
-    {
-      draw_rect (live_pos, live_dim);
-      live_pos.x += live_dim.x * 2;;
-    }
 }
 
 
+// What the active powerup adds to the paddle.
 static void
-draw_score (int score)
+draw_paddle_powerup (ShapeBatch *shapes, Paddle *paddle, PowerupType powerup)
 {
-  V2 score_dim = {0.05, 0.03};
-  V2 score_pos;
-  score_pos.x = 1 - score_dim.x * 1.5;
-  score_pos.y = -0.95;
-
-  glColor3f (1.0, 0.8, 0.8);
-
-  for (int score_index = 0;
-       score_index < score;
-       ++score_index)
+  switch (powerup)
     {
-      draw_rect (score_pos, score_dim);
-      score_pos.y += score_dim.y * 2;;
+    case POWERUP_GLUE:
+      {
+        V2 pos = paddle->pos;
+        pos.y += paddle->dim.y / 2;
+        V2 dim = paddle->dim;
+        dim.y /= 3;
+        draw_rect (shapes, pos, dim, (Color) {0.6, 1.0, 0.6});
+      } break;
+    case POWERUP_SHOOTER:
+      {
+        V2 dim;
+        dim.x = 0.03;
+        dim.y = 0.12;
+        V2 pos = paddle->pos;
+        pos.x -= paddle->dim.x / 2 ;
+        pos.y += 0.03;
+
+        for (int i = 0; i < 2; ++i)
+          {
+            draw_rect (shapes, pos, dim, (Color) {0.3, 0.3, 0.6});
+            pos.x += paddle->dim.x;
+          }
+      } break;
+    case POWERUP_SPLIT:
+    case POWERUP_ENUM_LENGTH: {}
     }
 }
 
 
 static void
-draw_powerup (Powerup *powerup, Image *powerups_image, double dt)
+draw_powerup (SpriteBatch *sprites, Powerup *powerup)
 {
-  powerup->animation_time += dt * 100;
-
   int animation_frame = ((int) powerup->animation_time / 16) * 16;
   int animation_type = powerup->type;
 
@@ -400,12 +546,14 @@ draw_powerup (Powerup *powerup, Image *powerups_image, double dt)
   image_offset.x = animation_frame;
   image_offset.y = animation_type * 16;
 
-  glColor3f (1, 1, 1);
-  draw_image (powerups_image, powerup->pos, powerup->dim,
-              image_offset, (V2) {16, 16});
+  draw_sprite (sprites, SPRITE_SHEET_POWERUPS, powerup->pos, powerup->dim,
+              image_offset, (V2) {16, 16}, (Color) {1, 1, 1});
 }
 
 
+#include "hud.cpp"
+
+
 static int
 is_rect_in_rect (V2 pos0, V2 dim0, V2 pos1, V2 dim1)
 {
@@ -465,41 +613,6 @@ get_intersection (V2 p0, V2 p1, V2 l0, V2 l1)
 }
 
 
-static Image
-load_image (const char* filepath, int width, int height)
-{
-  Image image = {};
-  image.dim.x = width;
-  image.dim.y = height;
-
-  size_t image_size = width * height * 4;
-
-  ifstream file (filepath, ifstream::binary);
-  file.seekg (0, file.end);
-  streampos file_size = file.tellg ();
-  assert (file_size > 0);
-  assert ((size_t) file_size == image_size);
-  file.seekg (0, file.beg);
-
-  char *data = new char[image_size];
-  file.read (data, image_size);
-  file.close ();
-
-  glGenTextures (1, &image.id);
-  glBindTexture (GL_TEXTURE_2D, image.id);
-  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA8,
-                width, height,
-                0,
-                GL_RGBA, GL_UNSIGNED_BYTE, data);
-
-  delete[] data;
-
-  return image;
-}
-
-
 static SoundsArray
 load_sounds (const char *filepath_pattern)
 {
@@ -556,135 +669,228 @@ free_sounds (SoundsArray *sounds_array)
 }
 
 
+// Plays nothing if sounds_array is null.
 static void
 play_random_sound (SoundsArray *sounds_array)
 {
+  if (!sounds_array || !sounds_array->count)
+    {
+      return;
+    }
+
   int sound_index = sounds_array->count * rand32 ();
   Mix_PlayChannel (-1, sounds_array->items[sound_index], 0);
 }
 
 
-static void
-load_config (const char *filepath, GameState *game_state)
+// Reads the whole file into text. Returns 0 if it can't be opened.
+static int
+read_file (const char *filepath, string *text)
 {
-  ifstream config_file(filepath);
+  ifstream file (filepath, ifstream::binary);
 
-  if (!config_file)
+  if (!file)
     {
-      cerr << "Error: Can't open config file \"" << filepath << "\": ";
-      perror (0);
-      exit (1);
+      return 0;
     }
 
-  string config_option;
-  while (config_file >> config_option)
+  ostringstream contents;
+  contents << file.rdbuf ();
+  *text = contents.str ();
+
+  return 1;
+}
+
+
+// Starts from the embedded copy of the stock config.txt, so a config
+// file on disk only needs the options it changes, and none at all.
+static void
+load_config (const char *filepath, Config *config)
+{
+  *config = embedded_config;
+
+  string config_text;
+  if (read_file (filepath, &config_text))
     {
-      if (config_option == "split_time")
-        {
-          config_file >> game_state->split_time_init;
-        }
-      else if (config_option == "glue_time")
-        {
-          config_file >> game_state->glue_time_init;
-        }
-      else if (config_option == "shooter_time")
-        {
-          config_file >> game_state->shooter_time_init;
-        }
-      else if (config_option == "split_chance")
-        {
-          config_file >> game_state->powerup_chances[POWERUP_SPLIT];
-        }
-      else if (config_option == "glue_chance")
-        {
-          config_file >> game_state->powerup_chances[POWERUP_GLUE];
-        }
-      else if (config_option == "shooter_chance")
-        {
-          config_file >> game_state->powerup_chances[POWERUP_SHOOTER];
-        }
-      else if (config_option == "lives_count")
-        {
-          config_file >> game_state->lives_count_init;
-        }
-      // else if (config_option == "music_volume") /// FINISH THIS
-      //   {
-      //     config_file >> game_state->lives_count_init;
-      //   }
-      else
+      int error_begin = 0;
+      int error_end = 0;
+
+      if (!parse_config (config_text.data (), config_text.size (), config,
+                         &error_begin, &error_end))
         {
-          cerr << "Error: Invalid config option \"" << config_option << "\"."<< endl;
+          cerr << "Error: Invalid config option \""
+               << config_text.substr (error_begin, error_end - error_begin)
+               << "\"." << endl;
           exit (1);
         }
     }
 
-  cout << "split_time: "     << game_state->split_time_init   << endl;
-  cout << "glue_time: "      << game_state->glue_time_init    << endl;
-  cout << "shooter_time: "   << game_state->shooter_time_init << endl;
-  cout << "split_chance: "   << game_state->powerup_chances[POWERUP_SPLIT]   << endl;
-  cout << "glue_chance: "    << game_state->powerup_chances[POWERUP_GLUE]    << endl;
-  cout << "shooter_chance: " << game_state->powerup_chances[POWERUP_SHOOTER] << endl;
-  cout << "lives_count: "    << game_state->lives_count_init  << endl;
+  cout << "split_time: "     << config->split_time   << endl;
+  cout << "glue_time: "      << config->glue_time    << endl;
+  cout << "shooter_time: "   << config->shooter_time << endl;
+  cout << "brick_regen_time: " << config->brick_regen_time << endl;
+  cout << "split_chance: "   << config->powerup_chances[POWERUP_SPLIT]   << endl;
+  cout << "glue_chance: "    << config->powerup_chances[POWERUP_GLUE]    << endl;
+  cout << "shooter_chance: " << config->powerup_chances[POWERUP_SHOOTER] << endl;
+  cout << "lives_count: "    << config->lives_count  << endl;
+  cout << "vsync: "          << config->vsync        << endl;
+  cout << "max_fps: "        << config->max_fps      << endl;
+  cout << "idle_fps: "       << config->idle_fps     << endl;
+  cout << "sim_fps: "        << config->sim_fps      << endl;
+  cout << "max_queued_frames: " << config->max_queued_frames << endl;
+  cout << "measure_latency: "   << config->measure_latency   << endl;
+  cout << "capture_fps: "       << config->capture_fps       << endl;
+  cout << "render_stats: "      << config->render_stats      << endl;
+  cout << "fullscreen: "        << config->fullscreen        << endl;
+  cout << "render_scale: "      << config->render_scale      << endl;
+  cout << "upscale_filter: "    << config->upscale_filter    << endl;
+  cout << "dynamic_resolution: " << config->dynamic_resolution << endl;
+  cout << "min_render_scale: "  << config->min_render_scale  << endl;
+  cout << "autoplay: "          << config->autoplay          << endl;
 }
 
 
-static BricksArray
-load_map (const char *filepath)
+// The last brick moves into the removed one's place, and takes its
+// timer along.
+static void
+remove_brick (GameState *game_state, int brick_index)
 {
-  ifstream map_file(filepath);
+  BricksArray *bricks_array = &game_state->bricks_array;
+  Brick *brick = bricks_array->items + brick_index;
+  Brick *last = bricks_array->items + bricks_array->count - 1;
+
+  cancel_timer (&game_state->timers, brick->timer);
+  if (last != brick && last->timer)
+    {
+      set_timer_data (&game_state->timers, last->timer, brick_index);
+    }
+
+  remove_level_brick (&game_state->level, brick);
+  remove_brick_from (bricks_array, &game_state->bricks_tree, brick_index);
+}
 
-  BricksArray bricks_array;
-  bricks_array.max = 64;
-  bricks_array.count = 0;
-  bricks_array.items = new Brick[bricks_array.max];
 
-  float brick_spacing = 0.02;
-  float map_begin = -1 + brick_spacing + DEFAULT_BRICK_WIDTH / 2;
-  float map_x = map_begin;
-  float map_y = 1 - brick_spacing - DEFAULT_BRICK_HEIGHT / 2;
+// Fills game_state->bricks_query with the bricks whose fat boxes
+// overlap aabb, highest index first. Removing a brick moves the last
+// one into its slot, so visiting in this order never skips or revisits
+// a brick when hit_brick destroys one mid-loop.
+static void
+query_bricks (GameState *game_state, AABB aabb)
+{
+  IntArray *bricks_query = &game_state->bricks_query;
+  bricks_query->count = 0;
+  aabb_tree_query (&game_state->bricks_tree, aabb, bricks_query);
+  game_state->collisions_tested += bricks_query->count;
 
-  char map_tile;
-  while (map_file.read(&map_tile, 1))
+  int *items = bricks_query->items;
+  for (int i = 1; i < bricks_query->count; ++i)
     {
-      if (map_tile == '\n')
+      int item = items[i];
+      int j = i;
+      for (; j > 0 && items[j - 1] < item; --j)
         {
-          map_x = map_begin;
-          map_y -= DEFAULT_BRICK_HEIGHT + brick_spacing;
+          items[j] = items[j - 1];
         }
-      else if (map_tile >= '1' && map_tile <= '0' + BRICK_MAX_HEALTH)
+      items[j] = item;
+    }
+}
+
+
+// Moves the paddle for the input held since it last moved.
+static void
+move_paddle (GameState *game_state, double time)
+{
+  Paddle *paddle = &game_state->paddle;
+  float dt = max (time - paddle->move_time, 0.0);
+  paddle->move_time = time;
+
+  float distance = 0;
+  if (game_state->input_left)
+    {
+      distance = -paddle->speed * dt;
+    }
+  if (game_state->input_right)
+    {
+      distance = +paddle->speed * dt;
+    }
+
+  paddle->pos.x += distance;
+  paddle->move_distance += distance;
+
+  if (paddle->pos.x - paddle->dim.x / 2 < -1)
+    {
+      paddle->pos.x = -1 + paddle->dim.x / 2;
+    }
+  else if (paddle->pos.x + paddle->dim.x / 2 > 1)
+    {
+      paddle->pos.x = 1 - paddle->dim.x / 2;
+    }
+
+  if (paddle->caught_ball >= 0)
+    {
+      Ball *ball = game_state->balls + paddle->caught_ball;
+      ball->pos.x = paddle->pos.x;
+      ball->pos.y = paddle->pos.y + paddle->dim.y / 2 + ball->size;
+    }
+}
+
+
+static void
+update_bricks (GameState *game_state, float dt)
+{
+  BricksArray *bricks_array = &game_state->bricks_array;
+  Paddle *paddle = &game_state->paddle;
+
+  // Moving bricks bounce off the walls and off a line above the
+  // paddle, so they can never push into it.
+  float bricks_floor = (paddle->pos.y + paddle->dim.y / 2 +
+                        DEFAULT_BALL_SIZE * 4);
+
+  game_state->moving_bricks_count = 0;
+
+  for (int brick_index = 0;
+       brick_index < bricks_array->count;
+       ++brick_index)
+    {
+      Brick *brick = bricks_array->items + brick_index;
+
+      if (brick->vel.x == 0 && brick->vel.y == 0)
         {
-          Brick brick;
-          brick.dim.x = DEFAULT_BRICK_WIDTH;
-          brick.dim.y = DEFAULT_BRICK_HEIGHT;
-          brick.pos.x = map_x;
-          brick.pos.y = map_y;
-          brick.health = (map_tile - '0');
-
-          if (bricks_array.count == bricks_array.max)
-            {
-              bricks_array.max *= 2;
-              Brick *new_bricks = new Brick[bricks_array.max];
-              for (int brick_index = 0;
-                   brick_index < bricks_array.count;
-                   ++brick_index)
-                {
-                  new_bricks[brick_index] = bricks_array.items[brick_index];
-                  delete[] bricks_array.items;
-                }
-            }
+          continue;
+        }
+
+      ++game_state->moving_bricks_count;
 
-          bricks_array.items[bricks_array.count++] = brick;
-          map_x += DEFAULT_BRICK_WIDTH + brick_spacing;
+      V2 displacement = brick->vel * dt;
+      V2 half_dim = brick->dim / 2;
+      brick->pos += displacement;
+
+      if (brick->pos.x - half_dim.x < -1)
+        {
+          brick->pos.x = -1 + half_dim.x;
+          brick->vel.x = -brick->vel.x;
         }
-      else
+      else if (brick->pos.x + half_dim.x > 1)
         {
-          map_x += DEFAULT_BRICK_WIDTH + brick_spacing;
+          brick->pos.x = 1 - half_dim.x;
+          brick->vel.x = -brick->vel.x;
         }
-    }
 
-  map_file.close();
+      if (brick->pos.y + half_dim.y > 1)
+        {
+          brick->pos.y = 1 - half_dim.y;
+          brick->vel.y = -brick->vel.y;
+        }
+      else if (brick->pos.y - half_dim.y < bricks_floor)
+        {
+          brick->pos.y = bricks_floor + half_dim.y;
+          brick->vel.y = -brick->vel.y;
+        }
 
-  return bricks_array;
+      aabb_tree_move (&game_state->bricks_tree, brick->proxy,
+                      aabb_from_rect (brick->pos, brick->dim),
+                      displacement);
+    }
 }
 
 
@@ -700,6 +906,28 @@ new_ball (V2 pos=(V2){0,0}, V2 dir=(V2){0,1})
 }
 
 
+// The colors of what each powerup puts on the paddle, or of the balls
+// for POWERUP_SPLIT.
+static const Color powerup_colors[] = {
+  {0.3, 0.3, 0.6},
+  {0.6, 1.0, 0.6},
+  {0.9, 0.2, 0.5},
+};
+
+
+// Redder the more health it has left, from near white at 1 to deep red
+// at BRICK_TILE_MAX_HEALTH, each health a tile can have a shade of its
+// own. The square root spreads the low healths most maps use further
+// apart.
+static Color
+get_brick_color (Brick *brick)
+{
+  float health = (brick->health - 1) / (BRICK_TILE_MAX_HEALTH - 1);
+  float light = 1 - sqrtf (max (0.0f, min (health, 1.0f)));
+  return (Color) {1, 0.1f + 0.8f * light, 0.2f + 0.8f * light};
+}
+
+
 static Powerup
 new_powerup (PowerupType type, V2 pos)
 {
@@ -714,19 +942,34 @@ new_powerup (PowerupType type, V2 pos)
 }
 
 
+// hit_pos is where the ball or bullet was when it hit.
 static void
-hit_brick (GameState *game_state, int *brick_index, int damage,
+hit_brick (GameState *game_state, int brick_index, int damage, V2 hit_pos,
            SoundsArray *sounds_array)
 {
   play_random_sound (sounds_array);
+  ++game_state->collisions_hit;
 
   BricksArray *bricks_array = &game_state->bricks_array;
-  Brick *brick = bricks_array->items + *brick_index;
+  Brick *brick = bricks_array->items + brick_index;
+  Color color = get_brick_color (brick);
 
   brick->health -= damage;
+  push_brick_hit (&game_state->brick_hits, brick->id, brick->health);
 
-  if (brick->health <= 0)
+  if (brick->health > 0)
     {
+      emit_particles (&game_state->particle_emissions, PARTICLE_SPARKS,
+                      hit_pos, (V2) {0, 0}, (Color) {1, 0.9, 0.6});
+      set_timer (&game_state->timers, &brick->timer,
+                 game_state->config.brick_regen_time, TIMER_BRICK_REGEN,
+                 brick_index);
+    }
+  else
+    {
+      emit_particles (&game_state->particle_emissions, PARTICLE_DEBRIS,
+                      brick->pos, brick->dim, color);
+
       V2 spawn_pos = brick->pos;
       PowerupType types[] = {POWERUP_SPLIT, POWERUP_GLUE, POWERUP_SHOOTER};
 
@@ -736,7 +979,8 @@ hit_brick (GameState *game_state, int *brick_index, int damage,
            ++type_index)
         {
           PowerupType type = types[type_index];
-          if (rand32 () < game_state->powerup_chances[type])
+          if (random_float (&game_state->random) <
+              game_state->config.powerup_chances[type])
             {
               game_state->powerups[game_state->powerups_count++] =
                 new_powerup (type, spawn_pos);
@@ -744,646 +988,1441 @@ hit_brick (GameState *game_state, int *brick_index, int damage,
             }
         }
 
-      bricks_array->items[(*brick_index)--] =
-        bricks_array->items[--bricks_array->count];
+      remove_brick (game_state, brick_index);
     }
 }
 
 
+// Moves the last ball into the removed one's place, keeping the paddle
+// on the ball it holds.
 static void
-new_level (GameState *game_state, const char *map_filepath)
+remove_ball (GameState *game_state, int ball_index)
 {
-  game_state->game_mode = GAME_STARTED;
-
-  game_state->balls_count = 0;
-  game_state->bullets_count = 0;
-  game_state->powerups_count = 0;
-  game_state->powerup_time = 0;
+  Paddle *paddle = &game_state->paddle;
+  int last_index = --game_state->balls_count;
+  game_state->balls[ball_index] = game_state->balls[last_index];
 
-  if (game_state->bricks_array.items)
+  if (paddle->caught_ball == ball_index)
     {
-      delete[] game_state->bricks_array.items;
+      paddle->caught_ball = -1;
+    }
+  else if (paddle->caught_ball == last_index)
+    {
+      paddle->caught_ball = ball_index;
     }
-
-  game_state->bricks_array = load_map (map_filepath);
-  game_state->balls[game_state->balls_count++] = new_ball ();
-
-  game_state->paddle.caught_ball = game_state->balls;
-  game_state->paddle.pos.x = 0;
-  game_state->paddle.pos.y = -0.85;
-  game_state->paddle.dim.x = DEFAULT_PADDLE_WIDTH;
-  game_state->paddle.dim.y = DEFAULT_PADDLE_HEIGHT;
-  game_state->paddle.speed = DEFAULT_PADDLE_SPEED;
 }
 
 
+// Disables POWERUP_SPLIT's effect, leaving only the first ball.
 static void
-new_game (GameState *game_state)
+end_split (GameState *game_state)
 {
-  game_state->balls_speed = BALLS_SPEED_INIT;
-  game_state->lives_count = game_state->lives_count_init;
-  game_state->score = 0;
+  if (game_state->balls_count > 1)
+    {
+      game_state->balls_count = 1;
+    }
+
+  if (game_state->paddle.caught_ball >= game_state->balls_count)
+    {
+      game_state->paddle.caught_ball = -1;
+    }
 }
 
 
-int
-main (int argc, char *argv[])
+static void
+update_balls_collisions (GameState *game_state)
 {
-  srand (time (0));
-  const char *map_filepath = "res/map1.txt";
-
-  if (argc == 2)
+  Ball *balls = game_state->balls;
+  IntArray *balls_pairs = &game_state->balls_pairs;
+
+  sweep_and_prune_update (&game_state->balls_sap, balls,
+                          game_state->balls_count);
+  balls_pairs->count = 0;
+  sweep_and_prune_pairs (&game_state->balls_sap, balls_pairs);
+  game_state->collisions_tested += balls_pairs->count / 2;
+
+  for (int pair_index = 0;
+       pair_index < balls_pairs->count;
+       pair_index += 2)
     {
-      map_filepath = argv[1];
+      int a_index = balls_pairs->items[pair_index];
+      int b_index = balls_pairs->items[pair_index + 1];
+      Ball *a = balls + a_index;
+      Ball *b = balls + b_index;
+
+      // A ball held by the glue stays on the paddle.
+      if (a_index == game_state->paddle.caught_ball ||
+          b_index == game_state->paddle.caught_ball)
+        {
+          continue;
+        }
+
+      if (collide_balls (a, b))
+        {
+          ++game_state->collisions_hit;
+          // Exchanging momentum changes each ball's speed, but the game
+          // keeps all balls at balls_speed.
+          a->dir = normalize (a->dir) * game_state->balls_speed;
+          b->dir = normalize (b->dir) * game_state->balls_speed;
+        }
     }
+}
 
-  GameState game_state = {};
-  game_state.sfx_volume = DEFAULT_SFX_VOLUME;
-  game_state.music_volume = DEFAULT_MUSIC_VOLUME;
 
-  load_config ("config.txt", &game_state);
-  new_game (&game_state);
-  new_level (&game_state, map_filepath);
+// screen_y goes from -1 at the bottom of the view to 1 at the top.
+static float
+get_view_y (Camera *camera, float screen_y)
+{
+  return camera->pos.y + screen_y * camera->dim.y / 2;
+}
 
-  int sdl_init_error = SDL_Init (SDL_INIT_VIDEO | SDL_INIT_AUDIO);
-  assert (!sdl_init_error);
-  SDL_Window *window =
-    SDL_CreateWindow ("Bricks",
-                      SDL_WINDOWPOS_UNDEFINED,
-                      SDL_WINDOWPOS_UNDEFINED,
-                      WINDOW_WIDTH, WINDOW_HEIGHT,
-                      SDL_WINDOW_OPENGL);
-  assert (window);
 
-  SDL_GLContext gl_context = SDL_GL_CreateContext (window);
-  assert (gl_context);
+// The camera keeps the lowest brick left at CAMERA_LOWEST_BRICK_Y on
+// screen or above, rising as the bottom rows are cleared but never
+// above the top of the level, and never going back down. The paddle
+// rides along with it.
+static float
+get_camera_target (GameState *game_state)
+{
+  Camera *camera = &game_state->camera;
+  float lowest_brick = get_lowest_brick (&game_state->level,
+                                         &game_state->bricks_tree);
 
-  int open_audio_error = Mix_OpenAudio (44100, MIX_DEFAULT_FORMAT, 2, 2048);
-  assert (!open_audio_error);
-  Mix_Volume (-1, (int) (MIX_MAX_VOLUME * game_state.sfx_volume));
-  Mix_VolumeMusic ((int) (MIX_MAX_VOLUME * game_state.music_volume));
+  float target = lowest_brick - CAMERA_LOWEST_BRICK_Y * camera->dim.y / 2;
+  return min (target, 1 - camera->dim.y / 2);
+}
+
+
+static void
+update_camera (GameState *game_state, float dt)
+{
+  Camera *camera = &game_state->camera;
+  float target = get_camera_target (game_state);
 
-  SoundsArray ball_hit_sounds  = load_sounds ("res/ball_hit_sounds/ball_hit?.wav");
-  SoundsArray shoot_hit_sounds = load_sounds ("res/shoot_hit_sounds/shoot_hit?.wav");
-  SoundsArray shoot_sounds     = load_sounds ("res/shoot_sounds/shoot?.wav");
+  if (target > camera->pos.y)
+    {
+      camera->pos.y = min (target, camera->pos.y + (float) CAMERA_SPEED * dt);
+    }
 
-  Mix_Music *music = Mix_LoadMUS ("res/happy_adventure.wav");
-  assert (music);
-  // TODO: Music config
-  int play_music_error = Mix_PlayMusic (music, -1);  // -1 == loops forever
-  assert (!play_music_error);
+  game_state->paddle.pos.y = get_view_y (camera, PADDLE_SCREEN_Y);
 
-  glEnable (GL_BLEND);
-  glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-  glClearColor (0.0, 0.1, 0.2, 1.0);
+  stream_level (&game_state->level,
+                get_view_y (camera, -1), get_view_y (camera, 1),
+                &game_state->bricks_array, &game_state->bricks_tree,
+                &game_state->bricks_query);
+}
 
-  Image powerups_image = load_image ("res/powerups.raw", 64, 48);
-  Mix_Chunk *powerup_sound = Mix_LoadWAV ("res/powerup.wav");
-  assert (powerup_sound);
 
-  Paddle *paddle = &game_state.paddle;
-  Ball *balls = game_state.balls;
-  Bullet *bullets = game_state.bullets;
-  Powerup *powerups = game_state.powerups;
-  BricksArray *bricks_array = &game_state.bricks_array;
+// Nothing but the paddle's eyes would change on screen until a key is
+// pressed, so frames can come slower without anyone noticing.
+static int
+is_game_idle (GameState *game_state)
+{
+  return (game_state->balls_count == 1 &&
+          game_state->paddle.caught_ball >= 0 &&
+          !game_state->input_left &&
+          !game_state->input_right &&
+          !game_state->input_shoot &&
+          !game_state->bullets_count &&
+          !game_state->powerups_count &&
+          !game_state->moving_bricks_count &&
+          game_state->camera.pos.y >= get_camera_target (game_state));
+}
 
-  int window_opened = 1;
-  uint last_time = SDL_GetTicks ();
-  int pause = 0;
 
-  while (window_opened)
+static void
+new_level (GameState *game_state, const char *map_filepath)
+{
+  TimerWheel *timers = &game_state->timers;
+  BricksArray *bricks_array = &game_state->bricks_array;
+
+  game_state->game_mode = GAME_STARTED;
+
+  game_state->balls_count = 0;
+  game_state->bullets_count = 0;
+  game_state->powerups_count = 0;
+  for (int type = 0; type < POWERUP_ENUM_LENGTH; ++type)
+    {
+      set_timer (timers, game_state->powerup_timers + type, 0,
+                 TIMER_POWERUP, type);
+    }
+  set_timer (timers, &game_state->shoot_timer, 0, TIMER_SHOOT, 0);
+  for (int brick_index = 0;
+       brick_index < bricks_array->count;
+       ++brick_index)
     {
-      SDL_Event event;
+      cancel_timer (timers, bricks_array->items[brick_index].timer);
+    }
+  ++game_state->levels_count;
+
+  free_level (&game_state->level, &game_state->bricks_array,
+              &game_state->bricks_tree);
+  double load_begin = get_seconds ();
+  load_level (&game_state->level, map_filepath,
+              &game_state->bricks_array, &game_state->bricks_tree);
+  observe_metric (METRICS_LEVEL_LOAD_TIME, get_seconds () - load_begin);
+  game_state->balls[game_state->balls_count++] = new_ball ();
+
+  game_state->paddle.caught_ball = 0;
+  game_state->paddle.pos.x = 0;
+  game_state->paddle.dim.x = DEFAULT_PADDLE_WIDTH;
+  game_state->paddle.dim.y = DEFAULT_PADDLE_HEIGHT;
+  game_state->paddle.speed = DEFAULT_PADDLE_SPEED;
 
-      while (SDL_PollEvent (&event))
+  // Start at the bottom of the map.
+  Camera *camera = &game_state->camera;
+  camera->dim = (V2) {2, 2};
+  camera->pos = (V2) {0, get_camera_target (game_state)};
+  update_camera (game_state, 0);
+}
+
+
+static void
+new_game (GameState *game_state)
+{
+  game_state->balls_speed = BALLS_SPEED_INIT;
+  game_state->lives_count = game_state->config.lives_count;
+  game_state->score = 0;
+}
+
+
+// Does what the timers that came due do. Returns 1 if a won or lost
+// game has waited long enough.
+static int
+run_timers (GameState *game_state)
+{
+  int wait_over = 0;
+  int type;
+  int data;
+
+  while (pop_timer (&game_state->timers, &type, &data))
+    {
+      switch ((TimerType) type)
         {
-          switch (event.type)
-            {
-            case SDL_QUIT:
-              {
-                window_opened = 0;
-              } break;
-            case SDL_KEYUP:
-              {
-                switch (event.key.keysym.sym)
-                  {
-                  case SDLK_ESCAPE: {window_opened = 0;} break;
-                  case SDLK_SPACE:
-                  case SDLK_j: {game_state.input_shoot = 0;} break;
-                  case SDLK_LEFT:
-                  case SDLK_a: {game_state.input_left  = 0;} break;
-                  case SDLK_RIGHT:
-                  case SDLK_d: {game_state.input_right = 0;} break;
-                  case SDLK_m:
-                    {
-                      if (game_state.music_volume > 0)
-                        {
-                          Mix_PauseMusic ();
-                          game_state.music_volume = 0;
-                        }
-                      else if (game_state.sfx_volume > 0)
-                        {
-                          game_state.sfx_volume = 0;
-                          Mix_Volume (-1, 0);
-                        }
-                      else
-                        {
-                          Mix_ResumeMusic ();
-                          game_state.music_volume = DEFAULT_MUSIC_VOLUME;
-                          game_state.sfx_volume = DEFAULT_SFX_VOLUME;
-                          Mix_Volume (-1, (int) (MIX_MAX_VOLUME *
-                                                 game_state.sfx_volume));
-                        }
-                    } break;
-                  }
-              } break;
-            case SDL_KEYDOWN:
+        case TIMER_POWERUP:
+          {
+            game_state->powerup_timers[data] = 0;
+            if (data == POWERUP_SPLIT)
               {
-                switch (event.key.keysym.sym)
-                  {
-                  case SDLK_p: {pause = pause ? 0 : 1;}
-                  case SDLK_SPACE:
-                  case SDLK_j: {game_state.input_shoot = 1;} break;
-                  case SDLK_LEFT:
-                  case SDLK_a: {game_state.input_left  = 1;} break;
-                  case SDLK_RIGHT:
-                  case SDLK_d: {game_state.input_right = 1;} break;
-                  }
-              } break;
-            }
+                end_split (game_state);
+              }
+          } break;
+        case TIMER_SHOOT:
+          {
+            game_state->shoot_timer = 0;
+          } break;
+        case TIMER_GAME_WAIT:
+          {
+            game_state->game_wait_timer = 0;
+            wait_over = 1;
+          } break;
+        case TIMER_BLINK:
+          {
+            game_state->blink_timer = 0;
+            game_state->paddle.blinking = 0;
+          } break;
+        case TIMER_BRICK_REGEN:
+          {
+            Brick *brick = game_state->bricks_array.items + data;
+            brick->timer = 0;
+            brick->health = brick->max_health;
+            push_brick_hit (&game_state->brick_hits, brick->id, brick->health);
+          } break;
         }
+    }
 
-      uint current_time = SDL_GetTicks ();
-      double dt = (current_time - last_time) / 1000.0;
-      last_time = current_time;
+  return wait_over;
+}
 
-      if (pause)
-        {
-          SDL_GL_SwapWindow (window);
-          continue;
-        }
 
-      if (game_state.game_mode != GAME_STARTED)
-        {
-          game_state.game_wait_time -= dt;
+// Advances the game by dt seconds to time, on the clock of get_seconds.
+// Touches nothing but the game state and the mixer, so it can run on a
+// thread of its own. With sounds null it doesn't touch the mixer either,
+// which is how forks step.
+static void
+step_game (GameState *game_state, GameSounds *sounds,
+           const char *map_filepath, double time, double dt)
+{
+  Camera *camera = &game_state->camera;
+  Paddle *paddle = &game_state->paddle;
+  Ball *balls = game_state->balls;
+  Bullet *bullets = game_state->bullets;
+  Powerup *powerups = game_state->powerups;
+  BricksArray *bricks_array = &game_state->bricks_array;
+  IntArray *bricks_query = &game_state->bricks_query;
 
-          switch (game_state.game_mode)
-            {
-            case GAME_WIN:
-              {
-                glClearColor (0.0, 0.3, 0.4, 1.0);
-                glClear (GL_COLOR_BUFFER_BIT);
-                paddle->pos.y += dt * 1.1;
-                draw_paddle (paddle, (V2) {0,1}, EMOTION_HAPPY, dt);
-                draw_lives (game_state.lives_count);
-              } break;
-            case GAME_OVER:
-              {
-                glClearColor (0.0, 0.1, 0.2, 1.0);
-                glClear (GL_COLOR_BUFFER_BIT);
-                draw_paddle (paddle, (V2) {0,1}, EMOTION_SAD, dt);
-              } break;
-            case GAME_STARTING:
-            case GAME_STARTED: {}
-            }
+  game_state->brick_hits.count = 0;
+  game_state->collisions_tested = 0;
+  game_state->collisions_hit = 0;
+  advance_timer_wheel (&game_state->timers, dt);
+  int wait_over = run_timers (game_state);
+  update_paddle_blink (game_state, dt);
 
-          if (game_state.game_wait_time <= 0)
-            {
-              game_state.balls_speed += BALLS_SPEED_INCREASE;
-              new_level (&game_state, map_filepath);
-            }
+  if (game_state->game_mode != GAME_STARTED)
+    {
+      paddle->move_time = time;
 
-          SDL_GL_SwapWindow (window);
-          continue;
+      if (game_state->game_mode == GAME_WIN)
+        {
+          paddle->pos.y += dt * 1.1;
         }
 
-      if (game_state.balls_count == 0)
+      if (wait_over)
         {
-          if (game_state.lives_count > 0)
-            {
-              --game_state.lives_count;
-              balls[game_state.balls_count++] = new_ball();
-              paddle->caught_ball = balls;
-            }
-          else
-            {
-              game_state.game_mode = GAME_OVER;
-              game_state.game_wait_time = DEFAULT_GAME_WAIT_TIME;
-              new_game (&game_state);
-              continue;
-            }
+          game_state->balls_speed += BALLS_SPEED_INCREASE;
+          new_level (game_state, map_filepath);
+          play_music_track (sounds ? sounds->music : 0,
+                            game_state->levels_count - 1);
         }
-      else if (bricks_array->count == 0)
+
+      return;
+    }
+
+  if (game_state->balls_count == 0)
+    {
+      if (game_state->lives_count > 0)
         {
-          game_state.game_mode = GAME_WIN;
-          game_state.game_wait_time = DEFAULT_GAME_WAIT_TIME;
-          ++game_state.score;
-          continue;
+          --game_state->lives_count;
+          paddle->caught_ball = game_state->balls_count;
+          balls[game_state->balls_count++] = new_ball();
+        }
+      else
+        {
+          game_state->game_mode = GAME_OVER;
+          set_timer (&game_state->timers, &game_state->game_wait_timer,
+                     DEFAULT_GAME_WAIT_TIME, TIMER_GAME_WAIT, 0);
+          new_game (game_state);
+          return;
         }
+    }
+  else if (game_state->level.bricks_left == 0)
+    {
+      game_state->game_mode = GAME_WIN;
+      set_timer (&game_state->timers, &game_state->game_wait_timer,
+                 DEFAULT_GAME_WAIT_TIME, TIMER_GAME_WAIT, 0);
+      ++game_state->score;
+      return;
+    }
 
-      glClearColor (0.0, 0.1, 0.2, 1.0);
-      glClear (GL_COLOR_BUFFER_BIT);
+  update_camera (game_state, dt);
+  float view_bottom = get_view_y (camera, -1);
+  float view_top = get_view_y (camera, 1);
 
-      if (game_state.powerup_time > 0)
-        {
-          game_state.powerup_time -= dt;
+  if (game_state->input_shoot)
+    {
 
-          if (game_state.powerup_time <= 0 &&
-              game_state.active_powerup == POWERUP_SPLIT)
-            {
-              // Disable POWERUP_SPLIT's effect.
-              game_state.balls_count = 1;
-            }
+      if (paddle->caught_ball >= 0)
+        {
+          game_state->input_shoot = 0;
+          balls[paddle->caught_ball].dir.x = 0;
+          balls[paddle->caught_ball].dir.y = game_state->balls_speed;
+          paddle->caught_ball = -1;
         }
+      else if (!game_state->shoot_timer &&
+               game_state->powerup_timers[POWERUP_SHOOTER] &&
+               game_state->bullets_count < BULLETS_MAX - 1)
+      {
+        play_random_sound (sounds ? &sounds->shoot : 0);
+        game_state->shoot_timer = schedule_timer (&game_state->timers,
+                                                  SHOOT_RATE, TIMER_SHOOT, 0);
 
-      if (game_state.input_shoot)
-        {
+        Bullet new_bullets[2];
 
-          if (paddle->caught_ball)
-            {
-              game_state.input_shoot = 0;
-              paddle->caught_ball->dir.x = 0;
-              paddle->caught_ball->dir.y = game_state.balls_speed;
-              paddle->caught_ball = 0;
-            }
-          else if (game_state.shoot_timeout <= 0 &&
-                   game_state.powerup_time > 0 &&
-                   game_state.active_powerup == POWERUP_SHOOTER &&
-                   game_state.bullets_count < BULLETS_MAX - 1)
+        for (int new_bullet_index = 0;
+             new_bullet_index < 2;
+             ++new_bullet_index)
           {
-            play_random_sound (&shoot_sounds);
-            game_state.shoot_timeout += SHOOT_RATE;
+            new_bullets[new_bullet_index].pos = paddle->pos;
+            new_bullets[new_bullet_index].size = DEFAULT_BULLET_SIZE;
+            new_bullets[new_bullet_index].speed = DEFAULT_BULLET_SPEED;
+          }
+
+        new_bullets[0].pos.x -= paddle->dim.x / 2;
+        new_bullets[1].pos.x += paddle->dim.x / 2;
+        bullets[game_state->bullets_count++] = new_bullets[0];
+        bullets[game_state->bullets_count++] = new_bullets[1];
+      }
+    }
 
-            Bullet new_bullets[2];
+  move_paddle (game_state, time);
+  float paddle_move_distance = paddle->move_distance;
+  paddle->move_distance = 0;
 
-            for (int new_bullet_index = 0;
-                 new_bullet_index < 2;
-                 ++new_bullet_index)
-              {
-                new_bullets[new_bullet_index].pos = paddle->pos;
-                new_bullets[new_bullet_index].size = DEFAULT_BULLET_SIZE;
-                new_bullets[new_bullet_index].speed = DEFAULT_BULLET_SPEED;
-              }
+  update_bricks (game_state, dt);
+  update_balls_collisions (game_state);
 
-            new_bullets[0].pos.x -= paddle->dim.x / 2;
-            new_bullets[1].pos.x += paddle->dim.x / 2;
-            bullets[game_state.bullets_count++] = new_bullets[0];
-            bullets[game_state.bullets_count++] = new_bullets[1];
-          }
-        }
+  for (int bullet_index = 0;
+       bullet_index < game_state->bullets_count;
+       ++bullet_index)
+    {
+      Bullet *bullet = bullets + bullet_index;
+      bullet->pos.y += bullet->speed * dt;
 
-      float paddle_move_distance = 0;
-      if (game_state.input_left)
+      V2 bullet_dim = {bullet->size, bullet->size};
+
+      if (bullet->pos.y - bullet->size > view_top)
         {
-          paddle_move_distance = -paddle->speed * dt;
+          bullets[bullet_index--] = bullets[--game_state->bullets_count];
         }
-      if (game_state.input_right)
+      else
         {
-          paddle_move_distance = +paddle->speed * dt;
+          query_bricks (game_state,
+                        aabb_from_rect (bullet->pos, bullet_dim));
+
+          for (int query_index = 0;
+               query_index < bricks_query->count;
+               ++query_index)
+            {
+              int brick_index = bricks_query->items[query_index];
+              Brick brick = bricks_array->items[brick_index];
+
+              if (is_rect_in_rect (bullet->pos, bullet_dim,
+                                   brick.pos, brick.dim))
+                {
+                  hit_brick (game_state, brick_index, 1, bullet->pos,
+                             sounds ? &sounds->shoot_hit : 0);
+                  bullets[bullet_index--] =
+                    bullets[--game_state->bullets_count];
+                  break;
+                }
+            }
         }
+    }
 
-      paddle->pos.x += paddle_move_distance;
+  for (int ball_index = 0;
+       ball_index < game_state->balls_count;
+       ++ball_index)
+    {
+      Ball *ball = balls + ball_index;
 
-      if (paddle->pos.x - paddle->dim.x / 2 < -1)
+      if (ball->pos.y + ball->size < view_bottom)
         {
-          paddle->pos.x = -1 + paddle->dim.x / 2;
+          remove_ball (game_state, ball_index--);
+          continue;
         }
-      else if (paddle->pos.x + paddle->dim.x / 2 > 1)
+
+      if (ball_index == paddle->caught_ball)
         {
-          paddle->pos.x = 1 - paddle->dim.x / 2;
+          ball->pos.x = paddle->pos.x;
+          ball->pos.y = paddle->pos.y + paddle->dim.y / 2 + ball->size;
         }
-
-      for (int bullet_index = 0;
-           bullet_index < game_state.bullets_count;
-           ++bullet_index)
+      else
         {
-          Bullet *bullet = bullets + bullet_index;
-          bullet->pos.y += bullet->speed * dt;
-
-          glColor3f (1, 1, 1);
-          V2 bullet_dim = {bullet->size, bullet->size};
-          draw_rect (bullet->pos, bullet_dim);
-
-          if (bullet->pos.y - bullet->size > 1)
+          if (is_circle_in_rect (ball->pos, ball->size,
+                                 paddle->pos, paddle->dim))
             {
-              bullets[bullet_index--] = bullets[--game_state.bullets_count];
+              ball->pos.x += paddle_move_distance;
+              ball->dir.x += paddle_move_distance * PADDLE_PUSH_FORCE;
+              ball->dir = normalize (ball->dir) * game_state->balls_speed;
             }
           else
             {
-              for (int brick_index = 0;
-                   brick_index < bricks_array->count;
-                   ++ brick_index)
-                {
-                  Brick brick = bricks_array->items[brick_index];
-
-                  if (is_rect_in_rect (bullet->pos, bullet_dim,
-                                       brick.pos, brick.dim))
-                    {
-                      hit_brick (&game_state, &brick_index, 1, &shoot_hit_sounds);
-                      bullets[bullet_index--] =
-                        bullets[--game_state.bullets_count];
-                    }
-                }
+              ball->pos += ball->dir * dt;
             }
-        }
-
-      for (int ball_index = 0;
-           ball_index < game_state.balls_count;
-           ++ball_index)
-        {
-          Ball *ball = balls + ball_index;
 
-          if (ball->pos.y + ball->size < -1)
+          if (ball->pos.y + ball->size > view_top)
             {
-              balls[ball_index--] = balls[--game_state.balls_count];
-              continue;
+              ball->pos.y = view_top - ball->size;
+              ball->dir.y = -ball->dir.y;
             }
 
-          if (ball == paddle->caught_ball)
+          if (ball->pos.x + ball->size > 1)
             {
-              ball->pos.x = paddle->pos.x;
-              ball->pos.y = paddle->pos.y + paddle->dim.y / 2 + ball->size;
+              ball->pos.x = 1 - ball->size;
+              ball->dir.x = -ball->dir.x;
             }
-          else
+          else if (ball->pos.x - ball->size < -1)
             {
-              if (is_circle_in_rect (ball->pos, ball->size,
-                                     paddle->pos, paddle->dim))
-                {
-                  ball->pos.x += paddle_move_distance;
-                  ball->dir.x += paddle_move_distance * PADDLE_PUSH_FORCE;
-                  ball->dir = normalize (ball->dir) * game_state.balls_speed;
-                }
-              else
-                {
-                  ball->pos += ball->dir * dt;
-                }
+              ball->pos.x = -1 + ball->size;
+              ball->dir.x = -ball->dir.x;
+            }
 
-              if (ball->pos.y + ball->size > 1)
-                {
-                  ball->pos.y = 1 - ball->size;
-                  ball->dir.y = -ball->dir.y;
-                }
+          float paddle_top   = paddle->pos.y + paddle->dim.y / 2;
+          float paddle_left  = paddle->pos.x - paddle->dim.x / 2;
+          float paddle_right = paddle->pos.x + paddle->dim.x / 2;
 
-              if (ball->pos.x + ball->size > 1)
+          if (ball->pos.y - ball->size < paddle_top &&
+              ball->pos.x + ball->size > paddle_left &&
+              ball->pos.x - ball->size < paddle_right)
+            {
+              if (game_state->powerup_timers[POWERUP_GLUE] &&
+                  paddle->caught_ball < 0)
                 {
-                  ball->pos.x = 1 - ball->size;
-                  ball->dir.x = -ball->dir.x;
+                  ball->dir.x = 0;
+                  ball->dir.y = 0;
+                  paddle->caught_ball = ball_index;
                 }
-              else if (ball->pos.x - ball->size < -1)
+              else if (ball->dir.x == 0)
                 {
-                  ball->pos.x = -1 + ball->size;
-                  ball->dir.x = -ball->dir.x;
+                  ball->dir.x += (ball->pos.x - paddle->pos.x) * PADDLE_CURVE_FACTOR;
+                  ball->dir.y = -ball->dir.y;
+                  ball->dir =
+                    normalize (ball->dir) * game_state->balls_speed;
+                  ball->pos.y = paddle_top + ball->size;
                 }
-
-              float paddle_top   = paddle->pos.y + paddle->dim.y / 2;
-              float paddle_left  = paddle->pos.x - paddle->dim.x / 2;
-              float paddle_right = paddle->pos.x + paddle->dim.x / 2;
-
-              if (ball->pos.y - ball->size < paddle_top &&
-                  ball->pos.x + ball->size > paddle_left &&
-                  ball->pos.x - ball->size < paddle_right)
+              else
                 {
-                  if (game_state.powerup_time > 0 &&
-                      game_state.active_powerup == POWERUP_GLUE &&
-                      !paddle->caught_ball)
+                  V2 top_intersection =
+                    get_intersection (ball->pos,
+                                      ball->pos + ball->dir,
+                                      (V2) {paddle_left,  paddle_top},
+                                      (V2) {paddle_right, paddle_top});
+
+                  if (ball->dir.x > 0 && top_intersection.x < paddle_left)
+                    {
+                      ball->dir.x = -ball->dir.x;
+                      ball->pos.x = paddle_left - ball->size;
+                    }
+                  else if (ball->dir.x < 0 && top_intersection.x > paddle_right)
                     {
-                      ball->dir.x = 0;
-                      ball->dir.y = 0;
-                      paddle->caught_ball = ball;
+                      ball->dir.x = -ball->dir.x;
+                      ball->pos.x = paddle_right + ball->size;
                     }
-                  else if (ball->dir.x == 0)
+                  else
                     {
                       ball->dir.x += (ball->pos.x - paddle->pos.x) * PADDLE_CURVE_FACTOR;
                       ball->dir.y = -ball->dir.y;
                       ball->dir =
-                        normalize (ball->dir) * game_state.balls_speed;
+                        normalize (ball->dir) * game_state->balls_speed;
                       ball->pos.y = paddle_top + ball->size;
                     }
+                }
+
+              ball->pos += ball->dir * dt;
+            }
+
+          // The ball is pushed by dir * dt after every bounce, so
+          // the query covers that step too.
+          V2 ball_dim = {ball->size * 2, ball->size * 2};
+          V2 ball_step = ball->dir * dt;
+          query_bricks (game_state,
+                        aabb_union (aabb_from_rect (ball->pos, ball_dim),
+                                    aabb_from_rect (ball->pos + ball_step,
+                                                    ball_dim)));
+
+          for (int query_index = 0;
+               query_index < bricks_query->count;
+               ++query_index)
+            {
+              int brick_index = bricks_query->items[query_index];
+              Brick *brick = bricks_array->items + brick_index;
+
+              if (is_circle_in_rect (ball->pos, ball->size,
+                                     brick->pos, brick->dim))
+                {
+                  if (ball->dir.x == 0)
+                    {
+                      ball->dir.y = -ball->dir.y;
+                    }
+                  else if (ball->dir.y == 0)
+                    {
+                      ball->dir.x = -ball->dir.x;
+                    }
                   else
                     {
-                      V2 top_intersection =
-                        get_intersection (ball->pos,
-                                          ball->pos + ball->dir,
-                                          (V2) {paddle_left,  paddle_top},
-                                          (V2) {paddle_right, paddle_top});
+                      V2 bot;
+                      bot.y = brick->pos.y - brick->dim.y / 2.0;;
+                      V2 top;
+                      top.y = brick->pos.y + brick->dim.y / 2.0;;
 
-                      if (ball->dir.x > 0 && top_intersection.x < paddle_left)
-                        {
-                          ball->dir.x = -ball->dir.x;
-                          ball->pos.x = paddle_left - ball->size;
-                        }
-                      else if (ball->dir.x < 0 && top_intersection.x > paddle_right)
+                      if (ball->dir.x > 0)
                         {
-                          ball->dir.x = -ball->dir.x;
-                          ball->pos.x = paddle_right + ball->size;
+                          // Check brick's left side
+                          bot.x = brick->pos.x - brick->dim.x / 2.0;
+                          top.x = bot.x;
                         }
                       else
                         {
-                          ball->dir.x += (ball->pos.x - paddle->pos.x) * PADDLE_CURVE_FACTOR;
-                          ball->dir.y = -ball->dir.y;
-                          ball->dir =
-                            normalize (ball->dir) * game_state.balls_speed;
-                          ball->pos.y = paddle_top + ball->size;
+                          // Check brick's right side
+                          bot.x = brick->pos.x + brick->dim.x / 2.0;
+                          top.x = bot.x;
                         }
-                    }
-
-                  ball->pos += ball->dir * dt;
-                }
 
-              for (int brick_index = 0;
-                   brick_index < bricks_array->count;
-                   ++brick_index)
-                {
-                  Brick *brick = bricks_array->items + brick_index;
+                      V2 side_intersection =
+                        get_intersection (ball->pos, ball->pos + ball->dir,
+                                          bot, top);
 
-                  if (is_circle_in_rect (ball->pos, ball->size,
-                                         brick->pos, brick->dim))
-                    {
-                      if (ball->dir.x == 0)
-                        {
-                          ball->dir.y = -ball->dir.y;
-                        }
-                      else if (ball->dir.y == 0)
+                      if ((ball->dir.y > 0 && side_intersection.y > bot.y) ||
+                          (ball->dir.y < 0 && side_intersection.y < top.y))
                         {
                           ball->dir.x = -ball->dir.x;
                         }
                       else
                         {
-                          V2 bot;
-                          bot.y = brick->pos.y - brick->dim.y / 2.0;;
-                          V2 top;
-                          top.y = brick->pos.y + brick->dim.y / 2.0;;
-
-                          if (ball->dir.x > 0)
-                            {
-                              // Check brick's left side
-                              bot.x = brick->pos.x - brick->dim.x / 2.0;
-                              top.x = bot.x;
-                            }
-                          else
-                            {
-                              // Check brick's right side
-                              bot.x = brick->pos.x + brick->dim.x / 2.0;
-                              top.x = bot.x;
-                            }
-
-                          V2 side_intersection =
-                            get_intersection (ball->pos, ball->pos + ball->dir,
-                                              bot, top);
-
-                          if ((ball->dir.y > 0 && side_intersection.y > bot.y) ||
-                              (ball->dir.y < 0 && side_intersection.y < top.y))
-                            {
-                              ball->dir.x = -ball->dir.x;
-                            }
-                          else
-                            {
-                              ball->dir.y = -ball->dir.y;
-                            }
+                          ball->dir.y = -ball->dir.y;
                         }
+                    }
 
-                      ball->pos += ball->dir * dt;
+                  ball->pos += ball->dir * dt;
 
-                      hit_brick (&game_state, &brick_index, 2, &ball_hit_sounds);
-                    }
+                  hit_brick (game_state, brick_index, 2, ball->pos,
+                             sounds ? &sounds->ball_hit : 0);
                 }
             }
-
-          glColor3f (0.9, 0.2, 0.5);
-          draw_circle (ball->pos, ball->size);
         }
+    }
 
-      for (int brick_index = 0;
-           brick_index < bricks_array->count;
-           ++brick_index)
-        {
-          Brick brick = bricks_array->items[brick_index];
-          float brick_color = 1 - brick.health / BRICK_MAX_HEALTH + (1.0 / BRICK_MAX_HEALTH);
+  for (int powerup_index = 0;
+       powerup_index < game_state->powerups_count;
+       ++powerup_index)
+    {
+      Powerup *powerup = powerups + powerup_index;
 
-          glColor3f (1, brick_color + 0.1, brick_color + 0.2);
-          draw_rect (brick.pos, brick.dim);
+      if (powerup->pos.y + powerup->dim.y / 2 < view_bottom)
+        {
+          powerups[powerup_index--] = powerups[--game_state->powerups_count];
+          continue;
         }
 
-      if (game_state.powerup_time > 0)
+      if (is_circle_in_rect (powerup->pos, powerup->dim.x / 2,
+                             paddle->pos, paddle->dim))
         {
-          switch (game_state.active_powerup)
+          if (sounds)
+            {
+              Mix_PlayChannel (-1, sounds->powerup, 0);
+            }
+          emit_particles (&game_state->particle_emissions, PARTICLE_BURST,
+                          powerup->pos, powerup->dim,
+                          powerup_colors[powerup->type]);
+
+          // Powerups of other types keep going alongside, and one of the
+          // same type starts over.
+          TimerWheel *timers = &game_state->timers;
+          int *timer = game_state->powerup_timers + powerup->type;
+
+          switch (powerup->type)
             {
+            case POWERUP_SPLIT:
+              {
+                end_split (game_state);
+                set_timer (timers, timer, game_state->config.split_time,
+                           TIMER_POWERUP, POWERUP_SPLIT);
+                if (game_state->balls_count > 0)
+                  {
+                    while (game_state->balls_count < BALLS_MAX)
+                      {
+                        V2 dir;
+                        dir.x = (random_float (&game_state->random) + 1) / 2;
+                        dir.y = random_float (&game_state->random) + 0.1;
+                        dir = normalize (dir) * game_state->balls_speed;
+                        balls[game_state->balls_count++] =
+                          new_ball (balls[0].pos, dir);
+                      }
+                  }
+              } break;
             case POWERUP_GLUE:
               {
-                V2 pos = paddle->pos;
-                pos.y += paddle->dim.y / 2;
-                V2 dim = paddle->dim;
-                dim.y /= 3;
-                glColor3f (0.6, 1.0, 0.6);
-                draw_rect (pos, dim);
+                set_timer (timers, timer, game_state->config.glue_time,
+                           TIMER_POWERUP, POWERUP_GLUE);
               } break;
             case POWERUP_SHOOTER:
               {
-                if (game_state.shoot_timeout < 0)
-                  {
-                    // Aways check < 0 first, so the line
-                    // game_state.shoot_timeout += SHOOT_RATE;
-                    // calculates the time correctly.
-                    game_state.shoot_timeout = 0;
-                  }
-                else if (game_state.shoot_timeout > 0)
-                  {
-                    game_state.shoot_timeout -= dt;
-                  }
-
-                V2 dim;
-                dim.x = 0.03;
-                dim.y = 0.12;
-                V2 pos = paddle->pos;
-                pos.x -= paddle->dim.x / 2 ;
-                pos.y += 0.03;
-
-                glColor3f (0.3, 0.3, 0.6);
-
-                for (int i = 0; i < 2; ++i)
-                  {
-                    draw_rect (pos, dim);
-                    pos.x += paddle->dim.x;
-                  }
+                set_timer (timers, &game_state->shoot_timer, 0,
+                           TIMER_SHOOT, 0);
+                set_timer (timers, timer, game_state->config.shooter_time,
+                           TIMER_POWERUP, POWERUP_SHOOTER);
               } break;
-            case POWERUP_SPLIT:
             case POWERUP_ENUM_LENGTH: {}
             }
-        }
 
-      for (int powerup_index = 0;
-           powerup_index < game_state.powerups_count;
-           ++powerup_index)
-        {
-          Powerup *powerup = powerups + powerup_index;
+          powerups[powerup_index--] = powerups[--game_state->powerups_count];
+        }
 
-          if (is_circle_in_rect (powerup->pos, powerup->dim.x / 2,
-                                 paddle->pos, paddle->dim))
-            {
-              Mix_PlayChannel (-1, powerup_sound, 0);
-              game_state.active_powerup = powerup->type;
+      powerup->pos += powerup->dir * dt;
+      powerup->animation_time += dt * 100;
+    }
+}
 
-              // Disable POWERUP_SPLIT's effect.
-              if (game_state.balls_count > 1)
-                {
-                  game_state.balls_count = 1;
-                }
 
-              switch (powerup->type)
-                {
-                case POWERUP_SPLIT:
-                  {
-                    game_state.powerup_time = game_state.split_time_init;
-                    if (game_state.balls_count > 0)
-                      {
-                        while (game_state.balls_count < BALLS_MAX)
-                          {
-                            V2 dir;
-                            dir.x = (rand32 () + 1) / 2;
-                            dir.y = rand32 () + 0.1;
-                            dir = normalize (dir) * game_state.balls_speed;
-                            balls[game_state.balls_count++] =
-                              new_ball (balls[0].pos, dir);
-                          }
-                      }
-                  } break;
-                case POWERUP_GLUE:
-                  {
-                    game_state.powerup_time = game_state.glue_time_init;
-                  } break;
-                case POWERUP_SHOOTER:
-                  {
-                    game_state.shoot_timeout = 0;
-                    game_state.powerup_time = game_state.shooter_time_init;
-                  } break;
-                case POWERUP_ENUM_LENGTH: {}
-                }
+// What the keyboard sets, owned by the thread handling events. The
+// simulation only sees the input, through Simulation.input.
+struct Controls {
+  int input_left;
+  int input_right;
+  int input_shoot;
+  int pause;
+  float sfx_volume;
+  float music_volume;
+};
+
+#define INPUT_LEFT 1
+#define INPUT_RIGHT 2
+#define INPUT_SHOOT 4
+
+
+// Between a window and desktop-sized fullscreen.
+static void
+toggle_fullscreen (SDL_Window *window)
+{
+  int fullscreen = SDL_GetWindowFlags (window) & SDL_WINDOW_FULLSCREEN;
+  SDL_SetWindowFullscreen (window,
+                           fullscreen ? 0 : SDL_WINDOW_FULLSCREEN_DESKTOP);
+}
+
+
+// Drains the event queue. Any change to the paddle or shoot input is
+// timed for latency from when its event came.
+static void
+handle_events (SDL_Window *window, Controls *controls, LatencyStats *latency,
+               int *window_opened)
+{
+  SDL_Event event;
+
+  while (SDL_PollEvent (&event))
+    {
+      int input_left = controls->input_left;
+      int input_right = controls->input_right;
+      int input_shoot = controls->input_shoot;
+
+      switch (event.type)
+        {
+        case SDL_QUIT:
+          {
+            *window_opened = 0;
+          } break;
+        case SDL_KEYUP:
+          {
+            switch (event.key.keysym.sym)
+              {
+              case SDLK_ESCAPE: {*window_opened = 0;} break;
+              case SDLK_F11: {toggle_fullscreen (window);} break;
+              case SDLK_RETURN:
+                {
+                  if (event.key.keysym.mod & KMOD_ALT)
+                    {
+                      toggle_fullscreen (window);
+                    }
+                } break;
+              case SDLK_SPACE:
+              case SDLK_j: {controls->input_shoot = 0;} break;
+              case SDLK_LEFT:
+              case SDLK_a: {controls->input_left  = 0;} break;
+              case SDLK_RIGHT:
+              case SDLK_d: {controls->input_right = 0;} break;
+              case SDLK_m:
+                {
+                  if (controls->music_volume > 0)
+                    {
+                      controls->music_volume = 0;
+                    }
+                  else if (controls->sfx_volume > 0)
+                    {
+                      controls->sfx_volume = 0;
+                      Mix_Volume (-1, 0);
+                    }
+                  else
+                    {
+                      controls->music_volume = DEFAULT_MUSIC_VOLUME;
+                      controls->sfx_volume = DEFAULT_SFX_VOLUME;
+                      Mix_Volume (-1, (int) (MIX_MAX_VOLUME *
+                                             controls->sfx_volume));
+                    }
+                } break;
+              }
+          } break;
+        case SDL_KEYDOWN:
+          {
+            switch (event.key.keysym.sym)
+              {
+              case SDLK_p: {controls->pause = controls->pause ? 0 : 1;}
+              case SDLK_SPACE:
+              case SDLK_j: {controls->input_shoot = 1;} break;
+              case SDLK_LEFT:
+              case SDLK_a: {controls->input_left  = 1;} break;
+              case SDLK_RIGHT:
+              case SDLK_d: {controls->input_right = 1;} break;
+              }
+          } break;
+        }
+
+      if (input_left != controls->input_left ||
+          input_right != controls->input_right ||
+          input_shoot != controls->input_shoot)
+        {
+          add_input (latency, get_event_seconds (event.key.timestamp));
+        }
+    }
+}
+
+
+#include "snapshot.cpp"
+#include "autoplay.cpp"
+#include "net_game.cpp"
+
+
+#define SIMULATION_PAUSE_DELAY 20
+
+// Shared by the simulation thread and the one starting it.
+struct Simulation {
+  GameState *game_state;
+  GameSounds *sounds;
+  // Plays instead of the input, if set.
+  Autoplay *autoplay;
+  // If set, the game is a server's, and the mirror puts it into
+  // game_state rather than it being stepped here.
+  NetMirror *mirror;
+  const char *map_filepath;
+  float fps;
+  SnapshotBuffer snapshots;
+  // INPUT_* bits.
+  SDL_atomic_t input;
+  SDL_atomic_t paused;
+  SDL_atomic_t running;
+};
+
+
+static void
+publish_input (Simulation *simulation, Controls *controls)
+{
+  SDL_AtomicSet (&simulation->input,
+                 ((controls->input_left ? INPUT_LEFT : 0) |
+                  (controls->input_right ? INPUT_RIGHT : 0) |
+                  (controls->input_shoot ? INPUT_SHOOT : 0)));
+  SDL_AtomicSet (&simulation->paused, controls->pause);
+}
+
+
+// tick_time is how long the tick took, from waking up to publishing its
+// snapshot. A mirror's game isn't stepped here, so it has no collision
+// tests to count.
+static void
+record_tick_metrics (GameState *game_state, int stepped, double tick_time)
+{
+  observe_metric (METRICS_TICK_TIME, tick_time);
+
+  if (stepped)
+    {
+      observe_metric (METRICS_COLLISIONS_TESTED, game_state->collisions_tested);
+      observe_metric (METRICS_COLLISIONS_HIT, game_state->collisions_hit);
+    }
+
+  set_metric (METRICS_BALLS, game_state->balls_count);
+  set_metric (METRICS_BULLETS, game_state->bullets_count);
+  set_metric (METRICS_POWERUPS, game_state->powerups_count);
+  set_metric (METRICS_BRICKS, game_state->bricks_array.count);
+  set_metric (METRICS_MOVING_BRICKS, game_state->moving_bricks_count);
+  set_metric (METRICS_TIMERS, game_state->timers.live_count);
+}
+
+
+// Steps the game at simulation->fps and publishes a snapshot after each
+// step, until running is cleared. Only input changes reach the game
+// state, so the game can still clear input_shoot itself while the key
+// is held. With the autoplay, the input is left out altogether. With a
+// mirror, the input goes to the server, and pausing is left to it.
+static int
+run_simulation (void *data)
+{
+  Simulation *simulation = (Simulation *) data;
+  GameState *game_state = simulation->game_state;
 
-              powerups[powerup_index--] = powerups[--game_state.powerups_count];
+  FramePacer pacer;
+  init_frame_pacer (&pacer);
+  double last_time = get_seconds ();
+  int last_input = 0;
+
+  while (SDL_AtomicGet (&simulation->running))
+    {
+      wait_next_frame (&pacer, simulation->fps, 0);
+
+      double current_time = get_seconds ();
+      double dt = current_time - last_time;
+      last_time = current_time;
+
+      if (SDL_AtomicGet (&simulation->paused) && !simulation->mirror)
+        {
+          SDL_Delay (SIMULATION_PAUSE_DELAY);
+          last_time = get_seconds ();
+          game_state->paddle.move_time = last_time;
+          reset_frame_pacer (&pacer);
+          continue;
+        }
+
+      int input = SDL_AtomicGet (&simulation->input);
+      int input_changes = input ^ last_input;
+      last_input = input;
+
+      if (simulation->mirror)
+        {
+          update_net_mirror (simulation->mirror, input, current_time);
+        }
+      else
+        {
+          if (simulation->autoplay)
+            {
+              update_autoplay (simulation->autoplay, game_state, current_time,
+                               simulation->fps > 0 ? 1 / simulation->fps : dt);
             }
+          else
+            {
+              if (input_changes & INPUT_LEFT)
+                {
+                  game_state->input_left = (input & INPUT_LEFT) != 0;
+                }
+              if (input_changes & INPUT_RIGHT)
+                {
+                  game_state->input_right = (input & INPUT_RIGHT) != 0;
+                }
+              if (input_changes & INPUT_SHOOT)
+                {
+                  game_state->input_shoot = (input & INPUT_SHOOT) != 0;
+                }
+            }
+
+          step_game (game_state, simulation->sounds,
+                     simulation->map_filepath, current_time, dt);
+        }
+
+      Snapshot *snapshot = get_write_snapshot (&simulation->snapshots);
+      fill_snapshot (snapshot, game_state, current_time);
+      snapshot->remote_input = (simulation->autoplay != 0 ||
+                                simulation->mirror != 0);
+      // A server's game changes without any event here.
+      if (simulation->mirror)
+        {
+          snapshot->idle = 0;
+        }
+      publish_snapshot (&simulation->snapshots);
+
+      record_tick_metrics (game_state, !simulation->mirror,
+                           get_seconds () - current_time);
+    }
+
+  return 0;
+}
+
 
-          powerup->pos += powerup->dir * dt;
+// now is the time on the clock of get_seconds the frame is for. The
+// frame is drawn in the passes of RenderPass, each flushed on its own so
+// stats can time it.
+static void
+draw_snapshot (Snapshot *snapshot, Controls *controls, double now,
+               ShapeBatch *shapes, Particles *particles, Hud *hud,
+               SpriteBatch *sprites,
+               RenderStats *stats)
+{
+  // The same snapshot may be drawn more than once, so it's left alone.
+  Paddle latched_paddle = snapshot->paddle;
+  Paddle *paddle = &latched_paddle;
+
+  switch (snapshot->game_mode)
+    {
+    case GAME_WIN:
+      {
+        begin_render_pass (stats, RENDER_PASS_PADDLE);
+        glClearColor (0.0, 0.3, 0.4, 1.0);
+        glClear (GL_COLOR_BUFFER_BIT);
+        set_camera_transform (&snapshot->camera);
+        draw_paddle (shapes, paddle, snapshot->eyes_target, EMOTION_HAPPY);
+        flush_shapes (shapes);
+        end_render_pass (stats);
+
+        begin_render_pass (stats, RENDER_PASS_HUD);
+        glLoadIdentity ();
+        draw_hud (hud, &snapshot->hud_values, sprites);
+        end_render_pass (stats);
+        return;
+      }
+    case GAME_OVER:
+      {
+        begin_render_pass (stats, RENDER_PASS_PADDLE);
+        glClearColor (0.0, 0.1, 0.2, 1.0);
+        glClear (GL_COLOR_BUFFER_BIT);
+        set_camera_transform (&snapshot->camera);
+        draw_paddle (shapes, paddle, snapshot->eyes_target, EMOTION_SAD);
+        flush_shapes (shapes);
+        end_render_pass (stats);
+        return;
+      }
+    case GAME_STARTING:
+    case GAME_STARTED: {}
+    }
+
+  // Late latching: the paddle, and the ball it holds, go on from where
+  // the snapshot left them with the input as it is now.
+  float latch_dt = min (now - snapshot->time, (double) SNAPSHOT_LATCH_MAX);
+  int input_left = (snapshot->remote_input ?
+                    snapshot->input_left : controls->input_left);
+  int input_right = (snapshot->remote_input ?
+                     snapshot->input_right : controls->input_right);
+  if (input_left)
+    {
+      paddle->pos.x = snapshot->paddle.pos.x - paddle->speed * latch_dt;
+    }
+  if (input_right)
+    {
+      paddle->pos.x = snapshot->paddle.pos.x + paddle->speed * latch_dt;
+    }
+  paddle->pos.x = max (-1 + paddle->dim.x / 2,
+                       min (paddle->pos.x, 1 - paddle->dim.x / 2));
+
+  begin_render_pass (stats, RENDER_PASS_BRICKS);
+  glClearColor (0.0, 0.1, 0.2, 1.0);
+  glClear (GL_COLOR_BUFFER_BIT);
+  set_camera_transform (&snapshot->camera);
+
+  for (int brick_index = 0;
+       brick_index < snapshot->bricks.count;
+       ++brick_index)
+    {
+      Brick *brick = snapshot->bricks.items + brick_index;
+      draw_rect (shapes, brick->pos, brick->dim, get_brick_color (brick));
+    }
+
+  flush_shapes (shapes);
+  end_render_pass (stats);
 
-          draw_powerup (powerup, &powerups_image, dt);
+  begin_render_pass (stats, RENDER_PASS_PARTICLES);
+  spawn_emitted_particles (particles, &snapshot->particle_emissions);
+  update_particles (particles, now);
+  draw_particles (particles);
+  end_render_pass (stats);
+
+  begin_render_pass (stats, RENDER_PASS_ENTITIES);
+
+  for (int bullet_index = 0;
+       bullet_index < snapshot->bullets_count;
+       ++bullet_index)
+    {
+      Bullet *bullet = snapshot->bullets + bullet_index;
+      draw_rect (shapes, bullet->pos, (V2) {bullet->size, bullet->size},
+                 (Color) {1, 1, 1});
+    }
+
+  for (int ball_index = 0;
+       ball_index < snapshot->balls_count;
+       ++ball_index)
+    {
+      Ball *ball = snapshot->balls + ball_index;
+      V2 ball_pos = ball->pos;
+
+      if (ball_index == snapshot->paddle.caught_ball)
+        {
+          ball_pos.x = paddle->pos.x;
+          ball_pos.y = paddle->pos.y + paddle->dim.y / 2 + ball->size;
         }
 
-      draw_paddle (paddle, balls[0].pos, EMOTION_HAPPY, dt);
-      draw_lives (game_state.lives_count);
-      draw_score (game_state.score);
+      draw_circle (shapes, ball_pos, ball->size, (Color) {0.9, 0.2, 0.5});
+    }
+
+  // The powerups are textured, so everything so far goes first.
+  flush_shapes (shapes);
+
+  for (int powerup_index = 0;
+       powerup_index < snapshot->powerups_count;
+       ++powerup_index)
+    {
+      draw_powerup (sprites, snapshot->powerups + powerup_index);
+    }
+
+  flush_sprites (sprites);
+
+  end_render_pass (stats);
+
+  begin_render_pass (stats, RENDER_PASS_PADDLE);
+
+  for (int type = 0; type < POWERUP_ENUM_LENGTH; ++type)
+    {
+      if (snapshot->powerup_times[type] > 0)
+        {
+          draw_paddle_powerup (shapes, paddle, (PowerupType) type);
+        }
+    }
+
+  draw_paddle (shapes, paddle, snapshot->eyes_target, EMOTION_HAPPY);
+  flush_shapes (shapes);
+  end_render_pass (stats);
+
+  begin_render_pass (stats, RENDER_PASS_HUD);
+  glLoadIdentity ();
+  draw_hud (hud, &snapshot->hud_values, sprites);
+  end_render_pass (stats);
+}
+
+
+#include "bench.cpp"
+#include "soak.cpp"
+#include "tiles.cpp"
+#include "render_bench.cpp"
+
+
+int
+main (int argc, char *argv[])
+{
+  srand (time (0));
+  const char *map_filepath = "res/map1.txt";
+  const char *capture_filepath = 0;
+  // With --metrics, a port on 127.0.0.1 or a Unix socket's path.
+  const char *metrics_endpoint = 0;
+  // With --connect or --watch, the game is the server's at this address.
+  const char *server_address = 0;
+  int seat = 0;
+  int spectate = 0;
+
+  // These two go before everything else, in either order.
+  for (;;)
+    {
+      if (argc >= 3 && strcmp (argv[1], "--capture") == 0)
+        {
+          capture_filepath = argv[2];
+        }
+      else if (argc >= 3 && strcmp (argv[1], "--metrics") == 0)
+        {
+          metrics_endpoint = argv[2];
+        }
+      else
+        {
+          break;
+        }
+
+      argc -= 2;
+      argv += 2;
+    }
+
+  if (argc == 2 && strcmp (argv[1], "--bench") == 0)
+    {
+      return run_benchmarks ();
+    }
+  else if (argc >= 2 && strcmp (argv[1], "--headless") == 0)
+    {
+      return run_headless_command (argc - 2, argv + 2);
+    }
+  else if (argc >= 2 && strcmp (argv[1], "--soak") == 0)
+    {
+      return run_soak_command (argc - 2, argv + 2);
+    }
+  else if (argc >= 2 && strcmp (argv[1], "--render-bench") == 0)
+    {
+      return run_render_bench (argc == 3 &&
+                               strcmp (argv[2], "--update-golden") == 0,
+                               capture_filepath);
+    }
+  else if (argc == 2 && strcmp (argv[1], "--build-atlas") == 0)
+    {
+      return build_atlas_command ();
+    }
+  else if (argc >= 2 && strcmp (argv[1], "--generate") == 0)
+    {
+      return generate_map_command (argc - 2, argv + 2);
+    }
+  else if (argc >= 2 && strcmp (argv[1], "--serve") == 0)
+    {
+      return run_net_server_command (argc - 2, argv + 2);
+    }
+  else if (argc >= 2 && strcmp (argv[1], "--tiles") == 0)
+    {
+      return run_tiles_command (argc - 2, argv + 2);
+    }
+  else if ((argc == 3 || argc == 4) &&
+           (strcmp (argv[1], "--connect") == 0 ||
+            strcmp (argv[1], "--watch") == 0))
+    {
+      server_address = argv[2];
+      seat = argc == 4 ? atoi (argv[3]) : 0;
+      spectate = strcmp (argv[1], "--watch") == 0;
+    }
+  else if (argc == 2)
+    {
+      map_filepath = argv[1];
+    }
+
+  GameState game_state;
+  init_game_state (&game_state, time (0));
+
+  Controls controls = {};
+  controls.sfx_volume = DEFAULT_SFX_VOLUME;
+  controls.music_volume = DEFAULT_MUSIC_VOLUME;
+
+  load_config ("config.txt", &game_state.config);
+  new_game (&game_state);
+
+  NetAddress server;
+  if (server_address)
+    {
+      if (!init_net () ||
+          !resolve_net_address (server_address, NET_DEFAULT_PORT, &server))
+        {
+          cerr << "Error: Can't find the server \"" << server_address
+               << "\"." << endl;
+          exit (1);
+        }
+    }
+  else
+    {
+      new_level (&game_state, map_filepath);
+    }
+
+  int sdl_init_error = SDL_Init (SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+  assert (!sdl_init_error);
+  SDL_Window *window =
+    SDL_CreateWindow ("Bricks",
+                      SDL_WINDOWPOS_UNDEFINED,
+                      SDL_WINDOWPOS_UNDEFINED,
+                      WINDOW_WIDTH, WINDOW_HEIGHT,
+                      (SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE |
+                       SDL_WINDOW_ALLOW_HIGHDPI |
+                       (game_state.config.fullscreen ?
+                        SDL_WINDOW_FULLSCREEN_DESKTOP : 0)));
+  assert (window);
+
+  SDL_GLContext gl_context = SDL_GL_CreateContext (window);
+  assert (gl_context);
+
+  if (!load_gl_functions ())
+    {
+      cerr << "Error: OpenGL 2.0 with instanced arrays and framebuffer "
+           << "objects is required." << endl;
+      exit (1);
+    }
+
+  VsyncMode vsync = set_vsync ((VsyncMode) game_state.config.vsync);
+  if (vsync != game_state.config.vsync)
+    {
+      cout << "vsync " << game_state.config.vsync << " isn't supported, "
+           << "using " << vsync << "." << endl;
+    }
+
+  ShapeBatch shapes = {};
+  init_shape_batch (&shapes);
+  Particles particles;
+  init_particles (&particles, time (0));
+  init_particle_drawing (&particles);
+
+  int open_audio_error = Mix_OpenAudio (44100, MIX_DEFAULT_FORMAT, 2, 2048);
+  assert (!open_audio_error);
+  Mix_Volume (-1, (int) (MIX_MAX_VOLUME * controls.sfx_volume));
+
+  double load_begin = get_seconds ();
+  GameSounds sounds;
+  sounds.ball_hit  = load_sounds ("res/ball_hit_sounds/ball_hit?.wav");
+  sounds.shoot_hit = load_sounds ("res/shoot_hit_sounds/shoot_hit?.wav");
+  sounds.shoot     = load_sounds ("res/shoot_sounds/shoot?.wav");
+  sounds.powerup   = Mix_LoadWAV ("res/powerup.wav");
+  assert (sounds.powerup);
+  set_metric (METRICS_SOUNDS_LOAD_TIME, get_seconds () - load_begin);
+
+  load_begin = get_seconds ();
+  Music music;
+  init_music (&music, "res/music/track?.ogg");
+  set_metric (METRICS_MUSIC_LOAD_TIME, get_seconds () - load_begin);
+  set_music_volume (&music, controls.music_volume);
+  play_music_track (&music, game_state.levels_count - 1);
+  sounds.music = &music;
+
+  glEnable (GL_BLEND);
+  glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glClearColor (0.0, 0.1, 0.2, 1.0);
+
+  load_begin = get_seconds ();
+  Atlas atlas;
+  load_atlas (&atlas);
+  set_metric (METRICS_ATLAS_LOAD_TIME, get_seconds () - load_begin);
+  SpriteBatch sprites = {};
+  init_sprite_batch (&sprites, &atlas);
+
+  Hud hud;
+  init_hud (&hud, WINDOW_WIDTH, WINDOW_HEIGHT * HUD_HEIGHT / 2);
+
+  int window_opened = 1;
+
+  FramePacer pacer;
+  init_frame_pacer (&pacer);
+  FrameQueue frame_queue;
+  init_frame_queue (&frame_queue, game_state.config.max_queued_frames);
+  LatencyStats latency = {};
+  // Dynamic resolution goes by the render stats, so it keeps them
+  // whether or not they're printed.
+  RenderStats render_stats;
+  init_render_stats (&render_stats, (game_state.config.render_stats ||
+                                     game_state.config.dynamic_resolution));
+  RenderScaler scaler;
+  init_render_scaler (&scaler, game_state.config.render_scale,
+                      game_state.config.min_render_scale,
+                      (UpscaleFilter) game_state.config.upscale_filter,
+                      game_state.config.dynamic_resolution,
+                      1 / (game_state.config.max_fps > 0 ?
+                           game_state.config.max_fps : 60));
+
+  // Recordings keep the size the game's square has at the start.
+  int drawable_width = 0;
+  int drawable_height = 0;
+  SDL_GL_GetDrawableSize (window, &drawable_width, &drawable_height);
+  int capture_size = min (drawable_width, drawable_height);
+
+  Capture capture = {};
+  if (capture_filepath &&
+      !start_capture (&capture, capture_filepath, capture_size, capture_size,
+                      game_state.config.capture_fps))
+    {
+      cerr << "Error: Can't write " << capture_filepath << endl;
+      exit (1);
+    }
+
+  MetricsServer metrics_server;
+  if (metrics_endpoint &&
+      !start_metrics_server (&metrics_server, metrics_endpoint, &music))
+    {
+      cerr << "Error: Can't serve metrics on " << metrics_endpoint << endl;
+      exit (1);
+    }
+
+  // The game steps on its own thread from here on. The first snapshot
+  // is published before it starts, so there's always one to draw.
+  Simulation simulation = {};
+  simulation.game_state = &game_state;
+  simulation.sounds = &sounds;
+  Autoplay autoplay;
+  NetMirror mirror;
+  if (server_address)
+    {
+      if (!init_net_mirror (&mirror, &game_state, &sounds, &server, seat,
+                            spectate))
+        {
+          cerr << "Error: Can't open a UDP socket." << endl;
+          exit (1);
+        }
+      simulation.mirror = &mirror;
+    }
+  else if (game_state.config.autoplay)
+    {
+      init_autoplay (&autoplay);
+      simulation.autoplay = &autoplay;
+    }
+  simulation.map_filepath = map_filepath;
+  simulation.fps = game_state.config.sim_fps;
+  init_snapshot_buffer (&simulation.snapshots);
+  SDL_AtomicSet (&simulation.running, 1);
+  game_state.paddle.move_time = get_seconds ();
+  fill_snapshot (get_write_snapshot (&simulation.snapshots), &game_state,
+                 game_state.paddle.move_time);
+  publish_snapshot (&simulation.snapshots);
+
+  SDL_Thread *simulation_thread =
+    SDL_CreateThread (run_simulation, "simulation", &simulation);
+  assert (simulation_thread);
+
+  // How the frame that just ended wants the next one paced.
+  float frame_fps = 0;
+  int frame_idle = 0;
+  // Of the last frame, or 0 if there's been a pause since.
+  double present_time = 0;
+
+  while (window_opened)
+    {
+      wait_next_frame (&pacer, frame_fps, frame_idle);
+      frame_fps = game_state.config.max_fps;
+      frame_idle = 0;
+
+      handle_events (window, &controls, &latency, &window_opened);
+      publish_input (&simulation, &controls);
+      set_music_volume (&music, controls.music_volume);
+      SDL_GL_GetDrawableSize (window, &drawable_width, &drawable_height);
+
+      if (controls.pause &&
+          drawable_width == scaler.drawable_width &&
+          drawable_height == scaler.drawable_height)
+        {
+          // The last frame stays on screen, so there's nothing to draw
+          // until an event comes, unless the window changed size.
+          SDL_WaitEventTimeout (0, 1000);
+          latency.pending_input_time = 0;
+          reset_frame_pacer (&pacer);
+          frame_fps = 0;
+          present_time = 0;
+          continue;
+        }
+
+      Snapshot *snapshot = get_latest_snapshot (&simulation.snapshots);
+      begin_render_frame (&render_stats);
+      begin_scaled_frame (&scaler, drawable_width, drawable_height);
+      draw_snapshot (snapshot, &controls, get_seconds (), &shapes,
+                     &particles, &hud, &sprites, &render_stats);
+      end_scaled_frame (&scaler, &render_stats);
+      end_render_frame (&render_stats);
+      update_render_scale (&scaler, get_render_stats (&render_stats));
+
+      // Recordings go at a steady rate, idle or not. The particles are
+      // only on this side, so the snapshot can't count them in.
+      if (capture_filepath)
+        {
+          capture_frame (&capture, scaler.view_x, scaler.view_y);
+          frame_fps = game_state.config.capture_fps;
+        }
+      else if (snapshot->idle && !particles.count)
+        {
+          frame_fps = game_state.config.idle_fps;
+          frame_idle = 1;
+        }
+
+      if (snapshot->game_mode != GAME_STARTED)
+        {
+          latency.pending_input_time = 0;
+        }
 
       SDL_GL_SwapWindow (window);
+      limit_frame_queue (&frame_queue);
+
+      double last_present_time = present_time;
+      present_time = get_seconds ();
+      add_present (&latency, present_time);
+      if (last_present_time)
+        {
+          observe_metric (METRICS_FRAME_TIME, present_time - last_present_time);
+        }
+      set_metric (METRICS_PARTICLES, particles.count);
     }
 
+  SDL_AtomicSet (&simulation.running, 0);
+  SDL_WaitThread (simulation_thread, 0);
+  free_snapshot_buffer (&simulation.snapshots);
+
+  if (metrics_endpoint)
+    {
+      stop_metrics_server (&metrics_server);
+    }
+
+  if (simulation.autoplay)
+    {
+      free_autoplay (&autoplay);
+    }
 
-  if (bricks_array->items)
+  if (simulation.mirror)
     {
-      delete[] bricks_array->items;
+      free_net_mirror (&mirror);
     }
 
-  free_sounds (&ball_hit_sounds);
-  free_sounds (&shoot_hit_sounds);
-  free_sounds (&shoot_sounds);
+  if (capture_filepath)
+    {
+      stop_capture (&capture);
+    }
+
+  if (game_state.config.measure_latency)
+    {
+      print_latency_stats (&latency);
+    }
+
+  if (game_state.config.render_stats)
+    {
+      finish_render_stats (&render_stats);
+      print_render_stats (&render_stats);
+    }
 
+  free_game_state (&game_state);
+
+  free_sounds (&sounds.ball_hit);
+  free_sounds (&sounds.shoot_hit);
+  free_sounds (&sounds.shoot);
+  Mix_FreeChunk (sounds.powerup);
+  free_music (&music);
+
+  free_shape_batch (&shapes);
+  free_sprite_batch (&sprites);
+  free_atlas (&atlas);
+  free_particles (&particles);
+  free_hud (&hud);
+  free_frame_queue (&frame_queue);
+  free_render_stats (&render_stats);
+  free_render_scaler (&scaler);
   SDL_GL_DeleteContext (gl_context);
   SDL_Quit ();
 
@@ -0,0 +1,573 @@
+/* Bricks Game - Frame Capture
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Recording what's drawn, for attract mode clips and bug reports.
+//
+// Reading a frame back right after drawing it would wait for the GPU to
+// finish it. Instead each frame is read into the next of a ring of pixel
+// buffer objects, and only mapped CAPTURE_READ_DELAY frames later, by
+// when the GPU is done with it. The writer thread converts and writes
+// straight from the mapped buffer, and the game unmaps it again once
+// that's done, so all the game pays for is starting the read. When the
+// writer falls behind and the ring fills up, the recording drops frames,
+// never the game.
+//
+// The file name picks the format: name.y4m is a YUV4MPEG2 video, which
+// most video tools read, name.png a sequence of name_00000.png,
+// name_00001.png and so on, and anything else raw RGBA frames one after
+// another, top row first.
+
+#define CAPTURE_FRAMES 8
+#define CAPTURE_READ_DELAY 2
+
+enum CaptureFormat {
+  CAPTURE_Y4M,
+  CAPTURE_PNG,
+  CAPTURE_RAW,
+};
+
+struct Capture {
+  CaptureFormat format;
+  char filepath[256];
+  FILE *file;
+  int width;
+  int height;
+  int fps;
+
+  // The ring of frames, each read by the game, then mapped and handed
+  // to the writer, then written, then unmapped by the game. The counts
+  // only go up, and frame n is in slot n % CAPTURE_FRAMES. The writer
+  // sets written_count, and reads mapped_count and stopping, under the
+  // mutex.
+  GLuint pbos[CAPTURE_FRAMES];
+  // Where the writer finds each mapped frame, bottom row first as GL
+  // reads them, or 0 if it couldn't be mapped. Without pixel buffer
+  // objects these are the frames themselves.
+  unsigned char *pixels[CAPTURE_FRAMES];
+  int read_count;
+  int mapped_count;
+  int written_count;
+  int unmapped_count;
+  int stopping;
+  SDL_mutex *mutex;
+  SDL_cond *cond;
+  SDL_Thread *writer;
+  // The writer's own, for converting a frame.
+  unsigned char *converted;
+  int write_error;
+
+  int frames_count;
+  int dropped_count;
+  double begin_time;
+  // Spent in capture_frame on the game's thread.
+  double capture_time;
+};
+
+
+static uint32_t png_crc_table[256];
+
+
+static void
+init_png_crc_table (void)
+{
+  for (uint32_t n = 0; n < 256; ++n)
+    {
+      uint32_t c = n;
+      for (int bit = 0; bit < 8; ++bit)
+        {
+          c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+      png_crc_table[n] = c;
+    }
+}
+
+
+static uint32_t
+update_png_crc (uint32_t crc, unsigned char *bytes, size_t size)
+{
+  for (size_t index = 0; index < size; ++index)
+    {
+      crc = png_crc_table[(crc ^ bytes[index]) & 0xff] ^ (crc >> 8);
+    }
+  return crc;
+}
+
+
+static void
+put_u32_be (unsigned char *bytes, uint32_t value)
+{
+  bytes[0] = value >> 24;
+  bytes[1] = value >> 16;
+  bytes[2] = value >> 8;
+  bytes[3] = value;
+}
+
+
+// data has 8 bytes free before it for the length and type.
+static void
+write_png_chunk (FILE *file, const char *type, unsigned char *data,
+                 uint32_t size)
+{
+  put_u32_be (data - 8, size);
+  memcpy (data - 4, type, 4);
+  unsigned char crc[4];
+  put_u32_be (crc, update_png_crc (0xffffffff, data - 4, size + 4) ^
+              0xffffffff);
+  fwrite (data - 8, 1, size + 8, file);
+  fwrite (crc, 1, 4, file);
+}
+
+
+// The most bytes a PNG of the frame takes, with 8 free in front.
+static size_t
+get_png_size (int width, int height)
+{
+  size_t raw_size = (size_t) height * (1 + width * 3);
+  return 8 + 6 + raw_size + (raw_size / 65535 + 1) * 5 + 4;
+}
+
+
+// Writes the image as RGB, with the deflate stream stored rather than
+// compressed: compressing would take longer than the game has for a
+// frame, and recordings can be compressed afterwards.
+static int
+write_png (const char *filepath, unsigned char *rgba, int width, int height,
+           unsigned char *buffer)
+{
+  FILE *file = fopen (filepath, "wb");
+  if (!file)
+    {
+      return 0;
+    }
+
+  static const unsigned char signature[] = {137, 'P', 'N', 'G',
+                                            '\r', '\n', 26, '\n'};
+  fwrite (signature, 1, sizeof (signature), file);
+
+  unsigned char *header = buffer + 8;
+  put_u32_be (header, width);
+  put_u32_be (header + 4, height);
+  header[8] = 8;   // bit depth
+  header[9] = 2;   // RGB
+  header[10] = 0;  // compression
+  header[11] = 0;  // filter
+  header[12] = 0;  // no interlace
+  write_png_chunk (file, "IHDR", header, 13);
+
+  // Rows of a filter byte and the pixels, top row first, in stored
+  // deflate blocks of at most 65535 bytes.
+  unsigned char *data = buffer + 8;
+  unsigned char *out = data;
+  *out++ = 0x78;
+  *out++ = 0x01;
+
+  size_t raw_size = (size_t) height * (1 + width * 3);
+  size_t block_left = 0;
+  size_t raw_left = raw_size;
+  uint32_t adler_a = 1;
+  uint32_t adler_b = 0;
+
+  for (int y = height - 1; y >= 0; --y)
+    {
+      unsigned char *row = rgba + (size_t) y * width * 4;
+
+      for (int x = -1; x < width * 3; ++x)
+        {
+          if (!block_left)
+            {
+              block_left = min (raw_left, (size_t) 65535);
+              raw_left -= block_left;
+              *out++ = raw_left ? 0 : 1;
+              *out++ = block_left;
+              *out++ = block_left >> 8;
+              *out++ = ~block_left;
+              *out++ = ~block_left >> 8;
+            }
+
+          unsigned char byte = x < 0 ? 0 : row[x / 3 * 4 + x % 3];
+          *out++ = byte;
+          --block_left;
+          adler_a = (adler_a + byte) % 65521;
+          adler_b = (adler_b + adler_a) % 65521;
+        }
+    }
+
+  put_u32_be (out, adler_b << 16 | adler_a);
+  out += 4;
+  write_png_chunk (file, "IDAT", data, out - data);
+  write_png_chunk (file, "IEND", buffer + 8, 0);
+
+  return fclose (file) == 0;
+}
+
+
+// BT.601 studio range, with each chroma sample the mean of a 2 by 2
+// block.
+static void
+write_y4m_frame (FILE *file, unsigned char *rgba, int width, int height,
+                 unsigned char *buffer)
+{
+  unsigned char *luma = buffer;
+  unsigned char *cb = luma + width * height;
+  unsigned char *cr = cb + (width / 2) * (height / 2);
+
+  for (int y = 0; y < height; ++y)
+    {
+      unsigned char *row = rgba + (size_t) (height - 1 - y) * width * 4;
+      for (int x = 0; x < width; ++x)
+        {
+          unsigned char *p = row + x * 4;
+          luma[y * width + x] = (66 * p[0] + 129 * p[1] + 25 * p[2] + 128 +
+                                 (16 << 8)) >> 8;
+        }
+    }
+
+  for (int y = 0; y < height / 2; ++y)
+    {
+      unsigned char *row0 = rgba + (size_t) (height - 1 - y * 2) * width * 4;
+      unsigned char *row1 = row0 - width * 4;
+      for (int x = 0; x < width / 2; ++x)
+        {
+          int r = row0[x * 8] + row0[x * 8 + 4] + row1[x * 8] + row1[x * 8 + 4];
+          int g = (row0[x * 8 + 1] + row0[x * 8 + 5] +
+                   row1[x * 8 + 1] + row1[x * 8 + 5]);
+          int b = (row0[x * 8 + 2] + row0[x * 8 + 6] +
+                   row1[x * 8 + 2] + row1[x * 8 + 6]);
+          int index = y * (width / 2) + x;
+          cb[index] = (-38 * r - 74 * g + 112 * b + 512 + (128 << 10)) >> 10;
+          cr[index] = (112 * r - 94 * g - 18 * b + 512 + (128 << 10)) >> 10;
+        }
+    }
+
+  fputs ("FRAME\n", file);
+  fwrite (buffer, 1, width * height + (width / 2) * (height / 2) * 2, file);
+}
+
+
+static void
+write_capture_frame (Capture *capture, unsigned char *rgba, int index)
+{
+  int width = capture->width;
+  int height = capture->height;
+
+  switch (capture->format)
+    {
+    case CAPTURE_Y4M:
+      {
+        write_y4m_frame (capture->file, rgba, width, height,
+                         capture->converted);
+      } break;
+    case CAPTURE_PNG:
+      {
+        // name.png becomes name_00000.png.
+        char filepath[sizeof (capture->filepath) + 8];
+        int stem_length = strlen (capture->filepath) - 4;
+        snprintf (filepath, sizeof (filepath), "%.*s_%05d.png",
+                  stem_length, capture->filepath, index);
+
+        if (!write_png (filepath, rgba, width, height, capture->converted))
+          {
+            capture->write_error = 1;
+          }
+      } break;
+    case CAPTURE_RAW:
+      {
+        for (int y = height - 1; y >= 0; --y)
+          {
+            fwrite (rgba + (size_t) y * width * 4, 1, width * 4,
+                    capture->file);
+          }
+      } break;
+    }
+
+  if (capture->file && ferror (capture->file))
+    {
+      capture->write_error = 1;
+    }
+}
+
+
+static int
+run_capture_writer (void *data)
+{
+  Capture *capture = (Capture *) data;
+  int written_count = 0;
+
+  SDL_LockMutex (capture->mutex);
+
+  for (;;)
+    {
+      while (written_count == capture->mapped_count && !capture->stopping)
+        {
+          SDL_CondWait (capture->cond, capture->mutex);
+        }
+
+      if (written_count == capture->mapped_count)
+        {
+          break;
+        }
+
+      unsigned char *pixels = capture->pixels[written_count % CAPTURE_FRAMES];
+      SDL_UnlockMutex (capture->mutex);
+
+      if (pixels)
+        {
+          write_capture_frame (capture, pixels, written_count);
+        }
+
+      SDL_LockMutex (capture->mutex);
+      capture->written_count = ++written_count;
+    }
+
+  SDL_UnlockMutex (capture->mutex);
+  return 0;
+}
+
+
+// Records frames of width by height at fps frames per second to
+// filepath. Needs load_gl_functions. Returns 0 if the file can't be
+// written.
+static int
+start_capture (Capture *capture, const char *filepath,
+               int width, int height, int fps)
+{
+  *capture = {};
+  snprintf (capture->filepath, sizeof (capture->filepath), "%s", filepath);
+  capture->width = width;
+  capture->height = height;
+  capture->fps = fps;
+
+  int length = strlen (filepath);
+  size_t converted_size = 0;
+
+  if (length > 4 && strcmp (filepath + length - 4, ".y4m") == 0)
+    {
+      capture->format = CAPTURE_Y4M;
+      // 4:2:0 needs even sizes, so an odd last row or column is left
+      // out.
+      capture->width &= ~1;
+      capture->height &= ~1;
+      converted_size = capture->width * capture->height * 3 / 2;
+    }
+  else if (length > 4 && strcmp (filepath + length - 4, ".png") == 0)
+    {
+      capture->format = CAPTURE_PNG;
+      converted_size = get_png_size (width, height);
+      init_png_crc_table ();
+    }
+  else
+    {
+      capture->format = CAPTURE_RAW;
+    }
+
+  if (capture->format != CAPTURE_PNG)
+    {
+      capture->file = fopen (filepath, "wb");
+      if (!capture->file)
+        {
+          return 0;
+        }
+    }
+
+  if (capture->format == CAPTURE_Y4M)
+    {
+      fprintf (capture->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+               capture->width, capture->height, fps);
+    }
+
+  size_t frame_size = (size_t) capture->width * capture->height * 4;
+
+  if (gl.has_pixel_buffers)
+    {
+      gl.GenBuffers (CAPTURE_FRAMES, capture->pbos);
+      for (int frame = 0; frame < CAPTURE_FRAMES; ++frame)
+        {
+          gl.BindBuffer (GL_PIXEL_PACK_BUFFER, capture->pbos[frame]);
+          gl.BufferData (GL_PIXEL_PACK_BUFFER, frame_size, 0, GL_STREAM_READ);
+        }
+      gl.BindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+    }
+  else
+    {
+      cout << "No pixel buffer objects, capturing stalls every frame."
+           << endl;
+
+      for (int frame = 0; frame < CAPTURE_FRAMES; ++frame)
+        {
+          capture->pixels[frame] = new unsigned char[frame_size];
+        }
+    }
+
+  capture->converted = converted_size ? new unsigned char[converted_size] : 0;
+
+  capture->mutex = SDL_CreateMutex ();
+  capture->cond = SDL_CreateCond ();
+  capture->writer = SDL_CreateThread (run_capture_writer, "capture", capture);
+  assert (capture->mutex && capture->cond && capture->writer);
+
+  capture->begin_time = get_seconds ();
+  return 1;
+}
+
+
+// Unmaps the frames the writer is done with, and hands it those read
+// at least delay frames ago.
+static void
+update_capture_frames (Capture *capture, int delay)
+{
+  SDL_LockMutex (capture->mutex);
+  int written_count = capture->written_count;
+  SDL_UnlockMutex (capture->mutex);
+
+  for (; capture->unmapped_count < written_count; ++capture->unmapped_count)
+    {
+      int slot = capture->unmapped_count % CAPTURE_FRAMES;
+      if (capture->pbos[slot] && capture->pixels[slot])
+        {
+          gl.BindBuffer (GL_PIXEL_PACK_BUFFER, capture->pbos[slot]);
+          gl.UnmapBuffer (GL_PIXEL_PACK_BUFFER);
+          capture->pixels[slot] = 0;
+        }
+    }
+
+  int mapped_count = capture->mapped_count;
+  for (; mapped_count < capture->read_count &&
+         mapped_count <= capture->read_count - delay; ++mapped_count)
+    {
+      int slot = mapped_count % CAPTURE_FRAMES;
+      if (capture->pbos[slot])
+        {
+          gl.BindBuffer (GL_PIXEL_PACK_BUFFER, capture->pbos[slot]);
+          capture->pixels[slot] =
+            (unsigned char *) gl.MapBuffer (GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+          if (!capture->pixels[slot])
+            {
+              ++capture->dropped_count;
+            }
+        }
+    }
+  gl.BindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+
+  if (mapped_count != capture->mapped_count)
+    {
+      SDL_LockMutex (capture->mutex);
+      capture->mapped_count = mapped_count;
+      SDL_CondSignal (capture->cond);
+      SDL_UnlockMutex (capture->mutex);
+    }
+}
+
+
+// Records the frame drawn to the bound framebuffer, from x, y up and to
+// the right. Call before the swap.
+static void
+capture_frame (Capture *capture, int x, int y)
+{
+  double begin = get_seconds ();
+  ++capture->frames_count;
+
+  int delay = capture->pbos[0] ? CAPTURE_READ_DELAY : 0;
+  update_capture_frames (capture, delay);
+
+  if (capture->read_count - capture->unmapped_count == CAPTURE_FRAMES)
+    {
+      ++capture->dropped_count;
+    }
+  else
+    {
+      int slot = capture->read_count % CAPTURE_FRAMES;
+      glPixelStorei (GL_PACK_ALIGNMENT, 4);
+
+      if (capture->pbos[slot])
+        {
+          gl.BindBuffer (GL_PIXEL_PACK_BUFFER, capture->pbos[slot]);
+          glReadPixels (x, y, capture->width, capture->height,
+                        GL_RGBA, GL_UNSIGNED_BYTE, 0);
+          gl.BindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+        }
+      else
+        {
+          glReadPixels (x, y, capture->width, capture->height,
+                        GL_RGBA, GL_UNSIGNED_BYTE, capture->pixels[slot]);
+        }
+
+      ++capture->read_count;
+    }
+
+  if (!delay)
+    {
+      update_capture_frames (capture, 0);
+    }
+
+  capture->capture_time += get_seconds () - begin;
+}
+
+
+// Writes out the frames still in the ring, and reports how the
+// recording went.
+static void
+stop_capture (Capture *capture)
+{
+  double end_time = get_seconds ();
+
+  update_capture_frames (capture, 0);
+
+  SDL_LockMutex (capture->mutex);
+  capture->stopping = 1;
+  SDL_CondSignal (capture->cond);
+  SDL_UnlockMutex (capture->mutex);
+  SDL_WaitThread (capture->writer, 0);
+
+  if (capture->pbos[0])
+    {
+      update_capture_frames (capture, 0);
+      gl.DeleteBuffers (CAPTURE_FRAMES, capture->pbos);
+    }
+  else
+    {
+      for (int frame = 0; frame < CAPTURE_FRAMES; ++frame)
+        {
+          delete[] capture->pixels[frame];
+        }
+    }
+
+  SDL_DestroyCond (capture->cond);
+  SDL_DestroyMutex (capture->mutex);
+
+  if (capture->file && fclose (capture->file) != 0)
+    {
+      capture->write_error = 1;
+    }
+
+  if (capture->write_error)
+    {
+      cerr << "Error: Can't write all of " << capture->filepath << endl;
+    }
+
+  double total_time = end_time - capture->begin_time;
+  printf ("Captured %d frames to %s, %d dropped. Capturing took %.2f%% of "
+          "the frame time, %.3f ms a frame.\n",
+          capture->frames_count - capture->dropped_count, capture->filepath,
+          capture->dropped_count,
+          total_time > 0 ? capture->capture_time / total_time * 100 : 0,
+          capture->frames_count ?
+          capture->capture_time / capture->frames_count * 1e3 : 0);
+
+  delete[] capture->converted;
+  *capture = {};
+}
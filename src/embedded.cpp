@@ -0,0 +1,142 @@
+/* Bricks Game - Embedded Maps and Config
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The stock maps and config.txt are pasted in by the Makefile as raw
+// string literals (src/embedded_maps.inc, src/embedded_config.inc) and
+// parsed here at compile time, so the default game runs without them.
+
+struct EmbeddedMap {
+  const char *path;
+  const char *text;
+};
+
+static constexpr EmbeddedMap embedded_maps[] = {
+#include "embedded_maps.inc"
+};
+
+static constexpr char embedded_config_text[] =
+#include "embedded_config.inc"
+  ;
+
+#define EMBEDDED_MAPS_COUNT ((int) array_len (embedded_maps))
+
+
+constexpr int
+count_embedded_bricks (void)
+{
+  int bricks_count = 0;
+
+  for (int map_index = 0; map_index < EMBEDDED_MAPS_COUNT; ++map_index)
+    {
+      const char *text = embedded_maps[map_index].text;
+      int map_bricks_count = parse_map (text, text_length (text), 0, 0, 0);
+
+      if (map_bricks_count < 0)
+        {
+          return -1;
+        }
+
+      bricks_count += map_bricks_count;
+    }
+
+  return bricks_count;
+}
+
+
+static constexpr int embedded_bricks_count = count_embedded_bricks ();
+static_assert (embedded_bricks_count >= 0, "An embedded map can't be parsed.");
+
+// All embedded maps' bricks in one table, map i owning the bricks from
+// offsets[i] to offsets[i + 1].
+struct EmbeddedBricks {
+  int offsets[EMBEDDED_MAPS_COUNT + 1];
+  Brick items[embedded_bricks_count > 0 ? embedded_bricks_count : 1];
+};
+
+
+constexpr EmbeddedBricks
+parse_embedded_maps (void)
+{
+  EmbeddedBricks embedded_bricks = {};
+
+  for (int map_index = 0; map_index < EMBEDDED_MAPS_COUNT; ++map_index)
+    {
+      const char *text = embedded_maps[map_index].text;
+      int offset = embedded_bricks.offsets[map_index];
+
+      embedded_bricks.offsets[map_index + 1] =
+        offset + parse_map (text, text_length (text),
+                            embedded_bricks.items + offset, 0, 0);
+    }
+
+  return embedded_bricks;
+}
+
+
+// Returns the parsed config and whether it was valid in *valid.
+constexpr Config
+parse_embedded_config (int *valid)
+{
+  Config config = {};
+  int error_begin = 0;
+  int error_end = 0;
+
+  *valid = parse_config (embedded_config_text, text_length (embedded_config_text),
+                         &config, &error_begin, &error_end);
+  return config;
+}
+
+
+constexpr int
+is_embedded_config_valid (void)
+{
+  int valid = 0;
+  parse_embedded_config (&valid);
+  return valid;
+}
+
+
+constexpr Config
+get_embedded_config (void)
+{
+  int valid = 0;
+  return parse_embedded_config (&valid);
+}
+
+
+static_assert (is_embedded_config_valid (),
+               "The embedded config can't be parsed.");
+
+static constexpr EmbeddedBricks embedded_bricks = parse_embedded_maps ();
+static constexpr Config embedded_config = get_embedded_config ();
+
+
+// Returns the map index, or -1 if no map was embedded for filepath.
+static int
+find_embedded_map (const char *filepath)
+{
+  for (int map_index = 0; map_index < EMBEDDED_MAPS_COUNT; ++map_index)
+    {
+      if (strcmp (embedded_maps[map_index].path, filepath) == 0)
+        {
+          return map_index;
+        }
+    }
+
+  return -1;
+}
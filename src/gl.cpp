@@ -0,0 +1,148 @@
+/* Bricks Game - OpenGL Functions
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Everything past OpenGL 1.1 has to be looked up at runtime on some
+// platforms, so it is all called through the gl table, as in
+// gl.CreateShader (GL_VERTEX_SHADER).
+
+#define GL_FUNCTIONS(X)                                                 \
+  X (PFNGLCREATESHADERPROC,             CreateShader)                   \
+  X (PFNGLSHADERSOURCEPROC,             ShaderSource)                   \
+  X (PFNGLCOMPILESHADERPROC,            CompileShader)                  \
+  X (PFNGLGETSHADERIVPROC,              GetShaderiv)                    \
+  X (PFNGLGETSHADERINFOLOGPROC,         GetShaderInfoLog)               \
+  X (PFNGLDELETESHADERPROC,             DeleteShader)                   \
+  X (PFNGLCREATEPROGRAMPROC,            CreateProgram)                  \
+  X (PFNGLATTACHSHADERPROC,             AttachShader)                   \
+  X (PFNGLBINDATTRIBLOCATIONPROC,       BindAttribLocation)             \
+  X (PFNGLLINKPROGRAMPROC,              LinkProgram)                    \
+  X (PFNGLGETPROGRAMIVPROC,             GetProgramiv)                   \
+  X (PFNGLGETPROGRAMINFOLOGPROC,        GetProgramInfoLog)              \
+  X (PFNGLDELETEPROGRAMPROC,            DeleteProgram)                  \
+  X (PFNGLUSEPROGRAMPROC,               UseProgram)                     \
+  X (PFNGLGETUNIFORMLOCATIONPROC,       GetUniformLocation)             \
+  X (PFNGLUNIFORM1FPROC,                Uniform1f)                      \
+  X (PFNGLUNIFORM2FPROC,                Uniform2f)                      \
+  X (PFNGLGENBUFFERSPROC,               GenBuffers)                     \
+  X (PFNGLDELETEBUFFERSPROC,            DeleteBuffers)                  \
+  X (PFNGLBINDBUFFERPROC,               BindBuffer)                     \
+  X (PFNGLBUFFERDATAPROC,               BufferData)                     \
+  X (PFNGLBUFFERSUBDATAPROC,            BufferSubData)                  \
+  X (PFNGLENABLEVERTEXATTRIBARRAYPROC,  EnableVertexAttribArray)        \
+  X (PFNGLDISABLEVERTEXATTRIBARRAYPROC, DisableVertexAttribArray)       \
+  X (PFNGLVERTEXATTRIBPOINTERPROC,      VertexAttribPointer)            \
+  X (PFNGLVERTEXATTRIBDIVISORPROC,      VertexAttribDivisor)            \
+  X (PFNGLDRAWARRAYSINSTANCEDPROC,      DrawArraysInstanced)            \
+  X (PFNGLGENFRAMEBUFFERSPROC,          GenFramebuffers)                \
+  X (PFNGLDELETEFRAMEBUFFERSPROC,       DeleteFramebuffers)             \
+  X (PFNGLBINDFRAMEBUFFERPROC,          BindFramebuffer)                \
+  X (PFNGLFRAMEBUFFERTEXTURE2DPROC,     FramebufferTexture2D)           \
+  X (PFNGLCHECKFRAMEBUFFERSTATUSPROC,   CheckFramebufferStatus)
+
+// Only there with OpenGL 3.2 or ARB_sync, see gl.has_sync.
+#define GL_SYNC_FUNCTIONS(X)                                            \
+  X (PFNGLFENCESYNCPROC,                FenceSync)                      \
+  X (PFNGLCLIENTWAITSYNCPROC,           ClientWaitSync)                 \
+  X (PFNGLDELETESYNCPROC,               DeleteSync)
+
+// Only there with OpenGL 3.3 or ARB_timer_query, see
+// gl.has_timer_query.
+#define GL_TIMER_QUERY_FUNCTIONS(X)                                     \
+  X (PFNGLGENQUERIESPROC,               GenQueries)                     \
+  X (PFNGLDELETEQUERIESPROC,            DeleteQueries)                  \
+  X (PFNGLBEGINQUERYPROC,               BeginQuery)                     \
+  X (PFNGLENDQUERYPROC,                 EndQuery)                       \
+  X (PFNGLGETQUERYOBJECTIVPROC,         GetQueryObjectiv)               \
+  X (PFNGLGETQUERYOBJECTUI64VPROC,      GetQueryObjectui64v)
+
+// Pixel buffer objects also need OpenGL 2.1 or ARB_pixel_buffer_object,
+// see gl.has_pixel_buffers.
+#define GL_PIXEL_BUFFER_FUNCTIONS(X)                                    \
+  X (PFNGLMAPBUFFERPROC,                MapBuffer)                      \
+  X (PFNGLUNMAPBUFFERPROC,              UnmapBuffer)
+
+struct GLFunctions {
+#define X(type, name) type name;
+  GL_FUNCTIONS (X)
+  GL_SYNC_FUNCTIONS (X)
+  GL_TIMER_QUERY_FUNCTIONS (X)
+  GL_PIXEL_BUFFER_FUNCTIONS (X)
+#undef X
+  int has_sync;
+  int has_timer_query;
+  int has_pixel_buffers;
+};
+
+static GLFunctions gl;
+
+
+// Needs a current GL context. Falls back to the ARB and EXT versions of
+// each function. Returns 0 if one is missing, which means no OpenGL
+// 2.0, no instancing or no framebuffer objects. The sync, timer query
+// and pixel buffer functions are optional.
+static int
+load_gl_functions (void)
+{
+  int loaded = 1;
+
+#define LOAD(type, name)                                                \
+  gl.name = (type) SDL_GL_GetProcAddress ("gl" #name);                  \
+  if (!gl.name)                                                         \
+    {                                                                   \
+      gl.name = (type) SDL_GL_GetProcAddress ("gl" #name "ARB");        \
+    }                                                                   \
+  if (!gl.name)                                                         \
+    {                                                                   \
+      gl.name = (type) SDL_GL_GetProcAddress ("gl" #name "EXT");        \
+    }
+#define X(type, name) LOAD (type, name) loaded = loaded && gl.name;
+  GL_FUNCTIONS (X)
+#undef X
+#define X(type, name) LOAD (type, name) gl.has_sync = gl.has_sync && gl.name;
+  // Some platforms hand out addresses for anything, so the version or
+  // extension has to be checked too.
+  int major = 0;
+  int minor = 0;
+  const char *version = (const char *) glGetString (GL_VERSION);
+  const char *extensions = (const char *) glGetString (GL_EXTENSIONS);
+  if (version)
+    {
+      sscanf (version, "%d.%d", &major, &minor);
+    }
+  gl.has_sync = (major > 3 || (major == 3 && minor >= 2) ||
+                 (extensions && strstr (extensions, "GL_ARB_sync")));
+  GL_SYNC_FUNCTIONS (X)
+#undef X
+#define X(type, name)                                                   \
+  LOAD (type, name) gl.has_timer_query = gl.has_timer_query && gl.name;
+  gl.has_timer_query = (major > 3 || (major == 3 && minor >= 3) ||
+                        (extensions &&
+                         strstr (extensions, "GL_ARB_timer_query")));
+  GL_TIMER_QUERY_FUNCTIONS (X)
+#undef X
+#define X(type, name)                                                   \
+  LOAD (type, name) gl.has_pixel_buffers = gl.has_pixel_buffers && gl.name;
+  gl.has_pixel_buffers = (major > 2 || (major == 2 && minor >= 1) ||
+                          (extensions &&
+                           strstr (extensions, "GL_ARB_pixel_buffer_object")));
+  GL_PIXEL_BUFFER_FUNCTIONS (X)
+#undef X
+#undef LOAD
+
+  return loaded;
+}
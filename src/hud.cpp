@@ -0,0 +1,283 @@
+/* Bricks Game - HUD
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The lives, the active powerups' times left and the score are drawn as
+// text along the bottom of the screen with the glyphs of the atlas's
+// digits sheet. The text goes to an offscreen texture that is only
+// redrawn when one of the values changes, so every other frame the HUD
+// is a single textured quad. The texture follows the size the frame is
+// drawn at, so it's never resampled on the way to the screen, and the
+// glyphs grow with it by whole steps, so they stay sharp.
+
+#define HUD_HEIGHT 0.1
+#define HUD_GLYPHS "0123456789.x#"
+#define HUD_GLYPH_SIZE 8
+// At the window's starting width.
+#define HUD_GLYPH_SCALE 2
+
+struct HudValues {
+  int lives_count;
+  int score;
+  // 0 for the powerups not active.
+  int powerup_tenths[POWERUP_ENUM_LENGTH];
+};
+
+struct Hud {
+  GLuint framebuffer;
+  GLuint texture;
+  int width;
+  int height;
+  int valid;
+  HudValues values;
+};
+
+
+static HudValues
+get_hud_values (GameState *game_state)
+{
+  HudValues values = {};
+  values.lives_count = game_state->lives_count;
+  values.score = game_state->score;
+
+  for (int type = 0; type < POWERUP_ENUM_LENGTH; ++type)
+    {
+      values.powerup_tenths[type] =
+        ceilf (get_powerup_time (game_state, (PowerupType) type) * 10);
+    }
+
+  return values;
+}
+
+
+static int
+hud_values_equal (HudValues *a, HudValues *b)
+{
+  return (a->lives_count == b->lives_count &&
+          a->score == b->score &&
+          memcmp (a->powerup_tenths, b->powerup_tenths,
+                  sizeof (a->powerup_tenths)) == 0);
+}
+
+
+// Makes the HUD texture width by height pixels, to be drawn again.
+// The framebuffer keeps it attached.
+static void
+resize_hud (Hud *hud, int width, int height)
+{
+  hud->width = width;
+  hud->height = height;
+  hud->valid = 0;
+
+  glBindTexture (GL_TEXTURE_2D, hud->texture);
+  glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0,
+                GL_RGBA, GL_UNSIGNED_BYTE, 0);
+}
+
+
+// The HUD texture starts out width by height pixels, and takes the size
+// it is drawn at from then on. Needs load_gl_functions.
+static void
+init_hud (Hud *hud, int width, int height)
+{
+  *hud = {};
+
+  glGenTextures (1, &hud->texture);
+  glBindTexture (GL_TEXTURE_2D, hud->texture);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  resize_hud (hud, width, height);
+
+  gl.GenFramebuffers (1, &hud->framebuffer);
+  gl.BindFramebuffer (GL_FRAMEBUFFER, hud->framebuffer);
+  gl.FramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, hud->texture, 0);
+
+  if (gl.CheckFramebufferStatus (GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+      cerr << "Error: Can't render to the HUD texture." << endl;
+      exit (1);
+    }
+
+  gl.BindFramebuffer (GL_FRAMEBUFFER, 0);
+}
+
+
+static void
+free_hud (Hud *hud)
+{
+  gl.DeleteFramebuffers (1, &hud->framebuffer);
+  glDeleteTextures (1, &hud->texture);
+  *hud = {};
+}
+
+
+// Draws text from HUD_GLYPHS with its bottom left corner at pos, in
+// pixels, each glyph glyph_size pixels square. Returns the x past the
+// last glyph.
+static float
+draw_glyphs (SpriteBatch *sprites, const char *text, V2 pos,
+             float glyph_size, Color color)
+{
+  V2 glyph_dim = {glyph_size, glyph_size};
+
+  for (const char *c = text; *c; ++c)
+    {
+      const char *glyph = strchr (HUD_GLYPHS, *c);
+
+      if (glyph)
+        {
+          V2 image_offset = {(float) (glyph - HUD_GLYPHS) * HUD_GLYPH_SIZE, 0};
+          draw_sprite (sprites, SPRITE_SHEET_DIGITS, pos + glyph_dim / 2,
+                       glyph_dim, image_offset,
+                       (V2) {HUD_GLYPH_SIZE, HUD_GLYPH_SIZE}, color);
+        }
+
+      pos.x += glyph_size;
+    }
+
+  return pos.x;
+}
+
+
+static void
+redraw_hud (Hud *hud, HudValues *values, SpriteBatch *sprites)
+{
+  GLint viewport[4];
+  glGetIntegerv (GL_VIEWPORT, viewport);
+  GLint framebuffer = 0;
+  glGetIntegerv (GL_FRAMEBUFFER_BINDING, &framebuffer);
+
+  gl.BindFramebuffer (GL_FRAMEBUFFER, hud->framebuffer);
+  glViewport (0, 0, hud->width, hud->height);
+  count_state_changes (2);
+
+  glMatrixMode (GL_PROJECTION);
+  glPushMatrix ();
+  glLoadIdentity ();
+  glOrtho (0, hud->width, 0, hud->height, -1, 1);
+  glMatrixMode (GL_MODELVIEW);
+  glPushMatrix ();
+  glLoadIdentity ();
+
+  glClearColor (0, 0, 0, 0);
+  glClear (GL_COLOR_BUFFER_BIT);
+
+  // Rounded down, so the glyphs fit in the height at any width.
+  int glyph_scale = max (1, hud->width * HUD_GLYPH_SCALE / WINDOW_WIDTH);
+  float glyph_size = HUD_GLYPH_SIZE * glyph_scale;
+  float margin = (hud->height - glyph_size) / 2;
+  char text[32];
+
+  snprintf (text, sizeof (text), "#x%d", values->lives_count);
+  draw_glyphs (sprites, text, (V2) {margin, margin}, glyph_size,
+               (Color) {0.8, 0.6, 1.0});
+
+  // Each active powerup's icon and time, a glyph apart, centered
+  // together.
+  char powerup_texts[POWERUP_ENUM_LENGTH][16];
+  float powerups_width = -glyph_size;
+
+  for (int type = 0; type < POWERUP_ENUM_LENGTH; ++type)
+    {
+      int tenths = values->powerup_tenths[type];
+      if (tenths > 0)
+        {
+          snprintf (powerup_texts[type], sizeof (powerup_texts[type]),
+                    "%d.%d", tenths / 10, tenths % 10);
+          powerups_width += (strlen (powerup_texts[type]) + 2) * glyph_size;
+        }
+    }
+
+  V2 pos = {(hud->width - powerups_width) / 2, margin};
+
+  for (int type = 0; type < POWERUP_ENUM_LENGTH; ++type)
+    {
+      if (values->powerup_tenths[type] > 0)
+        {
+          draw_sprite (sprites, SPRITE_SHEET_POWERUPS,
+                       pos + (V2) {glyph_size, glyph_size} / 2,
+                       (V2) {glyph_size, glyph_size},
+                       (V2) {0, (float) type * 16}, (V2) {16, 16},
+                       (Color) {1, 1, 1});
+          pos.x += glyph_size;
+          pos.x = draw_glyphs (sprites, powerup_texts[type], pos,
+                               glyph_size, (Color) {1, 1, 1});
+          pos.x += glyph_size;
+        }
+    }
+
+  snprintf (text, sizeof (text), "%d", values->score);
+  float text_width = strlen (text) * glyph_size;
+  draw_glyphs (sprites, text, (V2) {hud->width - margin - text_width, margin},
+               glyph_size, (Color) {1.0, 0.8, 0.8});
+  flush_sprites (sprites);
+
+  glMatrixMode (GL_PROJECTION);
+  glPopMatrix ();
+  glMatrixMode (GL_MODELVIEW);
+  glPopMatrix ();
+
+  gl.BindFramebuffer (GL_FRAMEBUFFER, framebuffer);
+  glViewport (viewport[0], viewport[1], viewport[2], viewport[3]);
+
+  hud->values = *values;
+  hud->valid = 1;
+}
+
+
+// Draws the HUD across the bottom of the viewport, with the identity
+// transform.
+static void
+draw_hud (Hud *hud, HudValues *values, SpriteBatch *sprites)
+{
+  GLint viewport[4];
+  glGetIntegerv (GL_VIEWPORT, viewport);
+  int width = max (viewport[2], 1);
+  int height = max ((int) (viewport[3] * HUD_HEIGHT / 2 + 0.5), 1);
+
+  if (width != hud->width || height != hud->height)
+    {
+      resize_hud (hud, width, height);
+    }
+
+  if (!hud->valid || !hud_values_equal (&hud->values, values))
+    {
+      redraw_hud (hud, values, sprites);
+    }
+
+  float top = -1 + HUD_HEIGHT;
+
+  // Textures rendered to have their first row at the bottom.
+  glBindTexture (GL_TEXTURE_2D, hud->texture);
+  count_texture_bind ();
+  glEnable (GL_TEXTURE_2D);
+  glColor4f (1, 1, 1, 1);
+  glBegin (GL_TRIANGLE_STRIP);
+  glTexCoord2f (0, 0);
+  glVertex2f (-1, -1);
+  glTexCoord2f (0, 1);
+  glVertex2f (-1, top);
+  glTexCoord2f (1, 0);
+  glVertex2f (1, -1);
+  glTexCoord2f (1, 1);
+  glVertex2f (1, top);
+  glEnd ();
+  glDisable (GL_TEXTURE_2D);
+  count_draw_call (4);
+  count_state_changes (2);
+}
@@ -0,0 +1,207 @@
+/* Bricks Game - Input Latency
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measuring how long a key press takes to reach the screen, and keeping
+// the driver from queueing up frames that would make it longer.
+//
+// A sample runs from the oldest input of a frame, by its event
+// timestamp, to the return of that frame's swap. Without a limit on the
+// frame queue the swap returns as soon as the frame is queued, so the
+// samples only show the part of the latency spent in the game.
+
+#define LATENCY_BUCKET_TIME 0.0005
+#define LATENCY_BUCKETS 200
+#define FRAME_QUEUE_MAX 4
+
+struct LatencyStats {
+  // Bucket i counts samples from i to i + 1 bucket times, the last one
+  // everything longer.
+  int counts[LATENCY_BUCKETS];
+  int samples_count;
+  double total;
+  double max;
+  // When the oldest input not yet on screen came, or 0.
+  double pending_input_time;
+};
+
+struct FrameQueue {
+  int max_frames;
+  int next;
+  GLsync fences[FRAME_QUEUE_MAX];
+};
+
+
+static double
+get_seconds (void)
+{
+  return (double) SDL_GetPerformanceCounter () / SDL_GetPerformanceFrequency ();
+}
+
+
+// SDL timestamps events in milliseconds of SDL_GetTicks.
+static double
+get_event_seconds (Uint32 timestamp)
+{
+  Uint32 age = SDL_GetTicks () - timestamp;
+  return get_seconds () - (age < 1000 ? age : 0) / 1000.0;
+}
+
+
+static void
+add_input (LatencyStats *stats, double input_time)
+{
+  if (!stats->pending_input_time || input_time < stats->pending_input_time)
+    {
+      stats->pending_input_time = input_time;
+    }
+}
+
+
+// Call when a frame was presented, with every input so far in it.
+static void
+add_present (LatencyStats *stats, double present_time)
+{
+  if (!stats->pending_input_time)
+    {
+      return;
+    }
+
+  double latency = max (present_time - stats->pending_input_time, 0.0);
+  int bucket = min ((int) (latency / LATENCY_BUCKET_TIME), LATENCY_BUCKETS - 1);
+
+  ++stats->counts[bucket];
+  ++stats->samples_count;
+  stats->total += latency;
+  stats->max = max (stats->max, latency);
+  stats->pending_input_time = 0;
+}
+
+
+// The upper edge of the bucket holding the given fraction of samples.
+static double
+get_latency_percentile (LatencyStats *stats, double fraction)
+{
+  int wanted = ceil (stats->samples_count * fraction);
+  int seen = 0;
+
+  for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+    {
+      seen += stats->counts[bucket];
+      if (seen >= wanted)
+        {
+          return (bucket + 1) * LATENCY_BUCKET_TIME;
+        }
+    }
+
+  return stats->max;
+}
+
+
+static void
+print_latency_stats (LatencyStats *stats)
+{
+  cout << "Input to present latency, " << stats->samples_count
+       << " samples:" << endl;
+
+  if (!stats->samples_count)
+    {
+      return;
+    }
+
+  printf ("  mean %.1f ms  p50 %.1f ms  p90 %.1f ms  p99 %.1f ms  max %.1f ms\n",
+          stats->total / stats->samples_count * 1e3,
+          get_latency_percentile (stats, 0.5) * 1e3,
+          get_latency_percentile (stats, 0.9) * 1e3,
+          get_latency_percentile (stats, 0.99) * 1e3,
+          stats->max * 1e3);
+
+  // Two buckets to a row, leaving out the empty ones.
+  for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket += 2)
+    {
+      int count = stats->counts[bucket];
+      if (bucket + 1 < LATENCY_BUCKETS)
+        {
+          count += stats->counts[bucket + 1];
+        }
+
+      if (count)
+        {
+          int bar = (count * 50 + stats->samples_count - 1) / stats->samples_count;
+          printf ("  %5.1f ms  %6d  %.*s\n", bucket * LATENCY_BUCKET_TIME * 1e3,
+                  count, bar, "##################################################");
+        }
+    }
+}
+
+
+// At most max_frames frames are left queued after a swap, 0 leaving it
+// to the driver. One frame is glFinish, more need sync objects and fall
+// back to glFinish without them. Needs load_gl_functions.
+static void
+init_frame_queue (FrameQueue *queue, int max_frames)
+{
+  *queue = {};
+  queue->max_frames = max (0, min (max_frames, FRAME_QUEUE_MAX));
+
+  if (queue->max_frames > 1 && !gl.has_sync)
+    {
+      cout << "No sync objects, the frame queue is limited with glFinish."
+           << endl;
+      queue->max_frames = 1;
+    }
+}
+
+
+static void
+free_frame_queue (FrameQueue *queue)
+{
+  for (int fence = 0; fence < FRAME_QUEUE_MAX; ++fence)
+    {
+      if (queue->fences[fence])
+        {
+          gl.DeleteSync (queue->fences[fence]);
+        }
+    }
+
+  *queue = {};
+}
+
+
+// Call right after the swap. Fences go around a ring of max_frames, so
+// the one waited on is from max_frames - 1 swaps ago.
+static void
+limit_frame_queue (FrameQueue *queue)
+{
+  if (queue->max_frames == 1)
+    {
+      glFinish ();
+    }
+  else if (queue->max_frames > 1)
+    {
+      queue->fences[queue->next] = gl.FenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      queue->next = (queue->next + 1) % queue->max_frames;
+
+      GLsync oldest = queue->fences[queue->next];
+      if (oldest)
+        {
+          gl.ClientWaitSync (oldest, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+          gl.DeleteSync (oldest);
+          queue->fences[queue->next] = 0;
+        }
+    }
+}
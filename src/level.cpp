@@ -0,0 +1,548 @@
+/* Bricks Game - Level Streaming
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Map files are read in chunks of LEVEL_CHUNK_ROWS grid rows. Loading a
+// level only scans the file once to find where each chunk starts, and
+// chunks are parsed into the bricks array when they come within
+// LEVEL_STREAM_MARGIN of the view and dropped again when they leave it,
+// so only the bricks around the camera are ever in memory.
+//
+// '@' bricks may be anywhere and may move, so they are always loaded.
+// So are the embedded maps, which are small and already parsed.
+
+#define LEVEL_CHUNK_ROWS 16
+#define LEVEL_STREAM_MARGIN 1.0
+
+enum ChunkState {
+  CHUNK_UNLOADED,
+  CHUNK_LOADED,
+  CHUNK_CLEARED,
+};
+
+struct LevelChunk {
+  long offset;
+  int first_row;
+  int rows_count;
+  int bricks_left;
+  // Bottom edge of the chunk's lowest brick.
+  float bottom;
+  // Tiles in its longest row. Without a grid line, rows can run on
+  // past the right edge of the playfield.
+  int columns;
+  ChunkState state;
+  // The id of the first brick in the chunk's lines.
+  int first_brick;
+};
+
+struct Level {
+  FILE *file;
+  MapLayout layout;
+  // All the bricks of the map, which is one more than the highest id.
+  int bricks_count;
+  int bricks_left;
+  int chunks_count;
+  LevelChunk *chunks;
+  // Chunks from loaded_begin up to loaded_end are loaded, and the ones
+  // from lowest_chunk down are all cleared.
+  int loaded_begin;
+  int loaded_end;
+  int lowest_chunk;
+};
+
+
+static void
+reserve_bricks (BricksArray *bricks_array, int count)
+{
+  if (bricks_array->max >= count)
+    {
+      return;
+    }
+
+  int new_max = max (count, bricks_array->max * 2);
+  Brick *new_items = new Brick[new_max];
+  if (bricks_array->count)
+    {
+      memcpy (new_items, bricks_array->items,
+              bricks_array->count * sizeof (Brick));
+    }
+  delete[] bricks_array->items;
+  bricks_array->items = new_items;
+  bricks_array->max = new_max;
+}
+
+
+// Adds the bricks from bricks_array->count up to count to the tree.
+static void
+insert_bricks (BricksArray *bricks_array, AABBTree *bricks_tree, int count)
+{
+  for (int brick_index = bricks_array->count;
+       brick_index < count;
+       ++brick_index)
+    {
+      Brick *brick = bricks_array->items + brick_index;
+      brick->proxy = aabb_tree_insert (bricks_tree,
+                                       aabb_from_rect (brick->pos, brick->dim),
+                                       brick_index);
+    }
+
+  bricks_array->count = count;
+}
+
+
+static void
+remove_brick_from (BricksArray *bricks_array, AABBTree *bricks_tree,
+                   int brick_index)
+{
+  aabb_tree_remove (bricks_tree, bricks_array->items[brick_index].proxy);
+  bricks_array->items[brick_index] =
+    bricks_array->items[--bricks_array->count];
+
+  if (brick_index < bricks_array->count)
+    {
+      aabb_tree_set_item (bricks_tree,
+                          bricks_array->items[brick_index].proxy,
+                          brick_index);
+    }
+}
+
+
+// Returns 0 at the end of the file.
+static int
+read_line (FILE *file, string *line)
+{
+  line->clear ();
+
+  int c = getc (file);
+  if (c == EOF)
+    {
+      return 0;
+    }
+
+  for (; c != EOF && c != '\n'; c = getc (file))
+    {
+      *line += c;
+    }
+
+  return 1;
+}
+
+
+// The grid row at height y, which may be past either end of the grid.
+static int
+get_tile_row (MapLayout *layout, float y)
+{
+  return floorf ((1 - layout->spacing - y) /
+                 (layout->brick_dim.y + layout->spacing));
+}
+
+
+static float
+get_chunk_top (Level *level, LevelChunk *chunk)
+{
+  return (get_tile_pos (&level->layout, 0, chunk->first_row).y +
+          level->layout.brick_dim.y / 2);
+}
+
+
+static float
+get_chunk_bottom (Level *level, LevelChunk *chunk)
+{
+  return (get_tile_pos (&level->layout, 0,
+                        chunk->first_row + chunk->rows_count - 1).y -
+          level->layout.brick_dim.y / 2);
+}
+
+
+// Right edge of the chunk's last column.
+static float
+get_chunk_right (Level *level, LevelChunk *chunk)
+{
+  return (get_tile_pos (&level->layout, max (chunk->columns - 1, 0), 0).x +
+          level->layout.brick_dim.x / 2);
+}
+
+
+static void
+free_level (Level *level, BricksArray *bricks_array, AABBTree *bricks_tree)
+{
+  if (level->file)
+    {
+      fclose (level->file);
+    }
+
+  delete[] level->chunks;
+  delete[] bricks_array->items;
+  *level = {};
+  *bricks_array = {};
+  aabb_tree_clear (bricks_tree);
+}
+
+
+// Copies source into level, bricks and all, leaving out the file: a
+// fork only has the bricks loaded when it was made, and never streams.
+// Reuses level's chunks and bricks storage when they are big enough.
+static void
+fork_level (Level *level, BricksArray *bricks_array,
+            Level *source, BricksArray *source_bricks)
+{
+  LevelChunk *chunks = level->chunks;
+  if (level->chunks_count < source->chunks_count)
+    {
+      delete[] chunks;
+      chunks = new LevelChunk[source->chunks_count];
+    }
+
+  *level = *source;
+  level->file = 0;
+  level->chunks = chunks;
+  if (source->chunks_count)
+    {
+      memcpy (chunks, source->chunks,
+              source->chunks_count * sizeof (LevelChunk));
+    }
+
+  bricks_array->count = 0;
+  reserve_bricks (bricks_array, source_bricks->count);
+  bricks_array->count = source_bricks->count;
+  if (source_bricks->count)
+    {
+      memcpy (bricks_array->items, source_bricks->items,
+              source_bricks->count * sizeof (Brick));
+    }
+}
+
+
+// Indexes the chunks of an open map file and loads its '@' bricks. The
+// level owns the file from then on. Exits on a malformed line.
+static void
+load_level_file (Level *level, FILE *file, const char *filepath,
+                 BricksArray *bricks_array, AABBTree *bricks_tree)
+{
+  level->file = file;
+  level->layout = get_default_map_layout ();
+
+  int chunks_max = 16;
+  level->chunks = new LevelChunk[chunks_max];
+
+  string line;
+  int line_number = 0;
+  int row = 0;
+  long offset = ftell (file);
+
+  while (read_line (file, &line))
+    {
+      ++line_number;
+      int line_valid = 1;
+
+      if (line_number == 1)
+        {
+          int layout_end = 0;
+          line_valid = parse_map_layout (line.data (), line.size (),
+                                         &level->layout, &layout_end);
+          if (line_valid && layout_end)
+            {
+              offset = ftell (file);
+              continue;
+            }
+        }
+
+      if (line_valid && line[0] == '@')
+        {
+          reserve_bricks (bricks_array, bricks_array->count + 1);
+          line_valid = parse_brick_line (line.data (), 0, line.size (),
+                                         bricks_array->items + bricks_array->count);
+          if (line_valid)
+            {
+              bricks_array->items[bricks_array->count].id =
+                level->bricks_count++;
+              insert_bricks (bricks_array, bricks_tree, bricks_array->count + 1);
+              ++level->bricks_left;
+            }
+        }
+      else if (line_valid)
+        {
+          if (row % LEVEL_CHUNK_ROWS == 0)
+            {
+              if (level->chunks_count == chunks_max)
+                {
+                  LevelChunk *new_chunks = new LevelChunk[chunks_max * 2];
+                  memcpy (new_chunks, level->chunks,
+                          chunks_max * sizeof (LevelChunk));
+                  delete[] level->chunks;
+                  level->chunks = new_chunks;
+                  chunks_max *= 2;
+                }
+
+              LevelChunk *chunk = level->chunks + level->chunks_count++;
+              *chunk = {};
+              chunk->offset = offset;
+              chunk->first_row = row;
+              chunk->first_brick = level->bricks_count;
+            }
+
+          LevelChunk *chunk = level->chunks + level->chunks_count - 1;
+          int row_bricks_count = parse_grid_row (line.data (), 0, line.size (),
+                                                 &level->layout, row, 0, 0);
+          line_valid = row_bricks_count >= 0;
+
+          ++chunk->rows_count;
+          chunk->columns = max (chunk->columns, (int) line.size ());
+          if (row_bricks_count > 0)
+            {
+              chunk->bricks_left += row_bricks_count;
+              chunk->bottom = get_chunk_bottom (level, chunk);
+              level->bricks_count += row_bricks_count;
+              level->bricks_left += row_bricks_count;
+            }
+
+          ++row;
+        }
+
+      if (!line_valid)
+        {
+          cerr << "Error: Invalid line " << line_number
+               << " in map \"" << filepath << "\"." << endl;
+          exit (1);
+        }
+
+      offset = ftell (file);
+    }
+
+  for (int chunk_index = 0;
+       chunk_index < level->chunks_count;
+       ++chunk_index)
+    {
+      LevelChunk *chunk = level->chunks + chunk_index;
+      chunk->state = chunk->bricks_left ? CHUNK_UNLOADED : CHUNK_CLEARED;
+    }
+
+  level->lowest_chunk = level->chunks_count - 1;
+}
+
+
+// A map file on disk takes precedence over the embedded map of the
+// same path, so the stock maps can still be edited in place.
+static void
+load_level (Level *level, const char *filepath,
+            BricksArray *bricks_array, AABBTree *bricks_tree)
+{
+  FILE *file = fopen (filepath, "rb");
+
+  if (file)
+    {
+      load_level_file (level, file, filepath, bricks_array, bricks_tree);
+      return;
+    }
+
+  int map_index = find_embedded_map (filepath);
+
+  if (map_index < 0)
+    {
+      cerr << "Error: Can't open map file \"" << filepath << "\": ";
+      perror (0);
+      exit (1);
+    }
+
+  const Brick *bricks = (embedded_bricks.items +
+                         embedded_bricks.offsets[map_index]);
+  int bricks_count = (embedded_bricks.offsets[map_index + 1] -
+                      embedded_bricks.offsets[map_index]);
+
+  reserve_bricks (bricks_array, bricks_count);
+  memcpy (bricks_array->items, bricks, bricks_count * sizeof (Brick));
+  insert_bricks (bricks_array, bricks_tree, bricks_count);
+
+  level->layout = get_default_map_layout ();
+  level->bricks_count = bricks_count;
+  level->bricks_left = bricks_count;
+  level->lowest_chunk = -1;
+}
+
+
+static void
+load_chunk (Level *level, int chunk_index,
+            BricksArray *bricks_array, AABBTree *bricks_tree)
+{
+  LevelChunk *chunk = level->chunks + chunk_index;
+  fseek (level->file, chunk->offset, SEEK_SET);
+
+  string line;
+  int row = chunk->first_row;
+  int first_brick = bricks_array->count;
+  // '@' bricks are numbered in the same run as the grid's.
+  int id = chunk->first_brick;
+
+  while (row < chunk->first_row + chunk->rows_count &&
+         read_line (level->file, &line))
+    {
+      if (line[0] == '@')
+        {
+          ++id;
+          continue;
+        }
+
+      int count = bricks_array->count;
+      int row_bricks_count = parse_grid_row (line.data (), 0, line.size (),
+                                             &level->layout, row, 0, 0);
+      reserve_bricks (bricks_array, count + row_bricks_count);
+      parse_grid_row (line.data (), 0, line.size (), &level->layout, row,
+                      id, bricks_array->items + count);
+      id += row_bricks_count;
+
+      for (int i = 0; i < row_bricks_count; ++i)
+        {
+          bricks_array->items[count + i].chunk = chunk_index;
+        }
+
+      insert_bricks (bricks_array, bricks_tree, count + row_bricks_count);
+      ++row;
+    }
+
+  // Bricks left from a chunk that was unloaded come back whole, see
+  // stream_level.
+  int bricks_count = bricks_array->count - first_brick;
+  level->bricks_left += bricks_count - chunk->bricks_left;
+  chunk->bricks_left = bricks_count;
+  chunk->state = CHUNK_LOADED;
+}
+
+
+static void
+unload_chunk (Level *level, int chunk_index,
+              BricksArray *bricks_array, AABBTree *bricks_tree,
+              IntArray *query)
+{
+  LevelChunk *chunk = level->chunks + chunk_index;
+
+  AABB aabb;
+  aabb.min = (V2) {-1, get_chunk_bottom (level, chunk)};
+  aabb.max = (V2) {max (1.0f, get_chunk_right (level, chunk)),
+                   get_chunk_top (level, chunk)};
+
+  query->count = 0;
+  aabb_tree_query (bricks_tree, aabb, query);
+
+  // Highest index first, as removing moves the last brick down.
+  sort (query->items, query->items + query->count, greater<int> ());
+
+  for (int i = 0; i < query->count; ++i)
+    {
+      int brick_index = query->items[i];
+      if (bricks_array->items[brick_index].chunk == chunk_index)
+        {
+          remove_brick_from (bricks_array, bricks_tree, brick_index);
+        }
+    }
+
+  chunk->state = chunk->bricks_left ? CHUNK_UNLOADED : CHUNK_CLEARED;
+}
+
+
+// Loads the chunks within LEVEL_STREAM_MARGIN of the view between
+// view_bottom and view_top, and unloads the rest. The camera never
+// scrolls down past bricks, so in play a chunk is only unloaded once
+// it is cleared; otherwise it would be reloaded as in the file.
+static void
+stream_level (Level *level, float view_bottom, float view_top,
+              BricksArray *bricks_array, AABBTree *bricks_tree,
+              IntArray *query)
+{
+  if (!level->file)
+    {
+      return;
+    }
+
+  int begin = (get_tile_row (&level->layout, view_top + LEVEL_STREAM_MARGIN) /
+               LEVEL_CHUNK_ROWS);
+  int end = (get_tile_row (&level->layout, view_bottom - LEVEL_STREAM_MARGIN) /
+             LEVEL_CHUNK_ROWS + 1);
+  begin = max (0, min (begin, level->chunks_count));
+  end = max (begin, min (end, level->chunks_count));
+
+  for (int chunk_index = level->loaded_begin;
+       chunk_index < level->loaded_end;
+       ++chunk_index)
+    {
+      if ((chunk_index < begin || chunk_index >= end) &&
+          level->chunks[chunk_index].state == CHUNK_LOADED)
+        {
+          unload_chunk (level, chunk_index, bricks_array, bricks_tree, query);
+        }
+    }
+
+  for (int chunk_index = begin; chunk_index < end; ++chunk_index)
+    {
+      if (level->chunks[chunk_index].state == CHUNK_UNLOADED)
+        {
+          load_chunk (level, chunk_index, bricks_array, bricks_tree);
+        }
+    }
+
+  level->loaded_begin = begin;
+  level->loaded_end = end;
+}
+
+
+// Called when a brick is destroyed.
+static void
+remove_level_brick (Level *level, Brick *brick)
+{
+  --level->bricks_left;
+
+  if (brick->chunk >= 0)
+    {
+      --level->chunks[brick->chunk].bricks_left;
+    }
+}
+
+
+// The bottom edge of the lowest brick left in the level, loaded or not,
+// or 1 (the top of the level) if there are none.
+static float
+get_lowest_brick (Level *level, AABBTree *bricks_tree)
+{
+  float lowest = 1;
+
+  if (bricks_tree->root != AABB_TREE_NULL)
+    {
+      lowest = bricks_tree->nodes[bricks_tree->root].aabb.min.y;
+    }
+
+  while (level->lowest_chunk >= 0 &&
+         level->chunks[level->lowest_chunk].state == CHUNK_CLEARED)
+    {
+      --level->lowest_chunk;
+    }
+
+  // Loaded chunks are in the tree already, so this stops at the first
+  // unloaded chunk with bricks, which is usually just above the view.
+  for (int chunk_index = level->lowest_chunk;
+       chunk_index >= 0;
+       --chunk_index)
+    {
+      LevelChunk *chunk = level->chunks + chunk_index;
+
+      if (chunk->state == CHUNK_UNLOADED)
+        {
+          lowest = min (lowest, chunk->bottom);
+          break;
+        }
+    }
+
+  return lowest;
+}
@@ -0,0 +1,375 @@
+/* Bricks Game - Map Generator
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Seeded level generator, run with
+//
+//   bricks --generate <pattern|noise|maze> <columns> <rows> <seed>
+//          [<brick_width> <brick_height>] > map.txt
+//
+// Maps are written a row at a time and the maze uses Eller's algorithm,
+// so memory only grows with the width and maps of millions of bricks
+// are fine.
+
+enum MapGenKind {
+  MAPGEN_PATTERN,
+  MAPGEN_NOISE,
+  MAPGEN_MAZE,
+  MAPGEN_ENUM_LENGTH,
+};
+
+static const char *mapgen_kind_names[MAPGEN_ENUM_LENGTH] = {
+  "pattern",
+  "noise",
+  "maze",
+};
+
+
+static uint32_t
+hash_cell (int x, int y, uint64_t seed)
+{
+  Random random = {seed ^ ((uint64_t) (uint32_t) x << 32 | (uint32_t) y)};
+  return random_next (&random) >> 32;
+}
+
+
+// Smoothly interpolated random values on an integer lattice, in [0, 1).
+static float
+value_noise (float x, float y, uint64_t seed)
+{
+  int x0 = floorf (x);
+  int y0 = floorf (y);
+  float tx = x - x0;
+  float ty = y - y0;
+  tx = tx * tx * (3 - 2 * tx);
+  ty = ty * ty * (3 - 2 * ty);
+
+  float scale = 1.0f / 4294967296.0f;
+  float v00 = hash_cell (x0,     y0,     seed) * scale;
+  float v10 = hash_cell (x0 + 1, y0,     seed) * scale;
+  float v01 = hash_cell (x0,     y0 + 1, seed) * scale;
+  float v11 = hash_cell (x0 + 1, y0 + 1, seed) * scale;
+
+  float top = v00 + (v10 - v00) * tx;
+  float bottom = v01 + (v11 - v01) * tx;
+  return top + (bottom - top) * ty;
+}
+
+
+static int
+get_pattern_health (int motif, int period, int column, int row,
+                    int columns, int rows)
+{
+  switch (motif)
+    {
+    case 0:
+      {
+        // Horizontal bands getting tougher further down.
+        int band = row / period;
+        return band % 2 == 0 ? 1 + (band / 2) % BRICK_MAX_HEALTH : 0;
+      }
+    case 1:
+      {
+        int cell = column / period + row / period;
+        return cell % 2 == 0 ? 1 + (cell / 2) % BRICK_MAX_HEALTH : 0;
+      }
+    case 2:
+      {
+        int dx = abs (column % (period * 2) - period);
+        int dy = abs (row % (period * 2) - period);
+        int distance = dx + dy;
+        return distance < period ? 1 + distance * BRICK_MAX_HEALTH / period : 0;
+      }
+    default:
+      {
+        float dx = column - columns / 2.0f;
+        float dy = row - rows / 2.0f;
+        int ring = sqrtf (dx * dx + dy * dy) / period;
+        return ring % 2 == 0 ? 1 + (ring / 2) % BRICK_MAX_HEALTH : 0;
+      }
+    }
+}
+
+
+// Writes one line per cell row of a maze of cells_x by cells_y cells
+// whose walls are bricks, using Eller's algorithm: cells of a row are
+// joined into sets, and every set is carried down to the next row
+// through at least one opening, which keeps the maze perfect while only
+// remembering one row.
+static void
+generate_maze (ostream &out, string &line, int columns, int rows,
+               Random *random)
+{
+  int cells_x = (columns - 1) / 2;
+  int cells_y = (rows - 1) / 2;
+
+  int *labels = new int[cells_x];
+  int *parents = new int[cells_x];
+  int *last_cells = new int[cells_x];
+  uchar *used = new uchar[cells_x];
+  uchar *right = new uchar[cells_x];
+  uchar *down = new uchar[cells_x];
+
+  for (int cell = 0; cell < cells_x; ++cell)
+    {
+      labels[cell] = -1;
+    }
+
+  auto find = [parents] (int label)
+    {
+      while (parents[label] != label)
+        {
+          parents[label] = parents[parents[label]];
+          label = parents[label];
+        }
+      return label;
+    };
+
+  // Top wall.
+  line.assign (columns, '1');
+  line += '\n';
+  out.write (line.data (), line.size ());
+
+  for (int cell_y = 0; cell_y < cells_y; ++cell_y)
+    {
+      int last_row = cell_y == cells_y - 1;
+
+      // Cells not carried down from the row above start a set of their
+      // own, with labels kept below cells_x.
+      memset (used, 0, cells_x);
+      for (int cell = 0; cell < cells_x; ++cell)
+        {
+          if (labels[cell] >= 0)
+            {
+              used[labels[cell]] = 1;
+            }
+        }
+      int free_label = 0;
+      for (int cell = 0; cell < cells_x; ++cell)
+        {
+          if (labels[cell] < 0)
+            {
+              while (used[free_label])
+                {
+                  ++free_label;
+                }
+              labels[cell] = free_label;
+              used[free_label] = 1;
+            }
+          parents[cell] = cell;
+        }
+
+      for (int cell = 0; cell + 1 < cells_x; ++cell)
+        {
+          int a = find (labels[cell]);
+          int b = find (labels[cell + 1]);
+          right[cell] = a != b && (last_row || random_int (random, 2));
+          if (right[cell])
+            {
+              parents[a] = b;
+            }
+        }
+
+      if (!last_row)
+        {
+          for (int cell = 0; cell < cells_x; ++cell)
+            {
+              last_cells[cell] = -1;
+              used[cell] = 0;
+            }
+          for (int cell = 0; cell < cells_x; ++cell)
+            {
+              int set = find (labels[cell]);
+              down[cell] = random_int (random, 3) == 0;
+              used[set] |= down[cell];
+              last_cells[set] = cell;
+            }
+          for (int set = 0; set < cells_x; ++set)
+            {
+              if (last_cells[set] >= 0 && !used[set])
+                {
+                  down[last_cells[set]] = 1;
+                }
+            }
+        }
+      else
+        {
+          memset (down, 0, cells_x);
+        }
+
+      line.assign (columns, '1');
+      for (int cell = 0; cell < cells_x; ++cell)
+        {
+          line[cell * 2 + 1] = '0';
+          if (cell + 1 < cells_x && right[cell])
+            {
+              line[cell * 2 + 2] = '0';
+            }
+        }
+      line += '\n';
+      out.write (line.data (), line.size ());
+
+      line.assign (columns, '1');
+      for (int cell = 0; cell < cells_x; ++cell)
+        {
+          if (down[cell])
+            {
+              line[cell * 2 + 1] = '0';
+            }
+          labels[cell] = down[cell] ? find (labels[cell]) : -1;
+        }
+      line += '\n';
+      out.write (line.data (), line.size ());
+    }
+
+  // The bottom wall was written with the last row, an even row count
+  // leaves one more line.
+  if (rows % 2 == 0)
+    {
+      line.assign (columns, '1');
+      line += '\n';
+      out.write (line.data (), line.size ());
+    }
+
+  delete[] labels;
+  delete[] parents;
+  delete[] last_cells;
+  delete[] used;
+  delete[] right;
+  delete[] down;
+}
+
+
+// A brick_dim of zero lets the columns fill the playfield's width.
+static void
+generate_map (ostream &out, MapGenKind kind, int columns, int rows,
+              uint64_t seed, V2 brick_dim)
+{
+  Random random = {seed};
+
+  out << "grid " << columns << " " << rows;
+  if (brick_dim.x > 0 && brick_dim.y > 0)
+    {
+      out << " " << brick_dim.x << " " << brick_dim.y;
+    }
+  out << "\n";
+
+  string line;
+
+  switch (kind)
+    {
+    case MAPGEN_PATTERN:
+      {
+        int motif = random_int (&random, 4);
+        int period = 2 + random_int (&random, 6);
+
+        for (int row = 0; row < rows; ++row)
+          {
+            line.assign (columns, '0');
+            for (int column = 0; column < columns; ++column)
+              {
+                line[column] = get_health_tile (get_pattern_health (motif, period,
+                                                                    column, row,
+                                                                    columns, rows));
+              }
+            line += '\n';
+            out.write (line.data (), line.size ());
+          }
+      } break;
+    case MAPGEN_NOISE:
+      {
+        uint64_t noise_seed = random_next (&random);
+        float frequency = 1.0f / (4 + random_int (&random, 12));
+        float threshold = 0.4 + random_float (&random) * 0.15;
+
+        for (int row = 0; row < rows; ++row)
+          {
+            line.assign (columns, '0');
+            for (int column = 0; column < columns; ++column)
+              {
+                // Two octaves of value noise.
+                float noise = (value_noise (column * frequency,
+                                            row * frequency,
+                                            noise_seed) * (2 / 3.0f) +
+                               value_noise (column * frequency * 2,
+                                            row * frequency * 2,
+                                            noise_seed + 1) * (1 / 3.0f));
+
+                if (noise > threshold)
+                  {
+                    int health = (1 + (noise - threshold) / (1 - threshold) *
+                                  BRICK_MAX_HEALTH);
+                    line[column] = get_health_tile (min (health, BRICK_MAX_HEALTH));
+                  }
+              }
+            line += '\n';
+            out.write (line.data (), line.size ());
+          }
+      } break;
+    case MAPGEN_MAZE:
+      {
+        generate_maze (out, line, columns, rows, &random);
+      } break;
+    case MAPGEN_ENUM_LENGTH: {}
+    }
+}
+
+
+static int
+generate_map_command (int argc, char *argv[])
+{
+  int kind = 0;
+  while (argc > 0 && kind < MAPGEN_ENUM_LENGTH &&
+         strcmp (argv[0], mapgen_kind_names[kind]) != 0)
+    {
+      ++kind;
+    }
+
+  int columns = argc > 1 ? atoi (argv[1]) : 0;
+  int rows = argc > 2 ? atoi (argv[2]) : 0;
+  V2 brick_dim = {0, 0};
+
+  if (argc == 6)
+    {
+      brick_dim.x = atof (argv[4]);
+      brick_dim.y = atof (argv[5]);
+    }
+
+  if ((argc != 4 && argc != 6) || kind == MAPGEN_ENUM_LENGTH ||
+      columns < 1 || rows < 1 ||
+      (kind == MAPGEN_MAZE && (columns < 3 || rows < 3)) ||
+      (argc == 6 && (brick_dim.x <= 0 || brick_dim.y <= 0)))
+    {
+      cerr << "Usage: bricks --generate <pattern|noise|maze> "
+           << "<columns> <rows> <seed> [<brick_width> <brick_height>]" << endl;
+      return 1;
+    }
+
+  // As the map's grid line will have it, with the default spacing.
+  MapLayout layout = {columns, rows, brick_dim, brick_dim.x / 10};
+  if (get_map_layout_width (&layout) > 2 + MAP_LAYOUT_WIDTH_SLACK)
+    {
+      cerr << "Error: " << columns << " columns " << brick_dim.x
+           << " wide don't fit in the playfield." << endl;
+      return 1;
+    }
+
+  generate_map (cout, (MapGenKind) kind, columns, rows,
+                strtoull (argv[3], 0, 10), brick_dim);
+
+  return 0;
+}
@@ -0,0 +1,549 @@
+/* Bricks Game - Metrics
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Live counters for watching a game from outside it, with no window to
+// look at: "bricks --metrics ENDPOINT ..." serves them over HTTP in the
+// Prometheus text format, on 127.0.0.1 if ENDPOINT is a port number and
+// on a Unix socket at that path otherwise.
+//
+// The game's threads only touch the metrics with relaxed atomic adds
+// and stores, and never wait on the endpoint. That runs on a thread of
+// its own, which adds up the buckets when a scrape comes and works out
+// the frame rate from the frame count once a second. A scrape may see a
+// sample's bucket but not yet its sum, which is fine for metrics read
+// every few seconds. Each histogram has cache lines of its own, as they
+// are written from different threads.
+
+#include <atomic>
+#ifndef _WIN32
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#define METRICS_BUCKETS_MAX 12
+// How often the thread checks whether to stop.
+#define METRICS_WAIT_SECONDS 0.25
+#define METRICS_FPS_SECONDS 1.0
+#define METRICS_REQUEST_MAX 4096
+// A client slower than this to send its request or take the answer is
+// dropped, as the next one waits on it.
+#define METRICS_CLIENT_TIMEOUT_MS 1000
+
+enum MetricsHistogramType {
+  METRICS_FRAME_TIME,
+  METRICS_TICK_TIME,
+  METRICS_COLLISIONS_TESTED,
+  METRICS_COLLISIONS_HIT,
+  METRICS_LEVEL_LOAD_TIME,
+  METRICS_HISTOGRAM_ENUM_LENGTH,
+};
+
+enum MetricsGaugeType {
+  METRICS_FPS,
+  METRICS_BALLS,
+  METRICS_BULLETS,
+  METRICS_POWERUPS,
+  METRICS_BRICKS,
+  METRICS_MOVING_BRICKS,
+  METRICS_PARTICLES,
+  METRICS_TIMERS,
+  METRICS_SOUNDS_LOAD_TIME,
+  METRICS_MUSIC_LOAD_TIME,
+  METRICS_ATLAS_LOAD_TIME,
+  METRICS_GAUGE_ENUM_LENGTH,
+};
+
+struct MetricsHistogramInfo {
+  const char *name;
+  const char *help;
+  // Sums are kept as a whole number of units, so adding to them is an
+  // integer add.
+  double unit;
+  int bounds_count;
+  double bounds[METRICS_BUCKETS_MAX];
+};
+
+// Gauges of the same name go one after another, told apart by labels.
+struct MetricsGaugeInfo {
+  const char *name;
+  const char *help;
+  const char *labels;
+  double unit;
+};
+
+static const MetricsHistogramInfo metrics_histogram_infos[] = {
+  {"bricks_frame_seconds", "Time from one frame presented to the next.",
+   1e-9, 11,
+   {0.002, 0.004, 0.006, 0.0084, 0.0112, 0.0167, 0.0223, 0.0334, 0.05,
+    0.1, 0.25}},
+  {"bricks_tick_seconds", "Time a simulation tick takes to run.",
+   1e-9, 10,
+   {0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.002, 0.004, 0.0084,
+    0.0167, 0.05}},
+  {"bricks_collisions_tested_per_tick",
+   "Collision tests after the broad phase, per tick.",
+   1, 11, {0, 1, 2, 4, 8, 16, 32, 64, 128, 256, 1024}},
+  {"bricks_collisions_hit_per_tick",
+   "Collision tests that found a hit, per tick.",
+   1, 7, {0, 1, 2, 4, 8, 16, 32}},
+  {"bricks_level_load_seconds", "Time loading a level's map takes.",
+   1e-9, 9, {0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.5, 1}},
+};
+
+static const MetricsGaugeInfo metrics_gauge_infos[] = {
+  {"bricks_fps", "Frames presented per second, over the last second.",
+   0, 0.001},
+  {"bricks_entities", "Live entities, by kind.", "kind=\"balls\"", 1},
+  {"bricks_entities", 0, "kind=\"bullets\"", 1},
+  {"bricks_entities", 0, "kind=\"powerups\"", 1},
+  {"bricks_entities", 0, "kind=\"bricks\"", 1},
+  {"bricks_entities", 0, "kind=\"moving_bricks\"", 1},
+  {"bricks_entities", 0, "kind=\"particles\"", 1},
+  {"bricks_entities", 0, "kind=\"timers\"", 1},
+  {"bricks_asset_load_seconds", "Time loading each kind of asset took.",
+   "asset=\"sounds\"", 1e-9},
+  {"bricks_asset_load_seconds", 0, "asset=\"music\"", 1e-9},
+  {"bricks_asset_load_seconds", 0, "asset=\"atlas\"", 1e-9},
+};
+
+struct alignas (64) MetricsHistogram {
+  // The last bucket is for everything past the last bound.
+  std::atomic<uint64_t> counts[METRICS_BUCKETS_MAX + 1];
+  std::atomic<uint64_t> sum;
+};
+
+struct Metrics {
+  MetricsHistogram histograms[METRICS_HISTOGRAM_ENUM_LENGTH];
+  alignas (64) std::atomic<int64_t> gauges[METRICS_GAUGE_ENUM_LENGTH];
+};
+
+struct MetricsServer {
+  NetHandle handle;
+  // Set for a Unix socket, to remove it again when stopping.
+  const char *unix_path;
+  // Read when scraped, if set.
+  Music *music;
+  SDL_Thread *thread;
+  SDL_atomic_t running;
+  uint64_t fps_frames;
+  double fps_time;
+};
+
+// Always counting, whether served or not.
+static Metrics metrics;
+
+
+static void
+observe_metric (MetricsHistogramType type, double value)
+{
+  const MetricsHistogramInfo *info = metrics_histogram_infos + type;
+  MetricsHistogram *histogram = metrics.histograms + type;
+
+  int bucket = 0;
+  while (bucket < info->bounds_count && value > info->bounds[bucket])
+    {
+      ++bucket;
+    }
+
+  histogram->counts[bucket].fetch_add (1, std::memory_order_relaxed);
+  histogram->sum.fetch_add ((uint64_t) max (value / info->unit + 0.5, 0.0),
+                            std::memory_order_relaxed);
+}
+
+
+static void
+set_metric (MetricsGaugeType type, double value)
+{
+  metrics.gauges[type].store ((int64_t) llround (value /
+                                                 metrics_gauge_infos[type].unit),
+                              std::memory_order_relaxed);
+}
+
+
+static double
+get_metric (MetricsGaugeType type)
+{
+  return (metrics.gauges[type].load (std::memory_order_relaxed) *
+          metrics_gauge_infos[type].unit);
+}
+
+
+static uint64_t
+get_metric_count (MetricsHistogramType type)
+{
+  MetricsHistogram *histogram = metrics.histograms + type;
+  uint64_t count = 0;
+
+  for (int bucket = 0; bucket <= METRICS_BUCKETS_MAX; ++bucket)
+    {
+      count += histogram->counts[bucket].load (std::memory_order_relaxed);
+    }
+
+  return count;
+}
+
+
+static void
+write_metric_header (ostringstream &text, const char *name, const char *help,
+                     const char *type)
+{
+  text << "# HELP " << name << " " << help << "\n"
+       << "# TYPE " << name << " " << type << "\n";
+}
+
+
+// Everything, in the Prometheus text format.
+static string
+format_metrics (MetricsServer *server)
+{
+  ostringstream text;
+  text.precision (9);
+
+  for (int type = 0; type < METRICS_HISTOGRAM_ENUM_LENGTH; ++type)
+    {
+      const MetricsHistogramInfo *info = metrics_histogram_infos + type;
+      MetricsHistogram *histogram = metrics.histograms + type;
+      write_metric_header (text, info->name, info->help, "histogram");
+
+      // Prometheus buckets count everything up to their bound.
+      uint64_t count = 0;
+      for (int bucket = 0; bucket <= info->bounds_count; ++bucket)
+        {
+          count += histogram->counts[bucket].load (std::memory_order_relaxed);
+          text << info->name << "_bucket{le=\"";
+          if (bucket < info->bounds_count)
+            {
+              text << info->bounds[bucket];
+            }
+          else
+            {
+              text << "+Inf";
+            }
+          text << "\"} " << count << "\n";
+        }
+
+      text << info->name << "_sum "
+           << histogram->sum.load (std::memory_order_relaxed) * info->unit
+           << "\n"
+           << info->name << "_count " << count << "\n";
+    }
+
+  for (int type = 0; type < METRICS_GAUGE_ENUM_LENGTH; ++type)
+    {
+      const MetricsGaugeInfo *info = metrics_gauge_infos + type;
+      if (info->help)
+        {
+          write_metric_header (text, info->name, info->help, "gauge");
+        }
+
+      text << info->name;
+      if (info->labels)
+        {
+          text << "{" << info->labels << "}";
+        }
+      text << " " << get_metric ((MetricsGaugeType) type) << "\n";
+    }
+
+  if (server->music)
+    {
+      // The mixer locks the audio thread out for this, but only for the
+      // scrape.
+      write_metric_header (text, "bricks_audio_voices",
+                           "Sound effects playing.", "gauge");
+      text << "bricks_audio_voices " << Mix_Playing (-1) << "\n";
+      write_metric_header (text, "bricks_music_underruns_total",
+                           "Times the music ran out of decoded frames.",
+                           "counter");
+      text << "bricks_music_underruns_total "
+           << SDL_AtomicGet (&server->music->underruns) << "\n";
+    }
+
+  return text.str ();
+}
+
+
+static void
+close_metrics_handle (NetHandle handle)
+{
+#ifdef _WIN32
+  closesocket (handle);
+#else
+  close (handle);
+#endif
+}
+
+
+// Sends all of data, or gives up on the client.
+static int
+send_metrics_data (NetHandle client, const char *data, int size)
+{
+#ifdef MSG_NOSIGNAL
+  int flags = MSG_NOSIGNAL;
+#else
+  int flags = 0;
+#endif
+
+  while (size > 0)
+    {
+      int sent = send (client, data, size, flags);
+      if (sent <= 0)
+        {
+          return 0;
+        }
+      data += sent;
+      size -= sent;
+    }
+
+  return 1;
+}
+
+
+// Reads one request and answers it, any GET of / or /metrics with the
+// metrics, and closes the connection.
+static void
+serve_metrics_client (MetricsServer *server, NetHandle client)
+{
+#ifdef _WIN32
+  DWORD timeout = METRICS_CLIENT_TIMEOUT_MS;
+#else
+  timeval timeout = {};
+  timeout.tv_sec = METRICS_CLIENT_TIMEOUT_MS / 1000;
+  timeout.tv_usec = METRICS_CLIENT_TIMEOUT_MS % 1000 * 1000;
+#endif
+  setsockopt (client, SOL_SOCKET, SO_RCVTIMEO, (const char *) &timeout,
+              sizeof (timeout));
+  setsockopt (client, SOL_SOCKET, SO_SNDTIMEO, (const char *) &timeout,
+              sizeof (timeout));
+
+  // Only the request line matters, but the rest of the headers are
+  // read too, as some clients take an early close as a failure.
+  char request[METRICS_REQUEST_MAX + 1];
+  int size = 0;
+  while (size < METRICS_REQUEST_MAX)
+    {
+      int received = recv (client, request + size,
+                           METRICS_REQUEST_MAX - size, 0);
+      if (received <= 0)
+        {
+          break;
+        }
+      size += received;
+      request[size] = 0;
+
+      if (strstr (request, "\r\n\r\n") || strstr (request, "\n\n"))
+        {
+          break;
+        }
+    }
+  request[size] = 0;
+
+  string status = "404 Not Found";
+  string body = "Not found, try /metrics.\n";
+  if (strncmp (request, "GET / ", 6) == 0 ||
+      strncmp (request, "GET /metrics ", 13) == 0 ||
+      strncmp (request, "GET /metrics?", 13) == 0)
+    {
+      status = "200 OK";
+      body = format_metrics (server);
+    }
+
+  ostringstream response;
+  response << "HTTP/1.0 " << status << "\r\n"
+           << "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+           << "Content-Length: " << body.size () << "\r\n"
+           << "Connection: close\r\n\r\n"
+           << body;
+  string text = response.str ();
+  send_metrics_data (client, text.data (), text.size ());
+  close_metrics_handle (client);
+}
+
+
+static void
+update_metrics_fps (MetricsServer *server, double now)
+{
+  if (now - server->fps_time < METRICS_FPS_SECONDS)
+    {
+      return;
+    }
+
+  uint64_t frames = get_metric_count (METRICS_FRAME_TIME);
+  set_metric (METRICS_FPS,
+              (frames - server->fps_frames) / (now - server->fps_time));
+  server->fps_frames = frames;
+  server->fps_time = now;
+}
+
+
+// Serves one client at a time, till running is cleared.
+static int
+run_metrics_server (void *data)
+{
+  MetricsServer *server = (MetricsServer *) data;
+  server->fps_frames = get_metric_count (METRICS_FRAME_TIME);
+  server->fps_time = get_seconds ();
+
+  while (SDL_AtomicGet (&server->running))
+    {
+      fd_set handles;
+      FD_ZERO (&handles);
+      FD_SET (server->handle, &handles);
+      timeval wait = {};
+      wait.tv_usec = METRICS_WAIT_SECONDS * 1e6;
+
+      int ready = select ((int) server->handle + 1, &handles, 0, 0, &wait);
+      update_metrics_fps (server, get_seconds ());
+
+      if (ready > 0)
+        {
+          NetHandle client = accept (server->handle, 0, 0);
+          if (client != NET_INVALID_HANDLE)
+            {
+              serve_metrics_client (server, client);
+            }
+        }
+    }
+
+  return 0;
+}
+
+
+static void
+stop_metrics_server (MetricsServer *server)
+{
+  if (server->thread)
+    {
+      SDL_AtomicSet (&server->running, 0);
+      SDL_WaitThread (server->thread, 0);
+    }
+
+  if (server->handle != NET_INVALID_HANDLE)
+    {
+      close_metrics_handle (server->handle);
+    }
+
+#ifndef _WIN32
+  if (server->unix_path)
+    {
+      unlink (server->unix_path);
+    }
+#endif
+
+  *server = {};
+  server->handle = NET_INVALID_HANDLE;
+}
+
+
+// Opens the endpoint, a port on 127.0.0.1 or the path of a Unix socket,
+// and starts serving it. Returns 0 if it can't be opened.
+static int
+start_metrics_server (MetricsServer *server, const char *endpoint,
+                      Music *music)
+{
+  *server = {};
+  server->handle = NET_INVALID_HANDLE;
+  server->music = music;
+
+  if (!init_net ())
+    {
+      return 0;
+    }
+
+  int is_port = endpoint[0] != 0;
+  for (const char *c = endpoint; *c; ++c)
+    {
+      is_port = is_port && *c >= '0' && *c <= '9';
+    }
+
+  if (is_port)
+    {
+      server->handle = socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      if (server->handle == NET_INVALID_HANDLE)
+        {
+          return 0;
+        }
+
+      // So a restarted game gets its port back right away.
+      int reuse = 1;
+      setsockopt (server->handle, SOL_SOCKET, SO_REUSEADDR,
+                  (const char *) &reuse, sizeof (reuse));
+
+      NetAddress address = {};
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+      address.sin_port = htons (atoi (endpoint));
+
+      if (bind (server->handle, (sockaddr *) &address, sizeof (address)) != 0)
+        {
+          stop_metrics_server (server);
+          return 0;
+        }
+    }
+  else
+    {
+#ifdef _WIN32
+      return 0;
+#else
+      sockaddr_un address = {};
+      address.sun_family = AF_UNIX;
+      if (strlen (endpoint) >= sizeof (address.sun_path))
+        {
+          return 0;
+        }
+      strcpy (address.sun_path, endpoint);
+
+      // A socket left behind by a game that didn't stop cleanly is in
+      // the way, but nothing else at that path is touched.
+      struct stat status;
+      if (lstat (endpoint, &status) == 0 && S_ISSOCK (status.st_mode))
+        {
+          unlink (endpoint);
+        }
+
+      server->handle = socket (AF_UNIX, SOCK_STREAM, 0);
+      if (server->handle == NET_INVALID_HANDLE)
+        {
+          return 0;
+        }
+
+      if (bind (server->handle, (sockaddr *) &address, sizeof (address)) != 0)
+        {
+          stop_metrics_server (server);
+          return 0;
+        }
+      server->unix_path = endpoint;
+#endif
+    }
+
+  if (listen (server->handle, 8) != 0)
+    {
+      stop_metrics_server (server);
+      return 0;
+    }
+
+  SDL_AtomicSet (&server->running, 1);
+  server->thread = SDL_CreateThread (run_metrics_server, "metrics", server);
+  if (!server->thread)
+    {
+      stop_metrics_server (server);
+      return 0;
+    }
+
+  return 1;
+}
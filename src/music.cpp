@@ -0,0 +1,445 @@
+/* Bricks Game - Music
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Background music, streamed from Ogg Vorbis files. A thread of its
+// own decodes a little at a time into a ring buffer, which the mixer
+// empties through Mix_HookMusic, so the game's threads never decode
+// and the music only takes the ring and the decoders' state in memory.
+//
+// A track loops by seeking back to its start as soon as it ends, in
+// the middle of filling the ring if need be, so there's no gap. A new
+// track fades in over the old one for MUSIC_CROSSFADE_SECONDS. Tracks
+// are picked by number, as levels go by, from the files a pattern like
+// "res/music/track?.ogg" finds.
+//
+// The ring holds the mixer's format, 16 bit stereo, and tracks need to
+// be at the mixer's rate, as nothing here resamples.
+
+#include <vorbis/vorbisfile.h>
+
+#define MUSIC_TRACKS_MAX 9
+#define MUSIC_CHANNELS 2
+// A power of two. At 44100 Hz about a fifth of a second, so a new track
+// starts fading in that soon.
+#define MUSIC_RING_FRAMES 8192
+#define MUSIC_DECODE_FRAMES 1024
+#define MUSIC_CROSSFADE_SECONDS 2.0
+
+struct MusicDecoder {
+  OggVorbis_File file;
+  int open;
+  int channels;
+};
+
+struct Music {
+  int tracks_count;
+  char tracks[MUSIC_TRACKS_MAX][256];
+  int rate;
+
+  // Frames of interleaved samples. Only the decode thread moves
+  // written and only the mixer read, and both only go up, wrapping
+  // around, so either side can tell how much there is without locking.
+  int16_t *ring;
+  SDL_atomic_t written;
+  SDL_atomic_t read;
+  // Posted by the mixer when it has made room.
+  SDL_sem *room;
+  // Set by the game, taken by the decode thread. -1 for none.
+  SDL_atomic_t requested_track;
+  // 0 to MIX_MAX_VOLUME.
+  SDL_atomic_t volume;
+  SDL_atomic_t stopping;
+  // Times the mixer found the ring empty while a track played.
+  SDL_atomic_t underruns;
+  SDL_Thread *thread;
+
+  // The decode thread's own. While a new track fades in, it's in the
+  // other decoder from the current one.
+  MusicDecoder decoders[2];
+  int current;
+  int track;
+  int fade_frames;
+  int fade_pos;
+  int16_t *scratch[2];
+  // Seconds spent decoding, for the benchmark.
+  double decode_time;
+};
+
+
+// Returns 0 if filepath can't be played at rate.
+static int
+open_music_decoder (MusicDecoder *decoder, const char *filepath, int rate)
+{
+  if (ov_fopen (filepath, &decoder->file) != 0)
+    {
+      cerr << "Warning: Can't decode " << filepath
+           << " as Ogg Vorbis." << endl;
+      return 0;
+    }
+
+  vorbis_info *info = ov_info (&decoder->file, -1);
+
+  if (!info || info->rate != rate || info->channels < 1 ||
+      info->channels > MUSIC_CHANNELS)
+    {
+      cerr << "Warning: " << filepath << " needs to be mono or stereo at "
+           << rate << " Hz to be played." << endl;
+      ov_clear (&decoder->file);
+      return 0;
+    }
+
+  decoder->channels = info->channels;
+  decoder->open = 1;
+  return 1;
+}
+
+
+static void
+close_music_decoder (MusicDecoder *decoder)
+{
+  if (decoder->open)
+    {
+      ov_clear (&decoder->file);
+    }
+  decoder->open = 0;
+}
+
+
+// Fills out with frames_count stereo frames, from the start again when
+// the track ends. Whatever can't be decoded is silence.
+static void
+read_music_frames (MusicDecoder *decoder, int16_t *out, int frames_count)
+{
+  int channels = decoder->channels;
+  int frames_read = 0;
+  int failures = 0;
+
+  while (frames_read < frames_count && failures < 2)
+    {
+      int bitstream;
+      long size = ov_read (&decoder->file,
+                           (char *) (out + frames_read * channels),
+                           (frames_count - frames_read) * channels * 2,
+                           SDL_BYTEORDER == SDL_BIG_ENDIAN, 2, 1,
+                           &bitstream);
+
+      if (size > 0)
+        {
+          frames_read += size / (channels * 2);
+          failures = 0;
+        }
+      else if (size == 0)
+        {
+          // The end, twice in a row if the track is empty.
+          ov_pcm_seek (&decoder->file, 0);
+          ++failures;
+        }
+      else if (size != OV_HOLE)
+        {
+          ++failures;
+        }
+    }
+
+  memset (out + frames_read * channels, 0,
+          (frames_count - frames_read) * channels * 2);
+
+  if (channels == 1)
+    {
+      for (int frame = frames_count - 1; frame >= 0; --frame)
+        {
+          out[frame * 2] = out[frame * 2 + 1] = out[frame];
+        }
+    }
+}
+
+
+static void
+start_music_track (Music *music, int track)
+{
+  if (music->fade_frames)
+    {
+      // Still fading in the one before, which takes over at once.
+      close_music_decoder (music->decoders + music->current);
+      music->current = 1 - music->current;
+      music->fade_frames = 0;
+    }
+
+  int fading = music->decoders[music->current].open;
+  MusicDecoder *decoder = music->decoders + (fading ?
+                                             1 - music->current :
+                                             music->current);
+
+  if (!open_music_decoder (decoder, music->tracks[track], music->rate))
+    {
+      return;
+    }
+
+  music->track = track;
+  if (fading)
+    {
+      music->fade_frames = MUSIC_CROSSFADE_SECONDS * music->rate;
+      music->fade_pos = 0;
+    }
+}
+
+
+// Decodes MUSIC_DECODE_FRAMES more into the ring, which has room.
+static void
+decode_music (Music *music)
+{
+  double begin = (double) SDL_GetPerformanceCounter ();
+  int16_t *frames = music->scratch[0];
+  read_music_frames (music->decoders + music->current, frames,
+                     MUSIC_DECODE_FRAMES);
+
+  if (music->fade_frames)
+    {
+      int16_t *next = music->scratch[1];
+      read_music_frames (music->decoders + 1 - music->current, next,
+                         MUSIC_DECODE_FRAMES);
+
+      // Equal power, so the loudness holds up halfway through.
+      for (int frame = 0; frame < MUSIC_DECODE_FRAMES; ++frame)
+        {
+          float t = min (1.0f, (float) (music->fade_pos + frame) /
+                                music->fade_frames);
+          float out_gain = cosf (t * (float) M_PI / 2);
+          float in_gain = sinf (t * (float) M_PI / 2);
+
+          for (int channel = 0; channel < MUSIC_CHANNELS; ++channel)
+            {
+              // The gains add up to as much as sqrt (2) midway, which
+              // loud tracks can take past what a sample holds.
+              int index = frame * MUSIC_CHANNELS + channel;
+              float sample = frames[index] * out_gain + next[index] * in_gain;
+              sample = max (-32768.0f, min (sample, 32767.0f));
+              frames[index] = (int16_t) sample;
+            }
+        }
+
+      music->fade_pos += MUSIC_DECODE_FRAMES;
+      if (music->fade_pos >= music->fade_frames)
+        {
+          memcpy (frames, next,
+                  MUSIC_DECODE_FRAMES * MUSIC_CHANNELS * sizeof (*frames));
+          close_music_decoder (music->decoders + music->current);
+          music->current = 1 - music->current;
+          music->fade_frames = 0;
+        }
+    }
+
+  // The ring's size is a multiple of MUSIC_DECODE_FRAMES, so this never
+  // wraps around.
+  unsigned start = ((unsigned) SDL_AtomicGet (&music->written) &
+                    (MUSIC_RING_FRAMES - 1));
+  memcpy (music->ring + start * MUSIC_CHANNELS, frames,
+          MUSIC_DECODE_FRAMES * MUSIC_CHANNELS * sizeof (*frames));
+  SDL_AtomicAdd (&music->written, MUSIC_DECODE_FRAMES);
+
+  music->decode_time += ((SDL_GetPerformanceCounter () - begin) /
+                         SDL_GetPerformanceFrequency ());
+}
+
+
+static int
+run_music_thread (void *data)
+{
+  Music *music = (Music *) data;
+
+  while (!SDL_AtomicGet (&music->stopping))
+    {
+      int track = SDL_AtomicSet (&music->requested_track, -1);
+      if (track >= 0 && track != music->track)
+        {
+          start_music_track (music, track);
+        }
+
+      unsigned queued = ((unsigned) SDL_AtomicGet (&music->written) -
+                         (unsigned) SDL_AtomicGet (&music->read));
+
+      if (!music->decoders[music->current].open ||
+          queued > MUSIC_RING_FRAMES - MUSIC_DECODE_FRAMES)
+        {
+          SDL_SemWaitTimeout (music->room, 100);
+          continue;
+        }
+
+      decode_music (music);
+    }
+
+  return 0;
+}
+
+
+// The mixer's music callback, on the audio thread: copies out what's
+// been decoded, at the music's volume, and leaves silence for the rest.
+static void SDLCALL
+mix_music_ring (void *data, Uint8 *stream, int length)
+{
+  Music *music = (Music *) data;
+  int16_t *out = (int16_t *) stream;
+  int frames_count = length / (MUSIC_CHANNELS * sizeof (*out));
+
+  unsigned read = SDL_AtomicGet (&music->read);
+  unsigned written = SDL_AtomicGet (&music->written);
+  int count = min (frames_count, (int) (written - read));
+  int volume = SDL_AtomicGet (&music->volume);
+
+  for (int frame = 0; frame < count; ++frame)
+    {
+      int16_t *in = (music->ring +
+                     ((read + frame) & (MUSIC_RING_FRAMES - 1)) *
+                     MUSIC_CHANNELS);
+      for (int channel = 0; channel < MUSIC_CHANNELS; ++channel)
+        {
+          out[frame * MUSIC_CHANNELS + channel] =
+            in[channel] * volume / MIX_MAX_VOLUME;
+        }
+    }
+
+  memset (out + count * MUSIC_CHANNELS, 0,
+          (frames_count - count) * MUSIC_CHANNELS * sizeof (*out));
+
+  if (count < frames_count && written)
+    {
+      SDL_AtomicAdd (&music->underruns, 1);
+    }
+
+  SDL_AtomicAdd (&music->read, count);
+  SDL_SemPost (music->room);
+}
+
+
+// Finds the tracks filepath_pattern names with its ? as 1 to 9, and
+// starts the decode thread, without hooking it up to the mixer. Returns
+// 0 if there are no tracks.
+static int
+init_music_stream (Music *music, const char *filepath_pattern, int rate)
+{
+  *music = {};
+  music->rate = rate;
+  music->track = -1;
+  SDL_AtomicSet (&music->requested_track, -1);
+  SDL_AtomicSet (&music->volume, MIX_MAX_VOLUME);
+
+  const char *wildcard = strchr (filepath_pattern, '?');
+  assert (wildcard && strlen (filepath_pattern) < sizeof (music->tracks[0]));
+
+  for (int track = 0; track < MUSIC_TRACKS_MAX; ++track)
+    {
+      char *filepath = music->tracks[music->tracks_count];
+      strcpy (filepath, filepath_pattern);
+      filepath[wildcard - filepath_pattern] = '1' + track;
+
+      FILE *file = fopen (filepath, "rb");
+      if (!file)
+        {
+          break;
+        }
+      fclose (file);
+      ++music->tracks_count;
+    }
+
+  if (!music->tracks_count)
+    {
+      return 0;
+    }
+
+  music->ring = new int16_t[MUSIC_RING_FRAMES * MUSIC_CHANNELS];
+  for (int index = 0; index < 2; ++index)
+    {
+      music->scratch[index] =
+        new int16_t[MUSIC_DECODE_FRAMES * MUSIC_CHANNELS];
+    }
+
+  music->room = SDL_CreateSemaphore (0);
+  music->thread = SDL_CreateThread (run_music_thread, "Music", music);
+  assert (music->room && music->thread);
+  return 1;
+}
+
+
+// Streams the tracks into the mixer, once it's open. Without any, or
+// if the mixer isn't 16 bit stereo, there's no music.
+static void
+init_music (Music *music, const char *filepath_pattern)
+{
+  int rate = 0;
+  Uint16 format = 0;
+  int channels = 0;
+  Mix_QuerySpec (&rate, &format, &channels);
+
+  if (format != AUDIO_S16SYS || channels != MUSIC_CHANNELS)
+    {
+      cerr << "Warning: The mixer isn't 16 bit stereo, so there's no music."
+           << endl;
+      *music = {};
+      return;
+    }
+
+  if (!init_music_stream (music, filepath_pattern, rate))
+    {
+      cerr << "Warning: There's no music at " << filepath_pattern << "."
+           << endl;
+      return;
+    }
+
+  Mix_HookMusic (mix_music_ring, music);
+}
+
+
+// Fades in the track for level track, counting from 0, going round
+// the tracks there are. Does nothing if music is null or has none.
+static void
+play_music_track (Music *music, int track)
+{
+  if (music && music->tracks_count)
+    {
+      SDL_AtomicSet (&music->requested_track, track % music->tracks_count);
+    }
+}
+
+
+// volume is from 0 to 1.
+static void
+set_music_volume (Music *music, float volume)
+{
+  SDL_AtomicSet (&music->volume, (int) (MIX_MAX_VOLUME * volume));
+}
+
+
+static void
+free_music (Music *music)
+{
+  if (music->thread)
+    {
+      Mix_HookMusic (0, 0);
+      SDL_AtomicSet (&music->stopping, 1);
+      SDL_SemPost (music->room);
+      SDL_WaitThread (music->thread, 0);
+      SDL_DestroySemaphore (music->room);
+
+      close_music_decoder (music->decoders);
+      close_music_decoder (music->decoders + 1);
+    }
+
+  delete[] music->ring;
+  delete[] music->scratch[0];
+  delete[] music->scratch[1];
+  *music = {};
+}
@@ -0,0 +1,349 @@
+/* Bricks Game - Network
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Non-blocking UDP sockets, on BSD sockets or Winsock, and the bit
+// packing packets are written in.
+//
+// Packets are read and written by the same code: a serialize function
+// is given a NetBits that either reads or writes, and a value it either
+// fills in or takes from. That way the two sides can't disagree on the
+// layout.
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET NetHandle;
+#define NET_INVALID_HANDLE INVALID_SOCKET
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+typedef int NetHandle;
+#define NET_INVALID_HANDLE -1
+#endif
+
+// Small enough to never be split up on the way, which would lose the
+// whole packet when any piece is lost.
+#define NET_PACKET_MAX 1200
+#define NET_DEFAULT_PORT 4747
+
+struct NetSocket {
+  NetHandle handle;
+};
+
+typedef sockaddr_in NetAddress;
+
+struct NetBits {
+  unsigned char *data;
+  int size;
+  // In bits.
+  int pos;
+  int reading;
+  // Set when a read or write went past size. Whatever came of it is
+  // garbage, and the packet should be dropped or not sent.
+  int overflow;
+};
+
+
+// Needed once before any socket, for Winsock's sake.
+static int
+init_net (void)
+{
+#ifdef _WIN32
+  WSADATA data;
+  return WSAStartup (MAKEWORD (2, 2), &data) == 0;
+#else
+  return 1;
+#endif
+}
+
+
+static void
+close_net_socket (NetSocket *net_socket)
+{
+  if (net_socket->handle != NET_INVALID_HANDLE)
+    {
+#ifdef _WIN32
+      closesocket (net_socket->handle);
+#else
+      close (net_socket->handle);
+#endif
+    }
+
+  net_socket->handle = NET_INVALID_HANDLE;
+}
+
+
+// Binds to port on every interface, or to a port the system picks if
+// port is 0. Returns 0 on failure.
+static int
+open_net_socket (NetSocket *net_socket, int port)
+{
+  net_socket->handle = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (net_socket->handle == NET_INVALID_HANDLE)
+    {
+      return 0;
+    }
+
+  NetAddress address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl (INADDR_ANY);
+  address.sin_port = htons (port);
+
+#ifdef _WIN32
+  u_long non_blocking = 1;
+  int failed = ioctlsocket (net_socket->handle, FIONBIO, &non_blocking) != 0;
+#else
+  int flags = fcntl (net_socket->handle, F_GETFL, 0);
+  int failed = fcntl (net_socket->handle, F_SETFL, flags | O_NONBLOCK) != 0;
+#endif
+
+  if (failed ||
+      bind (net_socket->handle, (sockaddr *) &address, sizeof (address)) != 0)
+    {
+      close_net_socket (net_socket);
+      return 0;
+    }
+
+  return 1;
+}
+
+
+static int
+get_net_socket_port (NetSocket *net_socket)
+{
+  NetAddress address = {};
+  socklen_t size = sizeof (address);
+  getsockname (net_socket->handle, (sockaddr *) &address, &size);
+  return ntohs (address.sin_port);
+}
+
+
+// text is "host" or "host:port". Returns 0 if the host can't be found.
+static int
+resolve_net_address (const char *text, int default_port, NetAddress *address)
+{
+  string host = text;
+  int port = default_port;
+  size_t colon = host.rfind (':');
+
+  if (colon != string::npos)
+    {
+      port = atoi (host.c_str () + colon + 1);
+      host.resize (colon);
+    }
+
+  addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  addrinfo *result = 0;
+
+  if (getaddrinfo (host.c_str (), 0, &hints, &result) != 0 || !result)
+    {
+      return 0;
+    }
+
+  *address = *(NetAddress *) result->ai_addr;
+  address->sin_port = htons (port);
+  freeaddrinfo (result);
+  return 1;
+}
+
+
+static int
+net_addresses_equal (NetAddress *a, NetAddress *b)
+{
+  return (a->sin_addr.s_addr == b->sin_addr.s_addr &&
+          a->sin_port == b->sin_port);
+}
+
+
+static void
+send_packet (NetSocket *net_socket, NetAddress *to,
+             unsigned char *data, int size)
+{
+  sendto (net_socket->handle, (const char *) data, size, 0,
+          (sockaddr *) to, sizeof (*to));
+}
+
+
+// Returns the packet's size, or -1 if none is waiting.
+static int
+receive_packet (NetSocket *net_socket, NetAddress *from,
+                unsigned char *data, int max)
+{
+  socklen_t from_size = sizeof (*from);
+  int size = recvfrom (net_socket->handle, (char *) data, max, 0,
+                       (sockaddr *) from, &from_size);
+  return size >= 0 ? size : -1;
+}
+
+
+static void
+init_net_writer (NetBits *bits, unsigned char *data, int size)
+{
+  *bits = {};
+  bits->data = data;
+  bits->size = size;
+  memset (data, 0, size);
+}
+
+
+static void
+init_net_reader (NetBits *bits, unsigned char *data, int size)
+{
+  *bits = {};
+  bits->data = data;
+  bits->size = size;
+  bits->reading = 1;
+}
+
+
+// The bytes written or read so far.
+static int
+get_net_bits_size (NetBits *bits)
+{
+  return (bits->pos + 7) / 8;
+}
+
+
+static int
+get_net_bits_left (NetBits *bits)
+{
+  return bits->size * 8 - bits->pos;
+}
+
+
+// The low count bits of *value, count up to 32, as an unsigned number.
+static void
+serialize_bits (NetBits *bits, int *value, int count)
+{
+  if (bits->pos + count > bits->size * 8)
+    {
+      bits->overflow = 1;
+      if (bits->reading)
+        {
+          *value = 0;
+        }
+      return;
+    }
+
+  uint32_t result = 0;
+  uint32_t data = bits->reading ? 0 : (uint32_t) *value;
+
+  for (int bit = 0; bit < count; ++bit, ++bits->pos)
+    {
+      unsigned char *byte = bits->data + bits->pos / 8;
+      int shift = bits->pos % 8;
+
+      if (bits->reading)
+        {
+          result |= (uint32_t) ((*byte >> shift) & 1) << bit;
+        }
+      else
+        {
+          *byte |= ((data >> bit) & 1) << shift;
+        }
+    }
+
+  if (bits->reading)
+    {
+      *value = (int) result;
+    }
+}
+
+
+// A value of 0 or more, 7 bits at a time, so small ones stay small.
+static void
+serialize_varint (NetBits *bits, int *value)
+{
+  uint32_t data = bits->reading ? 0 : (uint32_t) *value;
+  uint32_t result = 0;
+
+  for (int shift = 0; shift < 35; shift += 7)
+    {
+      int group = (data >> shift) & 0x7f;
+      int more = (data >> shift) > 0x7f;
+      serialize_bits (bits, &group, 7);
+      serialize_bits (bits, &more, 1);
+      result |= (uint32_t) group << shift;
+
+      if (!more || bits->overflow)
+        {
+          break;
+        }
+    }
+
+  if (bits->reading)
+    {
+      *value = (int) result;
+    }
+}
+
+
+// How many bits serialize_varint writes for value.
+static int
+get_varint_bits (int value)
+{
+  int bits = 8;
+  for (uint32_t data = value; data > 0x7f; data >>= 7)
+    {
+      bits += 8;
+    }
+  return bits;
+}
+
+
+// One bit if *value is the same as base, else the bit and the value.
+static void
+serialize_delta (NetBits *bits, int *value, int base, int count)
+{
+  int same = !bits->reading && *value == base;
+  serialize_bits (bits, &same, 1);
+
+  if (same)
+    {
+      *value = base;
+    }
+  else
+    {
+      serialize_bits (bits, value, count);
+    }
+}
+
+
+// value clamped to [-range, range], in count bits.
+static int
+quantize (float value, float range, int count)
+{
+  int steps = (1 << count) - 1;
+  float unit = (value + range) / (2 * range);
+  unit = max (0.0f, min (unit, 1.0f));
+  return (int) (unit * steps + 0.5f);
+}
+
+
+static float
+dequantize (int value, float range, int count)
+{
+  int steps = (1 << count) - 1;
+  return (float) value / steps * 2 * range - range;
+}
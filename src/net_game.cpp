@@ -0,0 +1,1593 @@
+/* Bricks Game - Network Game
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Games played on a server and watched, or played, from elsewhere.
+//
+// The server runs a game per seat, each on its own, played by the
+// client that took the seat or else by the autoplay, and sends every
+// client of a seat a snapshot NET_SEND_RATE times a second. Clients
+// load the same map file, so bricks never go over the wire whole: a
+// snapshot carries the level's brick hits by brick id, from the first
+// the client hasn't acknowledged, and the moving bricks near the
+// camera. Everything else, the paddle, balls, bullets and powerups, is
+// a NetFrame of quantized ints, delta coded against the last frame the
+// client acknowledged, so what doesn't change costs a bit.
+//
+// A client keeps its own copy of the level, the mirror, with the health
+// of every brick hit so far, and streams it by the server's camera like
+// the game does, patching up bricks as they load. It shows the game
+// NET_INTERPOLATION_DELAY behind the server, in between the two frames
+// around that time, so a lost or late packet doesn't make things jump.
+
+#define NET_PROTOCOL 0xb2
+#define NET_SEATS_MAX 2
+#define NET_PEERS_MAX 16
+// The frames a seat keeps to delta code against, and a client keeps to
+// decode and interpolate with.
+#define NET_FRAMES 64
+#define NET_SEND_RATE 30
+#define NET_TIMEOUT 5.0
+#define NET_HELLO_INTERVAL 0.5
+#define NET_STATS_INTERVAL 5.0
+#define NET_INTERPOLATION_DELAY 0.1
+// Anything that moved further than this between two frames jumped, and
+// isn't slid across.
+#define NET_SNAP_DISTANCE 0.2
+// More brick hits than this at once are a client catching up, which
+// isn't shown with particles and sounds.
+#define NET_LIVE_EVENTS 16
+#define NET_MOVING_BRICKS_MAX 128
+#define NET_MAP_PATH_MAX 255
+
+// x is sent over the level's width, y relative to the camera; sizes in
+// thousandths, times in hundredths of a second.
+#define NET_X_RANGE 1.25
+#define NET_X_BITS 14
+#define NET_Y_RANGE 3.0
+#define NET_Y_BITS 15
+#define NET_SIZE_BITS 10
+#define NET_POWERUP_TIME_BITS 14
+
+enum NetPacketType {
+  NET_HELLO,
+  NET_WELCOME,
+  NET_SNAPSHOT,
+  NET_ACK,
+  NET_BYE,
+  NET_PACKET_TYPE_ENUM_LENGTH,
+};
+
+struct NetBall {
+  int x;
+  int y;
+  int size;
+};
+
+struct NetBullet {
+  int x;
+  int y;
+};
+
+struct NetPowerup {
+  int type;
+  int x;
+  int y;
+  int animation;
+};
+
+// What clients see of a seat's game at one send.
+struct NetFrame {
+  // -1 for a slot with no frame. time is in milliseconds since the
+  // server started.
+  int seq;
+  int time;
+  int game_mode;
+  int powerup_times[POWERUP_ENUM_LENGTH];
+  int lives_count;
+  int score;
+  // The bits of the float, as the camera may be anywhere in the map.
+  int camera_y;
+  int paddle_x;
+  int paddle_y;
+  int paddle_width;
+  int paddle_height;
+  int paddle_blink;
+  // One more than the index, so 0 is none.
+  int caught_ball;
+  int balls_count;
+  NetBall balls[BALLS_MAX];
+  int bullets_count;
+  NetBullet bullets[BULLETS_MAX];
+  int powerups_count;
+  NetPowerup powerups[POWERUPS_MAX];
+};
+
+struct NetMovingBrick {
+  int id;
+  V2 pos;
+};
+
+struct NetPeer {
+  NetAddress address;
+  int seat;
+  int player;
+  // The newest snapshot the client has, or -1, and how far into the
+  // brick hits of which level it is.
+  int acked_seq;
+  int acked_level;
+  int acked_events;
+  // INPUT_* bits, if player.
+  int input;
+  double last_heard;
+  // Since the last print_net_server_stats.
+  long bytes_sent;
+  int packets_sent;
+};
+
+struct NetSeat {
+  GameState game_state;
+  Autoplay autoplay;
+  // The peer playing, or -1 for the autoplay.
+  int player;
+  // The player's input as last put into the game.
+  int input;
+  // Every brick hit of the level so far, which is the level numbered
+  // levels_count.
+  int levels_count;
+  BrickHits events;
+  // Frame seq is in frames[seq % NET_FRAMES].
+  int seq;
+  NetFrame frames[NET_FRAMES];
+};
+
+struct NetServer {
+  NetSocket socket;
+  const char *map_filepath;
+  double start_time;
+  double next_send;
+  int seats_count;
+  NetSeat seats[NET_SEATS_MAX];
+  int peers_count;
+  NetPeer peers[NET_PEERS_MAX];
+
+  // Since the last print_net_server_stats.
+  double stats_time;
+  int ticks_count;
+  double step_time;
+  double step_time_max;
+  double net_time;
+  double net_time_max;
+  long bytes_sent;
+  int packets_sent;
+};
+
+struct NetMirror {
+  NetSocket socket;
+  NetAddress server;
+  int seat;
+  int spectate;
+  // Set once the server's welcome came, with the map it plays and
+  // whether the seat is this client's to play.
+  int welcomed;
+  int player;
+  char map_filepath[NET_MAP_PATH_MAX + 1];
+  GameState *game_state;
+  GameSounds *sounds;
+
+  // The health of each brick of the level by id, INFINITY for the
+  // bricks not hit yet, from the first events_applied brick hits.
+  int healths_count;
+  float *healths;
+  int events_applied;
+  BrickHits incoming;
+  // The brick hits since the last sync_net_mirror_bricks.
+  int fresh_events;
+  int moving_count;
+  NetMovingBrick moving[NET_MOVING_BRICKS_MAX];
+  // Set when the bricks loaded need patching up.
+  int dirty;
+  int loaded_begin;
+  int loaded_end;
+
+  int latest_seq;
+  NetFrame frames[NET_FRAMES];
+  // The server's clock less ours, in seconds.
+  double clock_offset;
+  int has_clock;
+  double next_hello;
+  double last_heard;
+  int sent_input;
+
+  long bytes_received;
+  int packets_received;
+};
+
+static const NetFrame no_net_frame = {};
+
+
+static int
+get_float_bits (float value)
+{
+  int bits;
+  memcpy (&bits, &value, sizeof (bits));
+  return bits;
+}
+
+
+static float
+get_bits_float (int bits)
+{
+  float value;
+  memcpy (&value, &bits, sizeof (value));
+  return value;
+}
+
+
+static int
+quantize_net_count (float value, float scale, int count)
+{
+  int steps = (1 << count) - 1;
+  return max (0, min ((int) (value * scale + 0.5f), steps));
+}
+
+
+static int
+quantize_net_x (float x)
+{
+  return quantize (x, NET_X_RANGE, NET_X_BITS);
+}
+
+
+static int
+quantize_net_y (float y, float camera_y)
+{
+  return quantize (y - camera_y, NET_Y_RANGE, NET_Y_BITS);
+}
+
+
+static V2
+dequantize_net_pos (int x, int y, float camera_y)
+{
+  return (V2) {dequantize (x, NET_X_RANGE, NET_X_BITS),
+               camera_y + dequantize (y, NET_Y_RANGE, NET_Y_BITS)};
+}
+
+
+static void
+fill_net_frame (NetFrame *frame, GameState *game_state, int seq, int time)
+{
+  Camera *camera = &game_state->camera;
+  Paddle *paddle = &game_state->paddle;
+  float camera_y = camera->pos.y;
+
+  *frame = {};
+  frame->seq = seq;
+  frame->time = time;
+  frame->game_mode = game_state->game_mode;
+  for (int type = 0; type < POWERUP_ENUM_LENGTH; ++type)
+    {
+      frame->powerup_times[type] =
+        quantize_net_count (get_powerup_time (game_state, (PowerupType) type),
+                            100, NET_POWERUP_TIME_BITS);
+    }
+  frame->lives_count = quantize_net_count (game_state->lives_count, 1, 8);
+  frame->score = quantize_net_count (game_state->score, 1, 16);
+  frame->camera_y = get_float_bits (camera_y);
+
+  frame->paddle_x = quantize_net_x (paddle->pos.x);
+  frame->paddle_y = quantize_net_y (paddle->pos.y, camera_y);
+  frame->paddle_width = quantize_net_count (paddle->dim.x, 1000,
+                                            NET_SIZE_BITS);
+  frame->paddle_height = quantize_net_count (paddle->dim.y, 1000,
+                                             NET_SIZE_BITS);
+  frame->paddle_blink = paddle->blinking;
+  frame->caught_ball = paddle->caught_ball + 1;
+
+  frame->balls_count = game_state->balls_count;
+  for (int ball_index = 0;
+       ball_index < game_state->balls_count;
+       ++ball_index)
+    {
+      Ball *ball = game_state->balls + ball_index;
+      NetBall *net_ball = frame->balls + ball_index;
+      net_ball->x = quantize_net_x (ball->pos.x);
+      net_ball->y = quantize_net_y (ball->pos.y, camera_y);
+      net_ball->size = quantize_net_count (ball->size, 1000, NET_SIZE_BITS);
+    }
+
+  frame->bullets_count = game_state->bullets_count;
+  for (int bullet_index = 0;
+       bullet_index < game_state->bullets_count;
+       ++bullet_index)
+    {
+      Bullet *bullet = game_state->bullets + bullet_index;
+      frame->bullets[bullet_index].x = quantize_net_x (bullet->pos.x);
+      frame->bullets[bullet_index].y = quantize_net_y (bullet->pos.y,
+                                                       camera_y);
+    }
+
+  frame->powerups_count = game_state->powerups_count;
+  for (int powerup_index = 0;
+       powerup_index < game_state->powerups_count;
+       ++powerup_index)
+    {
+      Powerup *powerup = game_state->powerups + powerup_index;
+      NetPowerup *net_powerup = frame->powerups + powerup_index;
+      net_powerup->type = powerup->type;
+      net_powerup->x = quantize_net_x (powerup->pos.x);
+      net_powerup->y = quantize_net_y (powerup->pos.y, camera_y);
+      net_powerup->animation = (int) powerup->animation_time & 0xff;
+    }
+}
+
+
+// Reads or writes frame as it differs from base. A count too big for
+// its array reads as an overflow.
+static void
+serialize_net_frame (NetBits *bits, NetFrame *frame, const NetFrame *base)
+{
+  serialize_delta (bits, &frame->game_mode, base->game_mode, 2);
+  for (int type = 0; type < POWERUP_ENUM_LENGTH; ++type)
+    {
+      serialize_delta (bits, frame->powerup_times + type,
+                       base->powerup_times[type], NET_POWERUP_TIME_BITS);
+    }
+  serialize_delta (bits, &frame->lives_count, base->lives_count, 8);
+  serialize_delta (bits, &frame->score, base->score, 16);
+  serialize_delta (bits, &frame->camera_y, base->camera_y, 32);
+  serialize_delta (bits, &frame->paddle_x, base->paddle_x, NET_X_BITS);
+  serialize_delta (bits, &frame->paddle_y, base->paddle_y, NET_Y_BITS);
+  serialize_delta (bits, &frame->paddle_width, base->paddle_width,
+                   NET_SIZE_BITS);
+  serialize_delta (bits, &frame->paddle_height, base->paddle_height,
+                   NET_SIZE_BITS);
+  serialize_delta (bits, &frame->paddle_blink, base->paddle_blink, 1);
+  serialize_delta (bits, &frame->caught_ball, base->caught_ball, 2);
+
+  serialize_delta (bits, &frame->balls_count, base->balls_count, 2);
+  serialize_delta (bits, &frame->bullets_count, base->bullets_count, 7);
+  serialize_delta (bits, &frame->powerups_count, base->powerups_count, 2);
+
+  if (frame->balls_count > BALLS_MAX ||
+      frame->bullets_count > BULLETS_MAX ||
+      frame->powerups_count > POWERUPS_MAX ||
+      frame->caught_ball > frame->balls_count)
+    {
+      bits->overflow = 1;
+      return;
+    }
+
+  for (int ball_index = 0; ball_index < frame->balls_count; ++ball_index)
+    {
+      NetBall *ball = frame->balls + ball_index;
+      const NetBall *base_ball = (ball_index < base->balls_count ?
+                                  base->balls + ball_index :
+                                  no_net_frame.balls);
+      serialize_delta (bits, &ball->x, base_ball->x, NET_X_BITS);
+      serialize_delta (bits, &ball->y, base_ball->y, NET_Y_BITS);
+      serialize_delta (bits, &ball->size, base_ball->size, NET_SIZE_BITS);
+    }
+
+  for (int bullet_index = 0;
+       bullet_index < frame->bullets_count;
+       ++bullet_index)
+    {
+      NetBullet *bullet = frame->bullets + bullet_index;
+      const NetBullet *base_bullet = (bullet_index < base->bullets_count ?
+                                      base->bullets + bullet_index :
+                                      no_net_frame.bullets);
+      serialize_delta (bits, &bullet->x, base_bullet->x, NET_X_BITS);
+      serialize_delta (bits, &bullet->y, base_bullet->y, NET_Y_BITS);
+    }
+
+  for (int powerup_index = 0;
+       powerup_index < frame->powerups_count;
+       ++powerup_index)
+    {
+      NetPowerup *powerup = frame->powerups + powerup_index;
+      const NetPowerup *base_powerup = (powerup_index < base->powerups_count ?
+                                        base->powerups + powerup_index :
+                                        no_net_frame.powerups);
+      serialize_delta (bits, &powerup->type, base_powerup->type, 2);
+      serialize_delta (bits, &powerup->x, base_powerup->x, NET_X_BITS);
+      serialize_delta (bits, &powerup->y, base_powerup->y, NET_Y_BITS);
+      serialize_delta (bits, &powerup->animation, base_powerup->animation, 8);
+
+      if (powerup->type >= POWERUP_ENUM_LENGTH)
+        {
+          bits->overflow = 1;
+        }
+    }
+}
+
+
+static void
+begin_net_packet (NetBits *bits, unsigned char *data, NetPacketType type)
+{
+  init_net_writer (bits, data, NET_PACKET_MAX);
+  int protocol = NET_PROTOCOL;
+  int packet_type = type;
+  serialize_bits (bits, &protocol, 8);
+  serialize_bits (bits, &packet_type, 3);
+}
+
+
+// Returns the NetPacketType of the packet, or -1 if it isn't one.
+static int
+begin_net_packet_read (NetBits *bits, unsigned char *data, int size)
+{
+  init_net_reader (bits, data, size);
+  int protocol;
+  int packet_type;
+  serialize_bits (bits, &protocol, 8);
+  serialize_bits (bits, &packet_type, 3);
+
+  if (bits->overflow || protocol != NET_PROTOCOL ||
+      packet_type >= NET_PACKET_TYPE_ENUM_LENGTH)
+    {
+      return -1;
+    }
+
+  return packet_type;
+}
+
+
+// The quarter points of health a brick hit left, 0 if it destroyed the
+// brick.
+static int
+quantize_net_health (float health)
+{
+  return max (0, (int) (health * 4 + 0.5f));
+}
+
+
+// Starts a seat_count seat server on port, or on a port the system
+// picks if it's 0, at time on the clock update_net_server goes by.
+// Returns 0 if the port can't be had.
+static int
+init_net_server (NetServer *server, Config *config, const char *map_filepath,
+                 int port, int seats_count, uint64_t seed, double time)
+{
+  *server = {};
+
+  if (!open_net_socket (&server->socket, port))
+    {
+      return 0;
+    }
+
+  server->map_filepath = map_filepath;
+  server->start_time = time;
+  server->next_send = time;
+  server->stats_time = time;
+  server->seats_count = min (seats_count, NET_SEATS_MAX);
+
+  for (int seat_index = 0; seat_index < server->seats_count; ++seat_index)
+    {
+      NetSeat *seat = server->seats + seat_index;
+      GameState *game_state = &seat->game_state;
+      init_game_state (game_state, seed + seat_index);
+      game_state->config = *config;
+      new_game (game_state);
+      new_level (game_state, map_filepath);
+      game_state->paddle.move_time = time;
+      init_autoplay (&seat->autoplay);
+
+      seat->player = -1;
+      seat->levels_count = game_state->levels_count;
+      for (int frame_index = 0; frame_index < NET_FRAMES; ++frame_index)
+        {
+          seat->frames[frame_index].seq = -1;
+        }
+    }
+
+  return 1;
+}
+
+
+static void
+free_net_server (NetServer *server)
+{
+  close_net_socket (&server->socket);
+
+  for (int seat_index = 0; seat_index < server->seats_count; ++seat_index)
+    {
+      NetSeat *seat = server->seats + seat_index;
+      free_game_state (&seat->game_state);
+      free_autoplay (&seat->autoplay);
+      delete[] seat->events.items;
+    }
+
+  server->seats_count = 0;
+  server->peers_count = 0;
+}
+
+
+static int
+find_net_peer (NetServer *server, NetAddress *address)
+{
+  for (int peer_index = 0; peer_index < server->peers_count; ++peer_index)
+    {
+      if (net_addresses_equal (&server->peers[peer_index].address, address))
+        {
+          return peer_index;
+        }
+    }
+
+  return -1;
+}
+
+
+// Moves the last peer into the removed one's place, and hands a seat
+// the removed peer played back to the autoplay.
+static void
+remove_net_peer (NetServer *server, int peer_index)
+{
+  NetPeer *peer = server->peers + peer_index;
+  if (peer->player)
+    {
+      server->seats[peer->seat].player = -1;
+    }
+
+  int last_index = --server->peers_count;
+  *peer = server->peers[last_index];
+
+  if (peer_index < last_index && peer->player)
+    {
+      server->seats[peer->seat].player = peer_index;
+    }
+}
+
+
+static void
+send_net_welcome (NetServer *server, NetPeer *peer)
+{
+  unsigned char data[NET_PACKET_MAX];
+  NetBits bits;
+  begin_net_packet (&bits, data, NET_WELCOME);
+  serialize_bits (&bits, &peer->seat, 4);
+  serialize_bits (&bits, &peer->player, 1);
+
+  int length = min ((int) strlen (server->map_filepath), NET_MAP_PATH_MAX);
+  serialize_bits (&bits, &length, 8);
+  for (int char_index = 0; char_index < length; ++char_index)
+    {
+      int c = (unsigned char) server->map_filepath[char_index];
+      serialize_bits (&bits, &c, 8);
+    }
+
+  send_packet (&server->socket, &peer->address, data,
+               get_net_bits_size (&bits));
+}
+
+
+static void
+receive_net_hello (NetServer *server, NetBits *bits, NetAddress *from,
+                   double time)
+{
+  int seat_index;
+  int spectate;
+  serialize_bits (bits, &seat_index, 4);
+  serialize_bits (bits, &spectate, 1);
+
+  int peer_index = find_net_peer (server, from);
+  if (bits->overflow ||
+      (peer_index < 0 && server->peers_count == NET_PEERS_MAX))
+    {
+      return;
+    }
+
+  // A hello from a client already in is one that didn't get its
+  // welcome, or lost the connection for a while.
+  if (peer_index < 0)
+    {
+      peer_index = server->peers_count++;
+      NetPeer *peer = server->peers + peer_index;
+      *peer = {};
+      peer->address = *from;
+      peer->seat = min (seat_index, server->seats_count - 1);
+      peer->acked_seq = -1;
+
+      NetSeat *seat = server->seats + peer->seat;
+      if (!spectate && seat->player < 0)
+        {
+          peer->player = 1;
+          seat->player = peer_index;
+          seat->input = 0;
+          seat->game_state.input_left = 0;
+          seat->game_state.input_right = 0;
+          seat->game_state.input_shoot = 0;
+        }
+    }
+
+  NetPeer *peer = server->peers + peer_index;
+  peer->last_heard = time;
+  send_net_welcome (server, peer);
+}
+
+
+static void
+receive_net_ack (NetServer *server, NetBits *bits, NetAddress *from,
+                 double time)
+{
+  int seq;
+  int level;
+  int events;
+  int input;
+  serialize_bits (bits, &seq, 32);
+  serialize_varint (bits, &level);
+  serialize_varint (bits, &events);
+  serialize_bits (bits, &input, 3);
+
+  // The level and events index the seat's history, so past the end is
+  // clamped when sending, but below zero is never right.
+  int peer_index = find_net_peer (server, from);
+  if (bits->overflow || peer_index < 0 || level < 0 || events < 0)
+    {
+      return;
+    }
+
+  NetPeer *peer = server->peers + peer_index;
+  peer->last_heard = time;
+  peer->input = input;
+
+  // Acks may come out of order, and only the newest counts.
+  if (seq >= peer->acked_seq && seq <= server->seats[peer->seat].seq)
+    {
+      peer->acked_seq = seq;
+      peer->acked_level = level;
+      peer->acked_events = events;
+    }
+}
+
+
+// Takes in every packet waiting, and drops the clients not heard from
+// in NET_TIMEOUT.
+static void
+receive_net_packets (NetServer *server, double time)
+{
+  unsigned char data[NET_PACKET_MAX];
+  NetAddress from;
+  int size;
+
+  while ((size = receive_packet (&server->socket, &from, data,
+                                 sizeof (data))) >= 0)
+    {
+      NetBits bits;
+
+      switch (begin_net_packet_read (&bits, data, size))
+        {
+        case NET_HELLO:
+          {
+            receive_net_hello (server, &bits, &from, time);
+          } break;
+        case NET_ACK:
+          {
+            receive_net_ack (server, &bits, &from, time);
+          } break;
+        case NET_BYE:
+          {
+            int peer_index = find_net_peer (server, &from);
+            if (peer_index >= 0)
+              {
+                remove_net_peer (server, peer_index);
+              }
+          } break;
+        }
+    }
+
+  for (int peer_index = 0; peer_index < server->peers_count; ++peer_index)
+    {
+      if (time - server->peers[peer_index].last_heard > NET_TIMEOUT)
+        {
+          remove_net_peer (server, peer_index--);
+        }
+    }
+}
+
+
+// Steps every seat's game by dt to time, and logs its brick hits.
+static void
+step_net_seats (NetServer *server, double time, double dt)
+{
+  for (int seat_index = 0; seat_index < server->seats_count; ++seat_index)
+    {
+      NetSeat *seat = server->seats + seat_index;
+      GameState *game_state = &seat->game_state;
+
+      // Like run_simulation, only input changes reach the game.
+      if (seat->player >= 0)
+        {
+          int input = server->peers[seat->player].input;
+          int input_changes = input ^ seat->input;
+          seat->input = input;
+
+          if (input_changes & INPUT_LEFT)
+            {
+              game_state->input_left = (input & INPUT_LEFT) != 0;
+            }
+          if (input_changes & INPUT_RIGHT)
+            {
+              game_state->input_right = (input & INPUT_RIGHT) != 0;
+            }
+          if (input_changes & INPUT_SHOOT)
+            {
+              game_state->input_shoot = (input & INPUT_SHOOT) != 0;
+            }
+        }
+      else
+        {
+          update_autoplay (&seat->autoplay, game_state, time, dt);
+        }
+
+      step_game (game_state, 0, server->map_filepath, time, dt);
+
+      if (game_state->levels_count != seat->levels_count)
+        {
+          seat->levels_count = game_state->levels_count;
+          seat->events.count = 0;
+        }
+
+      BrickHits *brick_hits = &game_state->brick_hits;
+      for (int hit_index = 0; hit_index < brick_hits->count; ++hit_index)
+        {
+          BrickHit *hit = brick_hits->items + hit_index;
+          push_brick_hit (&seat->events, hit->id, hit->health);
+        }
+    }
+}
+
+
+// The snapshot has the seat's newest frame, the moving bricks in range
+// of the camera, and as many of the brick hits the client hasn't acked
+// as fit, oldest first, all of them again until they're acked.
+static void
+send_net_snapshot (NetServer *server, NetPeer *peer)
+{
+  NetSeat *seat = server->seats + peer->seat;
+  GameState *game_state = &seat->game_state;
+  NetFrame *frame = seat->frames + seat->seq % NET_FRAMES;
+
+  const NetFrame *base = &no_net_frame;
+  int baseline_offset = 0;
+  if (peer->acked_seq >= 0 && seat->seq - peer->acked_seq < NET_FRAMES &&
+      seat->frames[peer->acked_seq % NET_FRAMES].seq == peer->acked_seq)
+    {
+      baseline_offset = seat->seq - peer->acked_seq;
+      base = seat->frames + peer->acked_seq % NET_FRAMES;
+    }
+
+  unsigned char data[NET_PACKET_MAX];
+  NetBits bits;
+  begin_net_packet (&bits, data, NET_SNAPSHOT);
+  serialize_bits (&bits, &frame->seq, 32);
+  serialize_bits (&bits, &baseline_offset, 6);
+  serialize_bits (&bits, &frame->time, 32);
+  serialize_net_frame (&bits, frame, base);
+  serialize_varint (&bits, &seat->levels_count);
+
+  BricksArray *bricks_array = &game_state->bricks_array;
+  float camera_y = game_state->camera.pos.y;
+  int moving[NET_MOVING_BRICKS_MAX];
+  int moving_count = 0;
+
+  for (int brick_index = 0;
+       (brick_index < bricks_array->count &&
+        moving_count < NET_MOVING_BRICKS_MAX);
+       ++brick_index)
+    {
+      Brick *brick = bricks_array->items + brick_index;
+      if ((brick->vel.x != 0 || brick->vel.y != 0) &&
+          fabsf (brick->pos.y - camera_y) < NET_Y_RANGE)
+        {
+          moving[moving_count++] = brick_index;
+        }
+    }
+
+  serialize_varint (&bits, &moving_count);
+  for (int moving_index = 0; moving_index < moving_count; ++moving_index)
+    {
+      Brick *brick = bricks_array->items + moving[moving_index];
+      int x = quantize_net_x (brick->pos.x);
+      int y = quantize_net_y (brick->pos.y, camera_y);
+      serialize_varint (&bits, &brick->id);
+      serialize_bits (&bits, &x, NET_X_BITS);
+      serialize_bits (&bits, &y, NET_Y_BITS);
+    }
+
+  BrickHits *events = &seat->events;
+  int first_event = (peer->acked_level == seat->levels_count ?
+                     min (peer->acked_events, events->count) : 0);
+  int bits_left = (get_net_bits_left (&bits) -
+                   get_varint_bits (first_event) - get_varint_bits (events->count));
+  int events_count = 0;
+
+  for (int event_index = first_event;
+       event_index < events->count;
+       ++event_index)
+    {
+      BrickHit *event = events->items + event_index;
+      bits_left -= (get_varint_bits (event->id) +
+                    get_varint_bits (quantize_net_health (event->health)));
+      if (bits_left < 0)
+        {
+          break;
+        }
+      ++events_count;
+    }
+
+  serialize_varint (&bits, &first_event);
+  serialize_varint (&bits, &events_count);
+  for (int event_index = first_event;
+       event_index < first_event + events_count;
+       ++event_index)
+    {
+      BrickHit *event = events->items + event_index;
+      int health = quantize_net_health (event->health);
+      serialize_varint (&bits, &event->id);
+      serialize_varint (&bits, &health);
+    }
+
+  if (bits.overflow)
+    {
+      return;
+    }
+
+  int size = get_net_bits_size (&bits);
+  send_packet (&server->socket, &peer->address, data, size);
+  peer->bytes_sent += size;
+  ++peer->packets_sent;
+  server->bytes_sent += size;
+  ++server->packets_sent;
+}
+
+
+// Takes a frame of every seat and sends it to the seat's clients, if
+// it's time for that.
+static void
+send_net_snapshots (NetServer *server, double time)
+{
+  if (time < server->next_send)
+    {
+      return;
+    }
+
+  server->next_send = max (server->next_send + 1.0 / NET_SEND_RATE, time);
+  int time_ms = (int) ((time - server->start_time) * 1000);
+
+  for (int seat_index = 0; seat_index < server->seats_count; ++seat_index)
+    {
+      NetSeat *seat = server->seats + seat_index;
+      ++seat->seq;
+      fill_net_frame (seat->frames + seat->seq % NET_FRAMES,
+                      &seat->game_state, seat->seq, time_ms);
+    }
+
+  for (int peer_index = 0; peer_index < server->peers_count; ++peer_index)
+    {
+      send_net_snapshot (server, server->peers + peer_index);
+    }
+}
+
+
+// One tick of the server: the packets in, the games stepped by dt to
+// time, and the snapshots out. Times the steps apart from the rest.
+static void
+update_net_server (NetServer *server, double time, double dt)
+{
+  double begin = get_seconds ();
+  receive_net_packets (server, time);
+  double step_begin = get_seconds ();
+  step_net_seats (server, time, dt);
+  double step_end = get_seconds ();
+  send_net_snapshots (server, time);
+  double end = get_seconds ();
+
+  double step_time = step_end - step_begin;
+  double net_time = (step_begin - begin) + (end - step_end);
+  ++server->ticks_count;
+  server->step_time += step_time;
+  server->step_time_max = max (server->step_time_max, step_time);
+  server->net_time += net_time;
+  server->net_time_max = max (server->net_time_max, net_time);
+}
+
+
+// Prints the stats since the last call, and starts them over.
+static void
+print_net_server_stats (NetServer *server, double time)
+{
+  double interval = max (time - server->stats_time, 1e-6);
+  int ticks_count = max (server->ticks_count, 1);
+
+  printf ("%d clients, tick step %.3f ms (max %.3f), net %.3f ms "
+          "(max %.3f), %.0f B/s out\n",
+          server->peers_count,
+          server->step_time / ticks_count * 1e3, server->step_time_max * 1e3,
+          server->net_time / ticks_count * 1e3, server->net_time_max * 1e3,
+          server->bytes_sent / interval);
+
+  for (int peer_index = 0; peer_index < server->peers_count; ++peer_index)
+    {
+      NetPeer *peer = server->peers + peer_index;
+      printf ("  %s:%d  seat %d %-9s %6.0f B/s  %5.1f B per packet\n",
+              inet_ntoa (peer->address.sin_addr),
+              ntohs (peer->address.sin_port), peer->seat,
+              peer->player ? "player" : "spectator",
+              peer->bytes_sent / interval,
+              (double) peer->bytes_sent / max (peer->packets_sent, 1));
+      peer->bytes_sent = 0;
+      peer->packets_sent = 0;
+    }
+
+  fflush (stdout);
+
+  server->stats_time = time;
+  server->ticks_count = 0;
+  server->step_time = 0;
+  server->step_time_max = 0;
+  server->net_time = 0;
+  server->net_time_max = 0;
+  server->bytes_sent = 0;
+  server->packets_sent = 0;
+}
+
+
+// --serve [port [map]]: plays the map headless at sim_fps until killed.
+static int
+run_net_server_command (int argc, char *argv[])
+{
+  int port = argc >= 1 ? atoi (argv[0]) : NET_DEFAULT_PORT;
+  const char *map_filepath = argc >= 2 ? argv[1] : "res/map1.txt";
+
+  Config config;
+  load_config ("config.txt", &config);
+  float fps = config.sim_fps > 0 ? config.sim_fps : 120;
+
+  NetServer *server = new NetServer;
+  double time = get_seconds ();
+
+  if (!init_net () ||
+      !init_net_server (server, &config, map_filepath, port, NET_SEATS_MAX,
+                        ::time (0), time))
+    {
+      cerr << "Error: Can't listen on UDP port " << port << "." << endl;
+      exit (1);
+    }
+
+  cout << "Serving " << map_filepath << " on UDP port " << port
+       << " to " << NET_SEATS_MAX << " seats." << endl;
+
+  FramePacer pacer;
+  init_frame_pacer (&pacer);
+
+  for (;;)
+    {
+      wait_next_frame (&pacer, fps, 0);
+      double now = get_seconds ();
+      update_net_server (server, now, now - time);
+      time = now;
+
+      if (time - server->stats_time >= NET_STATS_INTERVAL)
+        {
+          print_net_server_stats (server, time);
+        }
+    }
+
+  free_net_server (server);
+  delete server;
+  return 0;
+}
+
+
+// Joins the server at address as seat's player, or as a spectator if
+// spectate is set or the seat is taken. The mirror plays into
+// game_state, which should have its config and no level, and plays
+// sounds if there are any. Returns 0 if there's no socket to be had.
+static int
+init_net_mirror (NetMirror *mirror, GameState *game_state,
+                 GameSounds *sounds, NetAddress *address, int seat,
+                 int spectate)
+{
+  *mirror = {};
+
+  if (!open_net_socket (&mirror->socket, 0))
+    {
+      return 0;
+    }
+
+  mirror->server = *address;
+  mirror->seat = max (0, min (seat, NET_SEATS_MAX - 1));
+  mirror->spectate = spectate;
+  mirror->game_state = game_state;
+  mirror->sounds = sounds;
+  mirror->latest_seq = -1;
+  for (int frame_index = 0; frame_index < NET_FRAMES; ++frame_index)
+    {
+      mirror->frames[frame_index].seq = -1;
+    }
+
+  // An empty field with the paddle waiting, until the first frame.
+  game_state->game_mode = GAME_STARTED;
+  game_state->camera.dim = (V2) {2, 2};
+  game_state->paddle.dim.x = DEFAULT_PADDLE_WIDTH;
+  game_state->paddle.dim.y = DEFAULT_PADDLE_HEIGHT;
+  game_state->paddle.pos.y = get_view_y (&game_state->camera,
+                                         PADDLE_SCREEN_Y);
+  game_state->paddle.caught_ball = -1;
+  game_state->levels_count = 0;
+
+  return 1;
+}
+
+
+static void
+free_net_mirror (NetMirror *mirror)
+{
+  if (mirror->welcomed)
+    {
+      unsigned char data[NET_PACKET_MAX];
+      NetBits bits;
+      begin_net_packet (&bits, data, NET_BYE);
+      send_packet (&mirror->socket, &mirror->server, data,
+                   get_net_bits_size (&bits));
+    }
+
+  close_net_socket (&mirror->socket);
+  delete[] mirror->healths;
+  delete[] mirror->incoming.items;
+  mirror->healths = 0;
+  mirror->incoming = {};
+}
+
+
+static void
+send_net_hello (NetMirror *mirror)
+{
+  unsigned char data[NET_PACKET_MAX];
+  NetBits bits;
+  begin_net_packet (&bits, data, NET_HELLO);
+  serialize_bits (&bits, &mirror->seat, 4);
+  serialize_bits (&bits, &mirror->spectate, 1);
+  send_packet (&mirror->socket, &mirror->server, data,
+               get_net_bits_size (&bits));
+}
+
+
+static void
+send_net_ack (NetMirror *mirror, int input)
+{
+  int seq = max (mirror->latest_seq, 0);
+  unsigned char data[NET_PACKET_MAX];
+  NetBits bits;
+  begin_net_packet (&bits, data, NET_ACK);
+  serialize_bits (&bits, &seq, 32);
+  serialize_varint (&bits, &mirror->game_state->levels_count);
+  serialize_varint (&bits, &mirror->events_applied);
+  serialize_bits (&bits, &input, 3);
+  send_packet (&mirror->socket, &mirror->server, data,
+               get_net_bits_size (&bits));
+  mirror->sent_input = input;
+}
+
+
+static void
+receive_net_welcome (NetMirror *mirror, NetBits *bits)
+{
+  int seat;
+  int player;
+  int length;
+  char map_filepath[NET_MAP_PATH_MAX + 1];
+  serialize_bits (bits, &seat, 4);
+  serialize_bits (bits, &player, 1);
+  serialize_bits (bits, &length, 8);
+
+  for (int char_index = 0; char_index < length; ++char_index)
+    {
+      int c;
+      serialize_bits (bits, &c, 8);
+      map_filepath[char_index] = c;
+    }
+  map_filepath[length] = 0;
+
+  if (bits->overflow || mirror->welcomed)
+    {
+      return;
+    }
+
+  mirror->welcomed = 1;
+  mirror->seat = seat;
+  mirror->player = player;
+  memcpy (mirror->map_filepath, map_filepath, length + 1);
+}
+
+
+// Loads the map over again for the level numbered levels_count, with no
+// bricks hit yet.
+static void
+load_net_mirror_level (NetMirror *mirror, int levels_count)
+{
+  GameState *game_state = mirror->game_state;
+  free_level (&game_state->level, &game_state->bricks_array,
+              &game_state->bricks_tree);
+  load_level (&game_state->level, mirror->map_filepath,
+              &game_state->bricks_array, &game_state->bricks_tree);
+  game_state->levels_count = levels_count;
+  play_music_track (mirror->sounds ? mirror->sounds->music : 0,
+                    levels_count - 1);
+
+  Level *level = &game_state->level;
+  if (mirror->healths_count < level->bricks_count)
+    {
+      delete[] mirror->healths;
+      mirror->healths = new float[level->bricks_count];
+    }
+  mirror->healths_count = level->bricks_count;
+  for (int id = 0; id < level->bricks_count; ++id)
+    {
+      mirror->healths[id] = INFINITY;
+    }
+
+  mirror->events_applied = 0;
+  mirror->moving_count = 0;
+  mirror->dirty = 1;
+}
+
+
+static bool
+net_moving_brick_less (const NetMovingBrick &a, const NetMovingBrick &b)
+{
+  return a.id < b.id;
+}
+
+
+static void
+receive_net_snapshot (NetMirror *mirror, NetBits *bits, double now)
+{
+  int seq;
+  int baseline_offset;
+  int time;
+  serialize_bits (bits, &seq, 32);
+  serialize_bits (bits, &baseline_offset, 6);
+  serialize_bits (bits, &time, 32);
+
+  // Late ones are no use, as a newer frame is in.
+  if (bits->overflow || seq <= mirror->latest_seq)
+    {
+      return;
+    }
+
+  const NetFrame *base = &no_net_frame;
+  if (baseline_offset)
+    {
+      int base_seq = seq - baseline_offset;
+      base = mirror->frames + base_seq % NET_FRAMES;
+      if (base_seq < 0 || base->seq != base_seq)
+        {
+          return;
+        }
+    }
+
+  NetFrame frame = {};
+  serialize_net_frame (bits, &frame, base);
+  frame.seq = seq;
+  frame.time = time;
+
+  int levels_count;
+  serialize_varint (bits, &levels_count);
+  if (levels_count < 0)
+    {
+      return;
+    }
+
+  float camera_y = get_bits_float (frame.camera_y);
+  int moving_count;
+  serialize_varint (bits, &moving_count);
+  if (moving_count < 0 || moving_count > NET_MOVING_BRICKS_MAX)
+    {
+      return;
+    }
+
+  NetMovingBrick moving[NET_MOVING_BRICKS_MAX];
+  for (int moving_index = 0; moving_index < moving_count; ++moving_index)
+    {
+      int x;
+      int y;
+      serialize_varint (bits, &moving[moving_index].id);
+      serialize_bits (bits, &x, NET_X_BITS);
+      serialize_bits (bits, &y, NET_Y_BITS);
+      moving[moving_index].pos = dequantize_net_pos (x, y, camera_y);
+    }
+
+  int first_event;
+  int events_count;
+  serialize_varint (bits, &first_event);
+  serialize_varint (bits, &events_count);
+  if (first_event < 0 || events_count < 0)
+    {
+      return;
+    }
+
+  BrickHits *incoming = &mirror->incoming;
+  incoming->count = 0;
+  for (int event_index = 0;
+       event_index < events_count && !bits->overflow;
+       ++event_index)
+    {
+      int id;
+      int health;
+      serialize_varint (bits, &id);
+      serialize_varint (bits, &health);
+      push_brick_hit (incoming, id, health / 4.0f);
+    }
+
+  if (bits->overflow)
+    {
+      return;
+    }
+
+  mirror->frames[seq % NET_FRAMES] = frame;
+  mirror->latest_seq = seq;
+
+  // The offset is smoothed, so the jitter of single packets doesn't
+  // shake the view, but a jump is taken at once.
+  double clock_offset = time / 1000.0 - now;
+  if (!mirror->has_clock || fabs (clock_offset - mirror->clock_offset) > 0.25)
+    {
+      mirror->clock_offset = clock_offset;
+      mirror->has_clock = 1;
+    }
+  else
+    {
+      mirror->clock_offset += (clock_offset - mirror->clock_offset) * 0.05;
+    }
+
+  if (levels_count != mirror->game_state->levels_count)
+    {
+      load_net_mirror_level (mirror, levels_count);
+    }
+
+  if (first_event <= mirror->events_applied &&
+      first_event + incoming->count > mirror->events_applied)
+    {
+      for (int event_index = mirror->events_applied - first_event;
+           event_index < incoming->count;
+           ++event_index)
+        {
+          BrickHit *event = incoming->items + event_index;
+          if (event->id >= 0 && event->id < mirror->healths_count)
+            {
+              mirror->healths[event->id] = event->health;
+            }
+          ++mirror->fresh_events;
+        }
+
+      mirror->events_applied = first_event + incoming->count;
+      mirror->dirty = 1;
+    }
+
+  memcpy (mirror->moving, moving, moving_count * sizeof (NetMovingBrick));
+  mirror->moving_count = moving_count;
+  sort (mirror->moving, mirror->moving + moving_count, net_moving_brick_less);
+  mirror->dirty |= moving_count > 0;
+}
+
+
+// Lerps from a to b by t, unless a jump came in between.
+static V2
+interpolate_net_pos (V2 a, V2 b, float t)
+{
+  if (length (b - a) > NET_SNAP_DISTANCE)
+    {
+      return a;
+    }
+
+  return a + (b - a) * t;
+}
+
+
+// Puts the game as it was t of the way from frame a to frame b into
+// game_state. What can't be lerped is as it was in a.
+static void
+apply_net_frames (GameState *game_state, NetFrame *a, NetFrame *b, float t)
+{
+  float camera_a = get_bits_float (a->camera_y);
+  float camera_b = get_bits_float (b->camera_y);
+  float camera_y = (fabsf (camera_b - camera_a) > NET_SNAP_DISTANCE ?
+                    camera_a : camera_a + (camera_b - camera_a) * t);
+
+  game_state->game_mode = (GameMode) a->game_mode;
+  // The mirror's timers never advance, so they just hold the times.
+  for (int type = 0; type < POWERUP_ENUM_LENGTH; ++type)
+    {
+      set_timer (&game_state->timers, game_state->powerup_timers + type,
+                 a->powerup_times[type] / 100.0, TIMER_POWERUP, type);
+    }
+  game_state->lives_count = a->lives_count;
+  game_state->score = a->score;
+  game_state->camera.pos = (V2) {0, camera_y};
+  game_state->camera.dim = (V2) {2, 2};
+
+  Paddle *paddle = &game_state->paddle;
+  paddle->pos = interpolate_net_pos (
+    dequantize_net_pos (a->paddle_x, a->paddle_y, camera_a),
+    dequantize_net_pos (b->paddle_x, b->paddle_y, camera_b), t);
+  paddle->dim.x = a->paddle_width / 1000.0f;
+  paddle->dim.y = a->paddle_height / 1000.0f;
+  paddle->speed = DEFAULT_PADDLE_SPEED;
+  paddle->blinking = a->paddle_blink;
+  paddle->caught_ball = a->caught_ball - 1;
+
+  game_state->balls_count = a->balls_count;
+  for (int ball_index = 0; ball_index < a->balls_count; ++ball_index)
+    {
+      NetBall *ball_a = a->balls + ball_index;
+      NetBall *ball_b = ball_index < b->balls_count ? b->balls + ball_index : ball_a;
+      Ball *ball = game_state->balls + ball_index;
+      *ball = new_ball ();
+      ball->pos = interpolate_net_pos (
+        dequantize_net_pos (ball_a->x, ball_a->y, camera_a),
+        dequantize_net_pos (ball_b->x, ball_b->y,
+                            ball_b == ball_a ? camera_a : camera_b), t);
+      ball->size = ball_a->size / 1000.0f;
+    }
+
+  game_state->bullets_count = a->bullets_count;
+  for (int bullet_index = 0; bullet_index < a->bullets_count; ++bullet_index)
+    {
+      NetBullet *bullet_a = a->bullets + bullet_index;
+      NetBullet *bullet_b = (bullet_index < b->bullets_count ?
+                             b->bullets + bullet_index : bullet_a);
+      Bullet *bullet = game_state->bullets + bullet_index;
+      bullet->pos = interpolate_net_pos (
+        dequantize_net_pos (bullet_a->x, bullet_a->y, camera_a),
+        dequantize_net_pos (bullet_b->x, bullet_b->y,
+                            bullet_b == bullet_a ? camera_a : camera_b), t);
+      bullet->size = DEFAULT_BULLET_SIZE;
+      bullet->speed = DEFAULT_BULLET_SPEED;
+    }
+
+  game_state->powerups_count = a->powerups_count;
+  for (int powerup_index = 0;
+       powerup_index < a->powerups_count;
+       ++powerup_index)
+    {
+      NetPowerup *powerup_a = a->powerups + powerup_index;
+      NetPowerup *powerup_b = (powerup_index < b->powerups_count &&
+                               b->powerups[powerup_index].type ==
+                               powerup_a->type ?
+                               b->powerups + powerup_index : powerup_a);
+      V2 pos = interpolate_net_pos (
+        dequantize_net_pos (powerup_a->x, powerup_a->y, camera_a),
+        dequantize_net_pos (powerup_b->x, powerup_b->y,
+                            powerup_b == powerup_a ? camera_a : camera_b), t);
+      Powerup *powerup = game_state->powerups + powerup_index;
+      *powerup = new_powerup ((PowerupType) powerup_a->type, pos);
+      powerup->animation_time = powerup_a->animation;
+    }
+}
+
+
+// Shows the game as it was NET_INTERPOLATION_DELAY ago on the server's
+// clock, or as in the newest frame if none is that new.
+static void
+update_net_mirror_view (NetMirror *mirror, double now)
+{
+  double render_time = now + mirror->clock_offset - NET_INTERPOLATION_DELAY;
+  NetFrame *from = 0;
+  NetFrame *to = 0;
+
+  for (int seq = mirror->latest_seq;
+       seq >= 0 && seq > mirror->latest_seq - NET_FRAMES;
+       --seq)
+    {
+      NetFrame *frame = mirror->frames + seq % NET_FRAMES;
+      if (frame->seq != seq)
+        {
+          continue;
+        }
+
+      if (frame->time / 1000.0 <= render_time)
+        {
+          from = frame;
+          break;
+        }
+
+      to = frame;
+    }
+
+  if (!from)
+    {
+      from = to;
+    }
+  if (!to)
+    {
+      to = from;
+    }
+
+  float t = 0;
+  if (to->time > from->time)
+    {
+      t = (render_time - from->time / 1000.0) / ((to->time - from->time) / 1000.0);
+      t = max (0.0f, min (t, 1.0f));
+    }
+
+  apply_net_frames (mirror->game_state, from, to, t);
+}
+
+
+// Streams the level by the camera, and brings the bricks loaded in line
+// with the brick hits and moving bricks the server sent. A few fresh
+// hits go off with particles and a sound, as they would in the game.
+static void
+sync_net_mirror_bricks (NetMirror *mirror)
+{
+  GameState *game_state = mirror->game_state;
+  Level *level = &game_state->level;
+  Camera *camera = &game_state->camera;
+  BricksArray *bricks_array = &game_state->bricks_array;
+
+  stream_level (level, get_view_y (camera, -1), get_view_y (camera, 1),
+                bricks_array, &game_state->bricks_tree,
+                &game_state->bricks_query);
+
+  if (!mirror->dirty &&
+      level->loaded_begin == mirror->loaded_begin &&
+      level->loaded_end == mirror->loaded_end)
+    {
+      return;
+    }
+
+  int live = mirror->fresh_events <= NET_LIVE_EVENTS;
+  int hit = 0;
+
+  // Highest index first, as removing moves the last brick down.
+  for (int brick_index = bricks_array->count - 1;
+       brick_index >= 0;
+       --brick_index)
+    {
+      Brick *brick = bricks_array->items + brick_index;
+
+      if (brick->vel.x != 0 || brick->vel.y != 0)
+        {
+          NetMovingBrick key = {brick->id, {}};
+          NetMovingBrick *moving =
+            lower_bound (mirror->moving, mirror->moving + mirror->moving_count,
+                         key, net_moving_brick_less);
+
+          if (moving < mirror->moving + mirror->moving_count &&
+              moving->id == brick->id)
+            {
+              V2 displacement = moving->pos - brick->pos;
+              brick->pos = moving->pos;
+              aabb_tree_move (&game_state->bricks_tree, brick->proxy,
+                              aabb_from_rect (brick->pos, brick->dim),
+                              displacement);
+            }
+        }
+
+      float health = (brick->id < mirror->healths_count ?
+                      mirror->healths[brick->id] : INFINITY);
+      if (health == INFINITY || health == brick->health)
+        {
+          continue;
+        }
+
+      if (live)
+        {
+          hit = 1;
+          if (health > 0)
+            {
+              emit_particles (&game_state->particle_emissions,
+                              PARTICLE_SPARKS, brick->pos, (V2) {0, 0},
+                              (Color) {1, 0.9, 0.6});
+            }
+          else
+            {
+              emit_particles (&game_state->particle_emissions,
+                              PARTICLE_DEBRIS, brick->pos, brick->dim,
+                              get_brick_color (brick));
+            }
+        }
+
+      if (health > 0)
+        {
+          brick->health = health;
+        }
+      else
+        {
+          remove_brick (game_state, brick_index);
+        }
+    }
+
+  if (hit)
+    {
+      play_random_sound (mirror->sounds ? &mirror->sounds->ball_hit : 0);
+    }
+
+  mirror->dirty = 0;
+  mirror->fresh_events = 0;
+  mirror->loaded_begin = level->loaded_begin;
+  mirror->loaded_end = level->loaded_end;
+}
+
+
+// Takes in what came from the server, sends it input, the INPUT_* bits,
+// if this is the seat's player, and puts the game as of now, on the
+// clock of get_seconds, into the mirror's game state.
+static void
+update_net_mirror (NetMirror *mirror, int input, double now)
+{
+  unsigned char data[NET_PACKET_MAX];
+  NetAddress from;
+  int size;
+
+  while ((size = receive_packet (&mirror->socket, &from, data,
+                                 sizeof (data))) >= 0)
+    {
+      if (!net_addresses_equal (&from, &mirror->server))
+        {
+          continue;
+        }
+
+      mirror->bytes_received += size;
+      ++mirror->packets_received;
+      mirror->last_heard = now;
+      NetBits bits;
+
+      switch (begin_net_packet_read (&bits, data, size))
+        {
+        case NET_WELCOME:
+          {
+            receive_net_welcome (mirror, &bits);
+          } break;
+        case NET_SNAPSHOT:
+          {
+            if (mirror->welcomed)
+              {
+                receive_net_snapshot (mirror, &bits, now);
+                send_net_ack (mirror, mirror->player ? input : 0);
+              }
+          } break;
+        }
+    }
+
+  // Hellos go until there's a welcome, and again once the server has
+  // been quiet too long, as it will have dropped this client.
+  if (mirror->welcomed && now - mirror->last_heard > NET_TIMEOUT)
+    {
+      mirror->welcomed = 0;
+    }
+
+  if (!mirror->welcomed && now >= mirror->next_hello)
+    {
+      send_net_hello (mirror);
+      mirror->next_hello = now + NET_HELLO_INTERVAL;
+    }
+
+  if (mirror->welcomed && mirror->player && input != mirror->sent_input)
+    {
+      send_net_ack (mirror, input);
+    }
+
+  if (mirror->latest_seq >= 0)
+    {
+      update_net_mirror_view (mirror, now);
+    }
+
+  sync_net_mirror_bricks (mirror);
+}
@@ -0,0 +1,138 @@
+/* Bricks Game - Frame Pacing
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Frames start on a fixed schedule of 1 / fps seconds. Most of the wait
+// for the next one is spent asleep, and only the last bit, about as long
+// as sleeps have lately been overshooting, spinning on the performance
+// counter. Idle waits sleep in SDL_WaitEventTimeout instead, so a key
+// press starts the next frame right away.
+
+#define FRAME_SPIN_MIN 0.0002
+#define FRAME_SPIN_MAX 0.004
+#define FRAME_OVERSLEEP_DECAY 0.98
+
+enum VsyncMode {
+  VSYNC_ADAPTIVE = -1,
+  VSYNC_OFF = 0,
+  VSYNC_ON = 1,
+};
+
+struct FramePacer {
+  double frequency;
+  uint64_t next_frame;
+  // The longest a sleep overshot lately, in seconds, slowly forgotten.
+  double oversleep;
+};
+
+
+static void
+init_frame_pacer (FramePacer *pacer)
+{
+  pacer->frequency = SDL_GetPerformanceFrequency ();
+  pacer->next_frame = SDL_GetPerformanceCounter ();
+  pacer->oversleep = FRAME_SPIN_MAX / 2;
+}
+
+
+// Adaptive vsync only waits for the vertical blank when the frame is on
+// time, and tears instead of dropping to half the rate when it's late.
+// Not every driver has it, so that falls back to plain vsync. Returns the
+// mode that was set. Needs a current GL context.
+static VsyncMode
+set_vsync (VsyncMode mode)
+{
+  if (SDL_GL_SetSwapInterval (mode) == 0)
+    {
+      return mode;
+    }
+
+  if (mode == VSYNC_ADAPTIVE && SDL_GL_SetSwapInterval (VSYNC_ON) == 0)
+    {
+      return VSYNC_ON;
+    }
+
+  SDL_GL_SetSwapInterval (VSYNC_OFF);
+  return VSYNC_OFF;
+}
+
+
+// Starts the schedule over, for when frames stopped for a while.
+static void
+reset_frame_pacer (FramePacer *pacer)
+{
+  pacer->next_frame = SDL_GetPerformanceCounter ();
+}
+
+
+// Waits for the next frame at fps frames per second, or not at all if
+// fps is 0. With wake_on_event an event ends the wait early, leaving it
+// in the queue. A frame more than a whole interval late restarts the
+// schedule, rather than rushing the next ones to catch up.
+static void
+wait_next_frame (FramePacer *pacer, float fps, int wake_on_event)
+{
+  uint64_t now = SDL_GetPerformanceCounter ();
+
+  if (fps <= 0)
+    {
+      pacer->next_frame = now;
+      return;
+    }
+
+  uint64_t interval = pacer->frequency / fps;
+  pacer->next_frame += interval;
+
+  if (pacer->next_frame + interval < now)
+    {
+      pacer->next_frame = now;
+      return;
+    }
+
+  if (pacer->next_frame <= now)
+    {
+      return;
+    }
+
+  double wait_time = (pacer->next_frame - now) / pacer->frequency;
+  double spin_time = min (pacer->oversleep + FRAME_SPIN_MIN, FRAME_SPIN_MAX);
+  int sleep_ms = (wait_time - spin_time) * 1000;
+
+  if (sleep_ms > 0)
+    {
+      if (wake_on_event)
+        {
+          if (SDL_WaitEventTimeout (0, sleep_ms))
+            {
+              pacer->next_frame = SDL_GetPerformanceCounter ();
+              return;
+            }
+        }
+      else
+        {
+          SDL_Delay (sleep_ms);
+        }
+
+      double slept = (SDL_GetPerformanceCounter () - now) / pacer->frequency;
+      pacer->oversleep = max (slept - sleep_ms / 1000.0,
+                              pacer->oversleep * FRAME_OVERSLEEP_DECAY);
+    }
+
+  while (SDL_GetPerformanceCounter () < pacer->next_frame)
+    {
+    }
+}
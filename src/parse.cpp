@@ -0,0 +1,615 @@
+/* Bricks Game - Map and Config Parsing
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Everything here is constexpr, so the same code parses the embedded
+// maps and config while compiling and the override files at runtime.
+
+#define BRICK_SPACING 0.02
+// For rounding, in a layout's width that fills the playfield exactly.
+#define MAP_LAYOUT_WIDTH_SLACK 1e-4f
+
+
+constexpr int
+is_blank (char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+
+constexpr int
+text_length (const char *text)
+{
+  int length = 0;
+  while (text[length])
+    {
+      ++length;
+    }
+  return length;
+}
+
+
+constexpr int
+text_equals (const char *text, int begin, int end, const char *word)
+{
+  int length = text_length (word);
+
+  if (end - begin != length)
+    {
+      return 0;
+    }
+
+  for (int i = 0; i < length; ++i)
+    {
+      if (text[begin + i] != word[i])
+        {
+          return 0;
+        }
+    }
+
+  return 1;
+}
+
+
+// Reads a number like "12", "-0.25" or "5e-2" at *pos, after any
+// blanks, and moves *pos past it. Returns 0 if there isn't one.
+constexpr int
+parse_float (const char *text, int end, int *pos, float *value)
+{
+  int p = *pos;
+  while (p < end && is_blank (text[p]))
+    {
+      ++p;
+    }
+
+  double sign = 1;
+  if (p < end && (text[p] == '-' || text[p] == '+'))
+    {
+      sign = text[p] == '-' ? -1 : 1;
+      ++p;
+    }
+
+  double result = 0;
+  int digits = 0;
+  while (p < end && text[p] >= '0' && text[p] <= '9')
+    {
+      result = result * 10 + (text[p++] - '0');
+      ++digits;
+    }
+
+  if (p < end && text[p] == '.')
+    {
+      ++p;
+      double scale = 0.1;
+      while (p < end && text[p] >= '0' && text[p] <= '9')
+        {
+          result += (text[p++] - '0') * scale;
+          scale /= 10;
+          ++digits;
+        }
+    }
+
+  if (!digits)
+    {
+      return 0;
+    }
+
+  if (p < end && (text[p] == 'e' || text[p] == 'E'))
+    {
+      ++p;
+      int exponent_sign = 1;
+      if (p < end && (text[p] == '-' || text[p] == '+'))
+        {
+          exponent_sign = text[p] == '-' ? -1 : 1;
+          ++p;
+        }
+
+      int exponent = 0;
+      while (p < end && text[p] >= '0' && text[p] <= '9')
+        {
+          exponent = exponent * 10 + (text[p++] - '0');
+        }
+
+      for (int i = 0; i < exponent; ++i)
+        {
+          result = exponent_sign > 0 ? result * 10 : result / 10;
+        }
+    }
+
+  if (p < end && !is_blank (text[p]))
+    {
+      return 0;
+    }
+
+  *value = sign * result;
+  *pos = p;
+  return 1;
+}
+
+
+// How grid tiles map to bricks. Maps without a grid line get the
+// original 9 columns of DEFAULT_BRICK_WIDTH with no limit on columns or
+// rows.
+struct MapLayout {
+  int columns;
+  int rows;
+  V2 brick_dim;
+  float spacing;
+};
+
+
+constexpr MapLayout
+get_default_map_layout (void)
+{
+  MapLayout layout = {};
+  layout.brick_dim = (V2) {DEFAULT_BRICK_WIDTH, DEFAULT_BRICK_HEIGHT};
+  layout.spacing = BRICK_SPACING;
+  return layout;
+}
+
+
+constexpr V2
+get_tile_pos (MapLayout *layout, int column, int row)
+{
+  V2 pos = {};
+  pos.x = (-1 + layout->spacing + layout->brick_dim.x / 2 +
+           column * (layout->brick_dim.x + layout->spacing));
+  pos.y = (1 - layout->spacing - layout->brick_dim.y / 2 -
+           row * (layout->brick_dim.y + layout->spacing));
+  return pos;
+}
+
+
+// '1' to '9' are bricks with that much health, 'a' to 'z' continue from
+// 10 to 35. Anything else is an empty tile.
+constexpr int
+get_tile_health (char tile)
+{
+  if (tile >= '1' && tile <= '9')
+    {
+      return tile - '0';
+    }
+  else if (tile >= 'a' && tile <= 'z')
+    {
+      return tile - 'a' + 10;
+    }
+  return 0;
+}
+
+
+constexpr char
+get_health_tile (int health)
+{
+  if (health <= 0)
+    {
+      return '0';
+    }
+  else if (health < 10)
+    {
+      return '0' + health;
+    }
+  return 'a' + min (health, BRICK_TILE_MAX_HEALTH) - 10;
+}
+
+
+// From the left of the first column to the right of the last, with the
+// spacing on both ends.
+constexpr float
+get_map_layout_width (MapLayout *layout)
+{
+  return (layout->spacing +
+          layout->columns * (layout->brick_dim.x + layout->spacing));
+}
+
+
+// Reads the optional first line of a map,
+//
+//   grid columns rows [brick_width brick_height [spacing]]
+//
+// which fixes the grid size. The spacing defaults to a tenth of the
+// brick width. Without a brick size the columns and the spacing around
+// them fill the playfield's width and bricks are half as tall as wide,
+// which for 9 columns is the original layout. Moves *pos past the line.
+// Returns 0 if the line is malformed, or if the columns don't fit in the
+// playfield's width, where the ball can't reach them.
+constexpr int
+parse_map_layout (const char *text, int text_size, MapLayout *layout, int *pos)
+{
+  *layout = get_default_map_layout ();
+
+  int line_end = 0;
+  while (line_end < text_size && text[line_end] != '\n')
+    {
+      ++line_end;
+    }
+
+  int word_end = 0;
+  while (word_end < line_end && !is_blank (text[word_end]))
+    {
+      ++word_end;
+    }
+
+  if (!text_equals (text, 0, word_end, "grid"))
+    {
+      *pos = 0;
+      return 1;
+    }
+
+  float values[5] = {};
+  int values_count = 0;
+  int p = word_end;
+
+  while (values_count < 5 &&
+         parse_float (text, line_end, &p, values + values_count))
+    {
+      ++values_count;
+    }
+  while (p < line_end && is_blank (text[p]))
+    {
+      ++p;
+    }
+
+  if (values_count < 2 || values_count == 3 || p != line_end ||
+      values[0] < 1 || values[1] < 1)
+    {
+      return 0;
+    }
+
+  layout->columns = values[0];
+  layout->rows = values[1];
+
+  if (values_count >= 4)
+    {
+      layout->brick_dim = (V2) {values[2], values[3]};
+    }
+  else
+    {
+      layout->brick_dim.x = 2 / (1.1f * layout->columns + 0.1f);
+      layout->brick_dim.y = layout->brick_dim.x / 2;
+    }
+
+  layout->spacing = (values_count == 5 ? values[4] :
+                     layout->brick_dim.x / 10);
+
+  if (layout->brick_dim.x <= 0 || layout->brick_dim.y <= 0 ||
+      layout->spacing < 0 ||
+      get_map_layout_width (layout) > 2 + MAP_LAYOUT_WIDTH_SLACK)
+    {
+      return 0;
+    }
+
+  *pos = line_end + 1;
+  return 1;
+}
+
+
+// Reads a line placing a brick of any size anywhere in the playfield,
+// optionally moving:
+//
+//   @ pos_x pos_y width height health [vel_x vel_y]
+//
+// Writes the brick to brick unless it is null. Returns 0 if the line is
+// malformed.
+constexpr int
+parse_brick_line (const char *text, int line_begin, int line_end, Brick *brick)
+{
+  float values[7] = {};
+  int values_count = 0;
+  int pos = line_begin + 1;
+
+  while (values_count < 7 &&
+         parse_float (text, line_end, &pos, values + values_count))
+    {
+      ++values_count;
+    }
+  while (pos < line_end && is_blank (text[pos]))
+    {
+      ++pos;
+    }
+
+  if (text[line_begin] != '@' ||
+      (values_count != 5 && values_count != 7) ||
+      values[4] <= 0 || pos != line_end)
+    {
+      return 0;
+    }
+
+  if (brick)
+    {
+      *brick = {};
+      brick->pos = (V2) {values[0], values[1]};
+      brick->dim = (V2) {values[2], values[3]};
+      brick->health = values[4];
+      brick->max_health = values[4];
+      brick->vel = (V2) {values[5], values[6]};
+      brick->proxy = AABB_TREE_NULL;
+      brick->chunk = -1;
+    }
+
+  return 1;
+}
+
+
+// Every character of a grid line is a tile, see get_tile_health. Writes
+// the row's bricks to bricks unless it is null, numbered from first_id.
+// Returns how many bricks there are, or -1 if one lies outside the
+// declared grid.
+constexpr int
+parse_grid_row (const char *text, int line_begin, int line_end,
+                MapLayout *layout, int row, int first_id, Brick *bricks)
+{
+  int bricks_count = 0;
+
+  for (int column = 0; column < line_end - line_begin; ++column)
+    {
+      int health = get_tile_health (text[line_begin + column]);
+
+      if (!health)
+        {
+          continue;
+        }
+
+      if ((layout->columns && column >= layout->columns) ||
+          (layout->rows && row >= layout->rows))
+        {
+          return -1;
+        }
+
+      if (bricks)
+        {
+          Brick brick = {};
+          brick.dim = layout->brick_dim;
+          brick.pos = get_tile_pos (layout, column, row);
+          brick.health = health;
+          brick.max_health = health;
+          brick.proxy = AABB_TREE_NULL;
+          brick.chunk = -1;
+          brick.id = first_id + bricks_count;
+          bricks[bricks_count] = brick;
+        }
+      ++bricks_count;
+    }
+
+  return bricks_count;
+}
+
+
+// A map is an optional grid line (see parse_map_layout) followed by
+// grid rows and '@' brick lines in any order.
+//
+// Writes the bricks to bricks unless it is null, and the layout to
+// layout unless it is null. Returns how many bricks there are, or -1
+// with the line number in *error_line if a line can't be parsed or a
+// brick lies outside the declared grid.
+constexpr int
+parse_map (const char *text, int text_size, Brick *bricks,
+           MapLayout *layout, int *error_line)
+{
+  int bricks_count = 0;
+  int line = 1;
+  int row = 0;
+
+  MapLayout map_layout = {};
+  int line_begin = 0;
+
+  if (!parse_map_layout (text, text_size, &map_layout, &line_begin))
+    {
+      if (error_line)
+        {
+          *error_line = 1;
+        }
+      return -1;
+    }
+
+  if (layout)
+    {
+      *layout = map_layout;
+    }
+
+  if (line_begin)
+    {
+      ++line;
+    }
+
+  for (; line_begin < text_size; ++line)
+    {
+      int line_end = line_begin;
+      while (line_end < text_size && text[line_end] != '\n')
+        {
+          ++line_end;
+        }
+
+      int line_bricks_count = 0;
+
+      if (text[line_begin] == '@')
+        {
+          line_bricks_count =
+            (parse_brick_line (text, line_begin, line_end,
+                               bricks ? bricks + bricks_count : 0) ? 1 : -1);
+          if (bricks && line_bricks_count > 0)
+            {
+              bricks[bricks_count].id = bricks_count;
+            }
+        }
+      else
+        {
+          line_bricks_count =
+            parse_grid_row (text, line_begin, line_end, &map_layout, row,
+                            bricks_count, bricks ? bricks + bricks_count : 0);
+          ++row;
+        }
+
+      if (line_bricks_count < 0)
+        {
+          if (error_line)
+            {
+              *error_line = line;
+            }
+          return -1;
+        }
+
+      bricks_count += line_bricks_count;
+      line_begin = line_end + 1;
+    }
+
+  return bricks_count;
+}
+
+
+// Reads "option value" pairs into config, leaving the options the text
+// doesn't mention alone. Returns 0 with the offending word between
+// *error_begin and *error_end on an unknown option or a missing value.
+constexpr int
+parse_config (const char *text, int text_size, Config *config,
+              int *error_begin, int *error_end)
+{
+  int pos = 0;
+
+  for (;;)
+    {
+      while (pos < text_size && is_blank (text[pos]))
+        {
+          ++pos;
+        }
+
+      if (pos == text_size)
+        {
+          return 1;
+        }
+
+      int option_begin = pos;
+      while (pos < text_size && !is_blank (text[pos]))
+        {
+          ++pos;
+        }
+      int option_end = pos;
+
+      float *option = 0;
+      int *int_option = 0;
+
+      if (text_equals (text, option_begin, option_end, "split_time"))
+        {
+          option = &config->split_time;
+        }
+      else if (text_equals (text, option_begin, option_end, "glue_time"))
+        {
+          option = &config->glue_time;
+        }
+      else if (text_equals (text, option_begin, option_end, "shooter_time"))
+        {
+          option = &config->shooter_time;
+        }
+      else if (text_equals (text, option_begin, option_end,
+                            "brick_regen_time"))
+        {
+          option = &config->brick_regen_time;
+        }
+      else if (text_equals (text, option_begin, option_end, "split_chance"))
+        {
+          option = &config->powerup_chances[POWERUP_SPLIT];
+        }
+      else if (text_equals (text, option_begin, option_end, "glue_chance"))
+        {
+          option = &config->powerup_chances[POWERUP_GLUE];
+        }
+      else if (text_equals (text, option_begin, option_end, "shooter_chance"))
+        {
+          option = &config->powerup_chances[POWERUP_SHOOTER];
+        }
+      else if (text_equals (text, option_begin, option_end, "lives_count"))
+        {
+          int_option = &config->lives_count;
+        }
+      else if (text_equals (text, option_begin, option_end, "vsync"))
+        {
+          int_option = &config->vsync;
+        }
+      else if (text_equals (text, option_begin, option_end, "max_fps"))
+        {
+          option = &config->max_fps;
+        }
+      else if (text_equals (text, option_begin, option_end, "idle_fps"))
+        {
+          option = &config->idle_fps;
+        }
+      else if (text_equals (text, option_begin, option_end, "sim_fps"))
+        {
+          option = &config->sim_fps;
+        }
+      else if (text_equals (text, option_begin, option_end, "max_queued_frames"))
+        {
+          int_option = &config->max_queued_frames;
+        }
+      else if (text_equals (text, option_begin, option_end, "measure_latency"))
+        {
+          int_option = &config->measure_latency;
+        }
+      else if (text_equals (text, option_begin, option_end, "capture_fps"))
+        {
+          int_option = &config->capture_fps;
+        }
+      else if (text_equals (text, option_begin, option_end, "render_stats"))
+        {
+          int_option = &config->render_stats;
+        }
+      else if (text_equals (text, option_begin, option_end, "fullscreen"))
+        {
+          int_option = &config->fullscreen;
+        }
+      else if (text_equals (text, option_begin, option_end, "render_scale"))
+        {
+          option = &config->render_scale;
+        }
+      else if (text_equals (text, option_begin, option_end, "upscale_filter"))
+        {
+          int_option = &config->upscale_filter;
+        }
+      else if (text_equals (text, option_begin, option_end,
+                            "dynamic_resolution"))
+        {
+          int_option = &config->dynamic_resolution;
+        }
+      else if (text_equals (text, option_begin, option_end,
+                            "min_render_scale"))
+        {
+          option = &config->min_render_scale;
+        }
+      else if (text_equals (text, option_begin, option_end, "autoplay"))
+        {
+          int_option = &config->autoplay;
+        }
+
+      float value = 0;
+
+      if ((!option && !int_option) ||
+          !parse_float (text, text_size, &pos, &value))
+        {
+          *error_begin = option_begin;
+          *error_end = option_end;
+          return 0;
+        }
+
+      if (option)
+        {
+          *option = value;
+        }
+      else
+        {
+          *int_option = value;
+        }
+    }
+}
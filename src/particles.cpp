@@ -0,0 +1,469 @@
+/* Bricks Game - Particles
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Debris, sparks and bursts. They are only for show, so they live with
+// the renderer: the simulation just notes where an effect goes off, in
+// a ring of emissions each snapshot carries, and the renderer spawns
+// the particles of every emission it hasn't seen yet. The ring covers
+// the snapshots the renderer may skip.
+//
+// Particles are kept as a structure of arrays in a pool of fixed size,
+// allocated once, so the update runs down whole arrays in vectors and
+// the arrays go to the GPU as they are, one attribute each, for a
+// single draw of points. A point is one vertex where a quad would be
+// four, and particles are small squares anyway. A dead particle takes
+// the place of the last one, so the live ones stay packed at the front.
+// When the pool is full, new particles are dropped.
+
+#define PARTICLES_MAX 65536
+#define PARTICLE_EMISSIONS_MAX 256
+#define PARTICLE_GRAVITY -2.0
+// Per second, of the velocity.
+#define PARTICLE_DRAG 1.5
+// Particles fade out over the last of their life.
+#define PARTICLE_FADE_TIME 0.3
+// Longer gaps between updates, like a pause, don't move particles on.
+#define PARTICLE_MAX_DT 0.1
+
+enum ParticleEffect {
+  PARTICLE_DEBRIS,
+  PARTICLE_SPARKS,
+  PARTICLE_BURST,
+  PARTICLE_EFFECT_ENUM_LENGTH,
+};
+
+struct ParticleEffectInfo {
+  int count;
+  float speed_min, speed_max;
+  float life_min, life_max;
+  float size_min, size_max;
+  // How much lighter or darker than the emission's color a particle
+  // may be.
+  float shade;
+};
+
+// Debris comes from all over the brick, the others from its middle.
+static const ParticleEffectInfo particle_effects[] = {
+  {48, 0.2, 0.9, 0.6, 1.2, 0.008, 0.02, 0.2},
+  {12, 0.6, 1.5, 0.15, 0.35, 0.004, 0.008, 0.1},
+  {64, 0.4, 1.2, 0.4, 0.7, 0.006, 0.012, 0.1},
+};
+
+struct ParticleEmission {
+  ParticleEffect effect;
+  V2 pos;
+  V2 dim;
+  Color color;
+};
+
+// Emission n is in items[n % PARTICLE_EMISSIONS_MAX]; count only goes
+// up, so a reader can tell which it has seen.
+struct ParticleEmissions {
+  int count;
+  ParticleEmission items[PARTICLE_EMISSIONS_MAX];
+};
+
+enum ParticleAttribute {
+  PARTICLE_ATTRIBUTE_X,
+  PARTICLE_ATTRIBUTE_Y,
+  PARTICLE_ATTRIBUTE_LIFE,
+  PARTICLE_ATTRIBUTE_SIZE,
+  PARTICLE_ATTRIBUTE_COLOR,
+  PARTICLE_ATTRIBUTE_ENUM_LENGTH,
+};
+
+static const char *particle_attribute_names[PARTICLE_ATTRIBUTE_ENUM_LENGTH] = {
+  "x",
+  "y",
+  "life",
+  "size",
+  "color",
+};
+
+struct Particles {
+  int count;
+  // PARTICLES_MAX each. life is the seconds left and size half the
+  // width.
+  float *x;
+  float *y;
+  float *vx;
+  float *vy;
+  float *life;
+  float *size;
+  GLubyte *colors;
+
+  Random random;
+  // When the particles were last moved on, on the clock of get_seconds,
+  // or -1 if never.
+  double time;
+  int emissions_seen;
+
+  GLuint program;
+  GLuint buffer;
+  GLint fade_time_location;
+  GLint pixels_per_unit_location;
+};
+
+static const char *particle_vertex_shader = R"GLSL(
+#version 120
+
+uniform float fade_time;
+uniform float pixels_per_unit;
+
+attribute float x;
+attribute float y;
+attribute float life;
+attribute float size;
+attribute vec4 color;
+
+varying vec4 v_color;
+
+void
+main ()
+{
+  v_color = vec4 (color.rgb, color.a * clamp (life / fade_time, 0.0, 1.0));
+  gl_Position = gl_ModelViewProjectionMatrix * vec4 (x, y, 0, 1);
+  gl_PointSize = size * 2 * pixels_per_unit;
+}
+)GLSL";
+
+static const char *particle_fragment_shader = R"GLSL(
+#version 120
+
+varying vec4 v_color;
+
+void
+main ()
+{
+  gl_FragColor = v_color;
+}
+)GLSL";
+
+
+static void
+emit_particles (ParticleEmissions *emissions, ParticleEffect effect,
+                V2 pos, V2 dim, Color color)
+{
+  ParticleEmission *emission =
+    emissions->items + emissions->count % PARTICLE_EMISSIONS_MAX;
+  emission->effect = effect;
+  emission->pos = pos;
+  emission->dim = dim;
+  emission->color = color;
+  ++emissions->count;
+}
+
+
+// Only the pool; drawing needs init_particle_drawing too.
+static void
+init_particles (Particles *particles, uint64_t seed)
+{
+  *particles = {};
+  particles->x = new float[PARTICLES_MAX];
+  particles->y = new float[PARTICLES_MAX];
+  particles->vx = new float[PARTICLES_MAX];
+  particles->vy = new float[PARTICLES_MAX];
+  particles->life = new float[PARTICLES_MAX];
+  particles->size = new float[PARTICLES_MAX];
+  particles->colors = new GLubyte[PARTICLES_MAX * 4];
+  particles->random.state = seed;
+  particles->time = -1;
+}
+
+
+// Needs a current GL context and load_gl_functions.
+static void
+init_particle_drawing (Particles *particles)
+{
+  GLuint vertex_shader = compile_shader (GL_VERTEX_SHADER,
+                                         particle_vertex_shader);
+  GLuint fragment_shader = compile_shader (GL_FRAGMENT_SHADER,
+                                           particle_fragment_shader);
+
+  particles->program = gl.CreateProgram ();
+  gl.AttachShader (particles->program, vertex_shader);
+  gl.AttachShader (particles->program, fragment_shader);
+
+  for (int attribute = 0;
+       attribute < PARTICLE_ATTRIBUTE_ENUM_LENGTH;
+       ++attribute)
+    {
+      gl.BindAttribLocation (particles->program, attribute,
+                             particle_attribute_names[attribute]);
+    }
+
+  gl.LinkProgram (particles->program);
+  gl.DeleteShader (vertex_shader);
+  gl.DeleteShader (fragment_shader);
+
+  GLint linked = 0;
+  gl.GetProgramiv (particles->program, GL_LINK_STATUS, &linked);
+
+  if (!linked)
+    {
+      char log[1024];
+      gl.GetProgramInfoLog (particles->program, sizeof (log), 0, log);
+      cerr << "Error: Can't link shader program: " << log << endl;
+      exit (1);
+    }
+
+  particles->fade_time_location =
+    gl.GetUniformLocation (particles->program, "fade_time");
+  particles->pixels_per_unit_location =
+    gl.GetUniformLocation (particles->program, "pixels_per_unit");
+
+  gl.GenBuffers (1, &particles->buffer);
+}
+
+
+static void
+free_particles (Particles *particles)
+{
+  if (particles->program)
+    {
+      gl.DeleteProgram (particles->program);
+      gl.DeleteBuffers (1, &particles->buffer);
+    }
+
+  delete[] particles->x;
+  delete[] particles->y;
+  delete[] particles->vx;
+  delete[] particles->vy;
+  delete[] particles->life;
+  delete[] particles->size;
+  delete[] particles->colors;
+  *particles = {};
+}
+
+
+static float
+random_range (Random *random, float min, float max)
+{
+  return min + (max - min) * random_float (random);
+}
+
+
+static void
+spawn_particles (Particles *particles, ParticleEmission *emission)
+{
+  const ParticleEffectInfo *info = particle_effects + emission->effect;
+  Random *random = &particles->random;
+  int count = min (info->count, PARTICLES_MAX - particles->count);
+
+  for (int i = particles->count; i < particles->count + count; ++i)
+    {
+      V2 offset = {0, 0};
+      if (emission->effect == PARTICLE_DEBRIS)
+        {
+          offset.x = (random_float (random) - 0.5f) * emission->dim.x;
+          offset.y = (random_float (random) - 0.5f) * emission->dim.y;
+        }
+
+      float angle = random_float (random) * M_PI * 2;
+      float speed = random_range (random, info->speed_min, info->speed_max);
+      float shade = 1 + (random_float (random) * 2 - 1) * info->shade;
+
+      particles->x[i] = emission->pos.x + offset.x;
+      particles->y[i] = emission->pos.y + offset.y;
+      particles->vx[i] = cosf (angle) * speed;
+      particles->vy[i] = sinf (angle) * speed;
+      particles->life[i] = random_range (random, info->life_min,
+                                         info->life_max);
+      particles->size[i] = random_range (random, info->size_min,
+                                         info->size_max);
+
+      float rgb[] = {emission->color.r, emission->color.g, emission->color.b};
+      GLubyte *color = particles->colors + i * 4;
+      for (int channel = 0; channel < 3; ++channel)
+        {
+          color[channel] = get_color_byte (rgb[channel] * shade);
+        }
+      color[3] = get_color_byte (emission->color.a);
+    }
+
+  particles->count += count;
+}
+
+
+// Spawns what was emitted since the last call.
+static void
+spawn_emitted_particles (Particles *particles, ParticleEmissions *emissions)
+{
+  // The count goes back down when the game's state starts over.
+  if (emissions->count < particles->emissions_seen)
+    {
+      particles->emissions_seen = emissions->count;
+    }
+
+  int first = max (particles->emissions_seen,
+                   emissions->count - PARTICLE_EMISSIONS_MAX);
+
+  for (int index = first; index < emissions->count; ++index)
+    {
+      spawn_particles (particles,
+                       emissions->items + index % PARTICLE_EMISSIONS_MAX);
+    }
+
+  particles->emissions_seen = emissions->count;
+}
+
+
+// Gravity, then drag, then velocity, for particles begin to end. drag
+// is the factor velocities keep over dt. This is the reference
+// move_particles is benchmarked against.
+static void
+move_particles_scalar (Particles *particles, int begin, int end, float dt,
+                       float drag)
+{
+  float *x = particles->x;
+  float *y = particles->y;
+  float *vx = particles->vx;
+  float *vy = particles->vy;
+  float *life = particles->life;
+  float gravity = PARTICLE_GRAVITY * dt;
+
+  for (int i = begin; i < end; ++i)
+    {
+      vx[i] *= drag;
+      vy[i] = (vy[i] + gravity) * drag;
+      x[i] += vx[i] * dt;
+      y[i] += vy[i] * dt;
+      life[i] -= dt;
+    }
+}
+
+
+// The same, an array at a time with the float batch forms.
+static void
+move_particles (Particles *particles, float dt, float drag)
+{
+  int count = particles->count;
+  shift_scale_floats (particles->vx, count, 0, drag);
+  shift_scale_floats (particles->vy, count, PARTICLE_GRAVITY * dt, drag);
+  add_scaled_floats (particles->x, particles->vx, dt, count);
+  add_scaled_floats (particles->y, particles->vy, dt, count);
+  shift_scale_floats (particles->life, count, -dt, 1);
+}
+
+
+// Moves every particle on to now and removes the dead ones.
+static void
+update_particles (Particles *particles, double now)
+{
+  float dt = particles->time >= 0 ? now - particles->time : 0;
+  particles->time = now;
+
+  if (dt <= 0 || dt > PARTICLE_MAX_DT)
+    {
+      return;
+    }
+
+  move_particles (particles, dt, expf (-PARTICLE_DRAG * dt));
+
+  float *life = particles->life;
+  for (int i = 0; i < particles->count; ++i)
+    {
+      if (life[i] <= 0)
+        {
+          int last = --particles->count;
+          particles->x[i] = particles->x[last];
+          particles->y[i] = particles->y[last];
+          particles->vx[i] = particles->vx[last];
+          particles->vy[i] = particles->vy[last];
+          particles->life[i] = particles->life[last];
+          particles->size[i] = particles->size[last];
+          memcpy (particles->colors + i * 4, particles->colors + last * 4, 4);
+          --i;
+        }
+    }
+}
+
+
+// Draws every particle as a square, with the current transform and
+// viewport.
+static void
+draw_particles (Particles *particles)
+{
+  int count = particles->count;
+  if (!count)
+    {
+      return;
+    }
+
+  // Point sizes are in pixels, so they need the scale the transform
+  // and the viewport put on the level.
+  GLfloat modelview[16];
+  GLint viewport[4];
+  glGetFloatv (GL_MODELVIEW_MATRIX, modelview);
+  glGetIntegerv (GL_VIEWPORT, viewport);
+
+  gl.UseProgram (particles->program);
+  gl.Uniform1f (particles->fade_time_location, PARTICLE_FADE_TIME);
+  gl.Uniform1f (particles->pixels_per_unit_location,
+                modelview[5] * viewport[3] / 2);
+  glEnable (GL_VERTEX_PROGRAM_POINT_SIZE);
+
+  // The arrays go one after another in one buffer, orphaned first as in
+  // flush_shapes.
+  struct {
+    const void *data;
+    int size;
+    GLenum type;
+  } attributes[] = {
+    {particles->x, 1, GL_FLOAT},
+    {particles->y, 1, GL_FLOAT},
+    {particles->life, 1, GL_FLOAT},
+    {particles->size, 1, GL_FLOAT},
+    {particles->colors, 4, GL_UNSIGNED_BYTE},
+  };
+
+  int array_size = count * 4;
+  gl.BindBuffer (GL_ARRAY_BUFFER, particles->buffer);
+  gl.BufferData (GL_ARRAY_BUFFER, array_size * PARTICLE_ATTRIBUTE_ENUM_LENGTH,
+                 0, GL_STREAM_DRAW);
+
+  for (int attribute = 0;
+       attribute < PARTICLE_ATTRIBUTE_ENUM_LENGTH;
+       ++attribute)
+    {
+      size_t offset = attribute * array_size;
+      gl.BufferSubData (GL_ARRAY_BUFFER, offset, array_size,
+                        attributes[attribute].data);
+      gl.EnableVertexAttribArray (attribute);
+      gl.VertexAttribPointer (attribute,
+                              attributes[attribute].size,
+                              attributes[attribute].type,
+                              attributes[attribute].type == GL_UNSIGNED_BYTE,
+                              0, (void *) offset);
+    }
+
+  glDrawArrays (GL_POINTS, 0, count);
+  count_draw_call (count);
+  count_state_changes (4);
+
+  for (int attribute = 0;
+       attribute < PARTICLE_ATTRIBUTE_ENUM_LENGTH;
+       ++attribute)
+    {
+      gl.DisableVertexAttribArray (attribute);
+    }
+
+  glDisable (GL_VERTEX_PROGRAM_POINT_SIZE);
+  gl.BindBuffer (GL_ARRAY_BUFFER, 0);
+  gl.UseProgram (0);
+}
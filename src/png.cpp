@@ -0,0 +1,631 @@
+/* Bricks Game - PNG Reading
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Decoding the PNGs sprites are drawn in: 8 bits a channel, gray, gray
+// and alpha, RGB, RGBA or a palette, not interlaced. Any of them comes
+// out as RGBA, top row first.
+//
+// Inflate is written out here, after zlib's puff, rather than linking
+// zlib for a few small images. It decodes one symbol a bit at a time,
+// which is slow but only ever runs when the sprite atlas is rebuilt.
+
+#define PNG_MAX_SIDE 8192
+
+enum PngColorType {
+  PNG_GRAY = 0,
+  PNG_RGB = 2,
+  PNG_PALETTE = 3,
+  PNG_GRAY_ALPHA = 4,
+  PNG_RGBA = 6,
+};
+
+struct Inflate {
+  const unsigned char *in;
+  size_t in_size;
+  size_t in_pos;
+  uint32_t bits;
+  int bits_count;
+
+  unsigned char *out;
+  size_t out_size;
+  size_t out_pos;
+  // Set when the input runs out early or is not valid deflate data.
+  int error;
+};
+
+// Canonical Huffman codes, given by how many codes there are of each
+// length and the symbols in code order.
+struct InflateCodes {
+  short counts[16];
+  short symbols[288];
+};
+
+
+static int
+get_inflate_bits (Inflate *inflate, int count)
+{
+  while (inflate->bits_count < count)
+    {
+      if (inflate->in_pos == inflate->in_size)
+        {
+          inflate->error = 1;
+          return 0;
+        }
+
+      inflate->bits |= (uint32_t) inflate->in[inflate->in_pos++]
+                       << inflate->bits_count;
+      inflate->bits_count += 8;
+    }
+
+  int value = inflate->bits & ((1u << count) - 1);
+  inflate->bits >>= count;
+  inflate->bits_count -= count;
+  return value;
+}
+
+
+// Returns 0 if lengths give more codes than there is room for. Fewer
+// is fine, as some encoders leave distance codes unused.
+static int
+make_inflate_codes (InflateCodes *codes, const short *lengths,
+                    int symbols_count)
+{
+  memset (codes->counts, 0, sizeof (codes->counts));
+  for (int symbol = 0; symbol < symbols_count; ++symbol)
+    {
+      ++codes->counts[lengths[symbol]];
+    }
+
+  int left = 1;
+  for (int length = 1; length < 16; ++length)
+    {
+      left = left * 2 - codes->counts[length];
+      if (left < 0)
+        {
+          return 0;
+        }
+    }
+
+  short offsets[16];
+  offsets[1] = 0;
+  for (int length = 1; length < 15; ++length)
+    {
+      offsets[length + 1] = offsets[length] + codes->counts[length];
+    }
+
+  for (int symbol = 0; symbol < symbols_count; ++symbol)
+    {
+      if (lengths[symbol])
+        {
+          codes->symbols[offsets[lengths[symbol]]++] = symbol;
+        }
+    }
+
+  return 1;
+}
+
+
+// Returns the next symbol, or -1 if there's no such code.
+static int
+decode_inflate_symbol (Inflate *inflate, InflateCodes *codes)
+{
+  int code = 0;
+  int first = 0;
+  int index = 0;
+
+  for (int length = 1; length < 16; ++length)
+    {
+      code |= get_inflate_bits (inflate, 1);
+      int count = codes->counts[length];
+
+      if (code - count < first)
+        {
+          return codes->symbols[index + (code - first)];
+        }
+
+      index += count;
+      first = (first + count) << 1;
+      code <<= 1;
+    }
+
+  return -1;
+}
+
+
+static void
+inflate_stored_block (Inflate *inflate)
+{
+  inflate->bits = 0;
+  inflate->bits_count = 0;
+
+  if (inflate->in_pos + 4 > inflate->in_size)
+    {
+      inflate->error = 1;
+      return;
+    }
+
+  const unsigned char *header = inflate->in + inflate->in_pos;
+  size_t length = header[0] | header[1] << 8;
+  size_t length_complement = header[2] | header[3] << 8;
+  inflate->in_pos += 4;
+
+  if (length != (~length_complement & 0xffff) ||
+      inflate->in_pos + length > inflate->in_size ||
+      inflate->out_pos + length > inflate->out_size)
+    {
+      inflate->error = 1;
+      return;
+    }
+
+  memcpy (inflate->out + inflate->out_pos, inflate->in + inflate->in_pos,
+          length);
+  inflate->in_pos += length;
+  inflate->out_pos += length;
+}
+
+
+static void
+inflate_coded_block (Inflate *inflate, InflateCodes *lengths_codes,
+                     InflateCodes *distances_codes)
+{
+  static const short length_bases[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+  };
+  static const short length_extra_bits[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+  };
+  static const short distance_bases[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577,
+  };
+  static const short distance_extra_bits[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+  };
+
+  while (!inflate->error)
+    {
+      int symbol = decode_inflate_symbol (inflate, lengths_codes);
+
+      if (symbol < 0 || symbol > 285)
+        {
+          inflate->error = 1;
+        }
+      else if (symbol < 256)
+        {
+          if (inflate->out_pos == inflate->out_size)
+            {
+              inflate->error = 1;
+              return;
+            }
+          inflate->out[inflate->out_pos++] = symbol;
+        }
+      else if (symbol == 256)
+        {
+          return;
+        }
+      else
+        {
+          symbol -= 257;
+          size_t length = (length_bases[symbol] +
+                           get_inflate_bits (inflate,
+                                             length_extra_bits[symbol]));
+
+          symbol = decode_inflate_symbol (inflate, distances_codes);
+          if (symbol < 0 || symbol >= 30)
+            {
+              inflate->error = 1;
+              return;
+            }
+
+          size_t distance = (distance_bases[symbol] +
+                             get_inflate_bits (inflate,
+                                               distance_extra_bits[symbol]));
+
+          if (distance > inflate->out_pos ||
+              inflate->out_pos + length > inflate->out_size)
+            {
+              inflate->error = 1;
+              return;
+            }
+
+          // The copy may overlap what it writes, repeating it.
+          unsigned char *out = inflate->out + inflate->out_pos;
+          for (size_t index = 0; index < length; ++index)
+            {
+              out[index] = out[(ptrdiff_t) index - (ptrdiff_t) distance];
+            }
+          inflate->out_pos += length;
+        }
+    }
+}
+
+
+static void
+inflate_fixed_block (Inflate *inflate)
+{
+  static InflateCodes lengths_codes;
+  static InflateCodes distances_codes;
+  static int made;
+
+  if (!made)
+    {
+      short lengths[288];
+      for (int symbol = 0; symbol < 288; ++symbol)
+        {
+          lengths[symbol] = (symbol < 144 ? 8 :
+                             symbol < 256 ? 9 :
+                             symbol < 280 ? 7 : 8);
+        }
+      make_inflate_codes (&lengths_codes, lengths, 288);
+
+      for (int symbol = 0; symbol < 30; ++symbol)
+        {
+          lengths[symbol] = 5;
+        }
+      make_inflate_codes (&distances_codes, lengths, 30);
+      made = 1;
+    }
+
+  inflate_coded_block (inflate, &lengths_codes, &distances_codes);
+}
+
+
+static void
+inflate_dynamic_block (Inflate *inflate)
+{
+  static const short order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+  };
+
+  int lengths_count = get_inflate_bits (inflate, 5) + 257;
+  int distances_count = get_inflate_bits (inflate, 5) + 1;
+  int code_lengths_count = get_inflate_bits (inflate, 4) + 4;
+
+  if (lengths_count > 286 || distances_count > 30)
+    {
+      inflate->error = 1;
+      return;
+    }
+
+  short lengths[320] = {};
+  for (int index = 0; index < code_lengths_count; ++index)
+    {
+      lengths[order[index]] = get_inflate_bits (inflate, 3);
+    }
+
+  InflateCodes lengths_codes;
+  InflateCodes distances_codes;
+
+  if (!make_inflate_codes (&lengths_codes, lengths, 19))
+    {
+      inflate->error = 1;
+      return;
+    }
+
+  // The code lengths of both codes in one run, which repeats may cross.
+  int count = lengths_count + distances_count;
+  int index = 0;
+
+  while (index < count && !inflate->error)
+    {
+      int symbol = decode_inflate_symbol (inflate, &lengths_codes);
+      if (symbol < 0)
+        {
+          inflate->error = 1;
+          return;
+        }
+
+      if (symbol < 16)
+        {
+          lengths[index++] = symbol;
+          continue;
+        }
+
+      short length = 0;
+      int repeat;
+
+      if (symbol == 16)
+        {
+          if (index == 0)
+            {
+              inflate->error = 1;
+              return;
+            }
+          length = lengths[index - 1];
+          repeat = 3 + get_inflate_bits (inflate, 2);
+        }
+      else if (symbol == 17)
+        {
+          repeat = 3 + get_inflate_bits (inflate, 3);
+        }
+      else
+        {
+          repeat = 11 + get_inflate_bits (inflate, 7);
+        }
+
+      if (index + repeat > count)
+        {
+          inflate->error = 1;
+          return;
+        }
+
+      while (repeat--)
+        {
+          lengths[index++] = length;
+        }
+    }
+
+  if (inflate->error || lengths[256] == 0 ||
+      !make_inflate_codes (&lengths_codes, lengths, lengths_count) ||
+      !make_inflate_codes (&distances_codes, lengths + lengths_count,
+                           distances_count))
+    {
+      inflate->error = 1;
+      return;
+    }
+
+  inflate_coded_block (inflate, &lengths_codes, &distances_codes);
+}
+
+
+// Inflates a zlib stream into out, which it should fill exactly.
+// Returns 0 if it doesn't.
+static int
+inflate_zlib (const unsigned char *in, size_t in_size,
+              unsigned char *out, size_t out_size)
+{
+  if (in_size < 2 || (in[0] & 0x0f) != 8 || (in[0] << 8 | in[1]) % 31 ||
+      (in[1] & 0x20))
+    {
+      return 0;
+    }
+
+  Inflate inflate = {};
+  inflate.in = in;
+  inflate.in_size = in_size;
+  inflate.in_pos = 2;
+  inflate.out = out;
+  inflate.out_size = out_size;
+
+  int last = 0;
+
+  while (!last && !inflate.error)
+    {
+      last = get_inflate_bits (&inflate, 1);
+      int type = get_inflate_bits (&inflate, 2);
+
+      switch (type)
+        {
+        case 0: inflate_stored_block (&inflate); break;
+        case 1: inflate_fixed_block (&inflate); break;
+        case 2: inflate_dynamic_block (&inflate); break;
+        default: inflate.error = 1;
+        }
+    }
+
+  return !inflate.error && inflate.out_pos == out_size;
+}
+
+
+static uint32_t
+get_u32_be (const unsigned char *bytes)
+{
+  return ((uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 |
+          (uint32_t) bytes[2] << 8 | bytes[3]);
+}
+
+
+static int
+paeth_predictor (int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = abs (p - a);
+  int pb = abs (p - b);
+  int pc = abs (p - c);
+
+  if (pa <= pb && pa <= pc)
+    {
+      return a;
+    }
+  return pb <= pc ? b : c;
+}
+
+
+// Undoes each row's filter in place. Rows are stride bytes after their
+// filter byte, and pixels pixel_size bytes.
+static int
+unfilter_png (unsigned char *data, int height, int stride, int pixel_size)
+{
+  unsigned char *previous = 0;
+
+  for (int y = 0; y < height; ++y)
+    {
+      int filter = data[0];
+      unsigned char *row = data + 1;
+
+      for (int x = 0; x < stride; ++x)
+        {
+          int left = x >= pixel_size ? row[x - pixel_size] : 0;
+          int up = previous ? previous[x] : 0;
+          int up_left = previous && x >= pixel_size ?
+                        previous[x - pixel_size] : 0;
+
+          switch (filter)
+            {
+            case 0: break;
+            case 1: row[x] += left; break;
+            case 2: row[x] += up; break;
+            case 3: row[x] += (left + up) / 2; break;
+            case 4: row[x] += paeth_predictor (left, up, up_left); break;
+            default: return 0;
+            }
+        }
+
+      previous = row;
+      data += stride + 1;
+    }
+
+  return 1;
+}
+
+
+// Returns the pixels, new[]ed, or 0 if data isn't a PNG this reads.
+static unsigned char *
+decode_png (const unsigned char *data, size_t size, int *width, int *height)
+{
+  static const unsigned char signature[8] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+  };
+
+  if (size < 8 || memcmp (data, signature, 8) != 0)
+    {
+      return 0;
+    }
+
+  int color_type = -1;
+  unsigned char palette[256][4];
+  int palette_count = 0;
+  string compressed;
+
+  *width = 0;
+  *height = 0;
+  memset (palette, 0xff, sizeof (palette));
+
+  size_t pos = 8;
+  int ended = 0;
+
+  while (!ended && pos + 12 <= size)
+    {
+      uint32_t length = get_u32_be (data + pos);
+      const unsigned char *type = data + pos + 4;
+      const unsigned char *chunk = data + pos + 8;
+
+      if (length > size - pos - 12)
+        {
+          return 0;
+        }
+
+      if (memcmp (type, "IHDR", 4) == 0 && length == 13)
+        {
+          *width = get_u32_be (chunk);
+          *height = get_u32_be (chunk + 4);
+          color_type = chunk[9];
+
+          // Bit depth, compression, filter and interlace methods.
+          if (chunk[8] != 8 || chunk[10] || chunk[11] || chunk[12])
+            {
+              return 0;
+            }
+        }
+      else if (memcmp (type, "PLTE", 4) == 0)
+        {
+          palette_count = min ((int) length / 3, 256);
+          for (int index = 0; index < palette_count; ++index)
+            {
+              memcpy (palette[index], chunk + index * 3, 3);
+            }
+        }
+      else if (memcmp (type, "tRNS", 4) == 0 && color_type == PNG_PALETTE)
+        {
+          for (int index = 0; index < min ((int) length, 256); ++index)
+            {
+              palette[index][3] = chunk[index];
+            }
+        }
+      else if (memcmp (type, "IDAT", 4) == 0)
+        {
+          compressed.append ((const char *) chunk, length);
+        }
+      else if (memcmp (type, "IEND", 4) == 0)
+        {
+          ended = 1;
+        }
+
+      pos += length + 12;
+    }
+
+  int pixel_size;
+  switch (color_type)
+    {
+    case PNG_GRAY: pixel_size = 1; break;
+    case PNG_RGB: pixel_size = 3; break;
+    case PNG_PALETTE: pixel_size = 1; break;
+    case PNG_GRAY_ALPHA: pixel_size = 2; break;
+    case PNG_RGBA: pixel_size = 4; break;
+    default: return 0;
+    }
+
+  if (*width <= 0 || *width > PNG_MAX_SIDE ||
+      *height <= 0 || *height > PNG_MAX_SIDE ||
+      (color_type == PNG_PALETTE && !palette_count))
+    {
+      return 0;
+    }
+
+  int stride = *width * pixel_size;
+  size_t filtered_size = (size_t) (stride + 1) * *height;
+  unsigned char *filtered = new unsigned char[filtered_size];
+
+  if (!inflate_zlib ((const unsigned char *) compressed.data (),
+                     compressed.size (), filtered, filtered_size) ||
+      !unfilter_png (filtered, *height, stride, pixel_size))
+    {
+      delete[] filtered;
+      return 0;
+    }
+
+  unsigned char *rgba = new unsigned char[(size_t) *width * *height * 4];
+  unsigned char *out = rgba;
+
+  for (int y = 0; y < *height; ++y)
+    {
+      unsigned char *in = filtered + (size_t) y * (stride + 1) + 1;
+
+      for (int x = 0; x < *width; ++x, in += pixel_size, out += 4)
+        {
+          switch (color_type)
+            {
+            case PNG_GRAY:
+              out[0] = out[1] = out[2] = in[0];
+              out[3] = 0xff;
+              break;
+            case PNG_RGB:
+              memcpy (out, in, 3);
+              out[3] = 0xff;
+              break;
+            case PNG_PALETTE:
+              memcpy (out, palette[in[0]], 4);
+              break;
+            case PNG_GRAY_ALPHA:
+              out[0] = out[1] = out[2] = in[0];
+              out[3] = in[1];
+              break;
+            case PNG_RGBA:
+              memcpy (out, in, 4);
+              break;
+            }
+        }
+    }
+
+  delete[] filtered;
+  return rgba;
+}
@@ -0,0 +1,52 @@
+/* Bricks Game - Random Numbers
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// SplitMix64. Unlike rand () it gives the same sequence for a seed on
+// every platform, so a seed is enough to reproduce a generated level.
+
+#include <stdint.h>
+
+struct Random {
+  uint64_t state;
+};
+
+
+static uint64_t
+random_next (Random *random)
+{
+  uint64_t z = (random->state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+
+// In [0, 1).
+static float
+random_float (Random *random)
+{
+  return (random_next (random) >> 40) / (float) (1 << 24);
+}
+
+
+// In [0, count).
+static int
+random_int (Random *random, int count)
+{
+  return (int) ((random_next (random) >> 32) * count >> 32);
+}
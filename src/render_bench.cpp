@@ -0,0 +1,571 @@
+/* Bricks Game - Render Benchmark
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Run with "bricks --render-bench". A scripted game, with a fixed seed,
+// step and input, is drawn frame by frame to an offscreen framebuffer,
+// and the time each frame took is reported. A few of the frames are
+// compared with the images in res/golden, which
+// "bricks --render-bench --update-golden" writes anew after a change to
+// how the game looks. "bricks --capture FILE --render-bench" records
+// the frames too, and reports what that costs. Recording paces the
+// frames as the game would, so the writer gets the time it would have.
+//
+// No display or GPU is needed: SDL's offscreen video driver makes an
+// EGL context without a window system, and without a GPU Mesa draws
+// with llvmpipe.
+
+#define RENDER_BENCH_FRAMES 600
+#define RENDER_BENCH_SEED 1
+#define RENDER_BENCH_DT (1.0 / 60)
+#define GOLDEN_DIRECTORY "res/golden"
+// A pixel differs if a channel is off by more than this, and a frame if
+// more than this fraction of its pixels differ. Rasterizers round edges
+// a little differently, which this leaves room for.
+#define GOLDEN_CHANNEL_TOLERANCE 8
+#define GOLDEN_PIXELS_TOLERANCE 0.002
+#define PARTICLE_STRESS_COUNT 50000
+#define PARTICLE_STRESS_FRAMES 120
+#define TILES_STRESS_SIDE 8
+#define TILES_STRESS_FRAMES 120
+
+static const int golden_frames[] = {0, 300, 599};
+
+// Reads the target as RGB rows from the top down, as image files have
+// them.
+static void
+read_render_target (RenderTarget *target, unsigned char *pixels)
+{
+  int row_size = target->width * 3;
+
+  glPixelStorei (GL_PACK_ALIGNMENT, 1);
+  glReadPixels (0, 0, target->width, target->height,
+                GL_RGB, GL_UNSIGNED_BYTE, pixels);
+
+  unsigned char *row = new unsigned char[row_size];
+  for (int y = 0; y < target->height / 2; ++y)
+    {
+      unsigned char *top = pixels + y * row_size;
+      unsigned char *bottom = pixels + (target->height - 1 - y) * row_size;
+      memcpy (row, top, row_size);
+      memcpy (top, bottom, row_size);
+      memcpy (bottom, row, row_size);
+    }
+  delete[] row;
+}
+
+
+// Golden images are binary PPM, which anything can view and nothing is
+// needed to write.
+static int
+write_ppm (const char *filepath, unsigned char *pixels, int width, int height)
+{
+  FILE *file = fopen (filepath, "wb");
+  if (!file)
+    {
+      return 0;
+    }
+
+  fprintf (file, "P6\n%d %d\n255\n", width, height);
+  size_t size = (size_t) width * height * 3;
+  int written = fwrite (pixels, 1, size, file) == size;
+  return fclose (file) == 0 && written;
+}
+
+
+// Returns 0 if the file can't be read or isn't width by height.
+static int
+read_ppm (const char *filepath, unsigned char *pixels, int width, int height)
+{
+  FILE *file = fopen (filepath, "rb");
+  if (!file)
+    {
+      return 0;
+    }
+
+  int file_width = 0;
+  int file_height = 0;
+  int max_value = 0;
+  size_t size = (size_t) width * height * 3;
+  int valid = (fscanf (file, "P6 %d %d %d", &file_width, &file_height,
+                       &max_value) == 3 &&
+               file_width == width && file_height == height &&
+               max_value == 255 &&
+               fgetc (file) != EOF &&
+               fread (pixels, 1, size, file) == size);
+
+  fclose (file);
+  return valid;
+}
+
+
+// Returns the number of pixels that differ. Those are marked in diff,
+// which shows the rest of the image dimmed.
+static int
+compare_pixels (unsigned char *pixels, unsigned char *golden,
+                unsigned char *diff, int pixels_count)
+{
+  int differing = 0;
+
+  for (int pixel = 0; pixel < pixels_count; ++pixel)
+    {
+      unsigned char *a = pixels + pixel * 3;
+      unsigned char *b = golden + pixel * 3;
+      int channel_diff = max (abs (a[0] - b[0]),
+                              max (abs (a[1] - b[1]), abs (a[2] - b[2])));
+      unsigned char *d = diff + pixel * 3;
+
+      if (channel_diff > GOLDEN_CHANNEL_TOLERANCE)
+        {
+          ++differing;
+          d[0] = 255;
+          d[1] = 0;
+          d[2] = 255;
+        }
+      else
+        {
+          d[0] = a[0] / 4;
+          d[1] = a[1] / 4;
+          d[2] = a[2] / 4;
+        }
+    }
+
+  return differing;
+}
+
+
+// Plays like someone who isn't very good: goes after the lowest ball
+// coming down, aiming a little off center so it flies off at an angle,
+// and presses shoot now and then to serve and fire.
+static void
+set_render_bench_input (GameState *game_state, int frame)
+{
+  Paddle *paddle = &game_state->paddle;
+  float offset = ((frame / 90) % 2 ? 0.3 : -0.3) * paddle->dim.x / 2;
+  float target = sinf (frame * 0.03) * 0.6;
+  float lowest = INFINITY;
+
+  for (int ball_index = 0;
+       ball_index < game_state->balls_count;
+       ++ball_index)
+    {
+      Ball *ball = game_state->balls + ball_index;
+
+      if (ball_index != paddle->caught_ball && ball->dir.y < 0 &&
+          ball->pos.y < lowest)
+        {
+          lowest = ball->pos.y;
+          target = ball->pos.x + offset;
+        }
+    }
+
+  game_state->input_left = target < paddle->pos.x - paddle->dim.x / 8;
+  game_state->input_right = target > paddle->pos.x + paddle->dim.x / 8;
+  game_state->input_shoot = frame % 20 == 0;
+}
+
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+
+// Sorts times in place.
+static void
+print_render_times (const char *name, double *times, int count)
+{
+  double total = 0;
+  for (int index = 0; index < count; ++index)
+    {
+      total += times[index];
+    }
+
+  qsort (times, count, sizeof (double), compare_doubles);
+  printf ("  %-12s %8.3f  %8.3f  %8.3f  %8.3f\n", name,
+          total / count * 1e3, times[count / 2] * 1e3,
+          times[min (count - 1, count * 95 / 100)] * 1e3,
+          times[count - 1] * 1e3);
+}
+
+
+// Keeps PARTICLE_STRESS_COUNT particles going, topped up with debris
+// over the top half of the view, and times moving them on and drawing
+// them on their own.
+static void
+run_particle_stress (Particles *particles)
+{
+  double *update_times = new double[PARTICLE_STRESS_FRAMES];
+  double *draw_times = new double[PARTICLE_STRESS_FRAMES];
+  ParticleEmission emission = {PARTICLE_DEBRIS, {0, 0.5}, {2, 1},
+                               {1, 0.6, 0.4}};
+  int emission_count = particle_effects[PARTICLE_DEBRIS].count;
+
+  glMatrixMode (GL_MODELVIEW);
+  glLoadIdentity ();
+
+  for (int frame = 0; frame < PARTICLE_STRESS_FRAMES; ++frame)
+    {
+      while (particles->count + emission_count <= PARTICLE_STRESS_COUNT)
+        {
+          spawn_particles (particles, &emission);
+        }
+
+      double begin = get_seconds ();
+      update_particles (particles, frame * RENDER_BENCH_DT);
+      double updated = get_seconds ();
+
+      glClear (GL_COLOR_BUFFER_BIT);
+      draw_particles (particles);
+      glFinish ();
+
+      update_times[frame] = updated - begin;
+      draw_times[frame] = get_seconds () - updated;
+    }
+
+  cout << "Particles, " << PARTICLE_STRESS_COUNT << " live:" << endl;
+  cout << "               mean ms    p50 ms    p95 ms    max ms" << endl;
+  print_render_times ("update", update_times + 1,
+                      PARTICLE_STRESS_FRAMES - 1);
+  print_render_times ("draw", draw_times + 1, PARTICLE_STRESS_FRAMES - 1);
+
+  delete[] update_times;
+  delete[] draw_times;
+}
+
+
+// Steps a grid of TILES_STRESS_SIDE x TILES_STRESS_SIDE games on one
+// thread and then on every CPU, and times drawing them all, size_pixels
+// wide, as "bricks --tiles" does.
+static void
+run_tiles_stress (ShapeBatch *shapes, int size_pixels)
+{
+  double *serial_times = new double[TILES_STRESS_FRAMES];
+  double *step_times = new double[TILES_STRESS_FRAMES];
+  double *draw_times = new double[TILES_STRESS_FRAMES];
+  RenderCounts counts = {};
+  int threads_count = 0;
+
+  for (int run = 0; run < 2; ++run)
+    {
+      Tiles *tiles = new Tiles;
+      init_tiles (tiles, &embedded_config, "res/map1.txt", TILES_STRESS_SIDE,
+                  RENDER_BENCH_SEED, 0, run == 0 ? 0 : -1);
+      threads_count = tiles->pool.threads_count + 1;
+      double *times = run == 0 ? serial_times : step_times;
+
+      for (int frame = 0; frame < TILES_STRESS_FRAMES; ++frame)
+        {
+          double begin = get_seconds ();
+          step_tiles (tiles, (frame + 1) * RENDER_BENCH_DT, RENDER_BENCH_DT);
+          double stepped = get_seconds ();
+          times[frame] = stepped - begin;
+
+          if (run == 1)
+            {
+              RenderCounts counts_begin = render_counts;
+              glMatrixMode (GL_MODELVIEW);
+              glLoadIdentity ();
+              glClear (GL_COLOR_BUFFER_BIT);
+              draw_tiles (tiles, shapes, size_pixels);
+              glFinish ();
+              draw_times[frame] = get_seconds () - stepped;
+              add_render_counts (&counts,
+                                 subtract_render_counts (render_counts,
+                                                         counts_begin));
+            }
+        }
+
+      free_tiles (tiles);
+      delete tiles;
+    }
+
+  cout << "Tiles, " << TILES_STRESS_SIDE * TILES_STRESS_SIDE << " games "
+       << "in " << (double) counts.draw_calls / TILES_STRESS_FRAMES
+       << " draw calls a frame:" << endl;
+  cout << "               mean ms    p50 ms    p95 ms    max ms" << endl;
+  print_render_times ("step, 1", serial_times + 1, TILES_STRESS_FRAMES - 1);
+  char name[32];
+  snprintf (name, sizeof (name), "step, %d", threads_count);
+  print_render_times (name, step_times + 1, TILES_STRESS_FRAMES - 1);
+  print_render_times ("draw", draw_times + 1, TILES_STRESS_FRAMES - 1);
+
+  delete[] serial_times;
+  delete[] step_times;
+  delete[] draw_times;
+}
+
+
+// Returns the exit code: 1 if a frame doesn't match its golden image.
+// capture_filepath may be 0.
+static int
+run_render_bench (int update_golden, const char *capture_filepath)
+{
+  // The offscreen driver needs SDL 2.0.12. Either can still be
+  // overridden from the environment.
+  SDL_setenv ("SDL_VIDEODRIVER", "offscreen", 0);
+  SDL_setenv ("LIBGL_ALWAYS_SOFTWARE", "1", 0);
+
+  if (SDL_Init (SDL_INIT_VIDEO) != 0)
+    {
+      cerr << "Error: Can't start SDL video: " << SDL_GetError () << endl;
+      return 1;
+    }
+
+  SDL_Window *window =
+    SDL_CreateWindow ("Bricks", SDL_WINDOWPOS_UNDEFINED,
+                      SDL_WINDOWPOS_UNDEFINED, WINDOW_WIDTH, WINDOW_HEIGHT,
+                      SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+  SDL_GLContext gl_context = window ? SDL_GL_CreateContext (window) : 0;
+
+  if (!gl_context)
+    {
+      cerr << "Error: Can't create an OpenGL context: " << SDL_GetError ()
+           << endl;
+      return 1;
+    }
+
+  if (!load_gl_functions ())
+    {
+      cerr << "Error: OpenGL 2.0 with instanced arrays and framebuffer "
+           << "objects is required." << endl;
+      return 1;
+    }
+
+  glEnable (GL_BLEND);
+  glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+  ShapeBatch shapes = {};
+  init_shape_batch (&shapes);
+  Particles particles;
+  init_particles (&particles, RENDER_BENCH_SEED);
+  init_particle_drawing (&particles);
+  Atlas atlas;
+  load_atlas (&atlas);
+  SpriteBatch sprites = {};
+  init_sprite_batch (&sprites, &atlas);
+  Hud hud;
+  init_hud (&hud, WINDOW_WIDTH, WINDOW_HEIGHT * HUD_HEIGHT / 2);
+
+  // Last, as setting up the HUD binds the default framebuffer.
+  RenderTarget target;
+  init_render_target (&target, WINDOW_WIDTH, WINDOW_HEIGHT, GL_NEAREST);
+
+  // The stock config, so a changed config.txt doesn't change the
+  // frames, and no sounds.
+  GameState game_state;
+  init_game_state (&game_state, RENDER_BENCH_SEED);
+  game_state.config = embedded_config;
+  new_game (&game_state);
+  new_level (&game_state, "res/map1.txt");
+  Controls controls = {};
+  Snapshot snapshot = {};
+
+  RenderStats stats;
+  init_render_stats (&stats, 1);
+
+  double *cpu_times = new double[RENDER_BENCH_FRAMES];
+  double *frame_times = new double[RENDER_BENCH_FRAMES];
+  double *gpu_times = new double[RENDER_BENCH_FRAMES];
+  int gpu_times_count = 0;
+  double *capture_times = new double[RENDER_BENCH_FRAMES];
+  int pixels_count = target.width * target.height;
+  unsigned char *pixels = new unsigned char[pixels_count * 3];
+  unsigned char *golden = new unsigned char[pixels_count * 3];
+  unsigned char *diff = new unsigned char[pixels_count * 3];
+  int golden_index = 0;
+  int failed = 0;
+
+  Capture capture = {};
+  FramePacer pacer;
+  init_frame_pacer (&pacer);
+  if (capture_filepath &&
+      !start_capture (&capture, capture_filepath, target.width, target.height,
+                      round (1 / RENDER_BENCH_DT)))
+    {
+      cerr << "Error: Can't write " << capture_filepath << endl;
+      exit (1);
+    }
+
+  cout << "Render benchmark, " << RENDER_BENCH_FRAMES << " frames of "
+       << target.width << "x" << target.height << " on "
+       << glGetString (GL_RENDERER) << ":" << endl;
+
+  for (int frame = 0; frame < RENDER_BENCH_FRAMES; ++frame)
+    {
+      double time = frame * RENDER_BENCH_DT;
+      if (capture_filepath)
+        {
+          wait_next_frame (&pacer, capture.fps, 0);
+        }
+      set_render_bench_input (&game_state, frame);
+      controls.input_left = game_state.input_left;
+      controls.input_right = game_state.input_right;
+
+      if (frame > 0)
+        {
+          step_game (&game_state, 0, "res/map1.txt",
+                     time, RENDER_BENCH_DT);
+        }
+      fill_snapshot (&snapshot, &game_state, time);
+
+      // Drawn from the snapshot as the game would, the frame is timed
+      // on the CPU up to the last GL call and until glFinish returns,
+      // and each pass by the render stats. The first frame compiles
+      // shaders and uploads textures, and some drivers don't time it
+      // right either, so it's left out.
+      stats.enabled = frame > 0;
+      double begin = get_seconds ();
+      begin_render_frame (&stats);
+      draw_snapshot (&snapshot, &controls, time, &shapes, &particles, &hud,
+                     &sprites, &stats);
+      end_render_frame (&stats);
+      double submitted = get_seconds ();
+
+      // The stats come in a few frames late, and the last few only
+      // with finish_render_stats, which leaves them out here.
+      RenderFrameStats *latest = get_render_stats (&stats);
+      if (latest && latest->has_gpu_time &&
+          latest->frame >= gpu_times_count)
+        {
+          gpu_times[gpu_times_count++] = latest->gpu_time;
+        }
+      glFinish ();
+      double finished = get_seconds ();
+
+      cpu_times[frame] = submitted - begin;
+      frame_times[frame] = finished - begin;
+
+      capture_times[frame] = 0;
+      if (capture_filepath)
+        {
+          double capture_begin = get_seconds ();
+          capture_frame (&capture, 0, 0);
+          capture_times[frame] = get_seconds () - capture_begin;
+        }
+
+      if (golden_index < (int) array_len (golden_frames) &&
+          golden_frames[golden_index] == frame)
+        {
+          ++golden_index;
+          char filepath[64];
+          snprintf (filepath, sizeof (filepath),
+                    GOLDEN_DIRECTORY "/frame_%04d.ppm", frame);
+          read_render_target (&target, pixels);
+
+          if (update_golden)
+            {
+              if (!write_ppm (filepath, pixels, target.width, target.height))
+                {
+                  cerr << "Error: Can't write " << filepath << endl;
+                  exit (1);
+                }
+              continue;
+            }
+
+          if (!read_ppm (filepath, golden, target.width, target.height))
+            {
+              cerr << "Error: Can't read " << filepath << endl;
+              failed = 1;
+              continue;
+            }
+
+          int differing = compare_pixels (pixels, golden, diff, pixels_count);
+          if (differing > pixels_count * GOLDEN_PIXELS_TOLERANCE)
+            {
+              char diff_filepath[64];
+              snprintf (diff_filepath, sizeof (diff_filepath),
+                        "frame_%04d_diff.ppm", frame);
+              write_ppm (diff_filepath, diff, target.width, target.height);
+              cerr << "Error: Frame " << frame << " differs from "
+                   << filepath << " in " << differing << " pixels, see "
+                   << diff_filepath << endl;
+              failed = 1;
+            }
+        }
+    }
+
+  int timed_count = RENDER_BENCH_FRAMES - 1;
+  cout << "               mean ms    p50 ms    p95 ms    max ms" << endl;
+  print_render_times ("cpu", cpu_times + 1, timed_count);
+  if (gpu_times_count)
+    {
+      print_render_times ("gpu", gpu_times, gpu_times_count);
+    }
+  else
+    {
+      cout << "  gpu          no timer queries" << endl;
+    }
+  print_render_times ("to finish", frame_times + 1, timed_count);
+
+  if (capture_filepath)
+    {
+      print_render_times ("capture", capture_times + 1, timed_count);
+    }
+
+  finish_render_stats (&stats);
+  print_render_stats (&stats);
+
+  if (capture_filepath)
+    {
+      stop_capture (&capture);
+    }
+
+  // Last, as it starts the game's particles over.
+  particles.count = 0;
+  run_particle_stress (&particles);
+  run_tiles_stress (&shapes, min (target.width, target.height));
+
+  if (update_golden)
+    {
+      cout << "Wrote " << array_len (golden_frames) << " golden images to "
+           << GOLDEN_DIRECTORY << "." << endl;
+    }
+  else if (!failed)
+    {
+      cout << "All " << array_len (golden_frames)
+           << " frames match their golden images." << endl;
+    }
+
+  delete[] cpu_times;
+  delete[] frame_times;
+  delete[] gpu_times;
+  delete[] capture_times;
+  delete[] pixels;
+  delete[] golden;
+  delete[] diff;
+  delete[] snapshot.bricks.items;
+
+  free_render_stats (&stats);
+
+  free_game_state (&game_state);
+
+  free_shape_batch (&shapes);
+  free_sprite_batch (&sprites);
+  free_atlas (&atlas);
+  free_particles (&particles);
+  free_hud (&hud);
+  free_render_target (&target);
+  SDL_GL_DeleteContext (gl_context);
+  SDL_DestroyWindow (window);
+  SDL_Quit ();
+
+  return failed;
+}
@@ -0,0 +1,405 @@
+/* Bricks Game - Render Scale
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The game is square, and takes the biggest square that fits in the
+// window, with black bars beside it. Sizes are in the pixels of the
+// drawable, which on a high-DPI display has more of them than the
+// window's size says.
+//
+// At a render scale of 1 in a square window the game draws straight to
+// the window. Otherwise it draws to an offscreen target render_scale
+// times the size of its square, which is then drawn over the square
+// with one of the upscale filters. Nearest keeps texels sharp but makes
+// them uneven in width at scales that aren't whole. Sharp bilinear
+// scales up by the biggest whole factor with nearest, in effect, and the
+// rest of the way bilinearly, so only the edges between texels blend.
+//
+// Dynamic resolution brings the scale down when frames take longer than
+// the budget, as timed on the GPU where there are timer queries, and
+// back up to render_scale when there's room again. The cost of a frame
+// goes with its pixels, so the scale moves by the square root of how
+// far off the frames are.
+
+#define RENDER_SCALE_MIN 0.25
+#define RENDER_SCALE_MAX 4
+#define RENDER_TARGET_MIN_SIZE 16
+// Dynamic resolution aims for frames of DYNAMIC_SCALE_AIM of the budget,
+// and leaves the scale alone between DYNAMIC_SCALE_LOW and _HIGH.
+#define DYNAMIC_SCALE_AIM 0.75
+#define DYNAMIC_SCALE_LOW 0.5
+#define DYNAMIC_SCALE_HIGH 0.9
+// Going up is slower than going down, so a scale that only just fits
+// isn't left and come back to over and over.
+#define DYNAMIC_SCALE_MAX_INCREASE 0.1
+// Frames to wait after a change before judging the new scale, which
+// takes longer than the stats take to come in.
+#define DYNAMIC_SCALE_FRAMES 30
+#define DYNAMIC_SCALE_SMOOTHING 0.1
+
+enum UpscaleFilter {
+  UPSCALE_NEAREST,
+  UPSCALE_SHARP_BILINEAR,
+  UPSCALE_FILTER_ENUM_LENGTH,
+};
+
+struct RenderTarget {
+  GLuint framebuffer;
+  GLuint texture;
+  int width;
+  int height;
+};
+
+struct RenderScaler {
+  float scale;
+  float min_scale;
+  float max_scale;
+  UpscaleFilter filter;
+  int dynamic;
+  double frame_budget;
+
+  // The drawable last drawn to and the game's square in it.
+  int drawable_width;
+  int drawable_height;
+  int view_x;
+  int view_y;
+  int view_size;
+
+  // Whether the frame being drawn goes straight to the window.
+  int direct;
+  RenderTarget target;
+
+  GLuint program;
+  GLint image_size_location;
+  GLint prescale_location;
+
+  double frame_time;
+  int last_frame;
+  int frames_since_change;
+};
+
+static const char *upscale_vertex_shader = R"GLSL(
+#version 120
+
+varying vec2 v_texcoord;
+
+void
+main ()
+{
+  v_texcoord = gl_MultiTexCoord0.xy;
+  gl_Position = gl_Vertex;
+}
+)GLSL";
+
+static const char *upscale_fragment_shader = R"GLSL(
+#version 120
+
+uniform sampler2D image;
+uniform vec2 image_size;
+uniform float prescale;
+
+varying vec2 v_texcoord;
+
+void
+main ()
+{
+  // Up to region from the middle of a texel, scaled up prescale times,
+  // the texel has the pixel to itself; past it the pixel blends with
+  // the next texel, as bilinear filtering would at the prescaled size.
+  vec2 texel = v_texcoord * image_size;
+  vec2 texel_floor = floor (texel);
+  vec2 center_distance = texel - texel_floor - 0.5;
+  float region = 0.5 - 0.5 / prescale;
+  vec2 offset = ((center_distance - clamp (center_distance, -region, region))
+                 * prescale + 0.5);
+  gl_FragColor = texture2D (image, (texel_floor + offset) / image_size);
+}
+)GLSL";
+
+
+// Leaves the target bound, with the viewport over it.
+static void
+init_render_target (RenderTarget *target, int width, int height,
+                    GLint filter)
+{
+  *target = {};
+  target->width = width;
+  target->height = height;
+
+  glGenTextures (1, &target->texture);
+  glBindTexture (GL_TEXTURE_2D, target->texture);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0,
+                GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+  gl.GenFramebuffers (1, &target->framebuffer);
+  gl.BindFramebuffer (GL_FRAMEBUFFER, target->framebuffer);
+  gl.FramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, target->texture, 0);
+
+  if (gl.CheckFramebufferStatus (GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+      cerr << "Error: Can't render to an offscreen framebuffer." << endl;
+      exit (1);
+    }
+
+  glViewport (0, 0, width, height);
+}
+
+
+static void
+free_render_target (RenderTarget *target)
+{
+  gl.BindFramebuffer (GL_FRAMEBUFFER, 0);
+  gl.DeleteFramebuffers (1, &target->framebuffer);
+  glDeleteTextures (1, &target->texture);
+  *target = {};
+}
+
+
+// scale is clamped to RENDER_SCALE_MIN and _MAX, and min_scale, for
+// dynamic resolution, to those and scale. frame_budget is in seconds.
+// Needs load_gl_functions.
+static void
+init_render_scaler (RenderScaler *scaler, float scale, float min_scale,
+                    UpscaleFilter filter, int dynamic, double frame_budget)
+{
+  *scaler = {};
+  scaler->max_scale = min (max (scale, (float) RENDER_SCALE_MIN),
+                           (float) RENDER_SCALE_MAX);
+  scaler->min_scale = min (max (min_scale, (float) RENDER_SCALE_MIN),
+                           scaler->max_scale);
+  scaler->scale = scaler->max_scale;
+  scaler->filter = (filter >= 0 && filter < UPSCALE_FILTER_ENUM_LENGTH ?
+                    filter : UPSCALE_SHARP_BILINEAR);
+  scaler->dynamic = dynamic;
+  scaler->frame_budget = frame_budget;
+  scaler->last_frame = -1;
+
+  if (scaler->filter == UPSCALE_SHARP_BILINEAR)
+    {
+      GLuint vertex_shader = compile_shader (GL_VERTEX_SHADER,
+                                             upscale_vertex_shader);
+      GLuint fragment_shader = compile_shader (GL_FRAGMENT_SHADER,
+                                               upscale_fragment_shader);
+
+      scaler->program = gl.CreateProgram ();
+      gl.AttachShader (scaler->program, vertex_shader);
+      gl.AttachShader (scaler->program, fragment_shader);
+      gl.LinkProgram (scaler->program);
+      gl.DeleteShader (vertex_shader);
+      gl.DeleteShader (fragment_shader);
+
+      GLint linked = 0;
+      gl.GetProgramiv (scaler->program, GL_LINK_STATUS, &linked);
+
+      if (!linked)
+        {
+          char log[1024];
+          gl.GetProgramInfoLog (scaler->program, sizeof (log), 0, log);
+          cerr << "Error: Can't link shader program: " << log << endl;
+          exit (1);
+        }
+
+      scaler->image_size_location =
+        gl.GetUniformLocation (scaler->program, "image_size");
+      scaler->prescale_location =
+        gl.GetUniformLocation (scaler->program, "prescale");
+    }
+}
+
+
+static void
+free_render_scaler (RenderScaler *scaler)
+{
+  if (scaler->target.framebuffer)
+    {
+      free_render_target (&scaler->target);
+    }
+
+  if (scaler->program)
+    {
+      gl.DeleteProgram (scaler->program);
+    }
+
+  *scaler = {};
+}
+
+
+// Binds what the frame is drawn to, for a drawable of the given size in
+// pixels, and sets the viewport over it.
+static void
+begin_scaled_frame (RenderScaler *scaler, int drawable_width,
+                    int drawable_height)
+{
+  scaler->drawable_width = drawable_width;
+  scaler->drawable_height = drawable_height;
+  scaler->view_size = max (min (drawable_width, drawable_height), 1);
+  scaler->view_x = (drawable_width - scaler->view_size) / 2;
+  scaler->view_y = (drawable_height - scaler->view_size) / 2;
+  scaler->direct = (scaler->scale == 1 && !scaler->dynamic &&
+                    drawable_width == drawable_height);
+
+  if (scaler->direct)
+    {
+      if (scaler->target.framebuffer)
+        {
+          free_render_target (&scaler->target);
+        }
+
+      gl.BindFramebuffer (GL_FRAMEBUFFER, 0);
+      glViewport (0, 0, drawable_width, drawable_height);
+      count_state_changes (1);
+      return;
+    }
+
+  int size = max ((int) (scaler->view_size * scaler->scale + 0.5f),
+                  RENDER_TARGET_MIN_SIZE);
+
+  if (size != scaler->target.width)
+    {
+      if (scaler->target.framebuffer)
+        {
+          free_render_target (&scaler->target);
+        }
+
+      init_render_target (&scaler->target, size, size,
+                          (scaler->filter == UPSCALE_NEAREST ?
+                           GL_NEAREST : GL_LINEAR));
+    }
+  else
+    {
+      gl.BindFramebuffer (GL_FRAMEBUFFER, scaler->target.framebuffer);
+      glViewport (0, 0, size, size);
+    }
+
+  count_state_changes (1);
+}
+
+
+// Draws the offscreen target, if the frame went to one, over the game's
+// square in the window, in its own render pass. Leaves the window's
+// framebuffer bound either way.
+static void
+end_scaled_frame (RenderScaler *scaler, RenderStats *stats)
+{
+  if (scaler->direct)
+    {
+      return;
+    }
+
+  begin_render_pass (stats, RENDER_PASS_UPSCALE);
+
+  gl.BindFramebuffer (GL_FRAMEBUFFER, 0);
+  glViewport (0, 0, scaler->drawable_width, scaler->drawable_height);
+  glClearColor (0, 0, 0, 1);
+  glClear (GL_COLOR_BUFFER_BIT);
+  glViewport (scaler->view_x, scaler->view_y,
+              scaler->view_size, scaler->view_size);
+
+  // The target's alpha is whatever blending left in it.
+  glDisable (GL_BLEND);
+  glMatrixMode (GL_MODELVIEW);
+  glLoadIdentity ();
+  glBindTexture (GL_TEXTURE_2D, scaler->target.texture);
+  count_texture_bind ();
+
+  if (scaler->program)
+    {
+      float size = scaler->target.width;
+      gl.UseProgram (scaler->program);
+      gl.Uniform2f (scaler->image_size_location, size, size);
+      gl.Uniform1f (scaler->prescale_location,
+                    max (floorf (scaler->view_size / size), 1.0f));
+    }
+  else
+    {
+      glEnable (GL_TEXTURE_2D);
+    }
+
+  glBegin (GL_TRIANGLE_STRIP);
+  glTexCoord2f (0, 0);
+  glVertex2f (-1, -1);
+  glTexCoord2f (0, 1);
+  glVertex2f (-1, 1);
+  glTexCoord2f (1, 0);
+  glVertex2f (1, -1);
+  glTexCoord2f (1, 1);
+  glVertex2f (1, 1);
+  glEnd ();
+  count_draw_call (4);
+
+  if (scaler->program)
+    {
+      gl.UseProgram (0);
+    }
+  else
+    {
+      glDisable (GL_TEXTURE_2D);
+    }
+
+  glEnable (GL_BLEND);
+  count_state_changes (6);
+
+  end_render_pass (stats);
+}
+
+
+// Takes in the newest frame's stats, from get_render_stats, and moves
+// the scale for the frames after if dynamic resolution is on. Without
+// timer queries it goes by the CPU time alone, which misses a GPU that
+// falls behind.
+static void
+update_render_scale (RenderScaler *scaler, RenderFrameStats *frame)
+{
+  if (!scaler->dynamic || !frame || frame->frame == scaler->last_frame)
+    {
+      return;
+    }
+
+  scaler->last_frame = frame->frame;
+  double time = (frame->has_gpu_time ?
+                 max (frame->gpu_time, frame->cpu_time) : frame->cpu_time);
+
+  if (scaler->frames_since_change == 0)
+    {
+      scaler->frame_time = time;
+    }
+  else
+    {
+      scaler->frame_time += (time - scaler->frame_time) *
+        DYNAMIC_SCALE_SMOOTHING;
+    }
+
+  if (++scaler->frames_since_change < DYNAMIC_SCALE_FRAMES)
+    {
+      return;
+    }
+
+  double load = scaler->frame_time / scaler->frame_budget;
+  if ((load > DYNAMIC_SCALE_HIGH && scaler->scale > scaler->min_scale) ||
+      (load < DYNAMIC_SCALE_LOW && scaler->scale < scaler->max_scale))
+    {
+      float scale = scaler->scale * sqrt (DYNAMIC_SCALE_AIM / load);
+      scale = min (scale, scaler->scale + (float) DYNAMIC_SCALE_MAX_INCREASE);
+      scaler->scale = min (max (scale, scaler->min_scale), scaler->max_scale);
+      scaler->frames_since_change = 0;
+    }
+}
@@ -0,0 +1,418 @@
+/* Bricks Game - Render Statistics
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// What each pass of a frame costs on the CPU and the GPU, and how much
+// it asks of the driver.
+//
+// The drawing functions count their draw calls, vertices, texture binds
+// and state changes in render_counts as they go, which is cheap enough
+// to always do. Passes take the difference. GPU time comes from a
+// timer query around each pass, read RENDER_STATS_FRAMES frames later
+// so the read never waits for the GPU; a frame whose queries still
+// aren't done by then goes without GPU time rather than stall.
+
+#define RENDER_STATS_FRAMES 4
+
+enum RenderPass {
+  RENDER_PASS_BRICKS,
+  RENDER_PASS_PARTICLES,
+  RENDER_PASS_ENTITIES,
+  RENDER_PASS_PADDLE,
+  RENDER_PASS_HUD,
+  RENDER_PASS_UPSCALE,
+  RENDER_PASS_ENUM_LENGTH,
+};
+
+static const char *render_pass_names[] = {
+  "bricks",
+  "particles",
+  "entities",
+  "paddle",
+  "hud",
+  "upscale",
+};
+
+struct RenderCounts {
+  int draw_calls;
+  int vertices;
+  int texture_binds;
+  // glEnable and glDisable, program and framebuffer switches.
+  int state_changes;
+};
+
+struct RenderPassStats {
+  int used;
+  double cpu_time;
+  double gpu_time;
+  RenderCounts counts;
+};
+
+struct RenderFrameStats {
+  int frame;
+  // From the start to the end of the frame, on the CPU, and the sum of
+  // its passes on the GPU if has_gpu_time.
+  double cpu_time;
+  double gpu_time;
+  int has_gpu_time;
+  RenderCounts counts;
+  RenderPassStats passes[RENDER_PASS_ENUM_LENGTH];
+};
+
+struct RenderStats {
+  int enabled;
+  int frames_count;
+  int pass;
+  double frame_begin;
+  double pass_begin;
+  RenderCounts frame_counts_begin;
+  RenderCounts pass_counts_begin;
+
+  // The frames whose GPU times aren't in yet, frame n in slot
+  // n % RENDER_STATS_FRAMES.
+  RenderFrameStats frames[RENDER_STATS_FRAMES];
+  GLuint queries[RENDER_STATS_FRAMES][RENDER_PASS_ENUM_LENGTH];
+
+  // The newest frame that is all in, if latest.frame >= 0, and the
+  // sums over every frame so far.
+  RenderFrameStats latest;
+  RenderFrameStats total;
+  int total_count;
+  int total_gpu_count;
+};
+
+static RenderCounts render_counts;
+
+
+static void
+count_draw_call (int vertices)
+{
+  ++render_counts.draw_calls;
+  render_counts.vertices += vertices;
+}
+
+
+static void
+count_texture_bind (void)
+{
+  ++render_counts.texture_binds;
+}
+
+
+static void
+count_state_changes (int state_changes)
+{
+  render_counts.state_changes += state_changes;
+}
+
+
+static RenderCounts
+subtract_render_counts (RenderCounts a, RenderCounts b)
+{
+  RenderCounts result;
+  result.draw_calls = a.draw_calls - b.draw_calls;
+  result.vertices = a.vertices - b.vertices;
+  result.texture_binds = a.texture_binds - b.texture_binds;
+  result.state_changes = a.state_changes - b.state_changes;
+  return result;
+}
+
+
+static void
+add_render_counts (RenderCounts *a, RenderCounts b)
+{
+  a->draw_calls += b.draw_calls;
+  a->vertices += b.vertices;
+  a->texture_binds += b.texture_binds;
+  a->state_changes += b.state_changes;
+}
+
+
+// Does nothing at all unless enabled. Needs load_gl_functions.
+static void
+init_render_stats (RenderStats *stats, int enabled)
+{
+  *stats = {};
+  stats->enabled = enabled;
+  stats->pass = -1;
+  stats->latest.frame = -1;
+
+  if (enabled && gl.has_timer_query)
+    {
+      gl.GenQueries (RENDER_STATS_FRAMES * RENDER_PASS_ENUM_LENGTH,
+                     stats->queries[0]);
+    }
+}
+
+
+static void
+free_render_stats (RenderStats *stats)
+{
+  if (stats->queries[0][0])
+    {
+      gl.DeleteQueries (RENDER_STATS_FRAMES * RENDER_PASS_ENUM_LENGTH,
+                        stats->queries[0]);
+    }
+
+  *stats = {};
+}
+
+
+// Takes in the GPU times of the frame in slot, if they are done or wait
+// is set, and adds the frame to the totals.
+static void
+collect_render_frame (RenderStats *stats, int slot, int wait)
+{
+  RenderFrameStats *frame = stats->frames + slot;
+  GLuint *queries = stats->queries[slot];
+  frame->has_gpu_time = queries[0] != 0;
+
+  for (int pass = 0; pass < RENDER_PASS_ENUM_LENGTH && frame->has_gpu_time;
+       ++pass)
+    {
+      if (frame->passes[pass].used && !wait)
+        {
+          GLint available = 0;
+          gl.GetQueryObjectiv (queries[pass], GL_QUERY_RESULT_AVAILABLE,
+                               &available);
+          frame->has_gpu_time = available;
+        }
+    }
+
+  if (frame->has_gpu_time)
+    {
+      for (int pass = 0; pass < RENDER_PASS_ENUM_LENGTH; ++pass)
+        {
+          if (frame->passes[pass].used)
+            {
+              GLuint64 gpu_time = 0;
+              gl.GetQueryObjectui64v (queries[pass], GL_QUERY_RESULT,
+                                      &gpu_time);
+              frame->passes[pass].gpu_time = gpu_time * 1e-9;
+              frame->gpu_time += frame->passes[pass].gpu_time;
+            }
+        }
+    }
+
+  stats->latest = *frame;
+
+  RenderFrameStats *total = &stats->total;
+  ++stats->total_count;
+  total->cpu_time += frame->cpu_time;
+  add_render_counts (&total->counts, frame->counts);
+
+  if (frame->has_gpu_time)
+    {
+      ++stats->total_gpu_count;
+      total->gpu_time += frame->gpu_time;
+    }
+
+  for (int pass = 0; pass < RENDER_PASS_ENUM_LENGTH; ++pass)
+    {
+      RenderPassStats *pass_stats = frame->passes + pass;
+      RenderPassStats *pass_total = total->passes + pass;
+      pass_total->used += pass_stats->used;
+      pass_total->cpu_time += pass_stats->cpu_time;
+      add_render_counts (&pass_total->counts, pass_stats->counts);
+
+      if (frame->has_gpu_time)
+        {
+          pass_total->gpu_time += pass_stats->gpu_time;
+        }
+    }
+}
+
+
+static void
+begin_render_frame (RenderStats *stats)
+{
+  if (!stats->enabled)
+    {
+      return;
+    }
+
+  int slot = stats->frames_count % RENDER_STATS_FRAMES;
+  if (stats->frames_count >= RENDER_STATS_FRAMES)
+    {
+      collect_render_frame (stats, slot, 0);
+    }
+
+  stats->frames[slot] = {};
+  stats->frames[slot].frame = stats->frames_count;
+  stats->frame_begin = get_seconds ();
+  stats->frame_counts_begin = render_counts;
+}
+
+
+static void
+end_render_frame (RenderStats *stats)
+{
+  if (!stats->enabled)
+    {
+      return;
+    }
+
+  RenderFrameStats *frame =
+    stats->frames + stats->frames_count % RENDER_STATS_FRAMES;
+  frame->cpu_time = get_seconds () - stats->frame_begin;
+  frame->counts = subtract_render_counts (render_counts,
+                                          stats->frame_counts_begin);
+  ++stats->frames_count;
+}
+
+
+// Passes don't nest, as only one timer query can run at a time.
+static void
+begin_render_pass (RenderStats *stats, RenderPass pass)
+{
+  if (!stats->enabled)
+    {
+      return;
+    }
+
+  assert (stats->pass < 0);
+  stats->pass = pass;
+  int slot = stats->frames_count % RENDER_STATS_FRAMES;
+  stats->frames[slot].passes[pass].used = 1;
+
+  if (stats->queries[slot][pass])
+    {
+      gl.BeginQuery (GL_TIME_ELAPSED, stats->queries[slot][pass]);
+    }
+
+  stats->pass_begin = get_seconds ();
+  stats->pass_counts_begin = render_counts;
+}
+
+
+static void
+end_render_pass (RenderStats *stats)
+{
+  if (!stats->enabled)
+    {
+      return;
+    }
+
+  int slot = stats->frames_count % RENDER_STATS_FRAMES;
+  RenderPassStats *pass = stats->frames[slot].passes + stats->pass;
+  pass->cpu_time = get_seconds () - stats->pass_begin;
+  pass->counts = subtract_render_counts (render_counts,
+                                         stats->pass_counts_begin);
+
+  if (stats->queries[slot][stats->pass])
+    {
+      gl.EndQuery (GL_TIME_ELAPSED);
+    }
+
+  stats->pass = -1;
+}
+
+
+// Waits for the frames still on the GPU and takes them in, for when
+// rendering is over.
+static void
+finish_render_stats (RenderStats *stats)
+{
+  int first = max (0, stats->frames_count - RENDER_STATS_FRAMES);
+
+  for (int frame = first; frame < stats->frames_count; ++frame)
+    {
+      collect_render_frame (stats, frame % RENDER_STATS_FRAMES, 1);
+    }
+
+  stats->frames_count = 0;
+}
+
+
+// The newest frame with all its stats in, or 0 if there's none yet.
+// Stays valid until the next begin_render_frame.
+static RenderFrameStats *
+get_render_stats (RenderStats *stats)
+{
+  return stats->latest.frame >= 0 ? &stats->latest : 0;
+}
+
+
+static void
+print_render_counts_row (const char *name, int count, double cpu_time,
+                         double gpu_time, int gpu_count, RenderCounts counts)
+{
+  printf ("  %-9s %7.3f", name, cpu_time / count * 1e3);
+  if (gpu_count)
+    {
+      printf (" %8.3f", gpu_time / gpu_count * 1e3);
+    }
+  else
+    {
+      printf (" %8s", "-");
+    }
+  printf (" %6.1f %9.0f %6.1f %7.1f\n",
+          (double) counts.draw_calls / count,
+          (double) counts.vertices / count,
+          (double) counts.texture_binds / count,
+          (double) counts.state_changes / count);
+}
+
+
+// The means over every frame so far.
+static void
+print_render_stats (RenderStats *stats)
+{
+  int count = stats->total_count;
+  int gpu_count = stats->total_gpu_count;
+  RenderFrameStats *total = &stats->total;
+
+  cout << "Render stats, means over " << count << " frames";
+  if (stats->queries[0][0])
+    {
+      cout << ", " << count - gpu_count << " without GPU time";
+    }
+  cout << ":" << endl;
+
+  if (!count)
+    {
+      return;
+    }
+
+  cout << "  pass       cpu ms   gpu ms  draws  vertices  binds  states"
+       << endl;
+
+  for (int pass = 0; pass < RENDER_PASS_ENUM_LENGTH; ++pass)
+    {
+      RenderPassStats *pass_total = total->passes + pass;
+      if (!pass_total->used)
+        {
+          continue;
+        }
+
+      print_render_counts_row (render_pass_names[pass], count,
+                               pass_total->cpu_time, pass_total->gpu_time,
+                               gpu_count, pass_total->counts);
+    }
+
+  print_render_counts_row ("frame", count, total->cpu_time, total->gpu_time,
+                           gpu_count, total->counts);
+
+  if (gpu_count)
+    {
+      double cpu_time = total->cpu_time / count;
+      double gpu_time = total->gpu_time / gpu_count;
+      printf ("  The GPU takes %.0f%% of the CPU's time a frame, so frames "
+              "are %s-bound.\n", gpu_time / cpu_time * 100,
+              gpu_time > cpu_time ? "GPU" : "CPU");
+    }
+}
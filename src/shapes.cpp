@@ -0,0 +1,388 @@
+/* Bricks Game - Shape Rendering
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Rects, circles and arcs are queued as one instance each and drawn by
+// flush_shapes in a single instanced draw call. Every instance is a quad
+// whose fragment shader computes the signed distance to a rounded rect
+// (a circle being a rect rounded all the way), optionally cut to an arc,
+// and antialiases the edge over one pixel at any scale.
+//
+// The draw functions don't touch GL, so shapes must be flushed before
+// drawing anything else on top of them or changing the transform. Shapes
+// can also be moved and scaled on the CPU as they are queued, with
+// set_shape_transform, so views with transforms of their own still go
+// in one batch.
+
+#define SHAPE_AA_MARGIN 0.01
+
+struct Color {
+  float r, g, b;
+  float a = 1;
+};
+
+enum ShapeArc {
+  SHAPE_ARC_NONE,
+  SHAPE_ARC_UP_TO_HALF,
+  SHAPE_ARC_OVER_HALF,
+};
+
+struct ShapeInstance {
+  V2 center;
+  V2 half_dim;
+  float corner_radius;
+  float arc;
+  V2 arc_begin;
+  V2 arc_end;
+  GLubyte color[4];
+};
+
+struct ShapeBatch {
+  int max;
+  int count;
+  ShapeInstance *instances;
+  // What set_shape_transform set.
+  V2 offset;
+  float scale;
+  GLuint program;
+  GLuint corners_buffer;
+  GLuint instances_buffer;
+  GLint margin_location;
+};
+
+// Attribute locations, bound before linking.
+enum ShapeAttribute {
+  SHAPE_ATTRIBUTE_CORNER,
+  SHAPE_ATTRIBUTE_CENTER,
+  SHAPE_ATTRIBUTE_SHAPE,
+  SHAPE_ATTRIBUTE_ARC,
+  SHAPE_ATTRIBUTE_COLOR,
+  SHAPE_ATTRIBUTE_ENUM_LENGTH,
+};
+
+static const char *shape_attribute_names[SHAPE_ATTRIBUTE_ENUM_LENGTH] = {
+  "corner",
+  "center",
+  "shape",
+  "arc",
+  "color",
+};
+
+static const char *shape_vertex_shader = R"GLSL(
+#version 120
+
+uniform float margin;
+
+attribute vec2 corner;
+attribute vec4 center;
+attribute vec4 shape;
+attribute vec4 arc;
+attribute vec4 color;
+
+varying vec2 v_local;
+varying vec4 v_shape;
+varying vec4 v_arc;
+varying vec4 v_color;
+
+void
+main ()
+{
+  // center.xy is the center and center.zw the half size.
+  v_local = corner * (center.zw + margin);
+  v_shape = vec4 (center.zw, shape.xy);
+  v_arc = arc;
+  v_color = color;
+  gl_Position = gl_ModelViewProjectionMatrix * vec4 (center.xy + v_local, 0, 1);
+}
+)GLSL";
+
+static const char *shape_fragment_shader = R"GLSL(
+#version 120
+
+varying vec2 v_local;
+varying vec4 v_shape;
+varying vec4 v_arc;
+varying vec4 v_color;
+
+void
+main ()
+{
+  // v_shape is the half size, the corner radius and the arc kind.
+  vec2 q = abs (v_local) - v_shape.xy + v_shape.z;
+  float d = length (max (q, 0.0)) + min (max (q.x, q.y), 0.0) - v_shape.z;
+
+  if (v_shape.w > 0.5)
+    {
+      // Distances to the lines along the arc's first and last angle,
+      // positive on the side away from the arc.
+      float d0 = v_arc.y * v_local.x - v_arc.x * v_local.y;
+      float d1 = v_arc.z * v_local.y - v_arc.w * v_local.x;
+      float wedge = v_shape.w < 1.5 ? max (d0, d1) : min (d0, d1);
+      d = max (d, wedge);
+    }
+
+  float alpha = clamp (0.5 - d / max (fwidth (d), 1e-6), 0.0, 1.0);
+  gl_FragColor = vec4 (v_color.rgb, v_color.a * alpha);
+}
+)GLSL";
+
+
+static GLuint
+compile_shader (GLenum type, const char *source)
+{
+  GLuint shader = gl.CreateShader (type);
+  gl.ShaderSource (shader, 1, &source, 0);
+  gl.CompileShader (shader);
+
+  GLint compiled = 0;
+  gl.GetShaderiv (shader, GL_COMPILE_STATUS, &compiled);
+
+  if (!compiled)
+    {
+      char log[1024];
+      gl.GetShaderInfoLog (shader, sizeof (log), 0, log);
+      cerr << "Error: Can't compile shader: " << log << endl;
+      exit (1);
+    }
+
+  return shader;
+}
+
+
+// Needs a current GL context and load_gl_functions.
+static void
+init_shape_batch (ShapeBatch *batch)
+{
+  GLuint vertex_shader = compile_shader (GL_VERTEX_SHADER,
+                                         shape_vertex_shader);
+  GLuint fragment_shader = compile_shader (GL_FRAGMENT_SHADER,
+                                           shape_fragment_shader);
+
+  batch->program = gl.CreateProgram ();
+  gl.AttachShader (batch->program, vertex_shader);
+  gl.AttachShader (batch->program, fragment_shader);
+
+  for (int attribute = 0;
+       attribute < SHAPE_ATTRIBUTE_ENUM_LENGTH;
+       ++attribute)
+    {
+      gl.BindAttribLocation (batch->program, attribute,
+                             shape_attribute_names[attribute]);
+    }
+
+  gl.LinkProgram (batch->program);
+  gl.DeleteShader (vertex_shader);
+  gl.DeleteShader (fragment_shader);
+
+  GLint linked = 0;
+  gl.GetProgramiv (batch->program, GL_LINK_STATUS, &linked);
+
+  if (!linked)
+    {
+      char log[1024];
+      gl.GetProgramInfoLog (batch->program, sizeof (log), 0, log);
+      cerr << "Error: Can't link shader program: " << log << endl;
+      exit (1);
+    }
+
+  batch->margin_location = gl.GetUniformLocation (batch->program, "margin");
+
+  float corners[] = {-1, -1, 1, -1, -1, 1, 1, 1};
+  gl.GenBuffers (1, &batch->corners_buffer);
+  gl.BindBuffer (GL_ARRAY_BUFFER, batch->corners_buffer);
+  gl.BufferData (GL_ARRAY_BUFFER, sizeof (corners), corners, GL_STATIC_DRAW);
+
+  gl.GenBuffers (1, &batch->instances_buffer);
+  gl.BindBuffer (GL_ARRAY_BUFFER, 0);
+
+  batch->scale = 1;
+}
+
+
+static void
+free_shape_batch (ShapeBatch *batch)
+{
+  if (batch->program)
+    {
+      gl.DeleteProgram (batch->program);
+      gl.DeleteBuffers (1, &batch->corners_buffer);
+      gl.DeleteBuffers (1, &batch->instances_buffer);
+    }
+
+  delete[] batch->instances;
+  *batch = {};
+}
+
+
+// Shapes queued from now on are scaled by scale and then moved by
+// offset, before the GL transform.
+static void
+set_shape_transform (ShapeBatch *batch, V2 offset, float scale)
+{
+  batch->offset = offset;
+  batch->scale = scale;
+}
+
+
+// Clamped to [0, 1] first, as glColor did, since a float out of range
+// of the byte is undefined.
+static GLubyte
+get_color_byte (float channel)
+{
+  return max (0.0f, min (channel, 1.0f)) * 255 + 0.5f;
+}
+
+
+static ShapeInstance *
+push_shape (ShapeBatch *batch, V2 center, V2 half_dim, float corner_radius,
+            Color color)
+{
+  if (batch->count == batch->max)
+    {
+      int new_max = batch->max ? batch->max * 2 : 256;
+      ShapeInstance *new_instances = new ShapeInstance[new_max];
+      if (batch->count)
+        {
+          memcpy (new_instances, batch->instances,
+                  batch->count * sizeof (ShapeInstance));
+        }
+      delete[] batch->instances;
+      batch->instances = new_instances;
+      batch->max = new_max;
+    }
+
+  ShapeInstance *instance = batch->instances + batch->count++;
+  instance->center = batch->offset + center * batch->scale;
+  instance->half_dim = half_dim * batch->scale;
+  instance->corner_radius = corner_radius * batch->scale;
+  instance->arc = SHAPE_ARC_NONE;
+  instance->color[0] = get_color_byte (color.r);
+  instance->color[1] = get_color_byte (color.g);
+  instance->color[2] = get_color_byte (color.b);
+  instance->color[3] = get_color_byte (color.a);
+
+  return instance;
+}
+
+
+static void
+draw_rect (ShapeBatch *batch, V2 pos, V2 dim, Color color)
+{
+  push_shape (batch, pos, dim / 2, 0, color);
+}
+
+
+static void
+draw_rounded_rect (ShapeBatch *batch, V2 pos, V2 dim, float radius,
+                   Color color)
+{
+  push_shape (batch, pos, dim / 2, radius, color);
+}
+
+
+static void
+draw_circle (ShapeBatch *batch, V2 pos, float r, Color color)
+{
+  push_shape (batch, pos, (V2) {r, r}, r, color);
+}
+
+
+// The part of the circle counterclockwise from begin_angle to end_angle.
+static void
+draw_semi_circle (ShapeBatch *batch, V2 pos, float r,
+                  float begin_angle, float end_angle, Color color)
+{
+  if (end_angle < begin_angle)
+    {
+      end_angle += M_PI * 2;
+    }
+
+  ShapeInstance *instance = push_shape (batch, pos, (V2) {r, r}, r, color);
+  instance->arc = (end_angle - begin_angle <= M_PI ?
+                   SHAPE_ARC_UP_TO_HALF : SHAPE_ARC_OVER_HALF);
+  instance->arc_begin = (V2) {cosf (begin_angle), sinf (begin_angle)};
+  instance->arc_end = (V2) {cosf (end_angle), sinf (end_angle)};
+}
+
+
+// Draws and clears everything queued, with the current transform.
+static void
+flush_shapes (ShapeBatch *batch)
+{
+  if (!batch->count)
+    {
+      return;
+    }
+
+  gl.UseProgram (batch->program);
+  gl.Uniform1f (batch->margin_location, SHAPE_AA_MARGIN);
+
+  gl.BindBuffer (GL_ARRAY_BUFFER, batch->corners_buffer);
+  gl.EnableVertexAttribArray (SHAPE_ATTRIBUTE_CORNER);
+  gl.VertexAttribPointer (SHAPE_ATTRIBUTE_CORNER, 2, GL_FLOAT, GL_FALSE,
+                          0, 0);
+
+  // Orphaning the old storage first lets the driver hand out a fresh
+  // buffer instead of waiting for the last frame's draw to finish.
+  int size = batch->count * sizeof (ShapeInstance);
+  gl.BindBuffer (GL_ARRAY_BUFFER, batch->instances_buffer);
+  gl.BufferData (GL_ARRAY_BUFFER, size, 0, GL_STREAM_DRAW);
+  gl.BufferSubData (GL_ARRAY_BUFFER, 0, size, batch->instances);
+
+  struct {
+    int size;
+    GLenum type;
+    size_t offset;
+  } attributes[] = {
+    {0, 0, 0},
+    {4, GL_FLOAT, offsetof (ShapeInstance, center)},
+    {2, GL_FLOAT, offsetof (ShapeInstance, corner_radius)},
+    {4, GL_FLOAT, offsetof (ShapeInstance, arc_begin)},
+    {4, GL_UNSIGNED_BYTE, offsetof (ShapeInstance, color)},
+  };
+
+  for (int attribute = SHAPE_ATTRIBUTE_CENTER;
+       attribute < SHAPE_ATTRIBUTE_ENUM_LENGTH;
+       ++attribute)
+    {
+      gl.EnableVertexAttribArray (attribute);
+      gl.VertexAttribPointer (attribute,
+                              attributes[attribute].size,
+                              attributes[attribute].type,
+                              attributes[attribute].type == GL_UNSIGNED_BYTE,
+                              sizeof (ShapeInstance),
+                              (void *) attributes[attribute].offset);
+      gl.VertexAttribDivisor (attribute, 1);
+    }
+
+  gl.DrawArraysInstanced (GL_TRIANGLE_STRIP, 0, 4, batch->count);
+  count_draw_call (4 * batch->count);
+  count_state_changes (2);
+
+  for (int attribute = 0;
+       attribute < SHAPE_ATTRIBUTE_ENUM_LENGTH;
+       ++attribute)
+    {
+      gl.VertexAttribDivisor (attribute, 0);
+      gl.DisableVertexAttribArray (attribute);
+    }
+
+  gl.BindBuffer (GL_ARRAY_BUFFER, 0);
+  gl.UseProgram (0);
+
+  batch->count = 0;
+}
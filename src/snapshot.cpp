@@ -0,0 +1,182 @@
+/* Bricks Game - Render Snapshots
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The simulation hands the renderer a copy of everything it draws after
+// every step. Snapshots go through a triple buffer: the simulation fills
+// one slot, the renderer draws from another, and the third holds the
+// newest finished snapshot. Publishing and taking the newest are each a
+// single atomic swap, so neither side ever waits for the other, and a
+// renderer that falls behind just skips the snapshots it missed.
+//
+// Because snapshots can be skipped, each one carries the bricks in view
+// in full rather than what changed since the last; that is bounded by
+// the view, not the level.
+
+#define SNAPSHOT_FRESH 4
+// The longest the renderer moves the paddle on from a snapshot.
+#define SNAPSHOT_LATCH_MAX 0.05
+
+struct Snapshot {
+  // When the simulation took it, on the clock of get_seconds.
+  double time;
+  GameMode game_mode;
+  int idle;
+  Camera camera;
+  Paddle paddle;
+  // The input of the step. The renderer latches the paddle on it rather
+  // than on the keys when remote_input is set, for a game the keys here
+  // don't play, or play late.
+  int input_left;
+  int input_right;
+  int remote_input;
+  V2 eyes_target;
+  // The seconds left of each powerup, 0 for the ones not active.
+  float powerup_times[POWERUP_ENUM_LENGTH];
+  int balls_count;
+  Ball balls[BALLS_MAX];
+  int bullets_count;
+  Bullet bullets[BULLETS_MAX];
+  int powerups_count;
+  Powerup powerups[POWERUPS_MAX];
+  HudValues hud_values;
+  ParticleEmissions particle_emissions;
+  BricksArray bricks;
+};
+
+struct SnapshotBuffer {
+  Snapshot snapshots[3];
+  // The slot of the newest snapshot, with SNAPSHOT_FRESH until the
+  // renderer takes it.
+  SDL_atomic_t latest;
+  // Only the simulation touches write_index, only the renderer
+  // read_index.
+  int write_index;
+  int read_index;
+};
+
+
+static void
+init_snapshot_buffer (SnapshotBuffer *buffer)
+{
+  *buffer = {};
+  buffer->write_index = 0;
+  SDL_AtomicSet (&buffer->latest, 1);
+  buffer->read_index = 2;
+}
+
+
+static void
+free_snapshot_buffer (SnapshotBuffer *buffer)
+{
+  for (int slot = 0; slot < 3; ++slot)
+    {
+      delete[] buffer->snapshots[slot].bricks.items;
+    }
+
+  *buffer = {};
+}
+
+
+static void
+fill_snapshot (Snapshot *snapshot, GameState *game_state, double time)
+{
+  snapshot->time = time;
+  snapshot->game_mode = game_state->game_mode;
+  snapshot->idle = (game_state->game_mode != GAME_STARTED ||
+                    is_game_idle (game_state));
+  snapshot->camera = game_state->camera;
+  snapshot->paddle = game_state->paddle;
+  snapshot->input_left = game_state->input_left;
+  snapshot->input_right = game_state->input_right;
+  snapshot->eyes_target = (game_state->game_mode == GAME_STARTED ?
+                           game_state->balls[0].pos : (V2) {0, 1});
+  for (int type = 0; type < POWERUP_ENUM_LENGTH; ++type)
+    {
+      snapshot->powerup_times[type] =
+        get_powerup_time (game_state, (PowerupType) type);
+    }
+  snapshot->hud_values = get_hud_values (game_state);
+  snapshot->particle_emissions = game_state->particle_emissions;
+
+  snapshot->balls_count = game_state->balls_count;
+  memcpy (snapshot->balls, game_state->balls,
+          game_state->balls_count * sizeof (Ball));
+  snapshot->bullets_count = game_state->bullets_count;
+  memcpy (snapshot->bullets, game_state->bullets,
+          game_state->bullets_count * sizeof (Bullet));
+  snapshot->powerups_count = game_state->powerups_count;
+  memcpy (snapshot->powerups, game_state->powerups,
+          game_state->powerups_count * sizeof (Powerup));
+
+  BricksArray *bricks = &snapshot->bricks;
+  bricks->count = 0;
+
+  if (game_state->game_mode == GAME_STARTED)
+    {
+      IntArray *bricks_visible = &game_state->bricks_visible;
+      Camera *camera = &game_state->camera;
+      bricks_visible->count = 0;
+      aabb_tree_query (&game_state->bricks_tree,
+                       aabb_from_rect (camera->pos, camera->dim),
+                       bricks_visible);
+
+      reserve_bricks (bricks, bricks_visible->count);
+      for (int visible_index = 0;
+           visible_index < bricks_visible->count;
+           ++visible_index)
+        {
+          int brick_index = bricks_visible->items[visible_index];
+          bricks->items[bricks->count++] =
+            game_state->bricks_array.items[brick_index];
+        }
+    }
+}
+
+
+// The slot to fill next. Simulation side.
+static Snapshot *
+get_write_snapshot (SnapshotBuffer *buffer)
+{
+  return buffer->snapshots + buffer->write_index;
+}
+
+
+// Makes the filled slot the newest and takes the one it replaces.
+// Simulation side.
+static void
+publish_snapshot (SnapshotBuffer *buffer)
+{
+  int old = SDL_AtomicSet (&buffer->latest,
+                           buffer->write_index | SNAPSHOT_FRESH);
+  buffer->write_index = old & ~SNAPSHOT_FRESH;
+}
+
+
+// The newest snapshot, which stays the renderer's until the next call.
+// Renderer side.
+static Snapshot *
+get_latest_snapshot (SnapshotBuffer *buffer)
+{
+  if (SDL_AtomicGet (&buffer->latest) & SNAPSHOT_FRESH)
+    {
+      int old = SDL_AtomicSet (&buffer->latest, buffer->read_index);
+      buffer->read_index = old & ~SNAPSHOT_FRESH;
+    }
+
+  return buffer->snapshots + buffer->read_index;
+}
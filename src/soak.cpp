@@ -0,0 +1,507 @@
+/* Bricks Game - Soak Test
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// "bricks --soak [LEVELS [MAP...]]" plays the autoplay headless, as
+// fast as it goes, through LEVELS levels: the maps one after another in
+// rounds, each round a new game. It samples the process's memory, the
+// game's containers and the time a tick takes as it goes, then says
+// whether anything kept growing once it had warmed up, and exits 1 if
+// so, for running nightly.
+//
+// The samples are all taken at the start of a round, right after the
+// first map is loaded into a new game, so the game is in the same
+// state each time and whatever differs between them is what was left
+// over. Music, sounds and textures are loaded once at startup rather
+// than per level, so the headless game has all that can grow.
+//
+// To count allocations, operator new and delete are replaced here, for
+// the whole program, as malloc and free with a relaxed atomic add each.
+// That's only in the build "make soak" makes, with BRICKS_SOAK defined,
+// so the game and the rest don't pay for it. Other builds soak without
+// counting allocations.
+
+#include <atomic>
+#ifdef __linux__
+#include <dirent.h>
+#include <unistd.h>
+#endif
+#if defined (__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define SOAK_MALLINFO 1
+#endif
+
+#define SOAK_DEFAULT_LEVELS 3000
+#define SOAK_SAMPLES 24
+// The first quarter of the samples is warming up, during which
+// everything grows to the size it needs.
+#define SOAK_WARMUP_SAMPLES (SOAK_SAMPLES / 4)
+// A level not won or lost by then is cut short.
+#define SOAK_LEVEL_SECONDS 120
+// The generated map, tall enough to stream in chunks.
+#define SOAK_MAP_FILEPATH "soak_map.txt"
+#define SOAK_MAP_COLUMNS 30
+#define SOAK_MAP_ROWS 600
+
+// How much more than after warming up counts as a leak, or as the
+// ticks drifting.
+#define SOAK_LEAK_ALLOCATIONS 32
+#define SOAK_LEAK_HEAP_MB 1.0
+#define SOAK_LEAK_RSS_MB 8.0
+#define SOAK_DRIFT_MAX 0.25
+
+#ifdef BRICKS_SOAK
+// Apart, as they're added to from every thread.
+alignas (64) static std::atomic<uint64_t> soak_news;
+alignas (64) static std::atomic<uint64_t> soak_deletes;
+
+
+static void *
+soak_allocate (size_t size)
+{
+  void *memory = malloc (size ? size : 1);
+  if (!memory)
+    {
+      throw std::bad_alloc ();
+    }
+
+  soak_news.fetch_add (1, std::memory_order_relaxed);
+  return memory;
+}
+
+
+static void
+soak_free (void *memory)
+{
+  if (memory)
+    {
+      soak_deletes.fetch_add (1, std::memory_order_relaxed);
+      free (memory);
+    }
+}
+
+
+// Sanitizers replace every form of these, so every form is replaced
+// here too, or the ones left would go to the sanitizer's allocator.
+void *
+operator new (size_t size)
+{
+  return soak_allocate (size);
+}
+
+
+void *
+operator new[] (size_t size)
+{
+  return soak_allocate (size);
+}
+
+
+void
+operator delete (void *memory) noexcept
+{
+  soak_free (memory);
+}
+
+
+void
+operator delete[] (void *memory) noexcept
+{
+  soak_free (memory);
+}
+
+
+void
+operator delete (void *memory, size_t) noexcept
+{
+  soak_free (memory);
+}
+
+
+void
+operator delete[] (void *memory, size_t) noexcept
+{
+  soak_free (memory);
+}
+#endif
+
+
+struct SoakSample {
+  int levels_count;
+  double game_time;
+  // -1 where the system doesn't say.
+  double rss_mb;
+  double heap_mb;
+  int files_count;
+  // -1 if not counted.
+  int64_t allocations_count;
+  int64_t live_allocations;
+  int bricks_count;
+  int bricks_max;
+  int nodes_max;
+  int timers_count;
+  int timers_max;
+  // Of the ticks since the sample before.
+  double tick_time;
+  double tick_time_max;
+};
+
+struct Soak {
+  int levels_count;
+  int levels_won;
+  int levels_cut;
+  int games_lost;
+  double game_time;
+
+  // Since the last sample.
+  int ticks_count;
+  double tick_time;
+  double tick_time_max;
+
+  int samples_count;
+  SoakSample samples[SOAK_SAMPLES + 1];
+};
+
+
+static double
+get_rss_mb (void)
+{
+#ifdef __linux__
+  FILE *file = fopen ("/proc/self/statm", "r");
+  long size = 0;
+  long resident = -1;
+
+  if (file)
+    {
+      if (fscanf (file, "%ld %ld", &size, &resident) != 2)
+        {
+          resident = -1;
+        }
+      fclose (file);
+    }
+
+  return resident < 0 ? -1 : resident * (sysconf (_SC_PAGESIZE) / 1048576.0);
+#else
+  return -1;
+#endif
+}
+
+
+static double
+get_heap_mb (void)
+{
+#ifdef SOAK_MALLINFO
+  return mallinfo2 ().uordblks / 1048576.0;
+#else
+  return -1;
+#endif
+}
+
+
+static int
+get_open_files_count (void)
+{
+#ifdef __linux__
+  DIR *directory = opendir ("/proc/self/fd");
+  if (!directory)
+    {
+      return -1;
+    }
+
+  int count = 0;
+  while (readdir (directory))
+    {
+      ++count;
+    }
+
+  closedir (directory);
+  return count;
+#else
+  return -1;
+#endif
+}
+
+
+static void
+take_soak_sample (Soak *soak, GameState *game_state)
+{
+  SoakSample *sample = soak->samples + soak->samples_count++;
+
+  sample->levels_count = soak->levels_count;
+  sample->game_time = soak->game_time;
+  sample->rss_mb = get_rss_mb ();
+  sample->heap_mb = get_heap_mb ();
+  sample->files_count = get_open_files_count ();
+
+#ifdef BRICKS_SOAK
+  uint64_t deletes = soak_deletes.load (std::memory_order_relaxed);
+  uint64_t news = soak_news.load (std::memory_order_relaxed);
+  sample->allocations_count = (int64_t) news;
+  sample->live_allocations = (int64_t) (news - deletes);
+#else
+  sample->allocations_count = -1;
+  sample->live_allocations = -1;
+#endif
+
+  sample->bricks_count = game_state->bricks_array.count;
+  sample->bricks_max = game_state->bricks_array.max;
+  sample->nodes_max = game_state->bricks_tree.nodes_max;
+  sample->timers_count = game_state->timers.live_count;
+  sample->timers_max = game_state->timers.max;
+
+  sample->tick_time = (soak->ticks_count ?
+                       soak->tick_time / soak->ticks_count : 0);
+  sample->tick_time_max = soak->tick_time_max;
+  soak->ticks_count = 0;
+  soak->tick_time = 0;
+  soak->tick_time_max = 0;
+}
+
+
+// Plays the level in game_state until it's won or lost and, unless
+// it's the round's last, the next one loaded in its place. Returns
+// when the next level is loaded, or the level is over if there is
+// none.
+static void
+play_soak_level (Soak *soak, GameState *game_state, Autoplay *autoplay,
+                 const char *next_map_filepath)
+{
+  double dt = 1.0 / 120;
+  int levels_count = game_state->levels_count;
+  double level_time = 0;
+
+  while (game_state->levels_count == levels_count)
+    {
+      if (game_state->game_mode == GAME_STARTED &&
+          level_time >= SOAK_LEVEL_SECONDS)
+        {
+          ++soak->levels_cut;
+          if (next_map_filepath)
+            {
+              new_level (game_state, next_map_filepath);
+            }
+          return;
+        }
+
+      GameMode game_mode = game_state->game_mode;
+
+      double begin = bench_seconds ();
+      update_autoplay (autoplay, game_state, soak->game_time, dt);
+      step_game (game_state, 0, next_map_filepath, soak->game_time, dt);
+      double tick_time = bench_seconds () - begin;
+
+      ++soak->ticks_count;
+      soak->tick_time += tick_time;
+      soak->tick_time_max = max (soak->tick_time_max, tick_time);
+      soak->game_time += dt;
+      level_time += dt;
+
+      if (game_mode == GAME_STARTED && game_state->game_mode != GAME_STARTED)
+        {
+          soak->levels_won += game_state->game_mode == GAME_WIN;
+          soak->games_lost += game_state->game_mode == GAME_OVER;
+
+          if (!next_map_filepath)
+            {
+              return;
+            }
+        }
+    }
+}
+
+
+static void
+print_soak_sample (SoakSample *sample)
+{
+  printf ("  %6d  %6.1f  %6.1f  %7.2f  %5d  %11lld  %12lld"
+          "  %6d/%-6d  %6d  %3d/%-3d  %7.2f  %6.0f\n",
+          sample->levels_count, sample->game_time / 3600,
+          sample->rss_mb, sample->heap_mb, sample->files_count,
+          (long long) sample->live_allocations,
+          (long long) sample->allocations_count,
+          sample->bricks_count, sample->bricks_max, sample->nodes_max,
+          sample->timers_count, sample->timers_max,
+          sample->tick_time * 1e6, sample->tick_time_max * 1e6);
+}
+
+
+// Prints how much value grew from after warming up to the end, and
+// returns 1 if it's more than limit. Values the system doesn't give
+// are -1 and pass.
+static int
+check_soak_growth (const char *name, double warm, double last, double limit,
+                   const char *unit)
+{
+  if (warm < 0 || last < 0)
+    {
+      printf ("  %-12s not known here\n", name);
+      return 0;
+    }
+
+  int leaked = last - warm > limit;
+  printf ("  %-12s %+.*f%s since warming up  %s\n", name, *unit ? 2 : 0,
+          last - warm, unit, leaked ? "LEAK" : "ok");
+  return leaked;
+}
+
+
+// Returns the exit code.
+static int
+run_soak_command (int argc, char *argv[])
+{
+  static const char *default_map_filepaths[] = {
+    "res/map1.txt",
+    "res/map2.txt",
+    SOAK_MAP_FILEPATH,
+  };
+
+  int levels_count = argc >= 1 ? atoi (argv[0]) : SOAK_DEFAULT_LEVELS;
+  int generated = argc < 2;
+  const char **map_filepaths = (const char **) argv + 1;
+  int maps_count = argc - 1;
+
+  if (generated)
+    {
+      ofstream map_file (SOAK_MAP_FILEPATH);
+      generate_map (map_file, MAPGEN_NOISE, SOAK_MAP_COLUMNS, SOAK_MAP_ROWS,
+                    1, (V2) {0, 0});
+      if (!map_file)
+        {
+          cerr << "Error: Can't write " << SOAK_MAP_FILEPATH << "." << endl;
+          return 1;
+        }
+
+      map_filepaths = default_map_filepaths;
+      maps_count = array_len (default_map_filepaths);
+    }
+
+  int rounds_count = (levels_count + maps_count - 1) / maps_count;
+  int sample_rounds = rounds_count / SOAK_SAMPLES;
+
+  if (sample_rounds < 1)
+    {
+      cerr << "Error: A soak needs at least " << SOAK_SAMPLES * maps_count
+           << " levels to tell what grows." << endl;
+      return 1;
+    }
+
+  cout << "Soak, " << rounds_count << " rounds of";
+  for (int map_index = 0; map_index < maps_count; ++map_index)
+    {
+      cout << " " << map_filepaths[map_index];
+    }
+  cout << ":" << endl;
+  cout << "  levels  game h  rss MB  heap MB  files  live allocs  total allocs"
+       << "  bricks/max      nodes  timers   tick us  max us" << endl;
+
+  GameState game_state;
+  init_game_state (&game_state, 1);
+  game_state.config = embedded_config;
+  Autoplay autoplay;
+  init_autoplay (&autoplay);
+
+  Soak soak = {};
+  double begin = bench_seconds ();
+
+  for (int round = 0; round < rounds_count; ++round)
+    {
+      set_timer (&game_state.timers, &game_state.game_wait_timer, 0,
+                 TIMER_GAME_WAIT, 0);
+      new_game (&game_state);
+      new_level (&game_state, map_filepaths[0]);
+      ++soak.levels_count;
+
+      if (round % sample_rounds == 0 && soak.samples_count < SOAK_SAMPLES)
+        {
+          take_soak_sample (&soak, &game_state);
+          print_soak_sample (soak.samples + soak.samples_count - 1);
+        }
+
+      for (int map_index = 0; map_index < maps_count; ++map_index)
+        {
+          const char *next_map_filepath = (map_index + 1 < maps_count ?
+                                           map_filepaths[map_index + 1] : 0);
+          play_soak_level (&soak, &game_state, &autoplay, next_map_filepath);
+          soak.levels_count += next_map_filepath != 0;
+        }
+    }
+
+  // Once more in the same state as the others.
+  set_timer (&game_state.timers, &game_state.game_wait_timer, 0,
+             TIMER_GAME_WAIT, 0);
+  new_game (&game_state);
+  new_level (&game_state, map_filepaths[0]);
+  take_soak_sample (&soak, &game_state);
+  print_soak_sample (soak.samples + soak.samples_count - 1);
+
+  double total_time = bench_seconds () - begin;
+
+  printf ("  %.1f game hours in %.1f s, %.0f times real time\n",
+          soak.game_time / 3600, total_time, soak.game_time / total_time);
+  printf ("  %d levels won, %d cut short after %d s, %d games lost\n",
+          soak.levels_won, soak.levels_cut, SOAK_LEVEL_SECONDS,
+          soak.games_lost);
+
+  // Each sample's ticks are of the rounds before it, so the one after
+  // warming up is the first whose ticks are all warm.
+  SoakSample *warm = soak.samples + SOAK_WARMUP_SAMPLES;
+  SoakSample *last = soak.samples + soak.samples_count - 1;
+
+  int failed = 0;
+  failed |= check_soak_growth ("Allocations:", warm->live_allocations,
+                               last->live_allocations,
+                               SOAK_LEAK_ALLOCATIONS, "");
+  failed |= check_soak_growth ("Heap:", warm->heap_mb, last->heap_mb,
+                               SOAK_LEAK_HEAP_MB, " MB");
+  failed |= check_soak_growth ("RSS:", warm->rss_mb, last->rss_mb,
+                               SOAK_LEAK_RSS_MB, " MB");
+  failed |= check_soak_growth ("Open files:", warm->files_count,
+                               last->files_count, 0, "");
+
+  // The median tick of the last quarter of the samples against that of
+  // the quarter after warming up, so one slow stretch doesn't decide.
+  int quarter = max (1, soak.samples_count / 4);
+  double early_tick_times[SOAK_SAMPLES + 1];
+  double late_tick_times[SOAK_SAMPLES + 1];
+  for (int index = 0; index < quarter; ++index)
+    {
+      early_tick_times[index] = warm[1 + index].tick_time;
+      late_tick_times[index] = last[-index].tick_time;
+    }
+  sort (early_tick_times, early_tick_times + quarter);
+  sort (late_tick_times, late_tick_times + quarter);
+  double early_tick_time = early_tick_times[quarter / 2];
+  double late_tick_time = late_tick_times[quarter / 2];
+
+  double drift = late_tick_time / early_tick_time - 1;
+  int drifted = drift > SOAK_DRIFT_MAX;
+  printf ("  %-12s %.2f us after warming up, %.2f us at the end, %+.0f%%  %s\n",
+          "Tick time:", early_tick_time * 1e6, late_tick_time * 1e6,
+          drift * 100, drifted ? "DRIFT" : "ok");
+  failed |= drifted;
+
+  cout << (failed ? "FAIL" : "PASS") << endl;
+
+  free_autoplay (&autoplay);
+  free_game_state (&game_state);
+  if (generated)
+    {
+      remove (SOAK_MAP_FILEPATH);
+    }
+
+  return failed;
+}
@@ -0,0 +1,190 @@
+/* Bricks Game - Thread Pool
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Worker threads that run the same job over a range of indices, for
+// stepping many games at once. run_thread_pool hands the indices out one
+// at a time from an atomic counter, so a slow job doesn't hold up the
+// ones behind it, and the calling thread takes indices too rather than
+// sit and wait. The workers sleep on a condition between runs.
+
+// A job, run once for each index of a run.
+typedef void (*ThreadPoolJob) (void *data, int index);
+
+struct ThreadPool {
+  int threads_count;
+  SDL_Thread **threads;
+  SDL_mutex *mutex;
+  // Workers wait on work for a new run, the caller on done for the
+  // workers to finish one.
+  SDL_cond *work;
+  SDL_cond *done;
+
+  // Under the mutex.
+  int run;
+  int busy_count;
+  int stopping;
+
+  // Of the current run.
+  ThreadPoolJob job;
+  void *data;
+  int jobs_count;
+  SDL_atomic_t next_job;
+};
+
+
+static void
+run_thread_pool_jobs (ThreadPool *pool)
+{
+  for (;;)
+    {
+      int index = SDL_AtomicAdd (&pool->next_job, 1);
+      if (index >= pool->jobs_count)
+        {
+          break;
+        }
+
+      pool->job (pool->data, index);
+    }
+}
+
+
+static int
+run_thread_pool_worker (void *data)
+{
+  ThreadPool *pool = (ThreadPool *) data;
+  int run = 0;
+
+  SDL_LockMutex (pool->mutex);
+
+  for (;;)
+    {
+      while (pool->run == run && !pool->stopping)
+        {
+          SDL_CondWait (pool->work, pool->mutex);
+        }
+
+      if (pool->stopping)
+        {
+          break;
+        }
+
+      run = pool->run;
+      SDL_UnlockMutex (pool->mutex);
+
+      run_thread_pool_jobs (pool);
+
+      SDL_LockMutex (pool->mutex);
+      if (--pool->busy_count == 0)
+        {
+          SDL_CondSignal (pool->done);
+        }
+    }
+
+  SDL_UnlockMutex (pool->mutex);
+  return 0;
+}
+
+
+// threads_count worker threads besides the caller's, or one fewer than
+// there are CPUs if it's less than 0. Without workers, runs just go on
+// the caller's thread.
+static void
+init_thread_pool (ThreadPool *pool, int threads_count)
+{
+  *pool = {};
+
+  if (threads_count < 0)
+    {
+      threads_count = SDL_GetCPUCount () - 1;
+    }
+
+  pool->mutex = SDL_CreateMutex ();
+  pool->work = SDL_CreateCond ();
+  pool->done = SDL_CreateCond ();
+  assert (pool->mutex && pool->work && pool->done);
+
+  pool->threads = new SDL_Thread *[max (threads_count, 1)];
+  for (int thread_index = 0; thread_index < threads_count; ++thread_index)
+    {
+      SDL_Thread *thread =
+        SDL_CreateThread (run_thread_pool_worker, "pool", pool);
+      if (!thread)
+        {
+          break;
+        }
+
+      pool->threads[pool->threads_count++] = thread;
+    }
+}
+
+
+// Runs job for every index from 0 to jobs_count, on the workers and the
+// caller, and returns once all of them are done.
+static void
+run_thread_pool (ThreadPool *pool, ThreadPoolJob job, void *data,
+                 int jobs_count)
+{
+  pool->job = job;
+  pool->data = data;
+  pool->jobs_count = jobs_count;
+  SDL_AtomicSet (&pool->next_job, 0);
+
+  if (pool->threads_count == 0 || jobs_count <= 1)
+    {
+      run_thread_pool_jobs (pool);
+      return;
+    }
+
+  SDL_LockMutex (pool->mutex);
+  ++pool->run;
+  pool->busy_count = pool->threads_count;
+  SDL_CondBroadcast (pool->work);
+  SDL_UnlockMutex (pool->mutex);
+
+  run_thread_pool_jobs (pool);
+
+  SDL_LockMutex (pool->mutex);
+  while (pool->busy_count > 0)
+    {
+      SDL_CondWait (pool->done, pool->mutex);
+    }
+  SDL_UnlockMutex (pool->mutex);
+}
+
+
+static void
+free_thread_pool (ThreadPool *pool)
+{
+  SDL_LockMutex (pool->mutex);
+  pool->stopping = 1;
+  SDL_CondBroadcast (pool->work);
+  SDL_UnlockMutex (pool->mutex);
+
+  for (int thread_index = 0;
+       thread_index < pool->threads_count;
+       ++thread_index)
+    {
+      SDL_WaitThread (pool->threads[thread_index], 0);
+    }
+
+  delete[] pool->threads;
+  SDL_DestroyCond (pool->work);
+  SDL_DestroyCond (pool->done);
+  SDL_DestroyMutex (pool->mutex);
+  *pool = {};
+}
@@ -0,0 +1,462 @@
+/* Bricks Game - Tiles
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Many games in one window, for watching bot tournaments and balance
+// sweeps: "bricks --tiles SIDE [MAP]" plays SIDE x SIDE games with the
+// autoplay, each in a tile of a grid.
+//
+// All the games step together on a thread pool, one job per game, and
+// each publishes its own snapshots as the game's simulation thread
+// would. The renderer queues every tile into the one shape batch, with
+// the batch's transform set to the tile's place in the grid, and bricks
+// cut to the tile on the CPU, so the grid costs a single flush however
+// many games there are. Powerups are drawn as circles of their color
+// rather than from their texture, which would take a draw call each,
+// and there are no particles or HUD. Tiles too small to make out faces
+// and bullets go without them.
+
+#define TILES_DEFAULT_SIDE 8
+#define TILES_SIDE_MAX 16
+// The space between tiles, as part of a tile's width.
+#define TILE_GAP 0.04
+// Tiles fewer pixels wide than this are drawn with less detail.
+#define TILE_DETAIL_PIXELS 128
+
+struct TileGame {
+  GameState game_state;
+  Autoplay autoplay;
+  SnapshotBuffer snapshots;
+};
+
+struct Tiles {
+  int side;
+  int count;
+  TileGame *games;
+  const char *map_filepath;
+  float fps;
+  ThreadPool pool;
+  // Of the step being run.
+  double time;
+  double dt;
+
+  // Over every step so far.
+  int steps_count;
+  double step_time;
+  double step_time_max;
+
+  // For run_tiles_simulation.
+  SDL_atomic_t running;
+};
+
+
+// side x side games of map_filepath with config, the first seeded
+// with seed and each one after with the next, starting at time. The
+// games step on threads_count workers besides the caller, or one fewer
+// than there are CPUs if it's less than 0.
+static void
+init_tiles (Tiles *tiles, const Config *config, const char *map_filepath,
+            int side, uint64_t seed, double time, int threads_count)
+{
+  *tiles = {};
+  tiles->side = max (1, min (side, TILES_SIDE_MAX));
+  tiles->count = tiles->side * tiles->side;
+  tiles->games = new TileGame[tiles->count];
+  tiles->map_filepath = map_filepath;
+  tiles->fps = config->sim_fps > 0 ? config->sim_fps : 120;
+  init_thread_pool (&tiles->pool, threads_count);
+
+  for (int game_index = 0; game_index < tiles->count; ++game_index)
+    {
+      TileGame *game = tiles->games + game_index;
+      GameState *game_state = &game->game_state;
+      init_game_state (game_state, seed + game_index);
+      game_state->config = *config;
+      new_game (game_state);
+      new_level (game_state, map_filepath);
+      game_state->paddle.move_time = time;
+      init_autoplay (&game->autoplay);
+
+      init_snapshot_buffer (&game->snapshots);
+      fill_snapshot (get_write_snapshot (&game->snapshots), game_state, time);
+      publish_snapshot (&game->snapshots);
+    }
+}
+
+
+static void
+free_tiles (Tiles *tiles)
+{
+  free_thread_pool (&tiles->pool);
+
+  for (int game_index = 0; game_index < tiles->count; ++game_index)
+    {
+      TileGame *game = tiles->games + game_index;
+      free_game_state (&game->game_state);
+      free_autoplay (&game->autoplay);
+      free_snapshot_buffer (&game->snapshots);
+    }
+
+  delete[] tiles->games;
+  *tiles = {};
+}
+
+
+// One game's step, as a thread pool job.
+static void
+step_tile_game (void *data, int index)
+{
+  Tiles *tiles = (Tiles *) data;
+  TileGame *game = tiles->games + index;
+  GameState *game_state = &game->game_state;
+
+  update_autoplay (&game->autoplay, game_state, tiles->time, tiles->dt);
+  step_game (game_state, 0, tiles->map_filepath, tiles->time, tiles->dt);
+
+  Snapshot *snapshot = get_write_snapshot (&game->snapshots);
+  fill_snapshot (snapshot, game_state, tiles->time);
+  snapshot->remote_input = 1;
+  publish_snapshot (&game->snapshots);
+}
+
+
+// Steps every game by dt to time, and returns once they're all done.
+static void
+step_tiles (Tiles *tiles, double time, double dt)
+{
+  double begin = get_seconds ();
+
+  tiles->time = time;
+  tiles->dt = dt;
+  run_thread_pool (&tiles->pool, step_tile_game, tiles, tiles->count);
+
+  double step_time = get_seconds () - begin;
+  ++tiles->steps_count;
+  tiles->step_time += step_time;
+  tiles->step_time_max = max (tiles->step_time_max, step_time);
+}
+
+
+// Steps the games at tiles->fps until running is cleared, as
+// run_simulation does the one game.
+static int
+run_tiles_simulation (void *data)
+{
+  Tiles *tiles = (Tiles *) data;
+
+  FramePacer pacer;
+  init_frame_pacer (&pacer);
+
+  while (SDL_AtomicGet (&tiles->running))
+    {
+      wait_next_frame (&pacer, tiles->fps, 0);
+      step_tiles (tiles, get_seconds (), 1 / tiles->fps);
+    }
+
+  return 0;
+}
+
+
+// Queues rect cut to the view, if any of it is in the view.
+static void
+draw_clipped_rect (ShapeBatch *shapes, V2 pos, V2 dim, V2 view_min,
+                   V2 view_max, Color color)
+{
+  V2 rect_min = pos - dim / 2;
+  V2 rect_max = pos + dim / 2;
+  rect_min.x = max (rect_min.x, view_min.x);
+  rect_min.y = max (rect_min.y, view_min.y);
+  rect_max.x = min (rect_max.x, view_max.x);
+  rect_max.y = min (rect_max.y, view_max.y);
+
+  if (rect_min.x < rect_max.x && rect_min.y < rect_max.y)
+    {
+      draw_rect (shapes, (rect_min + rect_max) / 2, rect_max - rect_min,
+                 color);
+    }
+}
+
+
+static int
+is_point_in_view (V2 point, V2 view_min, V2 view_max)
+{
+  return (point.x >= view_min.x && point.x <= view_max.x &&
+          point.y >= view_min.y && point.y <= view_max.y);
+}
+
+
+// Whether any of the box of dim around pos is in view. Circles can't be
+// cut like bricks, so one at the tile's edge is drawn whole, and what
+// sticks out goes over the gap.
+static int
+is_box_in_view (V2 pos, V2 dim, V2 view_min, V2 view_max)
+{
+  V2 box_min = pos - dim / 2;
+  V2 box_max = pos + dim / 2;
+  return (box_max.x >= view_min.x && box_min.x <= view_max.x &&
+          box_max.y >= view_min.y && box_min.y <= view_max.y);
+}
+
+
+// Queues snapshot's game into the square around center, half_size on
+// each side of it, in the coordinates of the GL transform. Leaves the
+// batch's transform set to the tile.
+static void
+draw_tile (ShapeBatch *shapes, Snapshot *snapshot, V2 center, float half_size,
+           int detail)
+{
+  Color background = (snapshot->game_mode == GAME_WIN ?
+                      (Color) {0.0, 0.3, 0.4} : (Color) {0.0, 0.1, 0.2});
+  set_shape_transform (shapes, (V2) {0, 0}, 1);
+  draw_rect (shapes, center, (V2) {half_size * 2, half_size * 2}, background);
+
+  Camera *camera = &snapshot->camera;
+  float scale = half_size * 2 / camera->dim.x;
+  set_shape_transform (shapes, center - camera->pos * scale, scale);
+  V2 view_min = camera->pos - camera->dim / 2;
+  V2 view_max = camera->pos + camera->dim / 2;
+  Paddle *paddle = &snapshot->paddle;
+
+  if (snapshot->game_mode == GAME_WIN || snapshot->game_mode == GAME_OVER)
+    {
+      // The paddle flies off at a win, and the tile would no longer
+      // hold it.
+      if (is_point_in_view (paddle->pos, view_min, view_max))
+        {
+          draw_paddle (shapes, paddle, snapshot->eyes_target,
+                       (snapshot->game_mode == GAME_WIN ?
+                        EMOTION_HAPPY : EMOTION_SAD));
+        }
+      return;
+    }
+
+  for (int brick_index = 0;
+       brick_index < snapshot->bricks.count;
+       ++brick_index)
+    {
+      Brick *brick = snapshot->bricks.items + brick_index;
+      draw_clipped_rect (shapes, brick->pos, brick->dim, view_min, view_max,
+                         get_brick_color (brick));
+    }
+
+  if (detail)
+    {
+      for (int bullet_index = 0;
+           bullet_index < snapshot->bullets_count;
+           ++bullet_index)
+        {
+          Bullet *bullet = snapshot->bullets + bullet_index;
+          draw_clipped_rect (shapes, bullet->pos,
+                             (V2) {bullet->size, bullet->size},
+                             view_min, view_max, (Color) {1, 1, 1});
+        }
+    }
+
+  for (int powerup_index = 0;
+       powerup_index < snapshot->powerups_count;
+       ++powerup_index)
+    {
+      Powerup *powerup = snapshot->powerups + powerup_index;
+      if (is_box_in_view (powerup->pos, powerup->dim, view_min, view_max))
+        {
+          draw_circle (shapes, powerup->pos, powerup->dim.x / 2,
+                       powerup_colors[powerup->type]);
+        }
+    }
+
+  for (int ball_index = 0;
+       ball_index < snapshot->balls_count;
+       ++ball_index)
+    {
+      Ball *ball = snapshot->balls + ball_index;
+      V2 ball_dim = {ball->size * 2, ball->size * 2};
+      if (is_box_in_view (ball->pos, ball_dim, view_min, view_max))
+        {
+          draw_circle (shapes, ball->pos, ball->size, (Color) {0.9, 0.2, 0.5});
+        }
+    }
+
+  if (!detail)
+    {
+      draw_rounded_rect (shapes, paddle->pos, paddle->dim, paddle->dim.y / 3,
+                         (Color) {0.8, 0.6, 1});
+      return;
+    }
+
+  for (int type = 0; type < POWERUP_ENUM_LENGTH; ++type)
+    {
+      if (snapshot->powerup_times[type] > 0)
+        {
+          draw_paddle_powerup (shapes, paddle, (PowerupType) type);
+        }
+    }
+
+  draw_paddle (shapes, paddle, snapshot->eyes_target, EMOTION_HAPPY);
+}
+
+
+// Draws the newest snapshot of every game, in a grid filling the GL
+// transform's [-1, 1] square, which is size_pixels wide on screen.
+static void
+draw_tiles (Tiles *tiles, ShapeBatch *shapes, int size_pixels)
+{
+  float tile_size = 2.0f / tiles->side;
+  float half_size = tile_size * (1 - TILE_GAP) / 2;
+  int detail = size_pixels / tiles->side >= TILE_DETAIL_PIXELS;
+
+  for (int game_index = 0; game_index < tiles->count; ++game_index)
+    {
+      int column = game_index % tiles->side;
+      int row = game_index / tiles->side;
+      V2 center;
+      center.x = -1 + (column + 0.5f) * tile_size;
+      center.y = 1 - (row + 0.5f) * tile_size;
+
+      Snapshot *snapshot =
+        get_latest_snapshot (&tiles->games[game_index].snapshots);
+      draw_tile (shapes, snapshot, center, half_size, detail);
+    }
+
+  set_shape_transform (shapes, (V2) {0, 0}, 1);
+  flush_shapes (shapes);
+}
+
+
+static void
+print_tiles_stats (Tiles *tiles)
+{
+  int levels_count = 0;
+  for (int game_index = 0; game_index < tiles->count; ++game_index)
+    {
+      levels_count += tiles->games[game_index].game_state.levels_count;
+    }
+
+  printf ("%d games on %d threads, %d steps: %.3f ms a step, %.3f ms at "
+          "most, %d levels started.\n", tiles->count,
+          tiles->pool.threads_count + 1, tiles->steps_count,
+          tiles->steps_count ? tiles->step_time / tiles->steps_count * 1e3 : 0,
+          tiles->step_time_max * 1e3, levels_count);
+}
+
+
+// "bricks --tiles [SIDE [MAP]]". Returns the exit code.
+static int
+run_tiles_command (int argc, char *argv[])
+{
+  int side = argc >= 1 ? atoi (argv[0]) : TILES_DEFAULT_SIDE;
+  const char *map_filepath = argc >= 2 ? argv[1] : "res/map1.txt";
+
+  if (side < 1 || side > TILES_SIDE_MAX)
+    {
+      cerr << "Error: The grid can be 1 to " << TILES_SIDE_MAX
+           << " games wide." << endl;
+      return 1;
+    }
+
+  Config config;
+  load_config ("config.txt", &config);
+
+  int sdl_init_error = SDL_Init (SDL_INIT_VIDEO);
+  assert (!sdl_init_error);
+  SDL_Window *window =
+    SDL_CreateWindow ("Bricks",
+                      SDL_WINDOWPOS_UNDEFINED,
+                      SDL_WINDOWPOS_UNDEFINED,
+                      WINDOW_WIDTH, WINDOW_HEIGHT,
+                      (SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE |
+                       SDL_WINDOW_ALLOW_HIGHDPI |
+                       (config.fullscreen ?
+                        SDL_WINDOW_FULLSCREEN_DESKTOP : 0)));
+  assert (window);
+
+  SDL_GLContext gl_context = SDL_GL_CreateContext (window);
+  assert (gl_context);
+
+  if (!load_gl_functions ())
+    {
+      cerr << "Error: OpenGL 2.0 with instanced arrays and framebuffer "
+           << "objects is required." << endl;
+      exit (1);
+    }
+
+  set_vsync ((VsyncMode) config.vsync);
+  glEnable (GL_BLEND);
+  glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glClearColor (0.0, 0.0, 0.0, 1.0);
+
+  ShapeBatch shapes = {};
+  init_shape_batch (&shapes);
+
+  Tiles *tiles = new Tiles;
+  init_tiles (tiles, &config, map_filepath, side, time (0), get_seconds (),
+              -1);
+  SDL_AtomicSet (&tiles->running, 1);
+  SDL_Thread *simulation_thread =
+    SDL_CreateThread (run_tiles_simulation, "simulation", tiles);
+  assert (simulation_thread);
+
+  FramePacer pacer;
+  init_frame_pacer (&pacer);
+  Controls controls = {};
+  LatencyStats latency = {};
+  RenderStats render_stats;
+  init_render_stats (&render_stats, config.render_stats);
+  int window_opened = 1;
+
+  while (window_opened)
+    {
+      wait_next_frame (&pacer, config.max_fps, 0);
+      handle_events (window, &controls, &latency, &window_opened);
+
+      int drawable_width = 0;
+      int drawable_height = 0;
+      SDL_GL_GetDrawableSize (window, &drawable_width, &drawable_height);
+      int size = min (drawable_width, drawable_height);
+
+      begin_render_frame (&render_stats);
+      glViewport (0, 0, drawable_width, drawable_height);
+      glClear (GL_COLOR_BUFFER_BIT);
+      glViewport ((drawable_width - size) / 2, (drawable_height - size) / 2,
+                  size, size);
+      glMatrixMode (GL_MODELVIEW);
+      glLoadIdentity ();
+      draw_tiles (tiles, &shapes, size);
+      end_render_frame (&render_stats);
+
+      SDL_GL_SwapWindow (window);
+    }
+
+  SDL_AtomicSet (&tiles->running, 0);
+  SDL_WaitThread (simulation_thread, 0);
+
+  print_tiles_stats (tiles);
+  if (config.render_stats)
+    {
+      finish_render_stats (&render_stats);
+      print_render_stats (&render_stats);
+    }
+
+  free_tiles (tiles);
+  delete tiles;
+  free_render_stats (&render_stats);
+  free_shape_batch (&shapes);
+  SDL_GL_DeleteContext (gl_context);
+  SDL_DestroyWindow (window);
+  SDL_Quit ();
+
+  return 0;
+}
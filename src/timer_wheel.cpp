@@ -0,0 +1,397 @@
+/* Bricks Game - Timer Wheel
+ *
+ * Copyright (C) 2017 LibTec
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Timers on a hierarchical timing wheel, for everything in the game that
+// happens some time from now: powerups running out, the paddle opening
+// its eyes, damaged bricks healing.
+//
+// Time goes in ticks of 1 / TIMER_TICKS_PER_SECOND. The wheel has
+// TIMER_LEVELS levels of TIMER_SLOTS slots each; a slot of level n holds
+// the timers due in one span of TIMER_SLOTS^n ticks, and when the ticks
+// get through a slot of the level below, the next slot of the level
+// above is spread out over it. Scheduling and cancelling only link and
+// unlink a timer from its slot. Advancing skips over empty slots with a
+// bitmap of the occupied ones, so a step costs about as much as the
+// timers it fires, plus a little every TIMER_SLOTS ticks.
+//
+// Timers live in one array and refer to each other by index, so the
+// wheel copies as plain memory, which is what forking a game needs.
+// Fired timers wait in a list until pop_timer takes them, and whoever
+// scheduled a timer forgets its id once it's popped or cancelled.
+
+#define TIMER_TICKS_PER_SECOND 960
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4
+// The slot of a timer that isn't in one.
+#define TIMER_FREE -1
+#define TIMER_FIRED -2
+
+struct Timer {
+  // The tick it's due at.
+  uint64_t due;
+  int type;
+  int data;
+  // Neighbours in its slot or list, 0 for none.
+  int prev;
+  int next;
+  // level * TIMER_SLOTS + slot, or TIMER_FREE or TIMER_FIRED.
+  int slot;
+};
+
+struct TimerWheel {
+  double time;
+  uint64_t tick;
+  // Timer 0 is never used, so 0 can mean no timer.
+  int max;
+  int count;
+  Timer *timers;
+  int free_timers;
+  int live_count;
+  // The first timer of each slot, and which slots have any, a bit each.
+  int heads[TIMER_LEVELS * TIMER_SLOTS];
+  uint64_t occupied[TIMER_LEVELS];
+  int fired_head;
+  int fired_tail;
+};
+
+
+static void
+free_timer_wheel (TimerWheel *wheel)
+{
+  delete[] wheel->timers;
+  *wheel = {};
+}
+
+
+// Makes copy the same as wheel, keeping copy's storage.
+static void
+copy_timer_wheel (TimerWheel *copy, TimerWheel *wheel)
+{
+  int max = copy->max;
+  Timer *timers = copy->timers;
+
+  if (max < wheel->count)
+    {
+      delete[] timers;
+      max = wheel->max;
+      timers = new Timer[max];
+    }
+
+  *copy = *wheel;
+  copy->max = max;
+  copy->timers = timers;
+  if (wheel->count)
+    {
+      memcpy (copy->timers, wheel->timers, wheel->count * sizeof (Timer));
+    }
+}
+
+
+static void
+link_timer_after (TimerWheel *wheel, int *head, int *tail, int id)
+{
+  Timer *timer = wheel->timers + id;
+  timer->prev = *tail;
+  timer->next = 0;
+
+  if (*tail)
+    {
+      wheel->timers[*tail].next = id;
+    }
+  else
+    {
+      *head = id;
+    }
+  *tail = id;
+}
+
+
+// Puts the timer in the slot its due tick falls in, as seen from the
+// current tick.
+static void
+link_timer (TimerWheel *wheel, int id)
+{
+  Timer *timer = wheel->timers + id;
+  uint64_t due = max (timer->due, wheel->tick);
+  uint64_t delta = due - wheel->tick;
+  int level = 0;
+
+  while (level < TIMER_LEVELS - 1 &&
+         delta >> ((level + 1) * TIMER_SLOT_BITS))
+    {
+      ++level;
+    }
+
+  // Timers further off than the top level reaches wait in its furthest
+  // slot, and are put back in from there.
+  uint64_t reach = (uint64_t) 1 << (TIMER_LEVELS * TIMER_SLOT_BITS);
+  if (delta >= reach)
+    {
+      due = wheel->tick + reach - 1;
+    }
+
+  int index = (due >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1);
+  timer->slot = level * TIMER_SLOTS + index;
+  timer->prev = 0;
+  timer->next = wheel->heads[timer->slot];
+
+  if (timer->next)
+    {
+      wheel->timers[timer->next].prev = id;
+    }
+  wheel->heads[timer->slot] = id;
+  wheel->occupied[level] |= (uint64_t) 1 << index;
+}
+
+
+static void
+unlink_timer (TimerWheel *wheel, int id)
+{
+  Timer *timer = wheel->timers + id;
+
+  if (timer->prev)
+    {
+      wheel->timers[timer->prev].next = timer->next;
+    }
+  if (timer->next)
+    {
+      wheel->timers[timer->next].prev = timer->prev;
+    }
+
+  if (timer->slot == TIMER_FIRED)
+    {
+      if (wheel->fired_head == id)
+        {
+          wheel->fired_head = timer->next;
+        }
+      if (wheel->fired_tail == id)
+        {
+          wheel->fired_tail = timer->prev;
+        }
+    }
+  else if (wheel->heads[timer->slot] == id)
+    {
+      wheel->heads[timer->slot] = timer->next;
+      if (!timer->next)
+        {
+          int level = timer->slot / TIMER_SLOTS;
+          int index = timer->slot % TIMER_SLOTS;
+          wheel->occupied[level] &= ~((uint64_t) 1 << index);
+        }
+    }
+}
+
+
+static void
+release_timer (TimerWheel *wheel, int id)
+{
+  Timer *timer = wheel->timers + id;
+  timer->slot = TIMER_FREE;
+  timer->next = wheel->free_timers;
+  wheel->free_timers = id;
+  --wheel->live_count;
+}
+
+
+// Returns the new timer's id, which is never 0. It fires after at least
+// a tick, even if seconds is less.
+static int
+schedule_timer (TimerWheel *wheel, double seconds, int type, int data)
+{
+  int id = wheel->free_timers;
+
+  if (id)
+    {
+      wheel->free_timers = wheel->timers[id].next;
+    }
+  else
+    {
+      wheel->count = max (wheel->count, 1);
+
+      if (wheel->count >= wheel->max)
+        {
+          int new_max = max (wheel->max * 2, 64);
+          Timer *new_timers = new Timer[new_max];
+          if (wheel->max)
+            {
+              memcpy (new_timers, wheel->timers,
+                      wheel->count * sizeof (Timer));
+            }
+          delete[] wheel->timers;
+          wheel->timers = new_timers;
+          wheel->max = new_max;
+        }
+
+      id = wheel->count++;
+    }
+
+  Timer *timer = wheel->timers + id;
+  int64_t ticks = llround (seconds * TIMER_TICKS_PER_SECOND);
+  timer->due = wheel->tick + max (ticks, (int64_t) 1);
+  timer->type = type;
+  timer->data = data;
+  link_timer (wheel, id);
+  ++wheel->live_count;
+  return id;
+}
+
+
+// Whether it's waiting or has fired and not been popped. id may be 0.
+static void
+cancel_timer (TimerWheel *wheel, int id)
+{
+  if (id && wheel->timers[id].slot != TIMER_FREE)
+    {
+      unlink_timer (wheel, id);
+      release_timer (wheel, id);
+    }
+}
+
+
+// Cancels the timer *id, if any, and schedules a new one in its place,
+// unless seconds is 0 or less.
+static void
+set_timer (TimerWheel *wheel, int *id, double seconds, int type, int data)
+{
+  cancel_timer (wheel, *id);
+  *id = seconds > 0 ? schedule_timer (wheel, seconds, type, data) : 0;
+}
+
+
+static void
+set_timer_data (TimerWheel *wheel, int id, int data)
+{
+  wheel->timers[id].data = data;
+}
+
+
+// The seconds until the timer fires, or 0 for no timer. id may be 0.
+static float
+get_timer_left (TimerWheel *wheel, int id)
+{
+  if (!id || wheel->timers[id].slot == TIMER_FREE)
+    {
+      return 0;
+    }
+
+  uint64_t due = wheel->timers[id].due;
+  return (due > wheel->tick ?
+          (float) (due - wheel->tick) / TIMER_TICKS_PER_SECOND : 0);
+}
+
+
+// Moves every timer of the slot to where it goes from the current tick.
+static void
+cascade_timers (TimerWheel *wheel, int level, int index)
+{
+  int slot = level * TIMER_SLOTS + index;
+  int id = wheel->heads[slot];
+  wheel->heads[slot] = 0;
+  wheel->occupied[level] &= ~((uint64_t) 1 << index);
+
+  while (id)
+    {
+      int next = wheel->timers[id].next;
+      link_timer (wheel, id);
+      id = next;
+    }
+}
+
+
+static void
+fire_timers (TimerWheel *wheel, int index)
+{
+  int id = wheel->heads[index];
+  wheel->heads[index] = 0;
+  wheel->occupied[0] &= ~((uint64_t) 1 << index);
+
+  while (id)
+    {
+      int next = wheel->timers[id].next;
+      wheel->timers[id].slot = TIMER_FIRED;
+      link_timer_after (wheel, &wheel->fired_head, &wheel->fired_tail, id);
+      id = next;
+    }
+}
+
+
+// Moves time on by dt and fires the timers that come due, in the order
+// they're due.
+static void
+advance_timer_wheel (TimerWheel *wheel, double dt)
+{
+  wheel->time += dt;
+  uint64_t target = llround (wheel->time * TIMER_TICKS_PER_SECOND);
+
+  while (wheel->tick < target)
+    {
+      if (!wheel->live_count)
+        {
+          wheel->tick = target;
+          break;
+        }
+
+      // The next tick with timers in the bottom level, or the next one
+      // that wraps it around, whichever comes first.
+      uint64_t next = (wheel->tick | (TIMER_SLOTS - 1)) + 1;
+      int index = (wheel->tick + 1) & (TIMER_SLOTS - 1);
+      uint64_t pending = index ? wheel->occupied[0] >> index : 0;
+
+      if (pending)
+        {
+          next = wheel->tick + 1 + __builtin_ctzll (pending);
+        }
+
+      if (next > target)
+        {
+          wheel->tick = target;
+          break;
+        }
+
+      wheel->tick = next;
+      index = next & (TIMER_SLOTS - 1);
+
+      for (int level = 1; level < TIMER_LEVELS && index == 0; ++level)
+        {
+          index = (next >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1);
+          cascade_timers (wheel, level, index);
+        }
+
+      fire_timers (wheel, next & (TIMER_SLOTS - 1));
+    }
+}
+
+
+// Takes the next fired timer's type and data. Returns its id, or 0 when
+// there are none left.
+static int
+pop_timer (TimerWheel *wheel, int *type, int *data)
+{
+  int id = wheel->fired_head;
+  if (!id)
+    {
+      return 0;
+    }
+
+  *type = wheel->timers[id].type;
+  *data = wheel->timers[id].data;
+  unlink_timer (wheel, id);
+  release_timer (wheel, id);
+  return id;
+}
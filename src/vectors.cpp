@@ -16,11 +16,33 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+// Everything here is inline or constexpr, so this file can be included
+// from anywhere and the operators fold into the caller.
+
+#include <math.h>
+
+#if defined (__AVX2__)
+#include <immintrin.h>
+#define V2_SIMD 1
+#define V2_SIMD_NAME "AVX2"
+#elif defined (__SSE2__) || defined (_M_X64)
+#include <emmintrin.h>
+#define V2_SIMD 1
+#define V2_SIMD_NAME "SSE2"
+#elif defined (__ARM_NEON)
+#include <arm_neon.h>
+#define V2_SIMD 1
+#define V2_SIMD_NAME "NEON"
+#else
+#define V2_SIMD 0
+#define V2_SIMD_NAME "scalar"
+#endif
+
 struct V2 {
   float x, y;
 };
 
-V2
+constexpr V2
 operator+ (V2 a, V2 b)
 {
   a.x += b.x;
@@ -28,7 +50,7 @@ operator+ (V2 a, V2 b)
   return a;
 }
 
-V2
+constexpr V2 &
 operator+= (V2 &a, V2 b)
 {
   a.x += b.x;
@@ -36,7 +58,7 @@ operator+= (V2 &a, V2 b)
   return a;
 }
 
-V2
+constexpr V2
 operator/ (V2 a, V2 b)
 {
   a.x /= b.x;
@@ -44,7 +66,7 @@ operator/ (V2 a, V2 b)
   return a;
 }
 
-V2
+constexpr V2 &
 operator/= (V2 &a, V2 b)
 {
   a.x /= b.x;
@@ -52,7 +74,7 @@ operator/= (V2 &a, V2 b)
   return a;
 }
 
-V2
+constexpr V2
 operator- (V2 a, V2 b)
 {
   a.x -= b.x;
@@ -60,7 +82,7 @@ operator- (V2 a, V2 b)
   return a;
 }
 
-V2
+constexpr V2 &
 operator-= (V2 &a, V2 b)
 {
   a.x -= b.x;
@@ -68,7 +90,15 @@ operator-= (V2 &a, V2 b)
   return a;
 }
 
-V2
+constexpr V2
+operator- (V2 v)
+{
+  v.x = -v.x;
+  v.y = -v.y;
+  return v;
+}
+
+constexpr V2
 operator* (V2 v, float n)
 {
   v.x *= n;
@@ -76,7 +106,7 @@ operator* (V2 v, float n)
   return v;
 }
 
-V2
+constexpr V2 &
 operator*= (V2 &v, float n)
 {
   v.x *= n;
@@ -84,7 +114,7 @@ operator*= (V2 &v, float n)
   return v;
 }
 
-V2
+constexpr V2
 operator/ (V2 v, float n)
 {
   v.x /= n;
@@ -92,7 +122,7 @@ operator/ (V2 v, float n)
   return v;
 }
 
-V2
+constexpr V2 &
 operator/= (V2 &v, float n)
 {
   v.x /= n;
@@ -100,11 +130,294 @@ operator/= (V2 &v, float n)
   return v;
 }
 
-V2
+constexpr float
+dot (V2 a, V2 b)
+{
+  return a.x * b.x + a.y * b.y;
+}
+
+inline float
+length (V2 v)
+{
+  return sqrtf (dot (v, v));
+}
+
+// Hardware estimate refined by one Newton-Raphson step, good to about
+// 1e-6 relative error.
+inline float
+rsqrt (float n)
+{
+#if defined (__SSE2__) || defined (_M_X64)
+  float y = _mm_cvtss_f32 (_mm_rsqrt_ss (_mm_set_ss (n)));
+  return y * (1.5f - 0.5f * n * y * y);
+#elif defined (__ARM_NEON)
+  float32x2_t x = vdup_n_f32 (n);
+  float32x2_t y = vrsqrte_f32 (x);
+  y = vmul_f32 (y, vrsqrts_f32 (vmul_f32 (x, y), y));
+  return vget_lane_f32 (y, 0);
+#else
+  return 1 / sqrtf (n);
+#endif
+}
+
+// A zero vector has no direction and is returned unchanged.
+inline V2
 normalize (V2 v)
 {
-  float length = sqrt (v.x*v.x + v.y*v.y);
-  v.x /= length;
-  v.y /= length;
+  float length_squared = dot (v, v);
+
+  if (length_squared > 0)
+    {
+      v *= rsqrt (length_squared);
+    }
+
   return v;
 }
+
+
+// Batch forms over plain arrays of floats, for data kept as a structure
+// of arrays, like particles. The _scalar versions are the reference the
+// vector paths are checked and benchmarked against, and also finish the
+// elements left over after the last full register.
+
+inline void
+add_scaled_floats_scalar (float *dst, const float *src, float scale, int count)
+{
+  for (int i = 0; i < count; ++i)
+    {
+      dst[i] += src[i] * scale;
+    }
+}
+
+inline void
+shift_scale_floats_scalar (float *values, int count, float shift, float scale)
+{
+  for (int i = 0; i < count; ++i)
+    {
+      values[i] = (values[i] + shift) * scale;
+    }
+}
+
+
+// dst[i] += src[i] * scale
+inline void
+add_scaled_floats (float *dst, const float *src, float scale, int count)
+{
+  int i = 0;
+
+#if defined (__AVX2__)
+  __m256 scale8 = _mm256_set1_ps (scale);
+  for (; i + 8 <= count; i += 8)
+    {
+      __m256 r = _mm256_add_ps (_mm256_loadu_ps (dst + i),
+                                _mm256_mul_ps (_mm256_loadu_ps (src + i),
+                                               scale8));
+      _mm256_storeu_ps (dst + i, r);
+    }
+#elif defined (__SSE2__) || defined (_M_X64)
+  __m128 scale4 = _mm_set1_ps (scale);
+  for (; i + 4 <= count; i += 4)
+    {
+      __m128 r = _mm_add_ps (_mm_loadu_ps (dst + i),
+                             _mm_mul_ps (_mm_loadu_ps (src + i), scale4));
+      _mm_storeu_ps (dst + i, r);
+    }
+#elif defined (__ARM_NEON)
+  for (; i + 4 <= count; i += 4)
+    {
+      vst1q_f32 (dst + i, vmlaq_n_f32 (vld1q_f32 (dst + i),
+                                       vld1q_f32 (src + i), scale));
+    }
+#endif
+
+  add_scaled_floats_scalar (dst + i, src + i, scale, count - i);
+}
+
+
+// values[i] = (values[i] + shift) * scale
+inline void
+shift_scale_floats (float *values, int count, float shift, float scale)
+{
+  int i = 0;
+
+#if defined (__AVX2__)
+  __m256 shift8 = _mm256_set1_ps (shift);
+  __m256 scale8 = _mm256_set1_ps (scale);
+  for (; i + 8 <= count; i += 8)
+    {
+      __m256 r = _mm256_mul_ps (_mm256_add_ps (_mm256_loadu_ps (values + i),
+                                               shift8), scale8);
+      _mm256_storeu_ps (values + i, r);
+    }
+#elif defined (__SSE2__) || defined (_M_X64)
+  __m128 shift4 = _mm_set1_ps (shift);
+  __m128 scale4 = _mm_set1_ps (scale);
+  for (; i + 4 <= count; i += 4)
+    {
+      __m128 r = _mm_mul_ps (_mm_add_ps (_mm_loadu_ps (values + i), shift4),
+                             scale4);
+      _mm_storeu_ps (values + i, r);
+    }
+#elif defined (__ARM_NEON)
+  float32x4_t shift4 = vdupq_n_f32 (shift);
+  for (; i + 4 <= count; i += 4)
+    {
+      vst1q_f32 (values + i, vmulq_n_f32 (vaddq_f32 (vld1q_f32 (values + i),
+                                                     shift4), scale));
+    }
+#endif
+
+  shift_scale_floats_scalar (values + i, count - i, shift, scale);
+}
+
+
+// The same over arrays of V2, checked the same way. A V2 array is a
+// float array twice as long, where that is all it takes. Only the bench
+// calls these so far: the game's balls, bullets and powerups are structs
+// with a position among other fields, a few of each at most, and
+// gathering them into arrays would cost more than the loops do.
+
+inline void
+add_scaled_many_scalar (V2 *dst, const V2 *src, float scale, int count)
+{
+  for (int i = 0; i < count; ++i)
+    {
+      dst[i] += src[i] * scale;
+    }
+}
+
+inline void
+normalize_many_scalar (V2 *vectors, int count)
+{
+  for (int i = 0; i < count; ++i)
+    {
+      vectors[i] = normalize (vectors[i]);
+    }
+}
+
+inline void
+clamp_many_scalar (V2 *vectors, int count, V2 min, V2 max)
+{
+  for (int i = 0; i < count; ++i)
+    {
+      V2 *v = vectors + i;
+      v->x = v->x < min.x ? min.x : (v->x > max.x ? max.x : v->x);
+      v->y = v->y < min.y ? min.y : (v->y > max.y ? max.y : v->y);
+    }
+}
+
+
+// dst[i] += src[i] * scale
+inline void
+add_scaled_many (V2 *dst, const V2 *src, float scale, int count)
+{
+  add_scaled_floats ((float *) dst, (const float *) src, scale, count * 2);
+}
+
+
+// Same as calling normalize on each vector, zero vectors included.
+inline void
+normalize_many (V2 *vectors, int count)
+{
+  int i = 0;
+#if V2_SIMD
+  float *v = (float *) vectors;
+#endif
+
+#if defined (__AVX2__)
+  __m256 half = _mm256_set1_ps (0.5f);
+  __m256 three_halves = _mm256_set1_ps (1.5f);
+  __m256 zero = _mm256_setzero_ps ();
+  for (; i + 4 <= count; i += 4)
+    {
+      __m256 xy = _mm256_loadu_ps (v + i * 2);
+      __m256 squared = _mm256_mul_ps (xy, xy);
+      // Swap x and y within each vector and add, so both lanes of a
+      // vector hold its squared length.
+      __m256 length_squared =
+        _mm256_add_ps (squared, _mm256_permute_ps (squared, 0xB1));
+      __m256 y = _mm256_rsqrt_ps (length_squared);
+      y = _mm256_mul_ps (y, _mm256_sub_ps (three_halves,
+                                           _mm256_mul_ps (_mm256_mul_ps (half, length_squared),
+                                                          _mm256_mul_ps (y, y))));
+      __m256 nonzero = _mm256_cmp_ps (length_squared, zero, _CMP_GT_OQ);
+      _mm256_storeu_ps (v + i * 2,
+                        _mm256_and_ps (nonzero, _mm256_mul_ps (xy, y)));
+    }
+#elif defined (__SSE2__) || defined (_M_X64)
+  __m128 half = _mm_set1_ps (0.5f);
+  __m128 three_halves = _mm_set1_ps (1.5f);
+  __m128 zero = _mm_setzero_ps ();
+  for (; i + 2 <= count; i += 2)
+    {
+      __m128 xy = _mm_loadu_ps (v + i * 2);
+      __m128 squared = _mm_mul_ps (xy, xy);
+      __m128 length_squared =
+        _mm_add_ps (squared,
+                    _mm_shuffle_ps (squared, squared, _MM_SHUFFLE (2, 3, 0, 1)));
+      __m128 y = _mm_rsqrt_ps (length_squared);
+      y = _mm_mul_ps (y, _mm_sub_ps (three_halves,
+                                     _mm_mul_ps (_mm_mul_ps (half, length_squared),
+                                                 _mm_mul_ps (y, y))));
+      __m128 nonzero = _mm_cmpgt_ps (length_squared, zero);
+      _mm_storeu_ps (v + i * 2, _mm_and_ps (nonzero, _mm_mul_ps (xy, y)));
+    }
+#elif defined (__ARM_NEON)
+  float32x4_t zero = vdupq_n_f32 (0);
+  for (; i + 2 <= count; i += 2)
+    {
+      float32x4_t xy = vld1q_f32 (v + i * 2);
+      float32x4_t squared = vmulq_f32 (xy, xy);
+      float32x4_t length_squared = vaddq_f32 (squared, vrev64q_f32 (squared));
+      float32x4_t y = vrsqrteq_f32 (length_squared);
+      y = vmulq_f32 (y, vrsqrtsq_f32 (vmulq_f32 (length_squared, y), y));
+      uint32x4_t nonzero = vcgtq_f32 (length_squared, zero);
+      float32x4_t r = vmulq_f32 (xy, y);
+      vst1q_f32 (v + i * 2,
+                 vreinterpretq_f32_u32 (vandq_u32 (nonzero,
+                                                   vreinterpretq_u32_f32 (r))));
+    }
+#endif
+
+  normalize_many_scalar (vectors + i, count - i);
+}
+
+
+inline void
+clamp_many (V2 *vectors, int count, V2 min, V2 max)
+{
+  int i = 0;
+#if V2_SIMD
+  float *v = (float *) vectors;
+#endif
+
+#if defined (__AVX2__)
+  __m256 min8 = _mm256_setr_ps (min.x, min.y, min.x, min.y,
+                                min.x, min.y, min.x, min.y);
+  __m256 max8 = _mm256_setr_ps (max.x, max.y, max.x, max.y,
+                                max.x, max.y, max.x, max.y);
+  for (; i + 4 <= count; i += 4)
+    {
+      __m256 xy = _mm256_loadu_ps (v + i * 2);
+      _mm256_storeu_ps (v + i * 2, _mm256_min_ps (_mm256_max_ps (xy, min8), max8));
+    }
+#elif defined (__SSE2__) || defined (_M_X64)
+  __m128 min4 = _mm_setr_ps (min.x, min.y, min.x, min.y);
+  __m128 max4 = _mm_setr_ps (max.x, max.y, max.x, max.y);
+  for (; i + 2 <= count; i += 2)
+    {
+      __m128 xy = _mm_loadu_ps (v + i * 2);
+      _mm_storeu_ps (v + i * 2, _mm_min_ps (_mm_max_ps (xy, min4), max4));
+    }
+#elif defined (__ARM_NEON)
+  float32x4_t min4 = {min.x, min.y, min.x, min.y};
+  float32x4_t max4 = {max.x, max.y, max.x, max.y};
+  for (; i + 2 <= count; i += 2)
+    {
+      float32x4_t xy = vld1q_f32 (v + i * 2);
+      vst1q_f32 (v + i * 2, vminq_f32 (vmaxq_f32 (xy, min4), max4));
+    }
+#endif
+
+  clamp_many_scalar (vectors + i, count - i, min, max);
+}